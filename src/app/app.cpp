@@ -55,11 +55,13 @@
 #include "app/ui/workspace.h"
 #include "app/ui_context.h"
 #include "app/util/clipboard.h"
+#include "app/util/lazy_cels_evictor.h"
 #include "base/exception.h"
 #include "base/fs.h"
 #include "base/platform.h"
 #include "base/replace_string.h"
 #include "base/split_string.h"
+#include "doc/image_loader.h"
 #include "doc/sprite.h"
 #include "fmt/format.h"
 #include "os/error.h"
@@ -152,6 +154,7 @@ public:
   RecentFiles m_recent_files;
   InputChain m_inputChain;
   Clipboard m_clipboard;
+  std::unique_ptr<LazyCelsEvictor> m_lazyCelsEvictor;
 #endif
 #ifdef ENABLE_DATA_RECOVERY
   // This is a raw pointer because we want to delete it explicitly.
@@ -378,6 +381,16 @@ int App::initialize(const AppOptions& options)
     if (preferences().general.dataRecovery())
       m_modules->searchDataRecoverySessions();
 
+    // Unload cels decoded lazily when they use too much memory, and
+    // show errors decoding them in the console
+    m_modules->m_lazyCelsEvictor = std::make_unique<LazyCelsEvictor>(context());
+    doc::ImageLoader::setErrorHandler(
+      [](const std::string& msg){
+        ui::execute_from_ui_thread([msg]{
+          Console().printf("Error loading cel image: %s\n", msg.c_str());
+        });
+      });
+
     // Default status of the main window.
     app_rebuild_documents_tabs();
     m_mainWindow->statusBar()->showDefaultText();
@@ -640,6 +653,8 @@ App::~App()
     m_brushes.reset();
 #endif
 
+    doc::ImageLoader::setErrorHandler(nullptr);
+
     m_legacy.reset();
     m_modules.reset();
 
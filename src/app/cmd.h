@@ -1,4 +1,5 @@
 // Aseprite
+// Copyright (C) 2023  Igara Studio S.A.
 // Copyright (C) 2001-2018  David Capello
 //
 // This program is distributed under the terms of
@@ -11,11 +12,13 @@
 #include "base/disable_copying.h"
 #include "undo/undo_command.h"
 
+#include <memory>
 #include <string>
 
 namespace app {
 
   class Context;
+  class UndoSpillFile;
 
   class Cmd : public undo::UndoCommand {
   public:
@@ -32,6 +35,10 @@ namespace app {
     std::string label() const;
     size_t memSize() const;
 
+    // Moves the data used to undo/redo this command (e.g. pixels) to
+    // the given file. The data is loaded again when it's needed.
+    void spill(const std::shared_ptr<UndoSpillFile>& file);
+
     Context* context() const { return m_ctx; }
 
   protected:
@@ -41,6 +48,7 @@ namespace app {
     virtual void onFireNotifications();
     virtual std::string onLabel() const;
     virtual size_t onMemSize() const;
+    virtual void onSpill(const std::shared_ptr<UndoSpillFile>& file);
 
   private:
     Context* m_ctx;
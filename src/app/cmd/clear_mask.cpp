@@ -106,6 +106,7 @@ void ClearMask::clear()
     mask,
     m_bgcolor,
     (cel->image()->isTilemap() ? &grid: nullptr));
+  cel->image()->incrementVersion();
 }
 
 void ClearMask::restore()
@@ -118,6 +119,7 @@ void ClearMask::restore()
              m_copy.get(),
              m_cropPos.x,
              m_cropPos.y);
+  cel->image()->incrementVersion();
 }
 
 } // namespace cmd
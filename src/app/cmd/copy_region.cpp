@@ -1,5 +1,5 @@
 // Aseprite
-// Copyright (C) 2019-2020  Igara Studio S.A.
+// Copyright (C) 2019-2023  Igara Studio S.A.
 // Copyright (C) 2001-2016  David Capello
 //
 // This program is distributed under the terms of
@@ -42,7 +42,8 @@ CopyRegion::CopyRegion(Image* dst, const Image* src,
     m_region &= gfx::Region(clip.dstBounds());
   }
 
-  save_image_region_in_buffer(m_region, src, dstPos, m_buffer);
+  save_image_region_in_buffer(m_region, src, dstPos, m_buffer.data());
+  m_buffer.release();
 }
 
 CopyTileRegion::CopyTileRegion(Image* dst, const Image* src,
@@ -78,7 +79,8 @@ void CopyRegion::swap()
   Image* image = this->image();
   ASSERT(image);
 
-  swap_image_region_with_buffer(m_region, image, m_buffer);
+  swap_image_region_with_buffer(m_region, image, m_buffer.data());
+  m_buffer.release();
   image->incrementVersion();
 
   rehash();
@@ -1,5 +1,5 @@
 // Aseprite
-// Copyright (C) 2019-2020  Igara Studio S.A.
+// Copyright (C) 2019-2023  Igara Studio S.A.
 // Copyright (C) 2001-2016  David Capello
 //
 // This program is distributed under the terms of
@@ -11,7 +11,7 @@
 
 #include "app/cmd.h"
 #include "app/cmd/with_image.h"
-#include "base/buffer.h"
+#include "app/util/undo_buffer.h"
 #include "doc/tile.h"
 #include "gfx/point.h"
 #include "gfx/region.h"
@@ -43,6 +43,9 @@ namespace cmd {
     size_t onMemSize() const override {
       return sizeof(*this) + m_buffer.size();
     }
+    void onSpill(const UndoSpillFilePtr& file) override {
+      m_buffer.spill(file);
+    }
 
   private:
     void swap();
@@ -50,7 +53,7 @@ namespace cmd {
 
     bool m_alreadyCopied;
     gfx::Region m_region;
-    base::buffer m_buffer;
+    UndoBuffer m_buffer;
   };
 
   class CopyTileRegion : public CopyRegion {
@@ -25,9 +25,14 @@
 #include "doc/rgbmap.h"
 #include "doc/sprite.h"
 #include "doc/tilesets.h"
+#include "doc/worker_pool.h"
 #include "render/quantization.h"
 #include "render/task_delegate.h"
 
+#include <algorithm>
+#include <atomic>
+#include <vector>
+
 namespace app {
 namespace cmd {
 
@@ -35,6 +40,13 @@ using namespace doc;
 
 namespace {
 
+// Image of a cel or a tile to be converted
+struct Conversion {
+  ImageRef oldImage;
+  frame_t frame;
+  bool isBackground;
+};
+
 class SuperDelegate : public render::TaskDelegate {
 public:
   SuperDelegate(int nimages, render::TaskDelegate* delegate)
@@ -56,8 +68,8 @@ public:
       return true;
   }
 
-  void nextImage() {
-    ++m_curImage;
+  void setCurImage(int curImage) {
+    m_curImage = curImage;
   }
 
 private:
@@ -66,6 +78,24 @@ private:
   TaskDelegate* m_delegate;
 };
 
+// Delegate used to convert images in worker threads, the progress is
+// notified and the cancellation is checked from the calling thread.
+class CancelFlagDelegate : public render::TaskDelegate {
+public:
+  CancelFlagDelegate(const std::atomic<bool>& canceled)
+    : m_canceled(canceled) {
+  }
+
+  void notifyTaskProgress(double progress) override { }
+
+  bool continueTask() override {
+    return !m_canceled;
+  }
+
+private:
+  const std::atomic<bool>& m_canceled;
+};
+
 } // anonymous namespace
 
 SetPixelFormat::SetPixelFormat(Sprite* sprite,
@@ -81,39 +111,14 @@ SetPixelFormat::SetPixelFormat(Sprite* sprite,
   if (sprite->pixelFormat() == newFormat)
     return;
 
-  // Calculate the number of images to convert just to show a proper
-  // progress bar.
-  tile_index nimages = 0;
-  for (Cel* cel : sprite->uniqueCels())
-    if (!cel->layer()->isTilemap())
-      ++nimages;
-  if (sprite->hasTilesets()) {
-    for (Tileset* tileset : *sprite->tilesets()) {
-      if (tileset)
-        nimages += tileset->size();
-    }
-  }
-
-  SuperDelegate superDel(nimages, delegate);
-
-  // Convert cel images
+  // Images to convert (cels and tiles)
+  std::vector<Conversion> conversions;
   for (Cel* cel : sprite->uniqueCels()) {
-    if (cel->layer()->isTilemap())
-      continue;
-
-    ImageRef oldImage = cel->imageRef();
-    convertImage(sprite, dithering,
-                 oldImage,
-                 cel->frame(),
-                 cel->layer()->isBackground(),
-                 mapAlgorithm,
-                 toGray,
-                 &superDel);
-
-    superDel.nextImage();
+    if (!cel->layer()->isTilemap())
+      conversions.push_back(Conversion{ cel->imageRef(),
+                                        cel->frame(),
+                                        cel->layer()->isBackground() });
   }
-
-  // Convert tileset images
   if (sprite->hasTilesets()) {
     for (Tileset* tileset : *sprite->tilesets()) {
       if (!tileset)
@@ -122,19 +127,123 @@ SetPixelFormat::SetPixelFormat(Sprite* sprite,
       for (tile_index i=0; i<tileset->size(); ++i) {
         ImageRef oldImage = tileset->get(i);
         if (oldImage) {
-          convertImage(sprite, dithering,
-                       oldImage,
-                       0,     // TODO select a frame or generate other tilesets?
-                       false, // TODO is background? it depends of the layer where this tileset is used
-                       mapAlgorithm,
-                       toGray,
-                       &superDel);
+          conversions.push_back(
+            Conversion{ oldImage,
+                        0,       // TODO select a frame or generate other tilesets?
+                        false }); // TODO is background? it depends of the layer where this tileset is used
         }
-        superDel.nextImage();
       }
     }
   }
 
+  SuperDelegate superDel(int(conversions.size()), delegate);
+  std::vector<ImageRef> newImages(conversions.size());
+  std::atomic<bool> canceled(false);
+  CancelFlagDelegate workerDel(canceled);
+
+  // Consecutive images of frames with the same palette use the same
+  // rgbmap, so they can be converted in parallel (each conversion
+  // creates its own dithering algorithm). This is the only way to
+  // use several threads with error diffusion, as the pixels of each
+  // image must be dithered sequentially.
+  std::size_t i = 0;
+  while (i < conversions.size()) {
+    const Palette* palette = sprite->palette(conversions[i].frame);
+
+    // Making the RGBMap for Image->INDEXDED conversion.
+    RgbMap* rgbmap = nullptr;
+    int indexedMaskIndex = 0;
+    if (m_newFormat == IMAGE_INDEXED) {
+      rgbmap = sprite->rgbMap(conversions[i].frame,
+                              sprite->rgbMapForSprite(),
+                              mapAlgorithm);
+      if (m_oldFormat == IMAGE_INDEXED)
+        indexedMaskIndex = sprite->transparentColor();
+      else
+        indexedMaskIndex = rgbmap->maskIndex();
+    }
+
+    std::size_t j = i+1;
+    if (!rgbmap || rgbmap->isThreadSafe()) {
+      while (j < conversions.size() &&
+             sprite->palette(conversions[j].frame) == palette)
+        ++j;
+    }
+
+    const int nthreads =
+      std::clamp(worker_threads(), 1, int(j-i));
+
+    std::atomic<std::size_t> nextImage(i);
+    std::atomic<int> doneImages(int(i));
+
+    auto convertNextImage =
+      [&, j](render::TaskDelegate* del) -> bool {
+        std::size_t k;
+        if (canceled || (k = nextImage++) >= j)
+          return false;
+
+        const Conversion& conv = conversions[k];
+        ASSERT(conv.oldImage->pixelFormat() != IMAGE_TILEMAP);
+
+        const int newMaskIndex =
+          (m_newFormat == IMAGE_INDEXED ? indexedMaskIndex:
+           conv.isBackground ? -1: 0);
+
+        newImages[k].reset(
+          render::convert_pixel_format
+          (conv.oldImage.get(), nullptr, m_newFormat,
+           dithering,
+           rgbmap,
+           palette,
+           conv.isBackground,
+           newMaskIndex,
+           toGray,
+           del));
+
+        // The conversion could be stopped in the middle of the image
+        if (!del->continueTask()) {
+          canceled = true;
+          return false;
+        }
+        ++doneImages;
+        return true;
+      };
+
+    WorkerTasks tasks;
+    for (int t=1; t<nthreads; ++t) {
+      tasks.execute([&convertNextImage, &workerDel]{
+        while (convertNextImage(&workerDel))
+          ;
+      });
+    }
+
+    // The calling thread converts images too, and it's the only one
+    // that uses the given delegate.
+    do {
+      superDel.setCurImage(doneImages);
+      superDel.notifyTaskProgress(0.0);
+      if (!superDel.continueTask())
+        canceled = true;
+    } while (convertNextImage(&superDel));
+    tasks.wait();
+
+    if (canceled)
+      break;
+    i = j;
+  }
+
+  // If the conversion was canceled, some images could be partially
+  // converted, so we don't change anything.
+  if (canceled) {
+    m_newFormat = m_oldFormat;
+    return;
+  }
+
+  for (std::size_t k=0; k<conversions.size(); ++k) {
+    if (newImages[k])
+      m_seq.add(new cmd::ReplaceImage(sprite, conversions[k].oldImage, newImages[k]));
+  }
+
   // Set all cels opacity to 100% if we are converting to indexed.
   // TODO remove this
   if (newFormat == IMAGE_INDEXED) {
@@ -201,45 +310,5 @@ void SetPixelFormat::setFormat(PixelFormat format)
   doc->notify_observers<DocEvent&>(&DocObserver::onPixelFormatChanged, ev);
 }
 
-void SetPixelFormat::convertImage(doc::Sprite* sprite,
-                                  const render::Dithering& dithering,
-                                  const doc::ImageRef& oldImage,
-                                  const doc::frame_t frame,
-                                  const bool isBackground,
-                                  const doc::RgbMapAlgorithm mapAlgorithm,
-                                  doc::rgba_to_graya_func toGray,
-                                  render::TaskDelegate* delegate)
-{
-  ASSERT(oldImage);
-  ASSERT(oldImage->pixelFormat() != IMAGE_TILEMAP);
-
-  // Making the RGBMap for Image->INDEXDED conversion.
-  // TODO: this is needed only when newImage
-  RgbMap* rgbmap;
-  int newMaskIndex = (isBackground ? -1 : 0);
-  if (m_newFormat == IMAGE_INDEXED) {
-    rgbmap = sprite->rgbMap(frame, sprite->rgbMapForSprite(), mapAlgorithm);
-    if (m_oldFormat == IMAGE_INDEXED)
-      newMaskIndex = sprite->transparentColor();
-    else
-      newMaskIndex = rgbmap->maskIndex();
-  }
-  else {
-    rgbmap = nullptr;
-  }
-  ImageRef newImage(
-    render::convert_pixel_format
-    (oldImage.get(), nullptr, m_newFormat,
-     dithering,
-     rgbmap,
-     sprite->palette(frame),
-     isBackground,
-     newMaskIndex,
-     toGray,
-     delegate));
-
-  m_seq.add(new cmd::ReplaceImage(sprite, oldImage, newImage));
-}
-
 } // namespace cmd
 } // namespace app
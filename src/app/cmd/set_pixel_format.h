@@ -1,5 +1,5 @@
 // Aseprite
-// Copyright (C) 2019-2020  Igara Studio S.A.
+// Copyright (C) 2019-2023  Igara Studio S.A.
 // Copyright (C) 2001-2017  David Capello
 //
 // This program is distributed under the terms of
@@ -29,6 +29,8 @@ namespace render {
 namespace app {
 namespace cmd {
 
+  // Converts all images of the sprite to the new pixel format. If
+  // the given delegate cancels the task, the sprite is not modified.
   class SetPixelFormat : public Cmd
                        , public WithSprite {
   public:
@@ -49,14 +51,6 @@ namespace cmd {
 
   private:
     void setFormat(doc::PixelFormat format);
-    void convertImage(doc::Sprite* sprite,
-                      const render::Dithering& dithering,
-                      const doc::ImageRef& oldImage,
-                      const doc::frame_t frame,
-                      const bool isBackground,
-                      const doc::RgbMapAlgorithm mapAlgorithm,
-                      doc::rgba_to_graya_func toGray,
-                      render::TaskDelegate* delegate);
 
     doc::PixelFormat m_oldFormat;
     doc::PixelFormat m_newFormat;
@@ -0,0 +1,110 @@
+// Aseprite
+// Copyright (C) 2023  Igara Studio S.A.
+//
+// This program is distributed under the terms of
+// the End-User License Agreement for Aseprite.
+
+#include "tests/app_test.h"
+
+#include "app/cmd/set_pixel_format.h"
+#include "app/context.h"
+#include "app/doc.h"
+#include "app/test_context.h"
+#include "app/tx.h"
+#include "doc/cel.h"
+#include "doc/image.h"
+#include "doc/layer.h"
+#include "doc/primitives.h"
+#include "doc/sprite.h"
+#include "render/dithering.h"
+#include "render/task_delegate.h"
+
+#include <vector>
+
+using namespace app;
+using namespace doc;
+
+namespace {
+
+// Cancels the task after the given number of continueTask() calls
+class CancelAfterDelegate : public render::TaskDelegate {
+public:
+  CancelAfterDelegate(const int n) : m_n(n) { }
+  void notifyTaskProgress(double progress) override { }
+  bool continueTask() override { return (m_n-- > 0); }
+  bool canceled() const { return (m_n < 0); }
+private:
+  int m_n;
+};
+
+} // anonymous namespace
+
+TEST(SetPixelFormat, CancelDoesntModifyImages)
+{
+  TestContextT<Context> ctx;
+  const int w = 300, h = 250;       // Big enough to use several bands
+  const frame_t nframes = 6;
+
+  std::unique_ptr<Doc> doc(ctx.documents().add(w, h, ColorMode::RGB, 256));
+  Sprite* sprite = doc->sprite();
+  sprite->setTotalFrames(nframes);
+  auto layer = static_cast<LayerImage*>(sprite->root()->firstLayer());
+  for (frame_t f=0; f<nframes; ++f) {
+    if (!layer->cel(f))
+      layer->addCel(new Cel(f, ImageRef(Image::create(IMAGE_RGB, w, h))));
+    Image* image = layer->cel(f)->image();
+    for (int y=0; y<h; ++y)
+      for (int x=0; x<w; ++x)
+        put_pixel(image, x, y, rgba(x & 255, y & 255, f*40, 255));
+  }
+
+  std::vector<ImageRef> oldImages;
+  for (frame_t f=0; f<nframes; ++f)
+    oldImages.push_back(layer->cel(f)->imageRef());
+
+  // Cancel the conversion in different moments (the last ones
+  // could finish the whole conversion)
+  for (int n=0; n<60; n+=3) {
+    CancelAfterDelegate delegate(n);
+    {
+      Tx tx(sprite);
+      tx(new cmd::SetPixelFormat(
+           sprite, IMAGE_INDEXED,
+           render::Dithering(render::DitheringAlgorithm::Ordered),
+           RgbMapAlgorithm::DEFAULT,
+           nullptr, &delegate));
+
+      if (delegate.canceled()) {
+        // The canceled command doesn't modify the sprite
+        ASSERT_EQ(IMAGE_RGB, sprite->pixelFormat());
+        for (frame_t f=0; f<nframes; ++f)
+          EXPECT_EQ(oldImages[f], layer->cel(f)->imageRef());
+      }
+      else {
+        // All images are converted
+        ASSERT_EQ(IMAGE_INDEXED, sprite->pixelFormat());
+        for (frame_t f=0; f<nframes; ++f)
+          EXPECT_EQ(IMAGE_INDEXED, layer->cel(f)->image()->pixelFormat());
+      }
+      // Rollback
+    }
+    EXPECT_EQ(IMAGE_RGB, sprite->pixelFormat());
+  }
+
+  // Without a delegate
+  {
+    Tx tx(sprite);
+    tx(new cmd::SetPixelFormat(
+         sprite, IMAGE_INDEXED,
+         render::Dithering(render::DitheringAlgorithm::Ordered),
+         RgbMapAlgorithm::DEFAULT,
+         nullptr, nullptr));
+
+    ASSERT_EQ(IMAGE_INDEXED, sprite->pixelFormat());
+    for (frame_t f=0; f<nframes; ++f)
+      EXPECT_EQ(IMAGE_INDEXED, layer->cel(f)->image()->pixelFormat());
+    // Rollback
+  }
+
+  doc->close();
+}
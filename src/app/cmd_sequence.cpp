@@ -80,6 +80,12 @@ size_t CmdSequence::onMemSize() const
   return size;
 }
 
+void CmdSequence::onSpill(const std::shared_ptr<UndoSpillFile>& file)
+{
+  for (Cmd* cmd : m_cmds)
+    cmd->spill(file);
+}
+
 void CmdSequence::executeAndAdd(Cmd* cmd)
 {
   addAndExecute(context(), cmd);
@@ -32,6 +32,7 @@ namespace app {
     void onUndo() override;
     void onRedo() override;
     size_t onMemSize() const override;
+    void onSpill(const std::shared_ptr<UndoSpillFile>& file) override;
 
   private:
     std::vector<Cmd*> m_cmds;
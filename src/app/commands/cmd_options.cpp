@@ -33,14 +33,17 @@
 #include "app/ui/sampling_selector.h"
 #include "app/ui/separator_in_view.h"
 #include "app/ui/skin/skin_theme.h"
+#include "app/util/undo_buffer.h"
 #include "base/convert_to.h"
 #include "base/fs.h"
+#include "base/mem_utils.h"
 #include "base/string.h"
 #include "base/version.h"
 #include "doc/image.h"
 #include "fmt/format.h"
 #include "os/system.h"
 #include "os/window.h"
+#include "render/composite_cache.h"
 #include "render/render.h"
 #include "ui/ui.h"
 
@@ -477,6 +480,16 @@ public:
 
     nonactiveLayersOpacity()->setValue(m_pref.experimental.nonactiveLayersOpacity());
 
+    compositeCacheSize()->setTextf("%d", m_pref.experimental.compositeCacheSize());
+    {
+      const render::CompositeCache::Stats stats =
+        render::CompositeCache::totalStats();
+      compositeCacheStats()->setText(
+        fmt::format(Strings::options_composite_cache_stats(),
+                    base::get_pretty_memory_size(stats.memory),
+                    stats.entries, stats.hits, stats.misses));
+    }
+
     rgbmapAlgorithmPlaceholder()->addChild(&m_rgbmapAlgorithmSelector);
     m_rgbmapAlgorithmSelector.setExpansive(true);
     m_rgbmapAlgorithmSelector.algorithm(m_pref.quantization.rgbmapAlgorithm());
@@ -607,6 +620,16 @@ public:
     limitUndo()->setSelected(m_pref.undo.sizeLimit() != 0);
     onLimitUndoCheck();
 
+    undoMaxUnspilledSize()->setTextf("%d", m_pref.undo.maxUnspilledSize());
+    {
+      const UndoBuffer::Stats stats = UndoBuffer::stats();
+      undoMemoryStats()->setText(
+        fmt::format(Strings::options_undo_memory_stats(),
+                    base::get_pretty_memory_size(stats.resident),
+                    base::get_pretty_memory_size(stats.compressed),
+                    base::get_pretty_memory_size(stats.spilled)));
+    }
+
     undoGotoModified()->setSelected(m_pref.undo.gotoModified());
     undoAllowNonlinearHistory()->setSelected(m_pref.undo.allowNonlinearHistory());
 
@@ -824,12 +847,16 @@ public:
     undo_size_limit_value = std::clamp(undo_size_limit_value, 0, 999999);
 
     m_pref.undo.sizeLimit(undo_size_limit_value);
+    m_pref.undo.maxUnspilledSize(
+      std::clamp(undoMaxUnspilledSize()->textInt(), 0, 999999));
     m_pref.undo.gotoModified(undoGotoModified()->isSelected());
     m_pref.undo.allowNonlinearHistory(undoAllowNonlinearHistory()->isSelected());
 
     // Experimental features
     m_pref.experimental.flashLayer(flashLayer()->isSelected());
     m_pref.experimental.nonactiveLayersOpacity(nonactiveLayersOpacity()->getValue());
+    m_pref.experimental.compositeCacheSize(
+      std::clamp(compositeCacheSize()->textInt(), 0, 999999));
     m_pref.quantization.rgbmapAlgorithm(m_rgbmapAlgorithmSelector.algorithm());
 
 #ifdef _WIN32
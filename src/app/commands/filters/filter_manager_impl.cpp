@@ -35,14 +35,20 @@
 #include "doc/image.h"
 #include "doc/layer.h"
 #include "doc/mask.h"
+#include "doc/rgbmap.h"
 #include "doc/sprite.h"
+#include "doc/worker_pool.h"
 #include "filters/filter.h"
 #include "ui/manager.h"
 #include "ui/view.h"
 #include "ui/widget.h"
 
+#include <algorithm>
+#include <atomic>
 #include <cstdlib>
 #include <cstring>
+#include <exception>
+#include <mutex>
 #include <set>
 
 namespace app {
@@ -50,6 +56,119 @@ namespace app {
 using namespace std;
 using namespace ui;
 
+namespace {
+
+// Minimum number of rows that a thread processes from a cel at once.
+const int kMinRowsPerBand = 16;
+
+// A cel being modified by FilterManagerImpl::applyToCelsInParallel().
+struct TargetCel {
+  Cel* cel;
+  ImageRef src;
+  ImageRef dst;
+  Target target;
+};
+
+// Data shared by all the RowBandFilterManager instances. It's
+// filled from the thread that calls applyToTarget() because it
+// cannot be accessed from worker threads (e.g. the sprite palette
+// or the RgbMap).
+struct RowBandsData {
+  PixelFormat pixelFormat;
+  gfx::Rect bounds;
+  const Mask* mask;
+  bool isMaskActive;
+  const Palette* palette;
+  const RgbMap* rgbmap;
+  Palette* newPalette;
+  const PalettePicks* picks;
+  base::task_token* token;
+};
+
+// FilterManager to apply the filter to a band of rows of a cel from
+// a worker thread. Each thread needs its own instance because the
+// current row and the mask iterator are part of the FilterManager
+// state.
+class RowBandFilterManager : public FilterManager
+                           , public FilterIndexedData {
+public:
+  RowBandFilterManager(const RowBandsData& data,
+                       const TargetCel& targetCel)
+    : m_data(data)
+    , m_targetCel(targetCel)
+    , m_row(0) {
+  }
+
+  void applyToRows(Filter* filter, const int fromRow, const int toRow) {
+    const gfx::Rect& bounds = m_data.bounds;
+    const Mask* mask = m_data.mask;
+
+    for (m_row=fromRow; m_row<toRow && !m_data.token->canceled(); ++m_row) {
+      if (mask && mask->bitmap()) {
+        const int x = bounds.x - mask->bounds().x;
+        const int y = bounds.y - mask->bounds().y + m_row;
+        if ((x >= bounds.w) ||
+            (y >= bounds.h))
+          break;
+
+        m_maskBits = mask->bitmap()
+          ->lockBits<BitmapTraits>(Image::ReadLock,
+            gfx::Rect(x, y, bounds.w - x, bounds.h - y));
+
+        m_maskIterator = m_maskBits.begin();
+      }
+
+      switch (m_data.pixelFormat) {
+        case IMAGE_RGB:       filter->applyToRgba(this); break;
+        case IMAGE_GRAYSCALE: filter->applyToGrayscale(this); break;
+        case IMAGE_INDEXED:   filter->applyToIndexed(this); break;
+      }
+    }
+  }
+
+  // FilterManager implementation
+  PixelFormat pixelFormat() const override { return m_data.pixelFormat; }
+  const void* getSourceAddress() override {
+    return m_targetCel.src->getPixelAddress(m_data.bounds.x, m_data.bounds.y+m_row);
+  }
+  void* getDestinationAddress() override {
+    return m_targetCel.dst->getPixelAddress(m_data.bounds.x, m_data.bounds.y+m_row);
+  }
+  int getWidth() override { return m_data.bounds.w; }
+  Target getTarget() override { return m_targetCel.target; }
+  FilterIndexedData* getIndexedData() override { return this; }
+  bool skipPixel() override {
+    bool skip = false;
+    if (m_data.mask && m_data.mask->bitmap()) {
+      if (!*m_maskIterator)
+        skip = true;
+      ++m_maskIterator;
+    }
+    return skip;
+  }
+  const Image* getSourceImage() override { return m_targetCel.src.get(); }
+  int x() const override { return m_data.bounds.x; }
+  int y() const override { return m_data.bounds.y+m_row; }
+  bool isFirstRow() const override { return m_row == 0; }
+  bool isMaskActive() const override { return m_data.isMaskActive; }
+  base::task_token& taskToken() const override { return *m_data.token; }
+
+  // FilterIndexedData implementation
+  const Palette* getPalette() const override { return m_data.palette; }
+  const RgbMap* getRgbMap() const override { return m_data.rgbmap; }
+  Palette* getNewPalette() override { return m_data.newPalette; }
+  PalettePicks getPalettePicks() override { return *m_data.picks; }
+
+private:
+  const RowBandsData& m_data;
+  const TargetCel& m_targetCel;
+  int m_row;
+  ImageBits<BitmapTraits> m_maskBits;
+  ImageBits<BitmapTraits>::iterator m_maskIterator;
+};
+
+} // anonymous namespace
+
 FilterManagerImpl::FilterManagerImpl(Context* context, Filter* filter)
   : m_reader(context)
   , m_site(*const_cast<Site*>(m_reader.site()))
@@ -223,44 +342,7 @@ void FilterManagerImpl::apply()
   }
 
   if (!cancelled) {
-    gfx::Rect output;
-    if (algorithm::shrink_bounds2(m_src.get(), m_dst.get(),
-                                  m_bounds, output)) {
-      if (m_cel->layer()->isTilemap()) {
-        modify_tilemap_cel_region(
-          *m_tx,
-          m_cel, nullptr,
-          gfx::Region(output),
-          m_site.tilesetMode(),
-          [this](const doc::ImageRef& origTile,
-                 const gfx::Rect& tileBoundsInCanvas) -> doc::ImageRef {
-            return ImageRef(
-              crop_image(m_dst.get(),
-                         tileBoundsInCanvas.x,
-                         tileBoundsInCanvas.y,
-                         tileBoundsInCanvas.w,
-                         tileBoundsInCanvas.h,
-                         m_dst->maskColor()));
-          });
-      }
-      else if (m_cel->layer()->isBackground()) {
-        (*m_tx)(
-          new cmd::CopyRegion(
-            m_cel->image(),
-            m_dst.get(),
-            gfx::Region(output),
-            position()));
-      }
-      else {
-        // Patch "m_cel"
-        (*m_tx)(
-          new cmd::PatchCel(
-            m_cel, m_dst.get(),
-            gfx::Region(output),
-            position()));
-      }
-    }
-
+    patchCel();
     result = CommandResult(CommandResult::kOk);
   }
   else {
@@ -271,6 +353,49 @@ void FilterManagerImpl::apply()
   m_reader.context()->setCommandResult(result);
 }
 
+// Adds the commands to the transaction to copy the modified pixels
+// from m_dst to m_cel.
+void FilterManagerImpl::patchCel()
+{
+  gfx::Rect output;
+  if (algorithm::shrink_bounds2(m_src.get(), m_dst.get(),
+                                m_bounds, output)) {
+    if (m_cel->layer()->isTilemap()) {
+      modify_tilemap_cel_region(
+        *m_tx,
+        m_cel, nullptr,
+        gfx::Region(output),
+        m_site.tilesetMode(),
+        [this](const doc::ImageRef& origTile,
+               const gfx::Rect& tileBoundsInCanvas) -> doc::ImageRef {
+          return ImageRef(
+            crop_image(m_dst.get(),
+                       tileBoundsInCanvas.x,
+                       tileBoundsInCanvas.y,
+                       tileBoundsInCanvas.w,
+                       tileBoundsInCanvas.h,
+                       m_dst->maskColor()));
+        });
+    }
+    else if (m_cel->layer()->isBackground()) {
+      (*m_tx)(
+        new cmd::CopyRegion(
+          m_cel->image(),
+          m_dst.get(),
+          gfx::Region(output),
+          position()));
+    }
+    else {
+      // Patch "m_cel"
+      (*m_tx)(
+        new cmd::PatchCel(
+          m_cel, m_dst.get(),
+          gfx::Region(output),
+          position()));
+    }
+  }
+}
+
 void FilterManagerImpl::applyToTarget()
 {
   applyToPaletteIfNeeded();
@@ -311,9 +436,6 @@ void FilterManagerImpl::applyToTarget()
     return;
   }
 
-  m_progressBase = 0.0f;
-  m_progressWidth = (cels.size() > 0 ? 1.0f / cels.size(): 1.0f);
-
   std::set<ObjectId> visited;
 
   // Palette change
@@ -325,30 +447,168 @@ void FilterManagerImpl::applyToTarget()
                           m_site.frame(), &newPalette));
   }
 
-  // For each target image
-  for (auto it = cels.begin();
-       it != cels.end() && !cancelled;
-       ++it) {
-    Image* image = (*it)->image();
-
-    // Avoid applying the filter two times to the same image
+  // Avoid applying the filter two times to the same image
+  CelList uniqueCels;
+  for (Cel* cel : cels) {
+    Image* image = cel->image();
     if (visited.find(image->id()) == visited.end()) {
       visited.insert(image->id());
-      applyToCel(*it);
+      uniqueCels.push_back(cel);
     }
+  }
 
-    // Is there a delegate to know if the process was cancelled by the user?
-    if (m_progressDelegate)
-      cancelled = m_progressDelegate->isCancelled();
+  if (!uniqueCels.empty() && canApplyInParallel()) {
+    applyToCelsInParallel(uniqueCels, cancelled);
+  }
+  else {
+    m_progressBase = 0.0f;
+    m_progressWidth = (uniqueCels.size() > 0 ? 1.0f / uniqueCels.size(): 1.0f);
 
-    // Make progress
-    m_progressBase += m_progressWidth;
+    // For each target image
+    for (auto it = uniqueCels.begin();
+         it != uniqueCels.end() && !cancelled;
+         ++it) {
+      applyToCel(*it);
+
+      // Is there a delegate to know if the process was cancelled by the user?
+      if (m_progressDelegate)
+        cancelled = m_progressDelegate->isCancelled();
+
+      // Make progress
+      m_progressBase += m_progressWidth;
+    }
   }
 
   // Reset m_oldPalette to avoid restoring the color palette
   m_oldPalette.reset(nullptr);
 }
 
+bool FilterManagerImpl::canApplyInParallel() const
+{
+  // Some RgbMaps are filled lazily from RgbMap::mapColor() (which
+  // can be called from any row), so in that case indexed images are
+  // processed from one thread only.
+  return (m_filter->isThreadSafe() &&
+          (pixelFormat() != IMAGE_INDEXED || getRgbMap()->isThreadSafe()) &&
+          doc::worker_threads() > 1);
+}
+
+// Applies the filter to several cels at the same time, and to
+// several bands of rows of each cel, using the shared worker pool.
+// The calling thread processes bands too, and it's the only one
+// that reports the progress/checks the cancellation through the
+// IProgressDelegate and adds commands to the transaction.
+void FilterManagerImpl::applyToCelsInParallel(const CelList& cels, bool& cancelled)
+{
+  Doc* doc = m_site.document();
+  if (!updateBounds(doc->isMaskVisible() ? doc->mask(): nullptr))
+    throw InvalidAreaException();
+
+  base::task_token token;
+  RowBandsData data;
+  data.pixelFormat = pixelFormat();
+  data.bounds = m_bounds;
+  data.mask = (doc->isMaskVisible() ? doc->mask(): nullptr);
+  data.isMaskActive = isMaskActive();
+  data.palette = getPalette();
+  data.rgbmap = (data.pixelFormat == IMAGE_INDEXED ? getRgbMap(): nullptr);
+  data.newPalette = m_site.sprite()->palette(m_site.frame());
+  data.picks = &m_site.selectedColors();
+  data.token = &token;
+
+  const int nthreads = doc::worker_threads();
+  const int h = m_bounds.h;
+  const int bandsPerCel = std::clamp(h / kMinRowsPerBand, 1, 4*nthreads);
+  const int rowsPerBand = (h + bandsPerCel - 1) / bandsPerCel;
+  const int totalRows = std::max<int>(1, h * cels.size());
+  std::atomic<int> doneRows(0);
+
+  // We don't process all cels at once to avoid keeping a copy of all
+  // of them in memory (only "nthreads" cels are filtered at the
+  // same time).
+  for (int first=0; first<int(cels.size()) && !cancelled; first+=nthreads) {
+    std::vector<TargetCel> targets(std::min<int>(nthreads, cels.size()-first));
+    for (int i=0; i<int(targets.size()); ++i) {
+      Cel* cel = cels[first+i];
+      TargetCel& t = targets[i];
+      t.cel = cel;
+      t.src = crop_cel_image(cel, 0);
+      t.dst.reset(Image::createCopy(t.src.get()));
+      t.target = m_targetOrig;
+
+      // The alpha channel of the background layer can't be modified
+      if (cel->layer()->isBackground())
+        t.target &= ~TARGET_ALPHA_CHANNEL;
+    }
+
+    const int nbands = int(targets.size()) * bandsPerCel;
+    std::atomic<int> next(0);
+    std::exception_ptr error;
+    std::mutex mutex;
+
+    auto applyToNextBands = [&](const bool reportProgress) {
+      int i;
+      while (!token.canceled() && (i = next++) < nbands) {
+        const TargetCel& t = targets[i / bandsPerCel];
+        const int fromRow = (i % bandsPerCel) * rowsPerBand;
+        const int toRow = std::min(fromRow + rowsPerBand, h);
+        if (fromRow < toRow) {
+          try {
+            RowBandFilterManager band(data, t);
+            band.applyToRows(m_filter, fromRow, toRow);
+          }
+          catch (...) {
+            const std::lock_guard lock(mutex);
+            if (!error)
+              error = std::current_exception();
+            token.cancel();
+          }
+          doneRows += toRow - fromRow;
+        }
+
+        if (reportProgress && m_progressDelegate) {
+          m_progressDelegate->reportProgress(float(doneRows) / totalRows);
+
+          // Does the user cancelled the whole process?
+          if (m_progressDelegate->isCancelled())
+            token.cancel();
+        }
+      }
+    };
+
+    const int nworkers = std::min(nthreads, nbands) - 1;
+
+    doc::WorkerTasks tasks;
+    for (int i=0; i<nworkers; ++i)
+      tasks.execute([&applyToNextBands]{ applyToNextBands(false); });
+
+    applyToNextBands(true);
+    tasks.wait();
+
+    if (error)
+      std::rethrow_exception(error);
+
+    if (token.canceled()) {
+      cancelled = true;
+      break;
+    }
+
+    // Add the undoable commands in the same order as the serial
+    // version (one cel after the other).
+    for (TargetCel& t : targets) {
+      m_cel = t.cel;
+      m_src = t.src;
+      m_dst = t.dst;
+      patchCel();
+    }
+  }
+
+  ASSERT(m_reader.context());
+  m_reader.context()->setCommandResult(
+    CommandResult(cancelled ? CommandResult::kCanceled:
+                              CommandResult::kOk));
+}
+
 void FilterManagerImpl::initTransaction()
 {
   ASSERT(!m_tx);
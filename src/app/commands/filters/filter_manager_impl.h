@@ -15,6 +15,7 @@
 #include "app/tx.h"
 #include "base/exception.h"
 #include "base/task.h"
+#include "doc/cel_list.h"
 #include "doc/image_impl.h"
 #include "doc/image_ref.h"
 #include "doc/pixel_format.h"
@@ -133,6 +134,12 @@ namespace app {
     void init(doc::Cel* cel);
     void apply();
     void applyToCel(doc::Cel* cel);
+    void patchCel();
+
+    // Returns true if the filter can be applied to several cels/rows
+    // at the same time using the shared worker pool.
+    bool canApplyInParallel() const;
+    void applyToCelsInParallel(const doc::CelList& cels, bool& cancelled);
     bool updateBounds(doc::Mask* mask);
 
     // Returns true if the palette was changed (true when the filter
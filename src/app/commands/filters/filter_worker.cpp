@@ -1,5 +1,5 @@
 // Aseprite
-// Copyright (C) 2019-2022  Igara Studio S.A.
+// Copyright (C) 2019-2023  Igara Studio S.A.
 // Copyright (C) 2001-2018  David Capello
 //
 // This program is distributed under the terms of
@@ -76,6 +76,11 @@ private:
 // Applies filters in two threads: a background worker thread to
 // modify the sprite, and the main thread to monitoring the progress
 // (and given to the user the possibility to cancel the process).
+//
+// The background thread can use other threads to apply the filter
+// to several cels/rows at the same time (see
+// FilterManagerImpl::applyToCelsInParallel()), but it's the only
+// one that calls the IProgressDelegate functions.
 
 class FilterWorker : public FilterManagerImpl::IProgressDelegate {
 public:
@@ -1,5 +1,5 @@
 // Aseprite
-// Copyright (c) 2020  Igara Studio S.A.
+// Copyright (c) 2020-2023  Igara Studio S.A.
 //
 // This program is distributed under the terms of
 // the End-User License Agreement for Aseprite.
@@ -11,6 +11,7 @@
 #define DOC_FORMAT_VERSION_0     0  // Old version
 #define DOC_FORMAT_VERSION_1     1  // New version with tilesets
 #define DOC_FORMAT_VERSION_2     2  // Version 2 adds custom properties to user data
-#define DOC_FORMAT_VERSION_LAST  2
+#define DOC_FORMAT_VERSION_3     3  // Version 3 saves big images as tiles (see image_tiles.h)
+#define DOC_FORMAT_VERSION_LAST  3
 
 #endif
@@ -0,0 +1,220 @@
+// Aseprite
+// Copyright (C) 2023  Igara Studio S.A.
+//
+// This program is distributed under the terms of
+// the End-User License Agreement for Aseprite.
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "app/crash/image_tiles.h"
+
+#include "app/crash/internals.h"
+#include "base/exception.h"
+#include "base/serialization.h"
+#include "doc/image.h"
+#include "doc/image_io.h"
+#include "zlib.h"
+
+#include <city.h>
+
+#include <cstdio>
+#include <istream>
+#include <ostream>
+
+namespace app {
+namespace crash {
+
+using namespace base::serialization;
+using namespace base::serialization::little_endian;
+using namespace doc;
+
+namespace {
+
+int tile_row_bytes(const Image* image, const gfx::Rect& tile)
+{
+  return image->bytesPerPixel() * tile.w;
+}
+
+// Copies the tile pixels to a contiguous buffer.
+void get_tile_bytes(const Image* image,
+                    const gfx::Rect& tile,
+                    std::vector<uint8_t>& buf)
+{
+  const int rowBytes = tile_row_bytes(image, tile);
+  buf.resize(std::size_t(rowBytes) * tile.h);
+  uint8_t* dst = buf.data();
+  for (int y=0; y<tile.h; ++y, dst+=rowBytes) {
+    auto src = (const uint8_t*)image->getPixelAddress(tile.x, tile.y+y);
+    std::copy(src, src+rowBytes, dst);
+  }
+}
+
+} // anonymous namespace
+
+bool use_image_tiles(const Image* image)
+{
+  // Bitmaps can have rows that are not aligned to bytes in each tile
+  return (image->pixelFormat() != IMAGE_BITMAP &&
+          (image->width() > kImageTileSize ||
+           image->height() > kImageTileSize));
+}
+
+std::vector<gfx::Rect> get_image_tiles(const Image* image)
+{
+  std::vector<gfx::Rect> tiles;
+  for (int y=0; y<image->height(); y+=kImageTileSize)
+    for (int x=0; x<image->width(); x+=kImageTileSize)
+      tiles.push_back(gfx::Rect(x, y, kImageTileSize, kImageTileSize)
+                      .createIntersection(image->bounds()));
+  return tiles;
+}
+
+uint64_t calculate_image_tile_hash(const Image* image,
+                                   const gfx::Rect& tile)
+{
+  // The tile size is used as the seed, so tiles with the same bytes
+  // but different shapes (e.g. in the image edges) don't match.
+  const int rowBytes = tile_row_bytes(image, tile);
+  uint64_t h = (uint64_t(tile.w) << 32) | uint64_t(tile.h);
+  for (int y=0; y<tile.h; ++y) {
+    auto row = (const char*)image->getPixelAddress(tile.x, tile.y+y);
+    h = CityHash64WithSeed(row, rowBytes, h);
+  }
+  return h;
+}
+
+std::string image_tile_filename(const ObjectId imageId,
+                                const uint64_t hash)
+{
+  char buf[64];
+  std::snprintf(buf, sizeof(buf), "tile-%u-%016llx",
+                (unsigned int)imageId, (unsigned long long)hash);
+  return buf;
+}
+
+void write_image_tile(std::ostream& os,
+                      const Image* image,
+                      const gfx::Rect& tile)
+{
+  std::vector<uint8_t> buf;
+  get_tile_bytes(image, tile, buf);
+
+  uLongf len = compressBound(uLong(buf.size()));
+  std::vector<uint8_t> compressed(len);
+  int err = compress2((Bytef*)compressed.data(), &len,
+                      (const Bytef*)buf.data(), uLong(buf.size()),
+                      Z_DEFAULT_COMPRESSION);
+  if (err != Z_OK)
+    throw base::Exception("ZLib error %d in compress2().", err);
+
+  write32(os, uint32_t(buf.size()));
+  write32(os, uint32_t(len));
+  os.write((const char*)compressed.data(), len);
+  if (os.fail())
+    throw base::Exception("Error writing image tile.");
+}
+
+void write_tiled_image_header(std::ostream& os,
+                              const Image* image,
+                              const std::vector<uint64_t>& hashes)
+{
+  write32(os, kTiledImageMark);
+  write32(os, image->id());
+  write8(os, image->pixelFormat());
+  write16(os, image->width());
+  write16(os, image->height());
+  write32(os, image->maskColor());
+  write16(os, kImageTileSize);
+  write32(os, hashes.size());
+  for (const uint64_t hash : hashes)
+    write64(os, hash);
+}
+
+Image* read_tiled_image(std::istream& is,
+                        const OpenObject& openTile,
+                        const bool setId)
+{
+  const ObjectId id = read32(is);
+  const int pixelFormat = read8(is);
+  const int width = read16(is);
+  const int height = read16(is);
+  const uint32_t maskColor = read32(is);
+  const int tileSize = read16(is);
+  const uint32_t ntiles = read32(is);
+
+  if ((pixelFormat != IMAGE_RGB &&
+       pixelFormat != IMAGE_GRAYSCALE &&
+       pixelFormat != IMAGE_INDEXED &&
+       pixelFormat != IMAGE_TILEMAP) ||
+      (width < 1 || height < 1) ||
+      tileSize != kImageTileSize)
+    return nullptr;
+
+  std::unique_ptr<Image> image(
+    Image::create(static_cast<PixelFormat>(pixelFormat), width, height));
+
+  const std::vector<gfx::Rect> tiles = get_image_tiles(image.get());
+  if (ntiles != tiles.size())
+    return nullptr;
+
+  std::vector<uint8_t> compressed;
+  std::vector<uint8_t> buf;
+  for (const gfx::Rect& tile : tiles) {
+    const uint64_t hash = read64(is);
+    if (is.fail())
+      return nullptr;
+
+    std::unique_ptr<std::istream> s = openTile(image_tile_filename(id, hash));
+    if (!s || read32(*s) != MAGIC_NUMBER)
+      return nullptr;
+
+    const uint32_t size = read32(*s);
+    const uint32_t compressedSize = read32(*s);
+    const int rowBytes = tile_row_bytes(image.get(), tile);
+    if (size != uint32_t(rowBytes * tile.h))
+      return nullptr;
+
+    compressed.resize(compressedSize);
+    buf.resize(size);
+    if (s->read((char*)compressed.data(), compressedSize).fail())
+      return nullptr;
+
+    uLongf len = size;
+    if (uncompress((Bytef*)buf.data(), &len,
+                   (const Bytef*)compressed.data(), compressedSize) != Z_OK ||
+        len != size)
+      return nullptr;
+
+    const uint8_t* src = buf.data();
+    for (int y=0; y<tile.h; ++y, src+=rowBytes) {
+      auto dst = (uint8_t*)image->getPixelAddress(tile.x, tile.y+y);
+      std::copy(src, src+rowBytes, dst);
+    }
+
+    // Discard tiles with unexpected content
+    if (calculate_image_tile_hash(image.get(), tile) != hash)
+      return nullptr;
+  }
+
+  image->setMaskColor(maskColor);
+  if (setId)
+    image->setId(id);
+  return image.release();
+}
+
+Image* read_image_or_tiled_image(std::istream& is,
+                                 const OpenObject& openTile,
+                                 const bool setId)
+{
+  const std::istream::pos_type pos = is.tellg();
+  if (read32(is) == kTiledImageMark)
+    return read_tiled_image(is, openTile, setId);
+
+  is.seekg(pos);
+  return read_image(is, setId);
+}
+
+} // namespace crash
+} // namespace app
@@ -0,0 +1,84 @@
+// Aseprite
+// Copyright (C) 2023  Igara Studio S.A.
+//
+// This program is distributed under the terms of
+// the End-User License Agreement for Aseprite.
+
+#ifndef APP_CRASH_IMAGE_TILES_H_INCLUDED
+#define APP_CRASH_IMAGE_TILES_H_INCLUDED
+#pragma once
+
+#include "doc/object_id.h"
+#include "gfx/rect.h"
+
+#include <cstdint>
+#include <functional>
+#include <iosfwd>
+#include <memory>
+#include <string>
+#include <vector>
+
+namespace doc {
+  class Image;
+}
+
+namespace app {
+namespace crash {
+
+  // Big images are saved as a list of fixed-size tiles, where each
+  // tile is stored in its own "tile-<imageId>-<hash>" object. In this
+  // way a backup only has to write the tiles that were modified since
+  // the previous backup, and the "img" file contains only a list of
+  // tile hashes (see write_tiled_image_header()).
+  const int kImageTileSize = 128;
+
+  // Value written in place of the image ID at the beginning of an
+  // "img" file to indicate that it's a tiled image (object IDs are
+  // never zero).
+  const uint32_t kTiledImageMark = 0;
+
+  bool use_image_tiles(const doc::Image* image);
+
+  // Returns the bounds of each tile of the image (in row-major order).
+  std::vector<gfx::Rect> get_image_tiles(const doc::Image* image);
+
+  // 64-bit hash (CityHash) of the tile pixels, it identifies the
+  // tile object of the image.
+  uint64_t calculate_image_tile_hash(const doc::Image* image,
+                                     const gfx::Rect& tile);
+
+  std::string image_tile_filename(const doc::ObjectId imageId,
+                                  const uint64_t hash);
+
+  void write_image_tile(std::ostream& os,
+                        const doc::Image* image,
+                        const gfx::Rect& tile);
+
+  // Returns the stream to read the object with the given name (an
+  // "img" or "tile" object), or nullptr if it doesn't exist.
+  typedef std::function<std::unique_ptr<std::istream>(const std::string&)> OpenObject;
+
+  // Writes the "img" file content (after the magic number) for a
+  // tiled image. The "hashes" must be in the same order as
+  // get_image_tiles().
+  void write_tiled_image_header(std::ostream& os,
+                                const doc::Image* image,
+                                const std::vector<uint64_t>& hashes);
+
+  // Reads a tiled image from the "is" stream, its tiles are loaded
+  // with "openTile". Returns nullptr if a tile is missing or
+  // corrupted.
+  doc::Image* read_tiled_image(std::istream& is,
+                               const OpenObject& openTile,
+                               const bool setId);
+
+  // Reads a regular image (doc::read_image()) or a tiled image from
+  // the given "img" object stream.
+  doc::Image* read_image_or_tiled_image(std::istream& is,
+                                        const OpenObject& openTile,
+                                        const bool setId);
+
+} // namespace crash
+} // namespace app
+
+#endif
@@ -0,0 +1,179 @@
+// Aseprite
+// Copyright (C) 2023  Igara Studio S.A.
+//
+// This program is distributed under the terms of
+// the End-User License Agreement for Aseprite.
+
+#include "tests/app_test.h"
+
+#include "app/crash/image_tiles.h"
+#include "app/crash/internals.h"
+#include "base/serialization.h"
+#include "doc/image.h"
+#include "doc/image_io.h"
+#include "doc/image_ref.h"
+#include "doc/primitives.h"
+
+#include <map>
+#include <memory>
+#include <sstream>
+#include <string>
+
+using namespace app::crash;
+using namespace base::serialization::little_endian;
+using namespace doc;
+
+namespace {
+
+typedef std::map<std::string, std::string> Objects;
+
+// Writes the image as the backup does, the tiles in "objects" and
+// the tile hashes in the returned "img" object.
+std::string write_tiled_image(const Image* image, Objects& objects)
+{
+  std::vector<uint64_t> hashes;
+  for (const gfx::Rect& tile : get_image_tiles(image)) {
+    const uint64_t hash = calculate_image_tile_hash(image, tile);
+    hashes.push_back(hash);
+
+    std::ostringstream ts(std::ios::binary);
+    write32(ts, MAGIC_NUMBER);
+    write_image_tile(ts, image, tile);
+    objects[image_tile_filename(image->id(), hash)] = ts.str();
+  }
+
+  std::ostringstream s(std::ios::binary);
+  write_tiled_image_header(s, image, hashes);
+  return s.str();
+}
+
+Image* read_image_from(const std::string& data, const Objects& objects)
+{
+  std::istringstream s(data, std::ios::binary);
+  return read_image_or_tiled_image(
+    s,
+    [&objects](const std::string& name) -> std::unique_ptr<std::istream> {
+      auto it = objects.find(name);
+      if (it == objects.end())
+        return nullptr;
+      return std::make_unique<std::istringstream>(it->second, std::ios::binary);
+    },
+    false);
+}
+
+void fill_pattern(Image* image)
+{
+  for (int y=0; y<image->height(); ++y)
+    for (int x=0; x<image->width(); ++x)
+      put_pixel(image, x, y, (x*7 + y*13 + x*y) & 0xff);
+}
+
+void expect_same_pixels(const Image* a, const Image* b)
+{
+  ASSERT_EQ(a->pixelFormat(), b->pixelFormat());
+  ASSERT_EQ(a->bounds(), b->bounds());
+  for (int y=0; y<a->height(); ++y)
+    for (int x=0; x<a->width(); ++x)
+      ASSERT_EQ(get_pixel(a, x, y), get_pixel(b, x, y)) << x << "," << y;
+}
+
+} // anonymous namespace
+
+TEST(ImageTiles, RoundTrip)
+{
+  for (PixelFormat pf : { IMAGE_RGB, IMAGE_GRAYSCALE, IMAGE_INDEXED }) {
+    // The last column and row of tiles are smaller than kImageTileSize
+    ImageRef image(Image::create(pf, 2*kImageTileSize+30, kImageTileSize+1));
+    fill_pattern(image.get());
+    image->setMaskColor(pf == IMAGE_INDEXED ? 3: 0);
+    ASSERT_TRUE(use_image_tiles(image.get()));
+    EXPECT_EQ(6, int(get_image_tiles(image.get()).size()));
+
+    Objects objects;
+    const std::string img = write_tiled_image(image.get(), objects);
+    EXPECT_EQ(6, int(objects.size()));
+
+    ImageRef copy(read_image_from(img, objects));
+    ASSERT_TRUE(copy != nullptr);
+    EXPECT_EQ(image->maskColor(), copy->maskColor());
+    expect_same_pixels(image.get(), copy.get());
+  }
+}
+
+TEST(ImageTiles, SameTilesAreSavedOnce)
+{
+  ImageRef image(Image::create(IMAGE_RGB, 4*kImageTileSize, kImageTileSize));
+  clear_image(image.get(), rgba(255, 0, 0, 255));
+  put_pixel(image.get(), 0, 0, rgba(0, 0, 255, 255));
+
+  Objects objects;
+  const std::string img = write_tiled_image(image.get(), objects);
+  EXPECT_EQ(2, int(objects.size()));
+
+  ImageRef copy(read_image_from(img, objects));
+  ASSERT_TRUE(copy != nullptr);
+  expect_same_pixels(image.get(), copy.get());
+}
+
+// A null image is returned when a tile is missing or corrupted, so
+// the reader uses an older version of the image.
+TEST(ImageTiles, MissingTile)
+{
+  ImageRef image(Image::create(IMAGE_RGB, 2*kImageTileSize, 2*kImageTileSize));
+  fill_pattern(image.get());
+
+  Objects objects;
+  const std::string img = write_tiled_image(image.get(), objects);
+  ASSERT_EQ(4, int(objects.size()));
+  {
+    ImageRef copy(read_image_from(img, objects));
+    EXPECT_TRUE(copy != nullptr);
+  }
+
+  const auto tiles = get_image_tiles(image.get());
+  const std::string tileName =
+    image_tile_filename(image->id(),
+                        calculate_image_tile_hash(image.get(), tiles[3]));
+  ASSERT_TRUE(objects.find(tileName) != objects.end());
+
+  // Tile with other pixels but the same hash
+  {
+    Objects corrupted = objects;
+    ImageRef other(Image::createCopy(image.get()));
+    put_pixel(other.get(), tiles[3].x, tiles[3].y, rgba(1, 2, 3, 4));
+    std::ostringstream ts(std::ios::binary);
+    write32(ts, MAGIC_NUMBER);
+    write_image_tile(ts, other.get(), tiles[3]);
+    corrupted[tileName] = ts.str();
+
+    ImageRef copy(read_image_from(img, corrupted));
+    EXPECT_TRUE(copy == nullptr);
+  }
+
+  // Truncated tile
+  {
+    Objects truncated = objects;
+    truncated[tileName].resize(truncated[tileName].size() / 2);
+
+    ImageRef copy(read_image_from(img, truncated));
+    EXPECT_TRUE(copy == nullptr);
+  }
+
+  objects.erase(tileName);
+  ImageRef copy(read_image_from(img, objects));
+  EXPECT_TRUE(copy == nullptr);
+}
+
+TEST(ImageTiles, RegularImage)
+{
+  ImageRef image(Image::create(IMAGE_RGB, kImageTileSize, 32));
+  fill_pattern(image.get());
+  EXPECT_FALSE(use_image_tiles(image.get()));
+
+  std::ostringstream s(std::ios::binary);
+  write_image(s, image.get());
+
+  ImageRef copy(read_image_from(s.str(), Objects()));
+  ASSERT_TRUE(copy != nullptr);
+  expect_same_pixels(image.get(), copy.get());
+}
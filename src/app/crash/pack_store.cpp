@@ -0,0 +1,421 @@
+// Aseprite
+// Copyright (C) 2023  Igara Studio S.A.
+//
+// This program is distributed under the terms of
+// the End-User License Agreement for Aseprite.
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "app/crash/pack_store.h"
+
+#include "app/crash/internals.h"
+#include "app/crash/log.h"
+#include "base/convert_to.h"
+#include "base/exception.h"
+#include "base/fs.h"
+#include "base/fstream_path.h"
+#include "base/serialization.h"
+
+#include <algorithm>
+#include <cstring>
+
+namespace app {
+namespace crash {
+
+using namespace base::serialization;
+using namespace base::serialization::little_endian;
+
+namespace {
+
+const uint32_t kPackRecordMagic = 0x4B434150; // 'PACK' in ASCII
+const int kPackRecordHeaderSize = 4+8+4;      // Magic + key + size
+const int kPackRecordTrailerSize = 4;         // MAGIC_NUMBER
+
+// Minimum growth of the pack file to compact it
+const uint64_t kMinCompactionGrowth = 32*1024*1024;
+
+const char* kPackPrefix = "pack.";
+const char* kIndexPrefix = "index.";
+const char* kTempSuffix = "tmp";
+
+// Returns the latest generation of "prefix<generation>" files in
+// the directory (or 0 if there is no file).
+int find_latest_generation(const std::string& dir,
+                           const std::string& prefix)
+{
+  int generation = 0;
+  for (const auto& fn : base::list_files(dir)) {
+    if (fn.size() > prefix.size() &&
+        fn.compare(0, prefix.size(), prefix) == 0) {
+      generation = std::max(generation,
+                            base::convert_to<int>(fn.substr(prefix.size())));
+    }
+  }
+  return generation;
+}
+
+// Deletes "prefix<generation>" files of older generations (and
+// temporary files).
+void delete_old_generations(const std::string& dir,
+                            const std::string& prefix,
+                            const int latest)
+{
+  for (const auto& fn : base::list_files(dir)) {
+    if (fn.size() > prefix.size() &&
+        fn.compare(0, prefix.size(), prefix) == 0 &&
+        base::convert_to<int>(fn.substr(prefix.size())) < latest) {
+      try {
+        base::delete_file(base::join_path(dir, fn));
+      }
+      catch (const std::exception&) {
+        // The file could be in use by a reader, we'll try to delete
+        // it in the next compaction.
+        RECO_TRACE("RECO: Cannot delete '%s'\n", fn.c_str());
+      }
+    }
+  }
+}
+
+void write_pack_record(std::ostream& os,
+                       const PackStore::Key key,
+                       const std::string& data)
+{
+  write32(os, kPackRecordMagic);
+  write64(os, key);
+  write32(os, uint32_t(data.size()));
+  os.write(data.data(), data.size());
+  write32(os, MAGIC_NUMBER);
+}
+
+PackStore::Key hash_data(const std::string& data)
+{
+  const uint64_t k = 0x9e3779b97f4a7c15ull;
+  const uint8_t* p = (const uint8_t*)data.data();
+  std::size_t n = data.size();
+  uint64_t h = 0xcbf29ce484222325ull ^ (n * k);
+
+  for (; n >= 8; n-=8, p+=8) {
+    uint64_t w;
+    std::memcpy(&w, p, 8);
+    h = (h ^ w) * k;
+    h ^= (h >> 31);
+  }
+  for (; n > 0; --n, ++p)
+    h = (h ^ *p) * k;
+
+  // splitmix64 finalizer
+  h = (h ^ (h >> 30)) * 0xbf58476d1ce4e5b9ull;
+  h = (h ^ (h >> 27)) * 0x94d049bb133111ebull;
+  return h ^ (h >> 31);
+}
+
+} // anonymous namespace
+
+//////////////////////////////////////////////////////////////////////
+// PackStore
+
+PackStore::PackStore(const std::string& dir)
+  : m_dir(dir)
+{
+  m_generation = find_latest_generation(m_dir, kPackPrefix);
+  if (m_generation > 0)
+    scan();
+}
+
+PackStore::Key PackStore::add(const std::string& data)
+{
+  const std::lock_guard lock(m_mutex);
+
+  Key key = hash_data(data);
+  std::string existent;
+  for (auto it = m_entries.find(key); it != m_entries.end();
+       it = m_entries.find(++key)) {
+    // Compare the content to avoid hash collisions
+    if (it->second.size == data.size() &&
+        readData(it->second, existent) &&
+        existent == data)
+      return key;
+  }
+
+  openForWriting();
+
+  m_file.seekp(m_fileSize);
+  write_pack_record(m_file, key, data);
+  m_file.flush();
+  if (m_file.fail()) {
+    m_file.clear();
+    throw base::Exception("Error writing the recovery data pack file");
+  }
+
+  m_entries[key] = Entry{ m_fileSize + kPackRecordHeaderSize,
+                          uint32_t(data.size()) };
+  m_fileSize += kPackRecordHeaderSize + data.size() + kPackRecordTrailerSize;
+  return key;
+}
+
+bool PackStore::get(const Key key, std::string& data)
+{
+  const std::lock_guard lock(m_mutex);
+  auto it = m_entries.find(key);
+  if (it == m_entries.end())
+    return false;
+  return readData(it->second, data);
+}
+
+uint64_t PackStore::size() const
+{
+  const std::lock_guard lock(m_mutex);
+  return m_fileSize;
+}
+
+bool PackStore::needsCompaction() const
+{
+  const std::lock_guard lock(m_mutex);
+  return (m_fileSize > 2*m_compactedSize &&
+          m_fileSize - m_compactedSize > kMinCompactionGrowth);
+}
+
+void PackStore::compact(const std::set<Key>& usedKeys)
+{
+  const std::lock_guard lock(m_mutex);
+  const std::string tmpFn = packFilename(0);
+  std::unordered_map<Key, Entry> newEntries;
+  uint64_t newSize = 0;
+
+  RECO_TRACE("RECO: Compacting pack file (%d objects)\n", int(m_entries.size()));
+  {
+    std::ofstream out(FSTREAM_PATH(tmpFn), std::ofstream::binary);
+    std::string data;
+    for (const auto& kv : m_entries) {
+      if (usedKeys.find(kv.first) == usedKeys.end() ||
+          !readData(kv.second, data))
+        continue;
+
+      write_pack_record(out, kv.first, data);
+      newEntries[kv.first] = Entry{ newSize + kPackRecordHeaderSize,
+                                    kv.second.size };
+      newSize += kPackRecordHeaderSize + data.size() + kPackRecordTrailerSize;
+    }
+    out.flush();
+    if (out.fail())
+      throw base::Exception("Error writing the recovery data pack file");
+  }
+
+  // The new generation replaces the old one only when it's complete
+  m_file.close();
+  m_file.clear();
+  m_writable = false;
+  base::move_file(tmpFn, packFilename(m_generation+1));
+  ++m_generation;
+
+  m_entries = std::move(newEntries);
+  m_fileSize = newSize;
+  m_compactedSize = newSize;
+
+  delete_old_generations(m_dir, kPackPrefix, m_generation);
+  openForWriting();
+  RECO_TRACE("RECO: Pack file compacted (%d objects)\n", int(m_entries.size()));
+}
+
+// static
+void PackStore::deleteFiles(const std::string& dir)
+{
+  for (const auto& fn : base::list_files(dir)) {
+    if (fn.compare(0, std::strlen(kPackPrefix), kPackPrefix) == 0)
+      base::delete_file(base::join_path(dir, fn));
+  }
+}
+
+void PackStore::scan()
+{
+  m_file.open(FSTREAM_PATH(packFilename(m_generation)),
+              std::fstream::in | std::fstream::binary);
+  if (!m_file)
+    return;
+
+  // Read all record headers, we stop in the first incomplete record
+  // (e.g. an object that was being written when the program crashed).
+  uint64_t pos = 0;
+  while (true) {
+    m_file.seekg(pos);
+    if (read32(m_file) != kPackRecordMagic)
+      break;
+
+    const Key key = read64(m_file);
+    const uint32_t size = read32(m_file);
+    m_file.seekg(size, std::ios::cur);
+    if (read32(m_file) != MAGIC_NUMBER || m_file.fail())
+      break;
+
+    m_entries[key] = Entry{ pos + kPackRecordHeaderSize, size };
+    pos += kPackRecordHeaderSize + size + kPackRecordTrailerSize;
+  }
+  m_file.clear();
+  m_fileSize = pos;
+  m_compactedSize = pos;
+}
+
+void PackStore::openForWriting()
+{
+  if (m_file.is_open() && m_writable)
+    return;
+
+  if (m_file.is_open())
+    m_file.close();
+  m_file.clear();
+  m_writable = false;
+
+  if (m_generation == 0)
+    m_generation = 1;
+
+  const std::string fn = packFilename(m_generation);
+  if (!base::is_file(fn))
+    std::ofstream(FSTREAM_PATH(fn), std::ofstream::binary);
+
+  m_file.open(FSTREAM_PATH(fn),
+              std::fstream::in | std::fstream::out | std::fstream::binary);
+  if (!m_file)
+    throw base::Exception("Cannot open the recovery data pack file");
+  m_writable = true;
+}
+
+bool PackStore::readData(const Entry& entry, std::string& data)
+{
+  if (!m_file.is_open())
+    return false;
+
+  data.resize(entry.size);
+  m_file.seekg(entry.pos);
+  if (m_file.read(data.data(), entry.size).fail()) {
+    m_file.clear();
+    return false;
+  }
+  return true;
+}
+
+std::string PackStore::packFilename(const int generation) const
+{
+  return base::join_path(
+    m_dir, kPackPrefix + (generation > 0 ? base::convert_to<std::string>(generation):
+                                           std::string(kTempSuffix)));
+}
+
+//////////////////////////////////////////////////////////////////////
+// PackIndex
+
+PackIndex::PackIndex(const std::string& dir)
+  : m_dir(dir)
+{
+  m_generation = find_latest_generation(m_dir, kIndexPrefix);
+  if (m_generation == 0)
+    return;
+
+  std::ifstream s(FSTREAM_PATH(indexFilename(m_generation)), std::ifstream::binary);
+  while (s) {
+    const int len = read16(s);
+    std::string name(len, 0);
+    s.read(name.data(), len);
+    const PackStore::Key key = read64(s);
+    if (read32(s) != MAGIC_NUMBER || s.fail())
+      break;
+
+    m_entries[name] = key;
+  }
+}
+
+// static
+bool PackIndex::exists(const std::string& dir)
+{
+  return (find_latest_generation(dir, kIndexPrefix) > 0);
+}
+
+bool PackIndex::find(const std::string& name, PackStore::Key& key) const
+{
+  auto it = m_entries.find(name);
+  if (it == m_entries.end())
+    return false;
+  key = it->second;
+  return true;
+}
+
+void PackIndex::put(const std::string& name, const PackStore::Key key)
+{
+  if (!m_file.is_open()) {
+    if (m_generation == 0)
+      m_generation = 1;
+    m_file.open(FSTREAM_PATH(indexFilename(m_generation)),
+                std::ofstream::binary | std::ofstream::app);
+  }
+
+  write16(m_file, name.size());
+  m_file.write(name.data(), name.size());
+  write64(m_file, key);
+  write32(m_file, MAGIC_NUMBER);
+  m_file.flush();
+  if (m_file.fail()) {
+    m_file.clear();
+    throw base::Exception("Error writing the recovery data index file");
+  }
+
+  m_entries[name] = key;
+}
+
+void PackIndex::remove(const std::string& name)
+{
+  if (m_entries.erase(name))
+    ++m_removed;
+}
+
+void PackIndex::rewriteIfNeeded()
+{
+  if (m_removed >= 64 &&
+      m_removed >= int(m_entries.size()))
+    rewrite();
+}
+
+bool PackIndex::rewrite()
+{
+  if (m_removed == 0)
+    return true;
+
+  const std::string tmpFn = indexFilename(0);
+  {
+    std::ofstream s(FSTREAM_PATH(tmpFn), std::ofstream::binary);
+    for (const auto& kv : m_entries) {
+      write16(s, kv.first.size());
+      s.write(kv.first.data(), kv.first.size());
+      write64(s, kv.second);
+      write32(s, MAGIC_NUMBER);
+    }
+    s.flush();
+    if (s.fail())
+      return false;             // Try again in the next backup
+  }
+
+  m_file.close();
+  m_file.clear();
+  base::move_file(tmpFn, indexFilename(m_generation+1));
+  ++m_generation;
+  m_removed = 0;
+
+  delete_old_generations(m_dir, kIndexPrefix, m_generation);
+  return true;
+}
+
+void PackIndex::getKeys(std::set<PackStore::Key>& keys) const
+{
+  for (const auto& kv : m_entries)
+    keys.insert(kv.second);
+}
+
+std::string PackIndex::indexFilename(const int generation) const
+{
+  return base::join_path(
+    m_dir, kIndexPrefix + (generation > 0 ? base::convert_to<std::string>(generation):
+                                            std::string(kTempSuffix)));
+}
+
+} // namespace crash
+} // namespace app
@@ -0,0 +1,140 @@
+// Aseprite
+// Copyright (C) 2023  Igara Studio S.A.
+//
+// This program is distributed under the terms of
+// the End-User License Agreement for Aseprite.
+
+#ifndef APP_CRASH_PACK_STORE_H_INCLUDED
+#define APP_CRASH_PACK_STORE_H_INCLUDED
+#pragma once
+
+#include "base/disable_copying.h"
+
+#include <cstdint>
+#include <fstream>
+#include <map>
+#include <mutex>
+#include <set>
+#include <string>
+#include <unordered_map>
+
+namespace app {
+namespace crash {
+
+  // Append-only file where all the objects of a session are stored
+  // ("pack.<generation>" file in the session directory). Each object
+  // is identified by the hash of its content (its key), so identical
+  // objects (e.g. the same image in different versions/documents)
+  // are stored only once.
+  //
+  // Objects that are not used anymore are removed with compact(),
+  // which creates a new generation of the pack file.
+  //
+  // This class is thread-safe.
+  class PackStore {
+  public:
+    typedef uint64_t Key;
+
+    // Loads the index of the latest pack file in the given directory
+    // (the file is created when the first object is added).
+    explicit PackStore(const std::string& dir);
+
+    // Adds the given data (if it's not already in the pack) and
+    // returns its key. Throws an exception on I/O errors.
+    Key add(const std::string& data);
+
+    // Returns false if the object is not in the pack or cannot be read.
+    bool get(const Key key, std::string& data);
+
+    // Total bytes of objects in the pack file.
+    uint64_t size() const;
+
+    // Returns true if the pack file has grown enough since the last
+    // compaction to look for unused objects.
+    bool needsCompaction() const;
+
+    // Creates a new pack file with the given objects only, and
+    // deletes the old one.
+    void compact(const std::set<Key>& usedKeys);
+
+    // Deletes all pack files in the given directory.
+    static void deleteFiles(const std::string& dir);
+
+  private:
+    struct Entry {
+      uint64_t pos;             // Position of the object data
+      uint32_t size;
+    };
+
+    void scan();
+    void openForWriting();
+    bool readData(const Entry& entry, std::string& data);
+    std::string packFilename(const int generation) const;
+
+    mutable std::mutex m_mutex;
+    std::string m_dir;
+    int m_generation = 0;
+    std::fstream m_file;
+    bool m_writable = false;    // m_file was opened for writing
+    uint64_t m_fileSize = 0;    // End of the last valid record
+    uint64_t m_compactedSize = 0;
+    std::unordered_map<Key, Entry> m_entries;
+
+    DISABLE_COPYING(PackStore);
+  };
+
+  // List of objects saved for a document (object names like
+  // "img-12.3" associated to keys in the PackStore). It's stored
+  // in an append-only "index.<generation>" file in the document
+  // directory.
+  class PackIndex {
+  public:
+    typedef std::map<std::string, PackStore::Key> Entries;
+
+    // Loads the latest index file in the given directory (the file is
+    // created when the first entry is added).
+    explicit PackIndex(const std::string& dir);
+
+    // Returns true if the given directory contains an index file
+    // (i.e. the document was saved with a PackStore).
+    static bool exists(const std::string& dir);
+
+    const Entries& entries() const { return m_entries; }
+    bool find(const std::string& name, PackStore::Key& key) const;
+
+    // Appends a new entry to the index file.
+    void put(const std::string& name, const PackStore::Key key);
+
+    // Removes the entry from memory, the index file is updated in
+    // rewriteIfNeeded() (so the object is kept in the PackStore in
+    // the meantime).
+    void remove(const std::string& name);
+
+    // Writes a new index file without removed entries if there are
+    // too many of them.
+    void rewriteIfNeeded();
+
+    // Writes a new index file without removed entries (if there is
+    // any), so their objects can be removed from the PackStore.
+    // Returns false if the file cannot be written.
+    bool rewrite();
+
+    // Adds the keys of all entries to the given set.
+    void getKeys(std::set<PackStore::Key>& keys) const;
+
+  private:
+    std::string indexFilename(const int generation) const;
+
+    std::string m_dir;
+    int m_generation = 0;
+    std::ofstream m_file;
+    Entries m_entries;
+    int m_removed = 0;
+
+    DISABLE_COPYING(PackIndex);
+  };
+
+} // namespace crash
+} // namespace app
+
+#endif
@@ -0,0 +1,213 @@
+// Aseprite
+// Copyright (C) 2023  Igara Studio S.A.
+//
+// This program is distributed under the terms of
+// the End-User License Agreement for Aseprite.
+
+#include "tests/app_test.h"
+
+#include "app/crash/pack_store.h"
+#include "base/fs.h"
+#include "base/fstream_path.h"
+
+#include <fstream>
+#include <iterator>
+#include <set>
+#include <string>
+
+using namespace app::crash;
+
+namespace {
+
+// Empty directory for the files of a test
+std::string test_dir(const std::string& name)
+{
+  const std::string dir = "pack_store_tests_" + name;
+  if (base::is_directory(dir)) {
+    for (const auto& fn : base::list_files(dir))
+      base::delete_file(base::join_path(dir, fn));
+  }
+  else
+    base::make_directory(dir);
+  return dir;
+}
+
+std::string read_file(const std::string& fn)
+{
+  std::ifstream s(FSTREAM_PATH(fn), std::ifstream::binary);
+  return std::string(std::istreambuf_iterator<char>(s),
+                     std::istreambuf_iterator<char>());
+}
+
+void write_file(const std::string& fn, const std::string& data)
+{
+  std::ofstream s(FSTREAM_PATH(fn), std::ofstream::binary);
+  s.write(data.data(), data.size());
+}
+
+} // anonymous namespace
+
+TEST(PackStore, RoundTrip)
+{
+  const std::string dir = test_dir("round_trip");
+  const std::string a = "first object";
+  const std::string b(100000, 'b');
+  PackStore::Key ka, kb;
+  uint64_t size;
+
+  {
+    PackStore pack(dir);
+    EXPECT_EQ(0, int(pack.size()));
+
+    ka = pack.add(a);
+    kb = pack.add(b);
+    EXPECT_NE(ka, kb);
+    size = pack.size();
+
+    // Objects with the same content are stored once
+    EXPECT_EQ(ka, pack.add(a));
+    EXPECT_EQ(size, pack.size());
+
+    std::string data;
+    EXPECT_TRUE(pack.get(ka, data));
+    EXPECT_EQ(a, data);
+
+    // Adding objects after reading others (the file is open for
+    // writing only once)
+    const PackStore::Key kc = pack.add("c");
+    EXPECT_TRUE(pack.get(kc, data));
+    EXPECT_EQ("c", data);
+    EXPECT_TRUE(pack.get(kb, data));
+    EXPECT_EQ(b, data);
+    size = pack.size();
+  }
+
+  // Load the pack again from the file
+  PackStore pack(dir);
+  EXPECT_EQ(size, pack.size());
+  std::string data;
+  EXPECT_TRUE(pack.get(ka, data));
+  EXPECT_EQ(a, data);
+  EXPECT_TRUE(pack.get(kb, data));
+  EXPECT_EQ(b, data);
+  EXPECT_FALSE(pack.get(ka+kb, data));
+}
+
+TEST(PackStore, TruncatedRecord)
+{
+  const std::string dir = test_dir("truncated");
+  PackStore::Key ka, kb;
+  uint64_t sizeA;
+
+  {
+    PackStore pack(dir);
+    ka = pack.add("object a");
+    sizeA = pack.size();
+    kb = pack.add("object b");
+  }
+
+  // Simulate a crash while the last record was being written
+  const std::string fn = base::join_path(dir, "pack.1");
+  const std::string data = read_file(fn);
+  ASSERT_GT(data.size(), sizeA);
+  write_file(fn, data.substr(0, data.size()-3));
+
+  {
+    PackStore pack(dir);
+    EXPECT_EQ(sizeA, pack.size());
+
+    std::string obj;
+    EXPECT_TRUE(pack.get(ka, obj));
+    EXPECT_EQ("object a", obj);
+    EXPECT_FALSE(pack.get(kb, obj));
+
+    // The incomplete record is overwritten by new objects
+    EXPECT_EQ(kb, pack.add("object b"));
+    EXPECT_TRUE(pack.get(kb, obj));
+    EXPECT_EQ("object b", obj);
+  }
+
+  PackStore pack(dir);
+  std::string obj;
+  EXPECT_TRUE(pack.get(ka, obj));
+  EXPECT_TRUE(pack.get(kb, obj));
+  EXPECT_EQ("object b", obj);
+}
+
+TEST(PackStore, Compaction)
+{
+  const std::string dir = test_dir("compaction");
+  PackStore::Key ka, kb, kc;
+
+  {
+    PackStore pack(dir);
+    ka = pack.add("object a");
+    kb = pack.add(std::string(1000, 'b'));
+    kc = pack.add("object c");
+    const uint64_t size = pack.size();
+
+    pack.compact({ ka, kc });
+    EXPECT_LT(pack.size(), size);
+
+    std::string obj;
+    EXPECT_TRUE(pack.get(ka, obj));
+    EXPECT_EQ("object a", obj);
+    EXPECT_FALSE(pack.get(kb, obj));
+    EXPECT_TRUE(pack.get(kc, obj));
+    EXPECT_EQ("object c", obj);
+
+    // New objects go to the new generation
+    EXPECT_EQ(kb, pack.add(std::string(1000, 'b')));
+  }
+
+  // Only the latest generation is kept
+  EXPECT_EQ(base::paths{ "pack.2" }, base::list_files(dir));
+
+  PackStore pack(dir);
+  std::string obj;
+  EXPECT_TRUE(pack.get(ka, obj));
+  EXPECT_TRUE(pack.get(kb, obj));
+  EXPECT_EQ(std::string(1000, 'b'), obj);
+  EXPECT_TRUE(pack.get(kc, obj));
+}
+
+TEST(PackIndex, RoundTripAndRewrite)
+{
+  const std::string dir = test_dir("index");
+  EXPECT_FALSE(PackIndex::exists(dir));
+
+  {
+    PackIndex index(dir);
+    index.put("img-1.1", 10);
+    index.put("img-2.1", 20);
+    index.put("img-1.2", 11);
+    index.remove("img-1.1");
+  }
+  EXPECT_TRUE(PackIndex::exists(dir));
+
+  {
+    // Removed entries are still in the file until it's rewritten
+    PackIndex index(dir);
+    EXPECT_EQ(3, int(index.entries().size()));
+
+    PackStore::Key key;
+    EXPECT_TRUE(index.find("img-1.2", key));
+    EXPECT_EQ(PackStore::Key(11), key);
+
+    index.remove("img-1.1");
+    EXPECT_TRUE(index.rewrite());
+
+    std::set<PackStore::Key> keys;
+    index.getKeys(keys);
+    EXPECT_EQ((std::set<PackStore::Key>{ 11, 20 }), keys);
+
+    // New entries are added to the new file
+    index.put("img-3.1", 30);
+  }
+
+  PackIndex index(dir);
+  std::set<PackStore::Key> keys;
+  index.getKeys(keys);
+  EXPECT_EQ((std::set<PackStore::Key>{ 11, 20, 30 }), keys);
+  EXPECT_EQ(base::paths{ "index.2" }, base::list_files(dir));
+}
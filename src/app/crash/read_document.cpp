@@ -13,8 +13,10 @@
 
 #include "app/console.h"
 #include "app/crash/doc_format.h"
+#include "app/crash/image_tiles.h"
 #include "app/crash/internals.h"
 #include "app/crash/log.h"
+#include "app/crash/pack_store.h"
 #include "app/doc.h"
 #include "base/convert_to.h"
 #include "base/exception.h"
@@ -48,6 +50,8 @@
 
 #include <fstream>
 #include <map>
+#include <memory>
+#include <sstream>
 
 namespace app {
 namespace crash {
@@ -58,18 +62,69 @@ using namespace doc;
 
 namespace {
 
+// Objects saved for a document, stored in the session PackStore (or
+// as individual files in the document directory in sessions from
+// older versions).
+class BackupObjects {
+public:
+  BackupObjects(const std::string& dir) : m_dir(dir) {
+    if (PackIndex::exists(dir)) {
+      m_index = std::make_unique<PackIndex>(dir);
+      m_pack = std::make_unique<PackStore>(base::get_file_path(dir));
+    }
+  }
+
+  base::paths names() const {
+    if (!m_index)
+      return base::list_files(m_dir);
+
+    base::paths names;
+    for (const auto& kv : m_index->entries())
+      names.push_back(kv.first);
+    return names;
+  }
+
+  std::unique_ptr<std::istream> open(const std::string& name) const {
+    if (!m_index) {
+      auto s = std::make_unique<std::ifstream>(
+        FSTREAM_PATH(base::join_path(m_dir, name)), std::ifstream::binary);
+      if (!*s)
+        return nullptr;
+      return s;
+    }
+
+    PackStore::Key key;
+    std::string data;
+    if (!m_index->find(name, key) ||
+        !m_pack->get(key, data))
+      return nullptr;
+
+    return std::make_unique<std::istringstream>(std::move(data),
+                                                std::ios::binary);
+  }
+
+  OpenObject openFunc() const {
+    return [this](const std::string& name){ return open(name); };
+  }
+
+private:
+  std::string m_dir;
+  std::unique_ptr<PackIndex> m_index;
+  std::unique_ptr<PackStore> m_pack;
+};
+
 class Reader : public SubObjectsIO {
 public:
   Reader(const std::string& dir,
          base::task_token* t)
     : m_docFormatVer(DOC_FORMAT_VERSION_0)
     , m_sprite(nullptr)
-    , m_dir(dir)
+    , m_objects(dir)
     , m_docId(0)
     , m_docVersions(nullptr)
     , m_loadInfo(nullptr)
     , m_taskToken(t) {
-    for (const auto& fn : base::list_files(dir)) {
+    for (const auto& fn : m_objects.names()) {
       auto i = fn.find('-');
       if (i == std::string::npos)
         continue;               // Has no ID
@@ -145,7 +200,7 @@ private:
   }
 
   template<typename T>
-  T loadObject(const char* prefix, ObjectId id, T (Reader::*readMember)(std::ifstream&)) {
+  T loadObject(const char* prefix, ObjectId id, T (Reader::*readMember)(std::istream&)) {
     const ObjVersions& versions = m_objVersions[id];
 
     for (size_t i=0; i<versions.size(); ++i) {
@@ -161,10 +216,10 @@ private:
       fn.push_back('.');
       fn += base::convert_to<std::string>(ver);
 
-      std::ifstream s(FSTREAM_PATH(base::join_path(m_dir, fn)), std::ifstream::binary);
+      std::unique_ptr<std::istream> s = m_objects.open(fn);
       T obj = nullptr;
-      if (read32(s) == MAGIC_NUMBER)
-        obj = (this->*readMember)(s);
+      if (s && read32(*s) == MAGIC_NUMBER)
+        obj = (this->*readMember)(*s);
 
       if (obj) {
         RECO_TRACE("RECO: %s #%d v%d restored successfully\n", prefix, id, ver);
@@ -182,7 +237,7 @@ private:
     return nullptr;
   }
 
-  Doc* readDocument(std::ifstream& s) {
+  Doc* readDocument(std::istream& s) {
     ObjectId sprId = read32(s);
     std::string filename = read_string(s);
     m_docFormatVer = read16(s);
@@ -209,7 +264,7 @@ private:
     }
   }
 
-  Sprite* readSprite(std::ifstream& s) {
+  Sprite* readSprite(std::istream& s) {
     // Header
     ColorMode mode = (ColorMode)read8(s);
     int w = read16(s);
@@ -394,7 +449,7 @@ private:
     return spr.release();
   }
 
-  gfx::ColorSpaceRef readColorSpace(std::ifstream& s) {
+  gfx::ColorSpaceRef readColorSpace(std::istream& s) {
     const gfx::ColorSpace::Type type = (gfx::ColorSpace::Type)read16(s);
     const gfx::ColorSpace::Flag flags = (gfx::ColorSpace::Flag)read16(s);
     const double gamma = fixmath::fixtof(read32(s));
@@ -416,7 +471,7 @@ private:
     return colorSpace;
   }
 
-  gfx::Rect readGridBounds(std::ifstream& s) {
+  gfx::Rect readGridBounds(std::istream& s) {
     gfx::Rect grid;
     grid.x = (int16_t)read16(s);
     grid.y = (int16_t)read16(s);
@@ -426,7 +481,7 @@ private:
   }
 
   // TODO could we use doc::read_layer() here?
-  Layer* readLayer(std::ifstream& s) {
+  Layer* readLayer(std::istream& s) {
     LayerFlags flags = (LayerFlags)read32(s);
     ObjectType type = (ObjectType)read16(s);
     ASSERT(type == ObjectType::LayerImage ||
@@ -492,23 +547,23 @@ private:
       return nullptr;
   }
 
-  Cel* readCel(std::ifstream& s) {
+  Cel* readCel(std::istream& s) {
     return read_cel(s, this, false);
   }
 
-  CelData* readCelData(std::ifstream& s) {
+  CelData* readCelData(std::istream& s) {
     return read_celdata(s, this, false, m_docFormatVer);
   }
 
-  Image* readImage(std::ifstream& s) {
-    return read_image(s, false);
+  Image* readImage(std::istream& s) {
+    return read_image_or_tiled_image(s, m_objects.openFunc(), false);
   }
 
-  Palette* readPalette(std::ifstream& s) {
+  Palette* readPalette(std::istream& s) {
     return read_palette(s);
   }
 
-  Tileset* readTileset(std::ifstream& s) {
+  Tileset* readTileset(std::istream& s) {
     uint32_t tilesetVer;
     Tileset* tileset = read_tileset(s, m_sprite, false, &tilesetVer, m_docFormatVer);
     if (tileset && tilesetVer < TILESET_VER1)
@@ -516,11 +571,11 @@ private:
     return tileset;
   }
 
-  Tag* readTag(std::ifstream& s) {
+  Tag* readTag(std::istream& s) {
     return read_tag(s, false, m_docFormatVer);
   }
 
-  Slice* readSlice(std::ifstream& s) {
+  Slice* readSlice(std::istream& s) {
     return read_slice(s, false, m_docFormatVer);
   }
 
@@ -575,7 +630,7 @@ private:
 
   int m_docFormatVer;
   Sprite* m_sprite;    // Used to pass the sprite in LayerImage() ctor
-  std::string m_dir;
+  BackupObjects m_objects;
   ObjectVersion m_docId;
   ObjVersionsMap m_objVersions;
   ObjVersions* m_docVersions;
@@ -628,7 +683,8 @@ Doc* read_document_with_raw_images(const std::string& dir,
 
   int i = 0;
   frame_t frame = 0;
-  auto fns = base::list_files(dir);
+  BackupObjects objects(dir);
+  auto fns = objects.names();
   for (const auto& fn : fns) {
     if (t)
       t->set_progress((i++) / fns.size());
@@ -636,13 +692,13 @@ Doc* read_document_with_raw_images(const std::string& dir,
     if (fn.compare(0, 3, "img") != 0)
       continue;
 
-    std::ifstream s(FSTREAM_PATH(base::join_path(dir, fn)), std::ifstream::binary);
+    std::unique_ptr<std::istream> s = objects.open(fn);
     if (!s)
       continue;
 
     ImageRef img;
-    if (read32(s) == MAGIC_NUMBER)
-      img.reset(read_image(s, false));
+    if (read32(*s) == MAGIC_NUMBER)
+      img.reset(read_image_or_tiled_image(*s, objects.openFunc(), false));
 
     if (img) {
       lay->addCel(new Cel(frame, img));
@@ -14,6 +14,7 @@
 #include "app/console.h"
 #include "app/context.h"
 #include "app/crash/log.h"
+#include "app/crash/pack_store.h"
 #include "app/crash/read_document.h"
 #include "app/crash/recovery_config.h"
 #include "app/crash/write_document.h"
@@ -204,6 +205,9 @@ void Session::removeFromDisk()
     if (base::is_file(verFilename()))
       base::delete_file(verFilename());
 
+    m_pack.reset();
+    PackStore::deleteFiles(m_path);
+
     base::remove_directory(m_path);
   }
   catch (const std::exception& ex) {
@@ -228,31 +232,42 @@ public:
 
 bool Session::saveDocumentChanges(Doc* doc)
 {
-  CustomWeakDocReader reader(doc);
-  if (!reader.isLocked())
-    return false;
+  {
+    CustomWeakDocReader reader(doc);
+    if (!reader.isLocked())
+      return false;
 
-  app::Context ctx;
-  std::string dir = base::join_path(m_path,
-    base::convert_to<std::string>(doc->id()));
-  RECO_TRACE("RECO: Saving document '%s'...\n", dir.c_str());
+    app::Context ctx;
+    std::string dir = base::join_path(m_path,
+      base::convert_to<std::string>(doc->id()));
+    RECO_TRACE("RECO: Saving document '%s'...\n", dir.c_str());
+
+    // Create directory for document
+    if (!base::is_directory(dir))
+      base::make_directory(dir);
+
+    // Create "open" file to indicate that the document is open in this session
+    {
+      std::string openfile = base::join_path(dir, kOpenFilename);
+      if (!base::is_file(openfile)) {
+        std::ofstream of(FSTREAM_PATH(openfile));
+        if (of)
+          of << "open";
+      }
+    }
 
-  // Create directory for document
-  if (!base::is_directory(dir))
-    base::make_directory(dir);
+    if (!m_pack)
+      m_pack = std::make_unique<PackStore>(m_path);
 
-  // Create "open" file to indicate that the document is open in this session
-  {
-    std::string openfile = base::join_path(dir, kOpenFilename);
-    if (!base::is_file(openfile)) {
-      std::ofstream of(FSTREAM_PATH(openfile));
-      if (of)
-        of << "open";
-    }
+    // Save document information
+    if (!write_document(dir, m_pack.get(), doc, &reader))
+      return false;
   }
 
-  // Save document information
-  return write_document(dir, doc, &reader);
+  // Compact the pack file when the document is already unlocked
+  if (m_pack->needsCompaction())
+    compactPack();
+  return true;
 }
 
 void Session::removeDocument(Doc* doc)
@@ -395,6 +410,32 @@ void Session::deleteDirectory(const std::string& dir)
   base::remove_directory(dir);
 }
 
+// Removes objects from the pack file that are not used by any
+// document of this session. Documents that are still open use the
+// entries of their index in memory (old versions of their objects
+// can be removed), closed documents keep all the objects of the
+// index file in their directory.
+void Session::compactPack()
+{
+  std::set<PackStore::Key> usedKeys;
+  for (auto& item : base::list_files(m_path)) {
+    std::string docDir = base::join_path(m_path, item);
+    if (base::is_directory(docDir) &&
+        !get_document_pack_keys(doc::ObjectId(base::convert_to<int>(item)),
+                                usedKeys)) {
+      PackIndex(docDir).getKeys(usedKeys);
+    }
+  }
+
+  try {
+    m_pack->compact(usedKeys);
+  }
+  catch (const std::exception& ex) {
+    (void)ex;
+    LOG(ERROR, "RECO: Error compacting pack file: %s\n", ex.what());
+  }
+}
+
 void Session::fixFilename(Doc* doc)
 {
   std::string fn = doc->filename();
@@ -1,5 +1,5 @@
 // Aseprite
-// Copyright (C) 2019-2022  Igara Studio S.A.
+// Copyright (C) 2019-2023  Igara Studio S.A.
 // Copyright (C) 2001-2018  David Capello
 //
 // This program is distributed under the terms of
@@ -23,6 +23,7 @@
 namespace app {
 class Doc;
 namespace crash {
+  class PackStore;
   struct RecoveryConfig;
 
   // A class to record/restore session information.
@@ -78,6 +79,7 @@ namespace crash {
     void markDocumentAsCorrectlyClosed(Doc* doc);
     void deleteDirectory(const std::string& dir);
     void fixFilename(Doc* doc);
+    void compactPack();
 
     base::pid m_pid;
     std::string m_path;
@@ -85,6 +87,10 @@ namespace crash {
     Backups m_backups;
     RecoveryConfig* m_config;
 
+    // Pack file where documents of this session are saved (created
+    // when the first document is saved)
+    std::unique_ptr<PackStore> m_pack;
+
     DISABLE_COPYING(Session);
   };
 
@@ -12,12 +12,12 @@
 #include "app/crash/write_document.h"
 
 #include "app/crash/doc_format.h"
+#include "app/crash/image_tiles.h"
 #include "app/crash/internals.h"
 #include "app/crash/log.h"
+#include "app/crash/pack_store.h"
 #include "app/doc.h"
 #include "base/convert_to.h"
-#include "base/fs.h"
-#include "base/fstream_path.h"
 #include "base/serialization.h"
 #include "base/string.h"
 #include "doc/cancel_io.h"
@@ -43,8 +43,11 @@
 #include "doc/user_data_io.h"
 #include "fixmath/fixmath.h"
 
-#include <fstream>
 #include <map>
+#include <memory>
+#include <set>
+#include <sstream>
+#include <vector>
 
 namespace app {
 namespace crash {
@@ -55,16 +58,28 @@ using namespace doc;
 
 namespace {
 
+// Tiles of a tiled image (see image_tiles.h)
+struct ImageTiles {
+  // Hashes of the tiles used by each saved version of the image
+  std::map<ObjectVersion, std::vector<uint64_t>> versions;
+  // Hashes of the tiles that are in the index
+  std::set<uint64_t> saved;
+};
+
+typedef std::map<ObjectId, ImageTiles> ImageTilesMap;
+
 static std::map<ObjectId, ObjVersionsMap> g_docVersions;
-static std::map<ObjectId, base::paths> g_deleteFiles;
+static std::map<ObjectId, std::unique_ptr<PackIndex>> g_docIndexes;
+static std::map<ObjectId, ImageTilesMap> g_docImageTiles;
 
 class Writer {
 public:
-  Writer(const std::string& dir, Doc* doc, doc::CancelIO* cancel)
-    : m_dir(dir)
+  Writer(const std::string& dir, PackStore* pack, Doc* doc, doc::CancelIO* cancel)
+    : m_pack(pack)
+    , m_index(getIndex(dir, doc))
     , m_doc(doc)
     , m_objVersions(g_docVersions[doc->id()])
-    , m_deleteFiles(g_deleteFiles[doc->id()])
+    , m_imageTiles(g_docImageTiles[doc->id()])
     , m_cancel(cancel) {
   }
 
@@ -138,25 +153,33 @@ public:
     if (!saveObject("doc", m_doc, &Writer::writeDocumentFile))
       return false;
 
-    // Delete old files after all files are correctly saved.
-    deleteOldVersions();
+    // Remove old versions from the index file after all objects are
+    // correctly saved.
+    m_index.rewriteIfNeeded();
     return true;
   }
 
 private:
 
+  static PackIndex& getIndex(const std::string& dir, Doc* doc) {
+    std::unique_ptr<PackIndex>& index = g_docIndexes[doc->id()];
+    if (!index)
+      index = std::make_unique<PackIndex>(dir);
+    return *index;
+  }
+
   bool isCanceled() const {
     return (m_cancel && m_cancel->isCanceled());
   }
 
-  bool writeDocumentFile(std::ofstream& s, Doc* doc) {
+  bool writeDocumentFile(std::ostream& s, Doc* doc) {
     write32(s, doc->sprite()->id());
     write_string(s, doc->filename());
     write16(s, DOC_FORMAT_VERSION_LAST);
     return true;
   }
 
-  bool writeSprite(std::ofstream& s, Sprite* spr) {
+  bool writeSprite(std::ostream& s, Sprite* spr) {
     // Header
     write8(s, int(spr->colorMode()));
     write16(s, spr->width());
@@ -210,7 +233,7 @@ private:
     return true;
   }
 
-  bool writeGridBounds(std::ofstream& s, const gfx::Rect& grid) {
+  bool writeGridBounds(std::ostream& s, const gfx::Rect& grid) {
     write16(s, (int16_t)grid.x);
     write16(s, (int16_t)grid.y);
     write16(s, grid.w);
@@ -218,7 +241,7 @@ private:
     return true;
   }
 
-  bool writeColorSpace(std::ofstream& s, const gfx::ColorSpaceRef& colorSpace) {
+  bool writeColorSpace(std::ostream& s, const gfx::ColorSpaceRef& colorSpace) {
     write16(s, colorSpace->type());
     write16(s, colorSpace->flags());
     write32(s, fixmath::ftofix(colorSpace->gamma()));
@@ -232,7 +255,7 @@ private:
     return true;
   }
 
-  void writeAllLayersID(std::ofstream& s, ObjectId parentId, const LayerGroup* group) {
+  void writeAllLayersID(std::ostream& s, ObjectId parentId, const LayerGroup* group) {
     for (const Layer* lay : group->layers()) {
       write32(s, lay->id());
       write32(s, parentId);
@@ -242,7 +265,7 @@ private:
     }
   }
 
-  bool writeLayerStructure(std::ofstream& s, Layer* lay) {
+  bool writeLayerStructure(std::ostream& s, Layer* lay) {
     write32(s, static_cast<int>(lay->flags())); // Flags
     write16(s, static_cast<int>(lay->type()));  // Type
     write_string(s, lay->name());
@@ -282,42 +305,102 @@ private:
     return true;
   }
 
-  bool writeCel(std::ofstream& s, Cel* cel) {
+  bool writeCel(std::ostream& s, Cel* cel) {
     write_cel(s, cel);
     return true;
   }
 
-  bool writeCelData(std::ofstream& s, CelData* celdata) {
+  bool writeCelData(std::ostream& s, CelData* celdata) {
     write_celdata(s, celdata);
     return true;
   }
 
-  bool writeImage(std::ofstream& s, Image* img) {
-    return write_image(s, img, m_cancel);
+  bool writeImage(std::ostream& s, Image* img) {
+    if (use_image_tiles(img))
+      return writeTiledImage(s, img);
+    else
+      return write_image(s, img, m_cancel);
+  }
+
+  // Writes only the tiles that are not already saved, and the list
+  // of tile hashes in the "img" object.
+  bool writeTiledImage(std::ostream& s, Image* img) {
+    ImageTiles& imgTiles = m_imageTiles[img->id()];
+    const std::vector<gfx::Rect> tiles = get_image_tiles(img);
+    std::vector<uint64_t> hashes(tiles.size());
+
+    for (size_t i=0; i<tiles.size(); ++i) {
+      if (isCanceled())
+        return false;
+
+      const uint64_t hash = calculate_image_tile_hash(img, tiles[i]);
+      hashes[i] = hash;
+      if (imgTiles.saved.find(hash) != imgTiles.saved.end())
+        continue;
+
+      std::ostringstream ts(std::ios::binary);
+      write32(ts, MAGIC_NUMBER);
+      write_image_tile(ts, img, tiles[i]);
+      m_index.put(image_tile_filename(img->id(), hash), m_pack->add(ts.str()));
+      imgTiles.saved.insert(hash);
+
+      RECO_TRACE(" - Saved tile %d,%d of img #%d\n",
+                 tiles[i].x, tiles[i].y, img->id());
+    }
+
+    write_tiled_image_header(s, img, hashes);
+
+    // After saveObject() rotates the versions, only the two newer
+    // versions and this new one will be kept in the index.
+    const ObjVersions& versions = m_objVersions[img->id()];
+    imgTiles.versions[img->version()] = std::move(hashes);
+    for (auto it=imgTiles.versions.begin(); it!=imgTiles.versions.end(); ) {
+      if (it->first != img->version() &&
+          it->first != versions[0] &&
+          it->first != versions[1])
+        it = imgTiles.versions.erase(it);
+      else
+        ++it;
+    }
+
+    // Remove tiles that are not used anymore
+    std::set<uint64_t> used;
+    for (const auto& kv : imgTiles.versions)
+      used.insert(kv.second.begin(), kv.second.end());
+
+    for (auto it=imgTiles.saved.begin(); it!=imgTiles.saved.end(); ) {
+      if (used.find(*it) == used.end()) {
+        m_index.remove(image_tile_filename(img->id(), *it));
+        it = imgTiles.saved.erase(it);
+      }
+      else
+        ++it;
+    }
+    return true;
   }
 
-  bool writePalette(std::ofstream& s, Palette* pal) {
+  bool writePalette(std::ostream& s, Palette* pal) {
     write_palette(s, pal);
     return true;
   }
 
-  bool writeTileset(std::ofstream& s, Tileset* tileset) {
+  bool writeTileset(std::ostream& s, Tileset* tileset) {
     write_tileset(s, tileset);
     return true;
   }
 
-  bool writeFrameTag(std::ofstream& s, Tag* frameTag) {
+  bool writeFrameTag(std::ostream& s, Tag* frameTag) {
     write_tag(s, frameTag);
     return true;
   }
 
-  bool writeSlice(std::ofstream& s, Slice* slice) {
+  bool writeSlice(std::ostream& s, Slice* slice) {
     write_slice(s, slice);
     return true;
   }
 
   template<typename T>
-  bool saveObject(const char* prefix, T* obj, bool (Writer::*writeMember)(std::ofstream&, T*)) {
+  bool saveObject(const char* prefix, T* obj, bool (Writer::*writeMember)(std::ostream&, T*)) {
     if (isCanceled())
       return false;
 
@@ -332,26 +415,22 @@ private:
     fn.push_back('-');
     fn += base::convert_to<std::string>(obj->id());
 
-    std::string fullfn = base::join_path(m_dir, fn);
-    std::string oldfn = fullfn + "." + base::convert_to<std::string>(versions.older());
-    fullfn += "." + base::convert_to<std::string>(obj->version());
+    std::string oldfn = fn + "." + base::convert_to<std::string>(versions.older());
+    fn += "." + base::convert_to<std::string>(obj->version());
 
-    std::ofstream s(FSTREAM_PATH(fullfn), std::ofstream::binary);
-    write32(s, 0);                // Leave a room for the magic number
+    std::ostringstream s(std::ios::binary);
+    write32(s, MAGIC_NUMBER);
     if (!(this->*writeMember)(s, obj)) // Write the object
       return false;
 
-    // Flush all data. In this way we ensure that the magic number is
-    // the last thing being written in the file.
-    s.flush();
-
-    // Write the magic number
-    s.seekp(0);
-    write32(s, MAGIC_NUMBER);
+    // The object is added to the pack file (which is flushed) before
+    // adding it to the index, so an entry in the index always
+    // references a complete object.
+    m_index.put(fn, m_pack->add(s.str()));
 
     // Remove the older version
-    if (versions.older() && base::is_file(oldfn))
-      m_deleteFiles.push_back(oldfn);
+    if (versions.older())
+      m_index.remove(oldfn);
 
     // Rotate versions and add the latest one
     versions.rotateRevisions(obj->version());
@@ -360,25 +439,11 @@ private:
     return true;
   }
 
-  void deleteOldVersions() {
-    while (!m_deleteFiles.empty() && !isCanceled()) {
-      std::string file = m_deleteFiles.back();
-      m_deleteFiles.erase(m_deleteFiles.end()-1);
-
-      try {
-        RECO_TRACE(" - Deleting <%s>\n", file.c_str());
-        base::delete_file(file);
-      }
-      catch (const std::exception&) {
-        RECO_TRACE(" - Cannot delete <%s>\n", file.c_str());
-      }
-    }
-  }
-
-  std::string m_dir;
+  PackStore* m_pack;
+  PackIndex& m_index;
   Doc* m_doc;
   ObjVersionsMap& m_objVersions;
-  base::paths& m_deleteFiles;
+  ImageTilesMap& m_imageTiles;
   doc::CancelIO* m_cancel;
 };
 
@@ -388,10 +453,11 @@ private:
 // Public API
 
 bool write_document(const std::string& dir,
+                    PackStore* pack,
                     Doc* doc,
                     doc::CancelIO* cancel)
 {
-  Writer writer(dir, doc, cancel);
+  Writer writer(dir, pack, doc, cancel);
   return writer.saveDocument();
 }
 
@@ -407,10 +473,31 @@ void delete_document_internals(Doc* doc)
       g_docVersions.erase(it);
   }
   {
-    auto it = g_deleteFiles.find(doc->id());
-    if (it != g_deleteFiles.end())
-      g_deleteFiles.erase(it);
+    auto it = g_docIndexes.find(doc->id());
+    if (it != g_docIndexes.end())
+      g_docIndexes.erase(it);
   }
+  {
+    auto it = g_docImageTiles.find(doc->id());
+    if (it != g_docImageTiles.end())
+      g_docImageTiles.erase(it);
+  }
+}
+
+bool get_document_pack_keys(const doc::ObjectId docId,
+                            std::set<uint64_t>& keys)
+{
+  auto it = g_docIndexes.find(docId);
+  if (it == g_docIndexes.end())
+    return false;
+
+  // The index file cannot reference objects removed from the pack
+  PackIndex* index = it->second.get();
+  if (!index->rewrite())
+    return false;
+
+  index->getKeys(keys);
+  return true;
 }
 
 } // namespace crash
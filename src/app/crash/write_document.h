@@ -1,4 +1,5 @@
 // Aseprite
+// Copyright (C) 2023  Igara Studio S.A.
 // Copyright (C) 2001-2016  David Capello
 //
 // This program is distributed under the terms of
@@ -8,6 +9,10 @@
 #define APP_CRASH_WRITE_DOCUMENT_H_INCLUDED
 #pragma once
 
+#include "doc/object_id.h"
+
+#include <cstdint>
+#include <set>
 #include <string>
 
 namespace doc {
@@ -18,10 +23,21 @@ namespace app {
   class Doc;
 
   namespace crash {
+    class PackStore;
 
-    bool write_document(const std::string& dir, Doc* doc, doc::CancelIO* cancel);
+    // Saves the modified objects of the document in the given pack
+    // file. The list of objects is saved in the "dir" directory.
+    bool write_document(const std::string& dir, PackStore* pack,
+                        Doc* doc, doc::CancelIO* cancel);
     void delete_document_internals(Doc* doc);
 
+    // Adds the keys of the PackStore objects used by the document
+    // with the given ID. Returns false if the document is not being
+    // saved in this session (or its index file cannot be updated),
+    // in that case the keys must be read from its index file.
+    bool get_document_pack_keys(const doc::ObjectId docId,
+                                std::set<uint64_t>& keys);
+
   } // namespace crash
 } // namespace app
 
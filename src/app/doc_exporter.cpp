@@ -29,8 +29,6 @@
 #include "doc/algorithm/shrink_bounds.h"
 #include "doc/cel.h"
 #include "doc/image.h"
-#include "doc/images_map.h"
-#include "doc/images_map.h"
 #include "doc/layer.h"
 #include "doc/palette.h"
 #include "doc/primitives.h"
@@ -39,6 +37,7 @@
 #include "doc/slice.h"
 #include "doc/sprite.h"
 #include "doc/tag.h"
+#include "doc/worker_pool.h"
 #include "gfx/packing_rects.h"
 #include "gfx/rect_io.h"
 #include "gfx/size.h"
@@ -48,12 +47,17 @@
 #include "ver/info.h"
 
 #include <algorithm>
+#include <atomic>
 #include <cstdio>
+#include <exception>
 #include <fstream>
+#include <functional>
 #include <iomanip>
 #include <iostream>
 #include <memory>
+#include <mutex>
 #include <set>
+#include <unordered_map>
 #include <vector>
 
 #define DX_TRACE(...) // TRACEARGS
@@ -88,6 +92,43 @@ std::ostream& operator<<(std::ostream& os, const doc::UserData& data)
   return os;
 }
 
+// Calls func(i, buf) for each i in [0, n) from several threads (the
+// calling thread included). "buf" is a different ImageBuffer for
+// each thread to render samples.
+void for_each_sample_in_parallel(
+  const int n,
+  const std::function<void(int, doc::ImageBufferPtr&)>& func)
+{
+  const int nthreads =
+    std::min(n, doc::worker_threads());
+
+  std::atomic<int> next(0);
+  std::exception_ptr error;
+  std::mutex mutex;
+
+  auto processNextSamples = [&func, &next, &error, &mutex, n]{
+    doc::ImageBufferPtr buf = std::make_shared<doc::ImageBuffer>();
+    int i;
+    while ((i = next++) < n) {
+      try {
+        func(i, buf);
+      }
+      catch (...) {
+        const std::lock_guard lock(mutex);
+        if (!error)
+          error = std::current_exception();
+        next = n;
+      }
+    }
+  };
+
+  // The calling thread processes samples too
+  doc::run_in_workers(nthreads, processNextSamples);
+
+  if (error)
+    std::rethrow_exception(error);
+}
+
 } // anonymous namespace
 
 namespace app {
@@ -170,6 +211,9 @@ public:
     m_extrude(extrude),
     m_isLinked(false),
     m_isDuplicated(false),
+    m_linkedSample(-1),
+    m_hasRenderHash(false),
+    m_renderHash(0),
     m_originalSize(size),
     m_trimmedBounds(size),
     m_inTextureBounds(std::make_shared<gfx::Rect>(size)) {
@@ -225,6 +269,7 @@ public:
 
   bool isLinked() const { return m_isLinked; }
   bool isDuplicated() const { return m_isDuplicated; }
+  int linkedSample() const { return m_linkedSample; }
   bool isEmpty() const {
     // TODO trimmed bounds cannot be empty now (samples that are
     // completely trimmed out are included as a sample of size 1x1)
@@ -232,10 +277,28 @@ public:
     return m_trimmedBounds.isEmpty();
   }
 
-  void setLinked() { m_isLinked = true; }
+  void setLinked(const int linkedSample) {
+    m_isLinked = true;
+    m_linkedSample = linkedSample;
+  }
   void setDuplicated() { m_isDuplicated = true; }
 
-  ImageRef createRender(ImageBufferPtr& imageBuf) {
+  // Returns the hash of the given image created with createRender(),
+  // it's calculated only the first time.
+  uint32_t renderHash(const ImageRef& render) {
+    if (!m_hasRenderHash) {
+      m_renderHash = calculate_image_hash(render.get(), render->bounds());
+      m_hasRenderHash = true;
+    }
+    return m_renderHash;
+  }
+
+  // If "inParallel" is true, this function is being called from a
+  // worker thread, so it doesn't change the visibility of the
+  // selected layers (the caller must do it before) and doesn't
+  // render tiles of the sample in parallel.
+  ImageRef createRender(ImageBufferPtr& imageBuf,
+                        const bool inParallel = false) {
     ASSERT(m_sprite);
 
     // We use the m_image as it is, it doesn't require a special
@@ -250,17 +313,19 @@ public:
                     imageBuf));
     render->setMaskColor(m_sprite->transparentColor());
     clear_image(render.get(), m_sprite->transparentColor());
-    renderSample(render.get(), 0, 0, false);
+    renderSample(render.get(), 0, 0, false, inParallel);
     return render;
   }
 
-  void renderSample(doc::Image* dst, int x, int y, bool extrude) const {
+  void renderSample(doc::Image* dst, int x, int y, bool extrude,
+                    const bool inParallel = false) const {
     RestoreVisibleLayers layersVisibility;
-    if (m_selLayers)
+    if (m_selLayers && !inParallel)
       layersVisibility.showSelectedLayers(m_sprite,
                                           *m_selLayers);
 
     render::Render render;
+    render.setParallelRendering(!inParallel);
 
     // 1) We cannot use the Preferences because this is called from a non-UI thread
     // 2) We should use the new blend mode always when we're saving files
@@ -322,6 +387,9 @@ private:
   bool m_extrude;
   bool m_isLinked;
   bool m_isDuplicated;
+  int m_linkedSample;       // Index of the original sample when m_isLinked is true
+  bool m_hasRenderHash;
+  uint32_t m_renderHash;
   gfx::Size m_originalSize;
   gfx::Rect m_trimmedBounds;
   SharedRectPtr m_inTextureBounds;
@@ -337,22 +405,101 @@ public:
   int size() const { return int(m_samples.size()); }
 
   void addSample(const Sample& sample) {
+    m_index.insert(std::make_pair(Key(sample.sprite(),
+                                      sample.layer(),
+                                      sample.frame()),
+                                  int(m_samples.size())));
     m_samples.push_back(sample);
   }
 
+  // Returns the index of the first sample added for the given
+  // sprite/layer/frame, or -1 if there is no such sample.
+  int findSample(const Sprite* sprite,
+                 const Layer* layer,
+                 const frame_t frame) const {
+    auto it = m_index.find(Key(sprite, layer, frame));
+    return (it != m_index.end() ? it->second: -1);
+  }
+
   const Sample& operator[](const size_t i) const {
     return m_samples[i];
   }
 
+  // Returns the original sample of a linked sample if both samples
+  // have the same content (same cel and same trimmed bounds, which
+  // is not the case of the cells of a linked cel split by grid).
+  const Sample* originalSample(const Sample& sample) const {
+    if (sample.isLinked()) {
+      const Sample& other = m_samples[sample.linkedSample()];
+      if (other.trimmedBounds() == sample.trimmedBounds())
+        return &other;
+    }
+    return nullptr;
+  }
+
   iterator begin() { return m_samples.begin(); }
   iterator end() { return m_samples.end(); }
   const_iterator begin() const { return m_samples.begin(); }
   const_iterator end() const { return m_samples.end(); }
 
 private:
+  struct Key {
+    const Sprite* sprite;
+    const Layer* layer;
+    frame_t frame;
+    Key(const Sprite* sprite, const Layer* layer, const frame_t frame)
+      : sprite(sprite), layer(layer), frame(frame) { }
+    bool operator==(const Key& other) const {
+      return (sprite == other.sprite &&
+              layer == other.layer &&
+              frame == other.frame);
+    }
+  };
+
+  struct KeyHash {
+    size_t operator()(const Key& key) const {
+      size_t h = std::hash<const Sprite*>()(key.sprite);
+      h = h*31 + std::hash<const Layer*>()(key.layer);
+      h = h*31 + std::hash<frame_t>()(key.frame);
+      return h;
+    }
+  };
+
   List m_samples;
+  std::unordered_map<Key, int, KeyHash> m_index;
+};
+
+namespace {
+
+// Rendered sample used as a key to find duplicated samples. The
+// hash is calculated just one time (see Sample::renderHash()) and
+// it's used to discard different images before comparing pixels.
+struct SampleRender {
+  doc::ImageRef image;
+  uint32_t hash;
+};
+
+struct SampleRenderHash {
+  size_t operator()(const SampleRender& render) const {
+    return render.hash;
+  }
+};
+
+struct SampleRenderEq {
+  bool operator()(const SampleRender& a, const SampleRender& b) const {
+    return (a.hash == b.hash &&
+            is_same_image(a.image.get(), b.image.get()));
+  }
 };
 
+// Rendered sample -> index of the first sample with that render
+typedef std::unordered_map<SampleRender,
+                           uint32_t,
+                           SampleRenderHash,
+                           SampleRenderEq> SampleRendersMap;
+
+} // anonymous namespace
+
 class DocExporter::LayoutSamples {
 public:
   virtual ~LayoutSamples() { }
@@ -392,7 +539,7 @@ public:
     const Layer* oldLayer = nullptr;
     const Tag* oldTag = nullptr;
 
-    doc::ImagesMap duplicates;
+    SampleRendersMap duplicates;
     gfx::Point framePt(borderPadding, borderPadding);
     gfx::Size rowSize(0, 0);
 
@@ -417,21 +564,28 @@ public:
         continue;
       }
 
+      // Linked cels with the same content as the original sample
+      // don't need to be rendered.
+      if (const Sample* original = samples.originalSample(sample)) {
+        sample.setDuplicated();
+        sample.setSharedBounds(original->sharedBounds());
+        ++i;
+        continue;
+      }
+
       if (m_mergeDups || sample.isLinked()) {
         doc::ImageBufferPtr sampleBuf = std::make_shared<doc::ImageBuffer>();
         doc::ImageRef sampleRender(sample.createRender(sampleBuf));
-        auto it = duplicates.find(sampleRender);
-        if (it != duplicates.end()) {
-          const uint32_t j = it->second;
+        auto res = duplicates.insert(
+          std::make_pair(SampleRender{ sampleRender, sample.renderHash(sampleRender) }, i));
+        if (!res.second) {
+          const uint32_t j = res.first->second;
 
           sample.setDuplicated();
           sample.setSharedBounds(samples[j].sharedBounds());
           ++i;
           continue;
         }
-        else {
-          duplicates[sampleRender] = i;
-        }
       }
 
       const Sprite* sprite = sample.sprite();
@@ -534,7 +688,7 @@ public:
                      int& width, int& height,
                      base::task_token& token) override {
     gfx::PackingRects pr(borderPadding, shapePadding);
-    doc::ImagesMap duplicates;
+    SampleRendersMap duplicates;
 
     uint32_t i = 0;
     for (auto& sample : samples) {
@@ -548,19 +702,28 @@ public:
         continue;
       }
 
+      // Linked cels with the same content as the original sample
+      // don't need to be rendered.
+      if (const Sample* original = samples.originalSample(sample)) {
+        sample.setDuplicated();
+        sample.setSharedBounds(original->sharedBounds());
+        ++i;
+        continue;
+      }
+
       // We have to use one ImageBuffer for each image because we're
       // going to store all images in the "duplicates" map.
       doc::ImageBufferPtr sampleBuf = std::make_shared<doc::ImageBuffer>();
       doc::ImageRef sampleRender(sample.createRender(sampleBuf));
-      auto it = duplicates.find(sampleRender);
-      if (it != duplicates.end()) {
-        const uint32_t j = it->second;
+      auto res = duplicates.insert(
+        std::make_pair(SampleRender{ sampleRender, sample.renderHash(sampleRender) }, i));
+      if (!res.second) {
+        const uint32_t j = res.first->second;
 
         sample.setDuplicated();
         sample.setSharedBounds(samples[j].sharedBounds());
       }
       else {
-        duplicates[sampleRender] = i;
         pr.add(sample.requiredSize());
       }
       ++i;
@@ -940,8 +1103,104 @@ void DocExporter::captureSamples(Samples& samples,
       }
     }
 
+    const bool trimSamples =
+      ((m_ignoreEmptyCels || m_trimCels) && !item.isOneImageOnly());
+
+    // The reference color to trim samples is calculated here because
+    // the visibility of the background layer can be changed below to
+    // render samples in parallel.
+    const bool useBackgroundColor =
+      ((layer &&
+        layer->isBackground()) ||
+       (!layer &&
+        sprite->backgroundLayer() &&
+        sprite->backgroundLayer()->isVisible()));
+
+    // Renders the given sample and calculates its trimmed bounds
+    // ("frameBounds"), returns false if the whole sample is
+    // transparent.
+    auto shrinkSample = [this, sprite, &spriteBounds, useBackgroundColor]
+      (const Sample& sample, ImageBufferPtr& buf, const bool inParallel,
+       gfx::Rect& frameBounds) -> bool {
+      ImageRef sampleRender(sample.createRender(buf, inParallel));
+      doc::color_t refColor = 0;
+
+      if (m_trimCels) {
+        if (useBackgroundColor)
+          refColor = get_pixel(sampleRender.get(), 0, 0);
+        else
+          refColor = sprite->transparentColor();
+      }
+      else if (m_ignoreEmptyCels)
+        refColor = sprite->transparentColor();
+
+      // If shrink_bounds() returns false, it's because the whole
+      // image is transparent (equal to the mask color).
+      return algorithm::shrink_bounds(sampleRender.get(),
+                                      refColor,
+                                      nullptr,        // layer
+                                      spriteBounds,   // startBounds
+                                      frameBounds);   // output bounds
+    };
+
+    // Render and trim the samples of all frames in parallel (except
+    // the ones that will be ignored or re-use a linked sample). The
+    // results are used in the same order in the loop below.
+    struct TrimmedSample {
+      bool done = false;
+      bool result = false;
+      gfx::Rect bounds;
+    };
+    const doc::SelectedFrames selFrames = item.getSelectedFrames();
+    std::vector<TrimmedSample> trimmedSamples(trimSamples ? selFrames.size(): 0);
+    if (trimSamples) {
+      std::vector<frame_t> framesToTrim;
+      std::vector<int> indexes;
+      int frameIndex = 0;
+      for (frame_t frame : selFrames) {
+        Cel* cel = (layer && layer->isImage() ? layer->cel(frame): nullptr);
+        if (!(cel && cel->link() && m_mergeDuplicates) &&
+            !(layer && layer->isImage() && !cel && m_ignoreEmptyCels)) {
+          framesToTrim.push_back(frame);
+          indexes.push_back(frameIndex);
+        }
+        ++frameIndex;
+      }
+
+      RestoreVisibleLayers layersVisibility;
+      if (item.selLayers)
+        layersVisibility.showSelectedLayers(sprite, *item.selLayers);
+
+      const gfx::Size sampleSize =
+        (item.splitGrid ? sprite->gridBounds().size(): sprite->size());
+
+      // With only one sample we prefer to render its tiles in
+      // parallel.
+      const bool inParallel = (framesToTrim.size() > 1);
+
+      for_each_sample_in_parallel(
+        int(framesToTrim.size()),
+        [&](const int i, ImageBufferPtr& buf){
+          if (token.canceled())
+            return;
+
+          Sample sample(sampleSize, doc, sprite, nullptr,
+                        item.selLayers.get(), framesToTrim[i],
+                        nullptr, std::string(),
+                        m_innerPadding, m_extrude);
+          TrimmedSample& trimmed = trimmedSamples[indexes[i]];
+          trimmed.result = shrinkSample(sample, buf, inParallel, trimmed.bounds);
+          trimmed.done = true;
+        });
+
+      if (token.canceled())
+        return;
+    }
+
     frame_t outputFrame = 0;
-    for (frame_t frame : item.getSelectedFrames()) {
+    int frameIndex = -1;
+    for (frame_t frame : selFrames) {
+      ++frameIndex;
       if (token.canceled())
         return;
 
@@ -983,22 +1242,16 @@ void DocExporter::captureSamples(Samples& samples,
       bool alreadyTrimmed = false;
       if (link && m_mergeDuplicates &&
           !item.isOneImageOnly()) {
-        for (const Sample& other : samples) {
-          if (token.canceled())
-            return;
-
-          if (other.sprite() == sprite &&
-              other.layer() == layer &&
-              other.frame() == link->frame()) {
-            ASSERT(!other.isLinked());
-
-            sample.setLinked();
-            sample.setTrimmedBounds(other.trimmedBounds());
-            sample.setSharedBounds(other.sharedBounds());
-            alreadyTrimmed = true;
-            done = true;
-            break;
-          }
+        const int j = samples.findSample(sprite, layer, link->frame());
+        if (j >= 0) {
+          const Sample& other = samples[j];
+          ASSERT(!other.isLinked());
+
+          sample.setLinked(j);
+          sample.setTrimmedBounds(other.trimmedBounds());
+          sample.setSharedBounds(other.sharedBounds());
+          alreadyTrimmed = true;
+          done = true;
         }
         // "done" variable can be false here, e.g. when we export a
         // frame tag and the first linked cel is outside the tag range.
@@ -1011,34 +1264,12 @@ void DocExporter::captureSamples(Samples& samples,
         if (layer && layer->isImage() && !cel && m_ignoreEmptyCels)
           continue;
 
-        ImageRef sampleRender(sample.createRender(m_sampleBuf));
-
-        gfx::Rect frameBounds;
-        doc::color_t refColor = 0;
-
-        if (m_trimCels) {
-          if ((layer &&
-               layer->isBackground()) ||
-              (!layer &&
-               sprite->backgroundLayer() &&
-               sprite->backgroundLayer()->isVisible())) {
-            refColor = get_pixel(sampleRender.get(), 0, 0);
-          }
-          else {
-            refColor = sprite->transparentColor();
-          }
-        }
-        else if (m_ignoreEmptyCels)
-          refColor = sprite->transparentColor();
-
-        if (!algorithm::shrink_bounds(sampleRender.get(),
-                                      refColor,
-                                      nullptr,        // layer
-                                      spriteBounds,   // startBounds
-                                      frameBounds)) { // output bounds
-          // If shrink_bounds() returns false, it's because the whole
-          // image is transparent (equal to the mask color).
-
+        const TrimmedSample& trimmed = trimmedSamples[frameIndex];
+        gfx::Rect frameBounds = trimmed.bounds;
+        const bool notEmpty =
+          (trimmed.done ? trimmed.result:
+                          shrinkSample(sample, m_sampleBuf, false, frameBounds));
+        if (!notEmpty) {
           // Should we ignore this empty frame? (i.e. don't include
           // the frame in the sprite sheet)
           if (m_ignoreEmptyCels)
@@ -1272,21 +1503,18 @@ void DocExporter::renderTexture(Context* ctx,
 {
   textureImage->clear(textureImage->maskColor());
 
-  int i = 0;
+  // Make the sprites compatible with the texture so the render()
+  // works correctly. This modifies the sprites, so it cannot be done
+  // from the worker threads.
   for (const auto& sample : samples) {
     if (token.canceled())
       return;
-    token.set_progress(0.6f + 0.2f * i / int(samples.size()));
 
     if (sample.isLinked() ||
         sample.isDuplicated() ||
-        sample.isEmpty()) {
-      ++i;
+        sample.isEmpty())
       continue;
-    }
 
-    // Make the sprite compatible with the texture so the render()
-    // works correctly.
     if (sample.sprite()->pixelFormat() != textureImage->pixelFormat()) {
       cmd::SetPixelFormat(
         sample.sprite(),
@@ -1297,14 +1525,76 @@ void DocExporter::renderTexture(Context* ctx,
         nullptr) // TODO add a delegate to show progress
         .execute(ctx);
     }
+  }
+
+  // Samples are rendered in parallel in groups of consecutive samples
+  // with the same visible layers (the visibility of the layers is
+  // changed for the whole group from this thread). Each sample is
+  // rendered in its own area of the texture, so threads never write
+  // the same pixels (only if the shape padding is negative).
+  std::vector<const Sample*> group;
+  int i = 0;
+  auto renderGroup = [this, &group, &i, &samples, textureImage, &token]{
+    if (group.empty())
+      return;
+
+    RestoreVisibleLayers layersVisibility;
+    if (group[0]->selectedLayers())
+      layersVisibility.showSelectedLayers(group[0]->sprite(),
+                                          *group[0]->selectedLayers());
+
+    auto renderSampleInTexture =
+      [this, textureImage](const Sample* sample, const bool inParallel){
+        sample->renderSample(
+          textureImage,
+          sample->inTextureBounds().x+m_innerPadding,
+          sample->inTextureBounds().y+m_innerPadding,
+          m_extrude,
+          inParallel);
+      };
+
+    // With only one sample we prefer to render its tiles in
+    // parallel.
+    if (group.size() > 1 && m_shapePadding >= 0) {
+      for_each_sample_in_parallel(
+        int(group.size()),
+        [&group, &token, &renderSampleInTexture](const int j, ImageBufferPtr&){
+          if (!token.canceled())
+            renderSampleInTexture(group[j], true);
+        });
+    }
+    else {
+      for (const Sample* sample : group) {
+        if (token.canceled())
+          return;
+        renderSampleInTexture(sample, false);
+      }
+    }
+
+    i += int(group.size());
+    group.clear();
+    token.set_progress(0.6f + 0.2f * i / int(samples.size()));
+  };
+
+  for (const auto& sample : samples) {
+    if (token.canceled())
+      return;
 
-    sample.renderSample(
-      textureImage,
-      sample.inTextureBounds().x+m_innerPadding,
-      sample.inTextureBounds().y+m_innerPadding,
-      m_extrude);
-    ++i;
+    if (sample.isLinked() ||
+        sample.isDuplicated() ||
+        sample.isEmpty()) {
+      ++i;
+      continue;
+    }
+
+    if (!group.empty() &&
+        (group[0]->sprite() != sample.sprite() ||
+         group[0]->selectedLayers() != sample.selectedLayers())) {
+      renderGroup();
+    }
+    group.push_back(&sample);
   }
+  renderGroup();
 }
 
 void DocExporter::trimTexture(const Samples& samples,
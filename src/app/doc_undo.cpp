@@ -18,11 +18,14 @@
 #include "app/context.h"
 #include "app/doc_undo_observer.h"
 #include "app/pref/preferences.h"
+#include "app/util/undo_buffer.h"
+#include "base/log.h"
 #include "base/mem_utils.h"
 #include "base/scoped_value.h"
 #include "undo/undo_history.h"
 #include "undo/undo_state.h"
 
+#include <algorithm>
 #include <cassert>
 #include <stdexcept>
 
@@ -63,6 +66,7 @@ void DocUndo::add(CmdTransaction* cmd)
 
   m_undoHistory.add(cmd);
   m_totalUndoSize += cmd->memSize();
+  m_unspilledUndoSize += cmd->memSize();
 
   notify_observers(&DocUndoObserver::onAddUndoState, this);
   notify_observers(&DocUndoObserver::onTotalUndoSizeChange, this);
@@ -88,6 +92,8 @@ void DocUndo::add(CmdTransaction* cmd)
     }
   }
 
+  spillOldStates();
+
   UNDO_TRACE("UNDO: New undo size %s\n",
              base::get_pretty_memory_size(m_totalUndoSize).c_str());
 }
@@ -111,10 +117,16 @@ void DocUndo::undo()
     const undo::UndoState* state = nextUndo();
     ASSERT(state);
     const Cmd* cmd = STATE_CMD(state);
+    // The data of a spilled state is loaded in memory again, and it's
+    // kept there until spillOldStates() selects the state again.
+    const bool spilled = (m_spilledStates.erase(state) > 0);
     m_totalUndoSize -= cmd->memSize();
+    if (!spilled) m_unspilledUndoSize -= cmd->memSize();
     m_undoHistory.undo();
     m_totalUndoSize += cmd->memSize();
+    m_unspilledUndoSize += cmd->memSize();
   }
+  spillOldStates();
   // This notification could execute a script that modifies the sprite
   // again (e.g. a script that is listening the "change" event, check
   // the SpriteEvents class). If the sprite is modified, the "cmd" is
@@ -133,10 +145,16 @@ void DocUndo::redo()
     const undo::UndoState* state = nextRedo();
     ASSERT(state);
     const Cmd* cmd = STATE_CMD(state);
+    // The data of a spilled state is loaded in memory again, and it's
+    // kept there until spillOldStates() selects the state again.
+    const bool spilled = (m_spilledStates.erase(state) > 0);
     m_totalUndoSize -= cmd->memSize();
+    if (!spilled) m_unspilledUndoSize -= cmd->memSize();
     m_undoHistory.redo();
     m_totalUndoSize += cmd->memSize();
+    m_unspilledUndoSize += cmd->memSize();
   }
+  spillOldStates();
   notify_observers(&DocUndoObserver::onCurrentUndoStateChange, this);
   if (m_totalUndoSize != oldSize)
     notify_observers(&DocUndoObserver::onTotalUndoSizeChange, this);
@@ -283,6 +301,11 @@ void DocUndo::moveToState(const undo::UndoState* state)
 
   m_undoHistory.moveTo(state);
 
+  // Undone/redone states have their data in memory again, we don't
+  // know which ones, so all of them are candidates to be spilled
+  // again (spilling a state that is still spilled does nothing).
+  m_spilledStates.clear();
+
   // After onCurrentUndoStateChange don't use the "state" argument, it
   // might be deleted because some script might have modified the
   // sprite on its "change" event.
@@ -296,8 +319,55 @@ void DocUndo::moveToState(const undo::UndoState* state)
     m_totalUndoSize += STATE_CMD(s)->memSize();
     s = s->next();
   }
+  m_unspilledUndoSize = m_totalUndoSize;
   if (m_totalUndoSize != oldSize)
     notify_observers(&DocUndoObserver::onTotalUndoSizeChange, this);
+
+  spillOldStates();
+}
+
+// Moves the undo data of the oldest states to the spill file until
+// the data of the remaining states is smaller than the
+// "undo.max_unspilled_size" preference (0 means that states are
+// never spilled). The current state and the states to redo are
+// never spilled. Spilled data is compressed/written from a background
+// thread, and loaded again by UndoBuffer::data() when the state is
+// undone/redone.
+void DocUndo::spillOldStates()
+{
+  if (!m_canSpill || !App::instance())
+    return;
+
+  const size_t maxUnspilledSize =
+    size_t(std::max(0, App::instance()->preferences().undo.maxUnspilledSize()))
+    * 1024 * 1024;
+  if (maxUnspilledSize == 0 ||
+      m_unspilledUndoSize <= maxUnspilledSize)
+    return;
+
+  if (!m_spillFile) {
+    try {
+      m_spillFile = std::make_shared<UndoSpillFile>();
+    }
+    catch (const std::exception& ex) {
+      // Keep all the undo data in memory
+      LOG(ERROR, "UNDO: %s\n", ex.what());
+      m_canSpill = false;
+      return;
+    }
+  }
+
+  const undo::UndoState* current = currentState();
+  for (const undo::UndoState* state = firstState();
+       state && state != current &&
+         m_unspilledUndoSize > maxUnspilledSize;
+       state = state->next()) {
+    if (m_spilledStates.insert(state).second) {
+      Cmd* cmd = STATE_CMD(state);
+      cmd->spill(m_spillFile);
+      m_unspilledUndoSize -= cmd->memSize();
+    }
+  }
 }
 
 const undo::UndoState* DocUndo::nextUndo() const
@@ -325,6 +395,8 @@ void DocUndo::onDeleteUndoState(undo::UndoState* state)
              base::get_pretty_memory_size(m_totalUndoSize).c_str());
 
   m_totalUndoSize -= cmd->memSize();
+  if (m_spilledStates.erase(state) == 0)
+    m_unspilledUndoSize -= cmd->memSize();
   notify_observers(&DocUndoObserver::onDeleteUndoState, this, state);
 
   // Mark this document as impossible to match the version on disk
@@ -17,7 +17,9 @@
 #include "undo/undo_history.h"
 
 #include <iosfwd>
+#include <memory>
 #include <string>
+#include <unordered_set>
 
 namespace app {
   using namespace doc;
@@ -26,6 +28,7 @@ namespace app {
   class CmdTransaction;
   class Context;
   class DocUndoObserver;
+  class UndoSpillFile;
 
   // Exception thrown when we want to modify the sprite (add new
   // app::Cmd objects) when we are undoing/redoing/moving throw the
@@ -103,6 +106,7 @@ namespace app {
   private:
     const undo::UndoState* nextUndo() const;
     const undo::UndoState* nextRedo() const;
+    void spillOldStates();
 
     // undo::UndoHistoryDelegate impl
     void onDeleteUndoState(undo::UndoState* state) override;
@@ -112,6 +116,13 @@ namespace app {
     Context* m_ctx = nullptr;
     size_t m_totalUndoSize = 0;
 
+    // Old undo states are moved to a temporary file when the undo
+    // data of the other states (m_unspilledUndoSize) is too big.
+    std::shared_ptr<UndoSpillFile> m_spillFile;
+    std::unordered_set<const undo::UndoState*> m_spilledStates;
+    size_t m_unspilledUndoSize = 0;
+    bool m_canSpill = true;
+
     // True when we are undoing/redoing. Used to avoid adding new undo
     // information when we are moving through the undo history.
     bool m_undoing = false;
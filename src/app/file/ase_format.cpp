@@ -24,14 +24,19 @@
 #include "dio/decode_delegate.h"
 #include "dio/file_interface.h"
 #include "doc/doc.h"
+#include "doc/worker_pool.h"
 #include "fixmath/fixmath.h"
 #include "fmt/format.h"
 #include "ui/alert.h"
 #include "ver/info.h"
 #include "zlib.h"
 
+#include <algorithm>
+#include <atomic>
 #include <cstdio>
 #include <deque>
+#include <exception>
+#include <map>
 #include <variant>
 
 #define ASEFILE_TRACE(...) // TRACE(__VA_ARGS__)
@@ -88,6 +93,15 @@ public:
     return m_fop->config().cacheCompressedTilesets;
   }
 
+  bool cacheCompressedCels() const override {
+    return (m_fop->config().cacheCompressedCels &&
+            doc::Image::compressedDataMemory() < m_fop->config().compressedCelsMemoryLimit);
+  }
+
+  bool lazyLoadCels() const override {
+    return m_fop->config().lazyLoadCels;
+  }
+
 private:
   FileOp* m_fop;
   doc::Sprite* m_sprite;
@@ -156,9 +170,17 @@ static void ase_file_write_layers(FILE* f, FileOp* fop,
                                   dio::AsepriteFrameHeader* frame_header,
                                   const dio::AsepriteExternalFiles& ext_files,
                                   const Layer* layer, int child_level);
+// Cel images compressed in advance (in parallel) to be written in
+// ase_file_write_cel_chunk()
+typedef std::map<const Image*, base::buffer> CompressedCelImages;
+
+static void ase_file_compress_cel_images(const Sprite* sprite,
+                                         const frame_t frame,
+                                         CompressedCelImages& output);
 static layer_t ase_file_write_cels(FILE* f,  FileOp* fop,
                                    dio::AsepriteFrameHeader* frame_header,
                                    const dio::AsepriteExternalFiles& ext_files,
+                                   const CompressedCelImages& compressedImages,
                                    const Sprite* sprite, const Layer* layer,
                                    layer_t layer_index,
                                    const frame_t frame);
@@ -172,7 +194,9 @@ static void ase_file_write_close_chunk(FILE* f, dio::AsepriteChunk* chunk);
 static void ase_file_write_color2_chunk(FILE* f, dio::AsepriteFrameHeader* frame_header, const Palette* pal);
 static void ase_file_write_palette_chunk(FILE* f, dio::AsepriteFrameHeader* frame_header, const Palette* pal, int from, int to);
 static void ase_file_write_layer_chunk(FILE* f, dio::AsepriteFrameHeader* frame_header, const Layer* layer, int child_level);
-static void ase_file_write_cel_chunk(FILE* f, dio::AsepriteFrameHeader* frame_header,
+static void ase_file_write_cel_chunk(FILE* f, FileOp* fop,
+                                     dio::AsepriteFrameHeader* frame_header,
+                                     const CompressedCelImages& compressedImages,
                                      const Cel* cel,
                                      const LayerImage* layer,
                                      const layer_t layer_index,
@@ -280,15 +304,31 @@ FileFormat* CreateAseFormat()
 
 bool AseFormat::onLoad(FileOp* fop)
 {
-  FileHandle handle(open_file_with_exception(fop->filename(), "rb"));
-  dio::StdioFileInterface fileInterface(handle.get());
+  std::unique_ptr<dio::FileInterface> fileInterface;
+  FileHandle handle;
+
+  // Map the file in memory to decode cels lazily (we use the regular
+  // I/O functions if the file cannot be mapped)
+  if (fop->config().lazyLoadCels) {
+    auto mappedFile = std::make_shared<dio::MappedFile>(fop->filename());
+    if (mappedFile->isValid())
+      fileInterface = std::make_unique<dio::MmapFileInterface>(mappedFile);
+  }
+  if (!fileInterface) {
+    handle = open_file_with_exception(fop->filename(), "rb");
+    fileInterface = std::make_unique<dio::StdioFileInterface>(handle.get());
+  }
 
   DecodeDelegate delegate(fop);
   dio::AsepriteDecoder decoder;
-  decoder.initialize(&delegate, &fileInterface);
+  decoder.initialize(&delegate, fileInterface.get());
   if (!decoder.decode())
     return false;
 
+  // Unlock the mapped file (cels are decoded lazily from it with
+  // their own locks, see dio::MappedFile::Reader)
+  fileInterface.reset();
+
   Sprite* sprite = delegate.sprite();
   fop->createDocument(sprite);
 
@@ -364,6 +404,7 @@ bool AseFormat::onSave(FileOp* fop)
   // Write frames
   int outputFrame = 0;
   dio::AsepriteExternalFiles ext_files;
+  CompressedCelImages compressedImages;
   for (frame_t frame : fop->roi().framesSequence()) {
     // Prepare the frame header
     dio::AsepriteFrameHeader frame_header;
@@ -437,8 +478,11 @@ bool AseFormat::onSave(FileOp* fop)
                                   fop->roi().toFrame());
     }
 
-    // Write cel chunks
+    // Write cel chunks (compressing all the cel images of this frame
+    // in parallel first)
+    ase_file_compress_cel_images(sprite, frame, compressedImages);
     ase_file_write_cels(f, fop, &frame_header, ext_files,
+                        compressedImages,
                         sprite, sprite->root(),
                         0, frame);
 
@@ -586,6 +630,7 @@ static void ase_file_write_layers(FILE* f, FileOp* fop,
 static layer_t ase_file_write_cels(FILE* f, FileOp* fop,
                                    dio::AsepriteFrameHeader* frame_header,
                                    const dio::AsepriteExternalFiles& ext_files,
+                                   const CompressedCelImages& compressedImages,
                                    const Sprite* sprite, const Layer* layer,
                                    layer_t layer_index,
                                    const frame_t frame)
@@ -593,7 +638,7 @@ static layer_t ase_file_write_cels(FILE* f, FileOp* fop,
   if (layer->isImage()) {
     const Cel* cel = layer->cel(frame);
     if (cel) {
-      ase_file_write_cel_chunk(f, frame_header, cel,
+      ase_file_write_cel_chunk(f, fop, frame_header, compressedImages, cel,
                                static_cast<const LayerImage*>(layer),
                                layer_index, sprite, fop->roi().fromFrame());
 
@@ -614,7 +659,8 @@ static layer_t ase_file_write_cels(FILE* f, FileOp* fop,
   if (layer->isGroup()) {
     for (const Layer* child : static_cast<const LayerGroup*>(layer)->layers()) {
       layer_index =
-        ase_file_write_cels(f, fop, frame_header, ext_files, sprite, child,
+        ase_file_write_cels(f, fop, frame_header, ext_files,
+                            compressedImages, sprite, child,
                             layer_index, frame);
     }
   }
@@ -907,8 +953,11 @@ static void write_compressed_image_templ(FILE* f,
 
       int output_bytes = compressed.size() - zstream.avail_out;
       if (output_bytes > 0) {
-        if ((fwrite(&compressed[0], 1, output_bytes, f) != (size_t)output_bytes)
-            || ferror(f))
+        // "f" can be nullptr when we want to compress the image in
+        // memory only (see ase_file_compress_cel_images())
+        if (f &&
+            ((fwrite(&compressed[0], 1, output_bytes, f) != (size_t)output_bytes)
+             || ferror(f)))
           throw base::Exception("Error writing compressed image pixels.\n");
 
         // Save the whole compressed buffer to re-use in following
@@ -954,11 +1003,74 @@ static void write_compressed_image(FILE* f,
   }
 }
 
+// Compresses all the cel images of the given frame that need to be
+// compressed (images without valid cached compressed data) using
+// several threads, so then ase_file_write_cel_chunk() has only to
+// write the compressed data in the file order.
+static void ase_file_compress_cel_images(const Sprite* sprite,
+                                         const frame_t frame,
+                                         CompressedCelImages& output)
+{
+  output.clear();
+
+  std::vector<const Image*> images;
+  for (const Layer* layer : sprite->allLayers()) {
+    if (!layer->isImage() || layer->isTilemap())
+      continue;
+
+    // Linked cels are saved as ASE_FILE_LINK_CEL (or compressed
+    // in ase_file_write_cel_chunk() if the original cel is outside
+    // the saved range of frames)
+    const Cel* cel = layer->cel(frame);
+    if (!cel || cel->link())
+      continue;
+
+    const Image* image = cel->image();
+    if (image && !image->hasValidCompressedData()) {
+      images.push_back(image);
+    }
+  }
+
+  const int n = int(images.size());
+  const int nthreads =
+    std::min(n, doc::worker_threads());
+  if (nthreads < 2)
+    return;
+
+  std::vector<base::buffer> buffers(n);
+  std::vector<std::exception_ptr> errors(n);
+  std::atomic<int> next(0);
+  auto compressNextImages = [&images, &buffers, &errors, &next, n]{
+    int i;
+    while ((i = next++) < n) {
+      try {
+        ImageScanlines scan(images[i]);
+        write_compressed_image(nullptr, &scan, images[i]->pixelFormat(),
+                               &buffers[i]);
+      }
+      catch (...) {
+        errors[i] = std::current_exception();
+      }
+    }
+  };
+
+  // The calling thread compresses images too
+  doc::run_in_workers(nthreads, compressNextImages);
+
+  for (int i=0; i<n; ++i) {
+    if (errors[i])
+      std::rethrow_exception(errors[i]);
+    output[images[i]] = std::move(buffers[i]);
+  }
+}
+
 //////////////////////////////////////////////////////////////////////
 // Cel Chunk
 //////////////////////////////////////////////////////////////////////
 
-static void ase_file_write_cel_chunk(FILE* f, dio::AsepriteFrameHeader* frame_header,
+static void ase_file_write_cel_chunk(FILE* f, FileOp* fop,
+                                     dio::AsepriteFrameHeader* frame_header,
+                                     const CompressedCelImages& compressedImages,
                                      const Cel* cel,
                                      const LayerImage* layer,
                                      const layer_t layer_index,
@@ -1022,15 +1134,62 @@ static void ase_file_write_cel_chunk(FILE* f, dio::AsepriteFrameHeader* frame_he
       break;
 
     case ASE_FILE_COMPRESSED_CEL: {
-      const Image* image = cel->image();
+      Image* image = cel->image();
       ASSERT(image);
       if (image) {
         // Width and height
         fputw(image->width(), f);
         fputw(image->height(), f);
 
-        ImageScanlines scan(image);
-        write_compressed_image(f, &scan, image->pixelFormat());
+        // Save the cached compressed data
+        if (image->hasValidCompressedData()) {
+          const base::buffer& data = image->compressedData();
+
+          ASEFILE_TRACE("[%d] saving compressed cel image (%s)\n",
+                        image->id(), base::get_pretty_memory_size(data.size()).c_str());
+
+          if (fwrite(&data[0], 1, data.size(), f) != data.size() || ferror(f))
+            throw base::Exception("Error writing compressed image pixels.\n");
+        }
+        // Save the data compressed by ase_file_compress_cel_images()
+        else if (auto it = compressedImages.find(image);
+                 it != compressedImages.end()) {
+          const base::buffer& data = it->second;
+          if (fwrite(&data[0], 1, data.size(), f) != data.size() || ferror(f))
+            throw base::Exception("Error writing compressed image pixels.\n");
+
+          const FileOpConfig& config = fop->config();
+          if (config.cacheCompressedCels &&
+              Image::compressedDataMemory() < config.compressedCelsMemoryLimit) {
+            image->setCompressedData(data);
+          }
+          else {
+            image->discardCompressedData();
+          }
+        }
+        // Compress and save the image now
+        else {
+          const FileOpConfig& config = fop->config();
+          base::buffer compressedData;
+          base::buffer* compressedDataPtr = nullptr;
+          if (config.cacheCompressedCels &&
+              Image::compressedDataMemory() < config.compressedCelsMemoryLimit) {
+            compressedDataPtr = &compressedData;
+          }
+          // Drop old cached data (e.g. when the cache was disabled)
+          else {
+            image->discardCompressedData();
+          }
+
+          ImageScanlines scan(image);
+          write_compressed_image(f, &scan, image->pixelFormat(),
+                                 compressedDataPtr);
+
+          // As we've just compressed the image, we can cache this
+          // same data for the next save.
+          if (compressedDataPtr)
+            image->setCompressedData(compressedData);
+        }
       }
       else {
         // Width and height
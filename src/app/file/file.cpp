@@ -34,8 +34,10 @@
 #include "base/fs.h"
 #include "base/string.h"
 #include "dio/detect_format.h"
+#include "dio/file_interface.h"
 #include "doc/algorithm/resize_image.h"
 #include "doc/doc.h"
+#include "doc/worker_pool.h"
 #include "fmt/format.h"
 #include "render/quantization.h"
 #include "render/render.h"
@@ -48,8 +50,11 @@
 #include "open_sequence.xml.h"
 
 #include <algorithm>
-#include <cstring>
+#include <condition_variable>
 #include <cstdarg>
+#include <cstring>
+#include <functional>
+#include <vector>
 
 namespace app {
 
@@ -164,6 +169,7 @@ public:
 
     render::Render render;
     render.setNewBlend(m_newBlend);
+    render.setParallelRendering(true);
     render.setBgOptions(render::BgOptions::MakeNone());
     render.renderSprite(
       (needResize ? m_tmpUnscaledRender.get(): dst),
@@ -187,11 +193,11 @@ public:
     m_spec.setHeight(m_spec.height() * m_scale.y);
   }
 
-private:
   bool needResize() const {
     return (m_scale != gfx::PointF(1.0, 1.0));
   }
 
+private:
   const Doc* m_doc;
   const doc::Sprite* m_sprite;
   doc::ImageSpec m_spec;
@@ -829,6 +835,100 @@ bool FileOp::checkIfFormatSupportResizeOnTheFly(const std::string& filename)
           fileFormat->support(FILE_ENCODE_ABSTRACT_IMAGE));
 }
 
+// Returns false if some cel image of the sprite cannot be loaded
+// (see FileOpConfig::lazyLoadCels), we cannot save the sprite in that
+// case as those cels would be saved as empty images.
+static bool load_all_cel_images(const Sprite* sprite)
+{
+  for (const Cel* cel : sprite->uniqueCels()) {
+    if (cel->data()->isLazy()) {
+      cel->data()->loadImage();
+      if (cel->data()->imageLoadFailed())
+        return false;
+    }
+  }
+  return true;
+}
+
+// Calls processFrame(i) for each frame "i" in [0, n) of a sequence
+// from worker threads (or from the calling thread if no worker
+// started the frame yet), and frameDone(i) from the calling thread
+// in the frames order. The calling thread queues new frames only
+// when the previous ones are done, to limit the number of decoded
+// frames in memory (so workers never wait for other frames). If
+// frameDone() returns false the remaining frames are not processed.
+//
+// processFrame() must not throw exceptions.
+static void for_each_sequence_frame(
+  const int n,
+  const std::function<void(int)>& processFrame,
+  const std::function<bool(int)>& frameDone)
+{
+  enum class State : char { Queued, Processing, Ready };
+
+  const int maxAhead = 2*std::min(n, doc::worker_threads());
+
+  std::mutex mutex;
+  std::condition_variable cv;
+  std::vector<State> states(n, State::Queued);
+  bool abort = false;
+
+  // Processes the frame if nobody started it yet
+  auto processFrameOnce = [&](const int i) {
+    {
+      const std::lock_guard lock(mutex);
+      if (abort || states[i] != State::Queued)
+        return;
+      states[i] = State::Processing;
+    }
+    processFrame(i);
+    {
+      const std::lock_guard lock(mutex);
+      states[i] = State::Ready;
+    }
+    cv.notify_all();
+  };
+
+  doc::WorkerTasks tasks;
+  int queued = 0;
+  auto queueFrames = [&](const int end) {
+    for (; queued<std::min(n, end); ++queued) {
+      tasks.execute([&processFrameOnce, i=queued]{
+        processFrameOnce(i);
+      });
+    }
+  };
+
+  std::exception_ptr error;
+  try {
+    queueFrames(maxAhead);
+    for (int i=0; i<n; ++i) {
+      processFrameOnce(i);
+      {
+        std::unique_lock lock(mutex);
+        cv.wait(lock, [&]{ return states[i] == State::Ready; });
+      }
+      if (!frameDone(i))
+        break;
+      queueFrames(i+1+maxAhead);
+    }
+  }
+  catch (...) {
+    error = std::current_exception();
+  }
+
+  // The queued frames that weren't started are skipped, but we have
+  // to wait the workers before returning (they reference local data)
+  {
+    const std::lock_guard lock(mutex);
+    abort = true;
+  }
+  tasks.wait();
+
+  if (error)
+    std::rethrow_exception(error);
+}
+
 // Executes the file operation: loads or saves the sprite.
 //
 // It can be called from a different thread of the one used
@@ -882,68 +982,139 @@ void FileOp::operate(IFileOpProgress* progress)
       m_seq.progress_offset = 0.0f;
       m_seq.progress_fraction = 1.0f / (double)frames;
 
-      auto it = m_seq.filename_list.begin(),
-           end = m_seq.filename_list.end();
-      for (; it != end; ++it) {
-        m_filename = it->c_str();
-
-        // Call the "load" procedure to read the first bitmap.
-        bool loadres = m_format->load(this);
-        if (!loadres) {
-          setError("Error loading frame %d from file \"%s\"\n",
-                   frame+1, m_filename.c_str());
-        }
+      // Load the first frame in this thread (it creates the document)
+      m_filename = m_seq.filename_list[0];
 
-        // For the first frame...
-        if (!old_image) {
-          // Error reading the first frame
-          if (!loadres || !m_document || !m_seq.last_cel) {
-            m_seq.image.reset();
-            delete m_seq.last_cel;
-            delete m_document;
-            m_document = nullptr;
-            break;
-          }
-          // Read ok
-          else {
-            // Add the keyframe
-            add_image();
-          }
-        }
-        // For other frames
-        else {
-          // All done (or maybe not enough memory)
-          if (!loadres || !m_seq.last_cel) {
-            m_seq.image.reset();
-            delete m_seq.last_cel;
-            break;
-          }
+      // Call the "load" procedure to read the first bitmap.
+      bool loadres = m_format->load(this);
+      if (!loadres) {
+        setError("Error loading frame %d from file \"%s\"\n",
+                 frame+1, m_filename.c_str());
+      }
 
-          // Compare the old frame with the new one
-#if USE_LINK // TODO this should be configurable through a check-box
-          if (count_diff_between_images(old_image, m_seq.image)) {
-            add_image();
-          }
-          // We don't need this image
-          else {
-            m_seq.image.reset();
+      // Error reading the first frame
+      if (!loadres || !m_document || !m_seq.last_cel) {
+        m_seq.image.reset();
+        delete m_seq.last_cel;
+        m_seq.last_cel = nullptr;
+        delete m_document;
+        m_document = nullptr;
+      }
+      // Read ok
+      else {
+        // Add the keyframe
+        add_image();
 
-            // But add a link frame
-            m_seq.last_cel->image = image_index;
-            layer_add_frame(m_seq.layer, m_seq.last_cel);
+        m_document->sprite()->setFrameDuration(frame, m_seq.duration);
+        ++frame;
+        m_seq.progress_offset += m_seq.progress_fraction;
+      }
 
-            m_seq.last_image = NULL;
-            m_seq.last_cel = NULL;
-          }
+      // Other frames are decoded in parallel (each one with its own
+      // FileOp), and added to the sprite in order from this thread.
+      if (m_document && frames > 1) {
+        // Initial palette for each frame, only the entries modified
+        // by the format are applied to the sequence palette (see
+        // applySequencePaletteChanges())
+        const Palette firstPalette(*m_seq.palette);
+        std::vector<std::unique_ptr<FileOp>> frameOps(frames);
+
+        for_each_sequence_frame(
+          frames-1,
+          [this, &firstPalette, &frameOps](const int i){
+            const frame_t frame = i+1;
+            std::unique_ptr<FileOp> fop =
+              createSequenceFrameOp(m_seq.filename_list[frame]);
+            firstPalette.copyColorsTo(fop->m_seq.palette);
+
+            bool loadres = false;
+            if (!isStop()) {
+              try {
+                loadres = m_format->load(fop.get());
+              }
+              catch (const std::exception& ex) {
+                fop->setError("%s\n", ex.what());
+              }
+              if (!loadres) {
+                fop->setError("Error loading frame %d from file \"%s\"\n",
+                              frame+1, fop->m_filename.c_str());
+              }
+            }
+            if (!loadres) {
+              delete fop->m_seq.last_cel;
+              fop->m_seq.last_cel = nullptr;
+            }
+            frameOps[frame] = std::move(fop);
+          },
+          [&](const int) -> bool {
+            const std::unique_ptr<FileOp> fop = std::move(frameOps[frame]);
+            if (fop->hasError())
+              setError("%s", fop->error().c_str());
+            if (fop->hasIncompatibilityError())
+              setIncompatibilityError(fop->m_incompatibilityError);
+
+            // All done (or maybe not enough memory)
+            if (!fop->m_seq.last_cel)
+              return false;
+
+            Sprite* sprite = m_document->sprite();
+            if (fop->m_seq.image->pixelFormat() != sprite->pixelFormat()) {
+              setError("Error: image does not match color mode\n");
+              setError("Error loading frame %d from file \"%s\"\n",
+                       frame+1, fop->m_filename.c_str());
+              return false;
+            }
+
+            // Reconcile the data of this frame with the sequence data
+            if (fop->m_seq.has_alpha)
+              m_seq.has_alpha = true;
+            if (fop->m_formatOptions)
+              m_formatOptions = fop->m_formatOptions;
+            if (fop->m_embeddedColorProfile)
+              m_embeddedColorProfile = true;
+
+            const Sprite* frameSprite = fop->m_document->sprite();
+            if (sprite->colorSpace()->type() == gfx::ColorSpace::None &&
+                frameSprite->colorSpace()->type() != gfx::ColorSpace::None) {
+              sprite->setColorSpace(frameSprite->colorSpace());
+              m_document->notifyColorSpaceChanged();
+            }
+            if (frameSprite->transparentColor() != 0)
+              sprite->setTransparentColor(frameSprite->transparentColor());
+
+            applySequencePaletteChanges(fop.get());
+            m_seq.image = fop->m_seq.image;
+            m_seq.last_cel = fop->m_seq.last_cel;
+            m_seq.last_cel->setFrame(frame);
+            fop->m_seq.last_cel = nullptr;
+
+            // Compare the old frame with the new one
+#if USE_LINK // TODO this should be configurable through a check-box
+            if (count_diff_between_images(old_image, m_seq.image)) {
+              add_image();
+            }
+            // We don't need this image
+            else {
+              m_seq.image.reset();
+
+              // But add a link frame
+              m_seq.last_cel->image = image_index;
+              layer_add_frame(m_seq.layer, m_seq.last_cel);
+
+              m_seq.last_image = NULL;
+              m_seq.last_cel = NULL;
+            }
 #else
-          add_image();
+            add_image();
 #endif
-        }
 
-        m_document->sprite()->setFrameDuration(frame, m_seq.duration);
+            sprite->setFrameDuration(frame, m_seq.duration);
 
-        ++frame;
-        m_seq.progress_offset += m_seq.progress_fraction;
+            setProgress(1.0);
+            ++frame;
+            m_seq.progress_offset += m_seq.progress_fraction;
+            return true;
+          });
       }
       m_filename = *m_seq.filename_list.begin();
 
@@ -1008,8 +1179,13 @@ void FileOp::operate(IFileOpProgress* progress)
     //      is already checked in SaveFileBaseCommand::saveDocumentInBackground
     //      and only in UI mode (so the CLI still works)
 
+    if (!load_all_cel_images(m_document->sprite())) {
+      setError("Error saving \"%s\": some cel images cannot be loaded from "
+               "the original file (it was modified by other program)\n",
+               m_filename.c_str());
+    }
     // Save a sequence
-    if (isSequence()) {
+    else if (isSequence()) {
       ASSERT(m_format->support(FILE_SUPPORT_SEQUENCES));
 
       Sprite* sprite = m_document->sprite();
@@ -1022,55 +1198,149 @@ void FileOp::operate(IFileOpProgress* progress)
       m_seq.progress_offset = 0.0f;
       m_seq.progress_fraction = 1.0f / (double)sprite->totalFrames();
 
-      // For each frame in the sprite.
-      render::Render render;
-      render.setNewBlend(m_config.newBlend);
-
-      frame_t outputFrame = 0;
+      // Frames to be saved (frames without slice key are skipped),
+      // the index in this vector is the output frame.
+      std::vector<std::pair<frame_t, gfx::Rect>> outputFrames;
       for (frame_t frame : m_roi.framesSequence()) {
         gfx::Rect bounds = m_roi.frameBounds(frame);
-        if (bounds.isEmpty())
-          continue; // Skip frame because there is no slice key
+        if (!bounds.isEmpty())
+          outputFrames.push_back(std::make_pair(frame, bounds));
+      }
 
-        if (m_abstractImage) {
-          m_abstractImage->setSpecSize(m_roi.fileCanvasSize(),
-                                       bounds.size());
-        }
+      // Frames are encoded in parallel (each one with its own FileOp)
+      // when they don't need to be resized, as resize_image() uses
+      // the sprite RgbMap which cannot be shared between threads.
+      if (outputFrames.size() > 1 &&
+          (!m_abstractImage || !m_abstractImage->needResize())) {
+        const int n = int(outputFrames.size());
+        std::vector<std::unique_ptr<FileOp>> frameOps(n);
+        std::vector<char> saved(n, false);
+        std::mutex dirsMutex;
+
+        for_each_sequence_frame(
+          n,
+          [this, sprite, &outputFrames, &frameOps, &saved, &dirsMutex](const int i){
+            const frame_t frame = outputFrames[i].first;
+            const gfx::Rect& bounds = outputFrames[i].second;
+            std::unique_ptr<FileOp> fop =
+              createSequenceFrameOp(m_seq.filename_list[i]);
+            fop->m_document = m_document;
+            fop->m_roi = m_roi;
+            fop->m_formatOptions = m_formatOptions;
+            fop->m_seq.frame = i;
+
+            if (!isStop()) {
+              try {
+                fop->m_seq.image.reset(Image::create(sprite->pixelFormat(),
+                                                     m_roi.fileCanvasSize().w,
+                                                     m_roi.fileCanvasSize().h));
+                if (m_format->support(FILE_ENCODE_ABSTRACT_IMAGE)) {
+                  fop->makeAbstractImage();
+                  fop->m_abstractImage->setSpecSize(m_roi.fileCanvasSize(),
+                                                    bounds.size());
+                }
+
+                // Render the (unscaled) sequenced image.
+                render::Render render;
+                render.setNewBlend(m_config.newBlend);
+                render.renderSprite(
+                  fop->m_seq.image.get(), sprite, frame,
+                  gfx::Clip(gfx::Point(0, 0), bounds));
+
+                // Check if we have to ignore empty frames
+                if (m_ignoreEmpty &&
+                    !sprite->isOpaque() &&
+                    doc::is_empty_image(fop->m_seq.image.get())) {
+                  saved[i] = true;
+                }
+                else {
+                  // Setup the palette.
+                  sprite->palette(frame)->copyColorsTo(fop->m_seq.palette);
+
+                  // Make directories
+                  {
+                    const std::lock_guard lock(dirsMutex);
+                    fop->makeDirectories();
+                  }
+
+                  // Cels of other documents could be decoded lazily
+                  // from this same file (see FileOpConfig::lazyLoadCels)
+                  dio::MappedFile::detachAll(fop->m_filename);
+
+                  saved[i] = m_format->save(fop.get());
+                }
+              }
+              catch (const std::exception& ex) {
+                fop->setError("%s\n", ex.what());
+              }
+              if (!saved[i]) {
+                fop->setError("Error saving frame %d in the file \"%s\"\n",
+                              i+1, fop->m_filename.c_str());
+              }
+            }
+            frameOps[i] = std::move(fop);
+          },
+          [this, &frameOps, &saved](const int i) -> bool {
+            const std::unique_ptr<FileOp> fop = std::move(frameOps[i]);
+            if (fop->hasError())
+              setError("%s", fop->error().c_str());
+            if (!saved[i])
+              return false;
+
+            setProgress(1.0);
+            m_seq.progress_offset += m_seq.progress_fraction;
+            return true;
+          });
+      }
+      else {
+        render::Render render;
+        render.setNewBlend(m_config.newBlend);
+        render.setParallelRendering(true);
+
+        for (frame_t outputFrame=0; outputFrame<frame_t(outputFrames.size()); ++outputFrame) {
+          const frame_t frame = outputFrames[outputFrame].first;
+          const gfx::Rect& bounds = outputFrames[outputFrame].second;
 
-        // Render the (unscaled) sequenced image.
-        render.renderSprite(
-          m_seq.image.get(), sprite, frame,
-          gfx::Clip(gfx::Point(0, 0), bounds));
+          if (m_abstractImage) {
+            m_abstractImage->setSpecSize(m_roi.fileCanvasSize(),
+                                         bounds.size());
+          }
 
-        bool save = true;
+          // Render the (unscaled) sequenced image.
+          render.renderSprite(
+            m_seq.image.get(), sprite, frame,
+            gfx::Clip(gfx::Point(0, 0), bounds));
 
-        // Check if we have to ignore empty frames
-        if (m_ignoreEmpty &&
-            !sprite->isOpaque() &&
-            doc::is_empty_image(m_seq.image.get())) {
-          save = false;
-        }
+          bool save = true;
+
+          // Check if we have to ignore empty frames
+          if (m_ignoreEmpty &&
+              !sprite->isOpaque() &&
+              doc::is_empty_image(m_seq.image.get())) {
+            save = false;
+          }
 
-        if (save) {
-          // Setup the palette.
-          sprite->palette(frame)->copyColorsTo(m_seq.palette);
+          if (save) {
+            // Setup the palette.
+            sprite->palette(frame)->copyColorsTo(m_seq.palette);
 
-          // Setup the filename to be used.
-          m_filename = m_seq.filename_list[outputFrame];
+            // Setup the filename to be used.
+            m_filename = m_seq.filename_list[outputFrame];
 
-          // Make directories
-          makeDirectories();
+            // Make directories
+            makeDirectories();
+            dio::MappedFile::detachAll(m_filename);
 
-          // Call the "save" procedure... did it fail?
-          if (!m_format->save(this)) {
-            setError("Error saving frame %d in the file \"%s\"\n",
-                     outputFrame+1, m_filename.c_str());
-            break;
+            // Call the "save" procedure... did it fail?
+            if (!m_format->save(this)) {
+              setError("Error saving frame %d in the file \"%s\"\n",
+                       outputFrame+1, m_filename.c_str());
+              break;
+            }
           }
-        }
 
-        m_seq.progress_offset += m_seq.progress_fraction;
-        ++outputFrame;
+          m_seq.progress_offset += m_seq.progress_fraction;
+        }
       }
 
       m_filename = *m_seq.filename_list.begin();
@@ -1082,6 +1352,12 @@ void FileOp::operate(IFileOpProgress* progress)
     else {
       makeDirectories();
 
+      // Cel images that are not loaded yet (of any document) could be
+      // read from the same file that we are going to overwrite (see
+      // FileOpConfig::lazyLoadCels), so they have to read a copy of
+      // the file.
+      dio::MappedFile::detachAll(m_filename);
+
       if (m_abstractImage) {
         m_abstractImage->setSpecSize(m_roi.fileCanvasSize(),
                                      m_roi.fileCanvasSize());
@@ -1135,6 +1411,13 @@ void FileOp::stop()
 
 FileOp::~FileOp()
 {
+  // The document/cel created to load one frame of a sequence are
+  // temporary (the image is moved to the parent FileOp document).
+  if (m_parent && m_type == FileOpLoad) {
+    delete m_seq.last_cel;
+    delete m_document;
+  }
+
   delete m_seq.palette;
 }
 
@@ -1314,6 +1597,7 @@ void FileOp::setLoadedFormatOptions(const FormatOptionsPtr& opts)
 void FileOp::sequenceSetNColors(int ncolors)
 {
   m_seq.palette->resize(ncolors);
+  m_seq.palette_resized = true;
 }
 
 int FileOp::sequenceGetNColors() const
@@ -1324,6 +1608,7 @@ int FileOp::sequenceGetNColors() const
 void FileOp::sequenceSetColor(int index, int r, int g, int b)
 {
   m_seq.palette->setEntry(index, rgba(r, g, b, 255));
+  sequencePaletteChanged(index);
 }
 
 void FileOp::sequenceGetColor(int index, int* r, int* g, int* b) const
@@ -1349,6 +1634,7 @@ void FileOp::sequenceSetAlpha(int index, int a)
   int b = rgba_getb(c);
 
   m_seq.palette->setEntry(index, rgba(r, g, b, a));
+  sequencePaletteChanged(index);
 }
 
 void FileOp::sequenceGetAlpha(int index, int* a) const
@@ -1514,6 +1800,9 @@ bool FileOp::isDone() const
 
 bool FileOp::isStop() const
 {
+  if (m_parent)
+    return m_parent->isStop();
+
   bool stop;
   {
     std::scoped_lock lock(m_mutex);
@@ -1556,6 +1845,24 @@ FileOp::FileOp(FileOpType type,
   m_seq.last_cel = nullptr;
   m_seq.duration = 100;
   m_seq.flags = 0;
+  m_seq.palette_resized = false;
+}
+
+// Creates a FileOp to load/save only the given file of the sequence
+// from a worker thread. It has its own sequence data (palette,
+// image, progress, etc.) so several frames can be processed at the
+// same time.
+std::unique_ptr<FileOp> FileOp::createSequenceFrameOp(const std::string& filename) const
+{
+  std::unique_ptr<FileOp> fop(new FileOp(m_type, m_context, &m_config));
+  fop->m_parent = this;
+  fop->m_format = m_format;
+  fop->m_filename = filename;
+  fop->m_oneframe = m_oneframe;
+  fop->m_seq.filename_list.push_back(filename);
+  fop->m_seq.flags = m_seq.flags;
+  fop->prepareForSequence();
+  return fop;
 }
 
 void FileOp::prepareForSequence()
@@ -1564,6 +1871,33 @@ void FileOp::prepareForSequence()
   m_formatOptions.reset();
 }
 
+void FileOp::sequencePaletteChanged(const int index)
+{
+  if (index >= int(m_seq.palette_changes.size()))
+    m_seq.palette_changes.resize(index+1);
+  m_seq.palette_changes[index] = true;
+}
+
+// Applies the palette changes made when the given frame was loaded
+// (from the initial palette of the sequence) to the current palette,
+// so the palette of each frame is based on the palette of the
+// previous frame (as when frames are loaded one after another).
+void FileOp::applySequencePaletteChanges(const FileOp* frameOp)
+{
+  const Palette* framePalette = frameOp->m_seq.palette;
+  if (frameOp->m_seq.palette_resized)
+    m_seq.palette->resize(framePalette->size());
+
+  const doc::PalettePicks& changes = frameOp->m_seq.palette_changes;
+  const int n = std::min({ int(changes.size()),
+                           m_seq.palette->size(),
+                           framePalette->size() });
+  for (int i=0; i<n; ++i) {
+    if (changes[i])
+      m_seq.palette->setEntry(i, framePalette->getEntry(i));
+  }
+}
+
 void FileOp::makeDirectories()
 {
   std::string dir = base::get_file_path(m_filename);
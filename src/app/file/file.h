@@ -17,6 +17,7 @@
 #include "base/paths.h"
 #include "doc/frame.h"
 #include "doc/image_ref.h"
+#include "doc/palette_picks.h"
 #include "doc/pixel_format.h"
 #include "doc/frames_sequence.h"
 #include "os/color_space.h"
@@ -342,12 +343,23 @@ namespace app {
       int duration;
       // Flags after the user choose what to do with the sequence.
       int flags;
+      // Palette changes made by the format loading one frame, to
+      // apply them (in order) to the palette of the whole sequence.
+      bool palette_resized;
+      doc::PalettePicks palette_changes;
     } m_seq;
 
     class FileAbstractImageImpl;
     std::unique_ptr<FileAbstractImageImpl> m_abstractImage;
 
+    // FileOp that created this one to load/save just one frame of a
+    // sequence from a worker thread (see createSequenceFrameOp()).
+    const FileOp* m_parent = nullptr;
+
+    std::unique_ptr<FileOp> createSequenceFrameOp(const std::string& filename) const;
     void prepareForSequence();
+    void sequencePaletteChanged(const int index);
+    void applySequencePaletteChanges(const FileOp* frameOp);
     void makeAbstractImage();
     void makeDirectories();
   };
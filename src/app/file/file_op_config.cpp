@@ -12,6 +12,8 @@
 
 #include "app/color_spaces.h"
 
+#include <algorithm>
+
 namespace app {
 
 void FileOpConfig::fillFromPreferences()
@@ -26,6 +28,10 @@ void FileOpConfig::fillFromPreferences()
   workingCS = get_working_rgb_space_from_preferences();
   rgbMapAlgorithm = pref.quantization.rgbmapAlgorithm();
   cacheCompressedTilesets = pref.tileset.cacheCompressedTilesets();
+  cacheCompressedCels = pref.cels.cacheCompressedCels();
+  compressedCelsMemoryLimit =
+    std::size_t(std::max(0, pref.cels.compressedCelsCacheSize())) * 1024 * 1024;
+  lazyLoadCels = pref.cels.lazyLoad();
 }
 
 } // namespace app
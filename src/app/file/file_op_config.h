@@ -13,6 +13,8 @@
 #include "doc/rgbmap_algorithm.h"
 #include "gfx/color_space.h"
 
+#include <cstddef>
+
 namespace app {
 
   // Options that came from Preferences but can be used in the non-UI thread.
@@ -42,6 +44,16 @@ namespace app {
     // compressed data that was loaded as-is).
     bool cacheCompressedTilesets = true;
 
+    // Same as cacheCompressedTilesets but for cel images. No more
+    // compressed data is cached when the memory used by all the
+    // cached data is greater than compressedCelsMemoryLimit.
+    bool cacheCompressedCels = true;
+    std::size_t compressedCelsMemoryLimit = 512*1024*1024;
+
+    // Decode cel images of .aseprite files the first time they are
+    // used (reading them from the file mapped in memory).
+    bool lazyLoadCels = false;
+
     void fillFromPreferences();
   };
 
@@ -12,6 +12,7 @@
 #include "app/doc.h"
 #include "app/file/file.h"
 #include "app/file/file_formats_manager.h"
+#include "app/file/gif_options.h"
 #include "base/base64.h"
 #include "doc/doc.h"
 #include "doc/user_data.h"
@@ -341,3 +342,575 @@ TEST(File, CustomProperties)
     }
   }
 }
+
+TEST(File, CachedCompressedCels)
+{
+  app::Context ctx;
+  const std::string fn = "test_cached_cels.ase";
+  const int w = 64, h = 32;
+
+  auto check_pixels = [](const Image* image, const color_t modified) {
+    for (int y=0; y<image->height(); y++) {
+      for (int x=0; x<image->width(); x++) {
+        const color_t expected = (x == 3 && y == 4 ? modified: rgba(x*4, y*8, 0, 255));
+        ASSERT_EQ(expected, get_pixel(image, x, y));
+      }
+    }
+  };
+
+  {
+    std::unique_ptr<Doc> doc(
+      ctx.documents().add(w, h, doc::ColorMode::RGB, 256));
+    doc->setFilename(fn);
+
+    Image* image = doc->sprite()->root()->firstLayer()->cel(frame_t(0))->image();
+    for (int y=0; y<h; y++)
+      for (int x=0; x<w; x++)
+        put_pixel(image, x, y, rgba(x*4, y*8, 0, 255));
+
+    // The compressed data is cached when we save the file
+    save_document(&ctx, doc.get());
+    ASSERT_FALSE(image->compressedData().empty());
+    ASSERT_EQ(image->version(), image->compressedDataVersion());
+    doc->close();
+  }
+
+  {
+    // And when we load it
+    std::unique_ptr<Doc> doc(load_document(&ctx, fn));
+    Image* image = doc->sprite()->root()->firstLayer()->cel(frame_t(0))->image();
+    ASSERT_FALSE(image->compressedData().empty());
+    ASSERT_EQ(image->version(), image->compressedDataVersion());
+    check_pixels(image, rgba(12, 32, 0, 255));
+
+    // Modified images are compressed again
+    put_pixel(image, 3, 4, rgba(255, 0, 0, 255));
+    image->incrementVersion();
+    ASSERT_NE(image->version(), image->compressedDataVersion());
+
+    save_document(&ctx, doc.get());
+    ASSERT_EQ(image->version(), image->compressedDataVersion());
+    doc->close();
+  }
+
+  {
+    std::unique_ptr<Doc> doc(load_document(&ctx, fn));
+    Image* image = doc->sprite()->root()->firstLayer()->cel(frame_t(0))->image();
+    check_pixels(image, rgba(255, 0, 0, 255));
+
+    // Saving an unmodified image uses the cached data
+    save_document(&ctx, doc.get());
+    doc->close();
+  }
+
+  {
+    std::unique_ptr<Doc> doc(load_document(&ctx, fn));
+    Image* image = doc->sprite()->root()->firstLayer()->cel(frame_t(0))->image();
+    check_pixels(image, rgba(255, 0, 0, 255));
+    doc->close();
+  }
+}
+
+TEST(File, SeveralLayersAndFrames)
+{
+  app::Context ctx;
+  const std::string fn = "test_layers_frames.ase";
+  const int w = 31, h = 17;
+  const int nlayers = 6;
+  const frame_t nframes = 5;
+
+  // The last frame of the last layer is a link to the first one
+  auto src_frame = [=](const int l, const frame_t f) -> frame_t {
+    return (l == nlayers-1 && f == nframes-1 ? 0: f);
+  };
+  auto pixel = [](const int l, const frame_t f, const int x, const int y) {
+    return rgba((x*8+l) & 255, (y*8+f) & 255, l*16+f, 255);
+  };
+
+  {
+    std::unique_ptr<Doc> doc(
+      ctx.documents().add(w, h, doc::ColorMode::RGB, 256));
+    doc->setFilename(fn);
+
+    Sprite* sprite = doc->sprite();
+    sprite->setTotalFrames(nframes);
+    for (int l=1; l<nlayers; ++l)
+      sprite->root()->addLayer(new LayerImage(sprite));
+
+    int l = 0;
+    for (Layer* layer : sprite->root()->layers()) {
+      auto layerImage = static_cast<LayerImage*>(layer);
+      for (frame_t f=0; f<nframes; ++f) {
+        if (src_frame(l, f) != f) {
+          layerImage->addCel(Cel::MakeLink(f, layer->cel(src_frame(l, f))));
+          continue;
+        }
+
+        Cel* cel = layer->cel(f);
+        if (!cel) {
+          ImageRef image(Image::create(IMAGE_RGB, w, h));
+          cel = new Cel(f, image);
+          layerImage->addCel(cel);
+        }
+        for (int y=0; y<h; y++)
+          for (int x=0; x<w; x++)
+            put_pixel(cel->image(), x, y, pixel(l, f, x, y));
+      }
+      ++l;
+    }
+
+    save_document(&ctx, doc.get());
+    doc->close();
+  }
+
+  {
+    std::unique_ptr<Doc> doc(load_document(&ctx, fn));
+    Sprite* sprite = doc->sprite();
+    ASSERT_EQ(nframes, sprite->totalFrames());
+    ASSERT_EQ(nlayers, sprite->root()->layersCount());
+
+    int l = 0;
+    for (Layer* layer : sprite->root()->layers()) {
+      for (frame_t f=0; f<nframes; ++f) {
+        Cel* cel = layer->cel(f);
+        ASSERT_TRUE(cel != nullptr);
+        if (src_frame(l, f) != f)
+          EXPECT_EQ(layer->cel(src_frame(l, f))->image(), cel->image());
+
+        const Image* image = cel->image();
+        for (int y=0; y<h; y++)
+          for (int x=0; x<w; x++)
+            ASSERT_EQ(pixel(l, src_frame(l, f), x, y), get_pixel(image, x, y));
+      }
+      ++l;
+    }
+    doc->close();
+  }
+}
+
+TEST(File, LazyCelsAndSaveOver)
+{
+  app::Context ctx;
+  const std::string fn = "test_lazy_cels.ase";
+  const int w = 16, h = 8;
+  const frame_t nframes = 3;
+
+  auto pixel = [](const frame_t f, const int x, const int y, const int k) {
+    return rgba((x*16) & 255, (y*32) & 255, f*64, 255-k);
+  };
+  auto load_lazily = [&ctx, &fn]() -> Doc* {
+    FileOpConfig config;
+    config.lazyLoadCels = true;
+    std::unique_ptr<FileOp> fop(
+      FileOp::createLoadDocumentOperation(
+        &ctx, fn, FILE_LOAD_SEQUENCE_NONE, &config));
+    fop->operate();
+    fop->done();
+    fop->postLoad();
+    EXPECT_FALSE(fop->hasError());
+    Doc* doc = fop->releaseDocument();
+    doc->setContext(&ctx);
+    return doc;
+  };
+
+  {
+    std::unique_ptr<Doc> doc(
+      ctx.documents().add(w, h, doc::ColorMode::RGB, 256));
+    doc->setFilename(fn);
+
+    Sprite* sprite = doc->sprite();
+    sprite->setTotalFrames(nframes);
+    auto layer = static_cast<LayerImage*>(sprite->root()->firstLayer());
+    for (frame_t f=0; f<nframes; ++f) {
+      if (!layer->cel(f))
+        layer->addCel(new Cel(f, ImageRef(Image::create(IMAGE_RGB, w, h))));
+      Image* image = layer->cel(f)->image();
+      for (int y=0; y<h; y++)
+        for (int x=0; x<w; x++)
+          put_pixel(image, x, y, pixel(f, x, y, 0));
+    }
+    save_document(&ctx, doc.get());
+    doc->close();
+  }
+
+  // Two documents decoding their cels from the same file
+  std::unique_ptr<Doc> doc1(load_lazily());
+  std::unique_ptr<Doc> doc2(load_lazily());
+  Layer* layer1 = doc1->sprite()->root()->firstLayer();
+  Layer* layer2 = doc2->sprite()->root()->firstLayer();
+  for (frame_t f=0; f<nframes; ++f)
+    EXPECT_FALSE(layer2->cel(f)->data()->isImageLoaded());
+
+  // Save a modified doc1 over the file
+  Image* image = layer1->cel(1)->image();
+  for (int y=0; y<h; y++)
+    for (int x=0; x<w; x++)
+      put_pixel(image, x, y, pixel(1, x, y, 1));
+  image->incrementVersion();
+  save_document(&ctx, doc1.get());
+
+  // doc2 cels are still decoded from the original file
+  for (frame_t f=0; f<nframes; ++f) {
+    const Image* image = layer2->cel(f)->image();
+    for (int y=0; y<h; y++)
+      for (int x=0; x<w; x++)
+        ASSERT_EQ(pixel(f, x, y, 0), get_pixel(image, x, y));
+  }
+  doc1->close();
+  doc2->close();
+
+  std::unique_ptr<Doc> doc3(load_lazily());
+  Layer* layer3 = doc3->sprite()->root()->firstLayer();
+  for (frame_t f=0; f<nframes; ++f) {
+    const Image* image = layer3->cel(f)->image();
+    for (int y=0; y<h; y++)
+      for (int x=0; x<w; x++)
+        ASSERT_EQ(pixel(f, x, y, f == 1 ? 1: 0), get_pixel(image, x, y));
+  }
+  doc3->close();
+}
+
+TEST(File, LazyCelsIndexedMaskColor)
+{
+  app::Context ctx;
+  const std::string fn = "test_lazy_cels_indexed.ase";
+  const int w = 8, h = 8;
+
+  {
+    std::unique_ptr<Doc> doc(
+      ctx.documents().add(w, h, doc::ColorMode::INDEXED, 256));
+    doc->setFilename(fn);
+    doc->sprite()->setTransparentColor(3);
+    Image* image = doc->sprite()->root()->firstLayer()->cel(0)->image();
+    for (int y=0; y<h; y++)
+      for (int x=0; x<w; x++)
+        put_pixel(image, x, y, (x+y) & 7);
+    save_document(&ctx, doc.get());
+    doc->close();
+  }
+
+  FileOpConfig config;
+  config.lazyLoadCels = true;
+  std::unique_ptr<FileOp> fop(
+    FileOp::createLoadDocumentOperation(
+      &ctx, fn, FILE_LOAD_SEQUENCE_NONE, &config));
+  fop->operate();
+  fop->done();
+  fop->postLoad();
+  ASSERT_FALSE(fop->hasError());
+  std::unique_ptr<Doc> doc(fop->releaseDocument());
+  doc->setContext(&ctx);
+
+  CelData* celData = doc->sprite()->root()->firstLayer()->cel(0)->data();
+  EXPECT_FALSE(celData->isImageLoaded());
+
+  // The mask color is the transparent index each time the image is
+  // loaded
+  for (int i=0; i<2; ++i) {
+    const Image* image = celData->image();
+    EXPECT_EQ(3, image->maskColor());
+    EXPECT_EQ(5, get_pixel(image, 2, 3));
+    EXPECT_TRUE(celData->unloadImage());
+  }
+  doc->close();
+}
+
+// Saves the sprite as a sequence of PNG files (one for each frame),
+// and loads the whole sequence again, so both operations process
+// frames in parallel.
+static Doc* save_and_load_png_sequence(app::Context* ctx, Doc* doc)
+{
+  std::unique_ptr<FileOp> fop(
+    FileOp::createSaveDocumentOperation(
+      ctx,
+      FileOpROI(doc, doc->sprite()->bounds(),
+                "", "", FramesSequence(), false),
+      "test_seq1.png", "", false));
+  EXPECT_TRUE(fop != nullptr);
+  if (!fop)
+    return nullptr;
+
+  const base::paths filenames = fop->filenames();
+  EXPECT_EQ(doc->sprite()->totalFrames(), int(filenames.size()));
+  fop->operate();
+  fop->done();
+  EXPECT_FALSE(fop->hasError());
+
+  fop.reset(
+    FileOp::createLoadDocumentOperation(
+      ctx, filenames[0], FILE_LOAD_SEQUENCE_YES));
+  EXPECT_TRUE(fop != nullptr);
+  if (!fop)
+    return nullptr;
+  EXPECT_EQ(filenames, fop->filenames());
+  fop->operate();
+  fop->done();
+  fop->postLoad();
+  EXPECT_FALSE(fop->hasError());
+
+  Doc* result = fop->releaseDocument();
+  if (result)
+    result->setContext(ctx);
+
+  for (const auto& fn : filenames)
+    std::remove(fn.c_str());
+  return result;
+}
+
+TEST(File, RgbSequence)
+{
+  app::Context ctx;
+  const int w = 23, h = 11;
+  const frame_t nframes = 9;
+
+  auto pixel = [](const frame_t f, const int x, const int y) {
+    return rgba((x*11) & 255, (y*23) & 255, f*28, 255);
+  };
+
+  std::unique_ptr<Doc> doc(
+    ctx.documents().add(w, h, doc::ColorMode::RGB, 256));
+  Sprite* sprite = doc->sprite();
+  sprite->setTotalFrames(nframes);
+  auto layer = static_cast<LayerImage*>(sprite->root()->firstLayer());
+  for (frame_t f=0; f<nframes; ++f) {
+    if (!layer->cel(f))
+      layer->addCel(new Cel(f, ImageRef(Image::create(IMAGE_RGB, w, h))));
+    Image* image = layer->cel(f)->image();
+    for (int y=0; y<h; y++)
+      for (int x=0; x<w; x++)
+        put_pixel(image, x, y, pixel(f, x, y));
+  }
+
+  std::unique_ptr<Doc> doc2(save_and_load_png_sequence(&ctx, doc.get()));
+  ASSERT_TRUE(doc2 != nullptr);
+  Sprite* sprite2 = doc2->sprite();
+  ASSERT_EQ(IMAGE_RGB, sprite2->pixelFormat());
+  ASSERT_EQ(nframes, sprite2->totalFrames());
+  ASSERT_EQ(w, sprite2->width());
+  ASSERT_EQ(h, sprite2->height());
+
+  Layer* layer2 = sprite2->root()->firstLayer();
+  for (frame_t f=0; f<nframes; ++f) {
+    Cel* cel = layer2->cel(f);
+    ASSERT_TRUE(cel != nullptr);
+    for (int y=0; y<h; y++)
+      for (int x=0; x<w; x++)
+        ASSERT_EQ(pixel(f, x, y), get_pixel(cel->image(), x, y));
+  }
+  doc->close();
+  doc2->close();
+}
+
+// Each frame of the sequence has its own palette, and the palettes
+// of the loaded sprite must be in the same order as the frames.
+TEST(File, IndexedSequencePalettes)
+{
+  app::Context ctx;
+  const int w = 8, h = 4;
+  const frame_t nframes = 7;
+
+  // New palette in frames 0, 2, 3 and 6 with different sizes
+  auto palette_frame = [](const frame_t f) -> frame_t {
+    return (f == 1 ? 0: f == 4 || f == 5 ? 3: f);
+  };
+  auto palette_size = [](const frame_t f) {
+    return 4 + 3*f;
+  };
+  auto color = [](const frame_t f, const int i) {
+    return rgba(f*32, i*8, 255-i, 255);
+  };
+
+  std::unique_ptr<Doc> doc(
+    ctx.documents().add(w, h, doc::ColorMode::INDEXED, 256));
+  Sprite* sprite = doc->sprite();
+  sprite->setTotalFrames(nframes);
+  auto layer = static_cast<LayerImage*>(sprite->root()->firstLayer());
+  for (frame_t f=0; f<nframes; ++f) {
+    if (palette_frame(f) == f) {
+      Palette pal(f, palette_size(f));
+      for (int i=0; i<pal.size(); ++i)
+        pal.setEntry(i, color(f, i));
+      sprite->setPalette(&pal, true);
+    }
+    if (!layer->cel(f))
+      layer->addCel(new Cel(f, ImageRef(Image::create(IMAGE_INDEXED, w, h))));
+    Image* image = layer->cel(f)->image();
+    for (int y=0; y<h; y++)
+      for (int x=0; x<w; x++)
+        put_pixel(image, x, y, (x+y+f) % palette_size(palette_frame(f)));
+  }
+
+  std::unique_ptr<Doc> doc2(save_and_load_png_sequence(&ctx, doc.get()));
+  ASSERT_TRUE(doc2 != nullptr);
+  Sprite* sprite2 = doc2->sprite();
+  ASSERT_EQ(IMAGE_INDEXED, sprite2->pixelFormat());
+  ASSERT_EQ(nframes, sprite2->totalFrames());
+
+  Layer* layer2 = sprite2->root()->firstLayer();
+  for (frame_t f=0; f<nframes; ++f) {
+    const frame_t pf = palette_frame(f);
+    const Palette* pal = sprite2->palette(f);
+    ASSERT_EQ(palette_size(pf), pal->size());
+    // Entry 0 is the transparent color (saved with alpha=0)
+    for (int i=1; i<pal->size(); ++i)
+      EXPECT_EQ(color(pf, i), pal->getEntry(i));
+
+    Cel* cel = layer2->cel(f);
+    ASSERT_TRUE(cel != nullptr);
+    for (int y=0; y<h; y++)
+      for (int x=0; x<w; x++)
+        ASSERT_EQ((x+y+f) % palette_size(pf), get_pixel(cel->image(), x, y));
+  }
+  doc->close();
+  doc2->close();
+}
+
+// Returns the color of the (x, y) pixel of a loaded cel, GIF files
+// can be loaded as RGB or indexed sprites depending on the number of
+// colors of the whole animation.
+static color_t loaded_color(const Sprite* sprite, const frame_t frame,
+                            const Image* image, const int x, const int y)
+{
+  const color_t c = get_pixel(image, x, y);
+  if (image->pixelFormat() == IMAGE_INDEXED) {
+    if (c == sprite->transparentColor() && !sprite->isOpaque())
+      return 0;
+    return sprite->palette(frame)->getEntry(c);
+  }
+  return (rgba_geta(c) == 0 ? 0: c);
+}
+
+// Each frame of an RGB sprite is saved with its own local colormap.
+TEST(File, GifRgbLocalPalettes)
+{
+  app::Context ctx;
+  const std::string fn = "test_rgb.gif";
+  const int w = 16, h = 8;
+  const frame_t nframes = 5;
+
+  // 128 different colors in each frame (and 640 in the whole sprite)
+  auto pixel = [](const frame_t f, const int x, const int y) {
+    return rgba(x*16, y*32, 32+f*48, 255);
+  };
+
+  {
+    std::unique_ptr<Doc> doc(
+      ctx.documents().add(w, h, doc::ColorMode::RGB, 256));
+    doc->setFilename(fn);
+
+    Sprite* sprite = doc->sprite();
+    sprite->setTotalFrames(nframes);
+    auto layer = static_cast<LayerImage*>(sprite->root()->firstLayer());
+    for (frame_t f=0; f<nframes; ++f) {
+      if (!layer->cel(f))
+        layer->addCel(new Cel(f, ImageRef(Image::create(IMAGE_RGB, w, h))));
+      Image* image = layer->cel(f)->image();
+      for (int y=0; y<h; y++)
+        for (int x=0; x<w; x++)
+          put_pixel(image, x, y, pixel(f, x, y));
+    }
+    save_document(&ctx, doc.get());
+    doc->close();
+  }
+
+  {
+    std::unique_ptr<Doc> doc(load_document(&ctx, fn));
+    Sprite* sprite = doc->sprite();
+    ASSERT_EQ(nframes, sprite->totalFrames());
+    ASSERT_EQ(w, sprite->width());
+    ASSERT_EQ(h, sprite->height());
+
+    Layer* layer = sprite->root()->firstLayer();
+    for (frame_t f=0; f<nframes; ++f) {
+      Cel* cel = layer->cel(f);
+      ASSERT_TRUE(cel != nullptr);
+      for (int y=0; y<h; y++)
+        for (int x=0; x<w; x++)
+          ASSERT_EQ(pixel(f, x, y), loaded_color(sprite, f, cel->image(), x, y))
+            << "Frame " << f << " pixel " << x << "," << y;
+    }
+    doc->close();
+  }
+}
+
+// An indexed sprite with only one palette is saved with a global
+// colormap. With a background layer the palette order is preserved
+// (same indexes), and for transparent sprites (without the
+// "preserve palette order" option) a new palette is created.
+TEST(File, GifIndexedGlobalPalette)
+{
+  app::Context ctx;
+  const int w = 16, h = 8;
+  const frame_t nframes = 4;
+  const int ncolors = 16;
+
+  auto color = [](const int i) {
+    return rgba(i*16, 255-i*8, i*4, 255);
+  };
+  auto index = [=](const frame_t f, const int x, const int y) {
+    return (x+2*y+3*f) % ncolors;
+  };
+
+  for (const bool background : { true, false }) {
+    const std::string fn =
+      (background ? "test_indexed_bg.gif": "test_indexed.gif");
+
+    {
+      std::unique_ptr<Doc> doc(
+        ctx.documents().add(w, h, doc::ColorMode::INDEXED, ncolors));
+      doc->setFilename(fn);
+      doc->setFormatOptions(std::make_shared<GifOptions>(false, true, false));
+
+      Sprite* sprite = doc->sprite();
+      sprite->setTotalFrames(nframes);
+      Palette pal(0, ncolors);
+      for (int i=0; i<ncolors; ++i)
+        pal.setEntry(i, color(i));
+      sprite->setPalette(&pal, true);
+
+      auto layer = static_cast<LayerImage*>(sprite->root()->firstLayer());
+      if (background)
+        layer->configureAsBackground();
+      for (frame_t f=0; f<nframes; ++f) {
+        if (!layer->cel(f))
+          layer->addCel(new Cel(f, ImageRef(Image::create(IMAGE_INDEXED, w, h))));
+        Image* image = layer->cel(f)->image();
+        for (int y=0; y<h; y++)
+          for (int x=0; x<w; x++)
+            put_pixel(image, x, y, index(f, x, y));
+      }
+      save_document(&ctx, doc.get());
+      doc->close();
+    }
+
+    {
+      std::unique_ptr<Doc> doc(load_document(&ctx, fn));
+      Sprite* sprite = doc->sprite();
+      ASSERT_EQ(nframes, sprite->totalFrames());
+      ASSERT_EQ(IMAGE_INDEXED, sprite->pixelFormat());
+      ASSERT_EQ(background, sprite->isOpaque());
+      if (background) {
+        ASSERT_EQ(ncolors, sprite->palette(0)->size());
+        for (int i=0; i<ncolors; ++i)
+          EXPECT_EQ(color(i), sprite->palette(0)->getEntry(i));
+      }
+
+      Layer* layer = sprite->root()->firstLayer();
+      for (frame_t f=0; f<nframes; ++f) {
+        Cel* cel = layer->cel(f);
+        ASSERT_TRUE(cel != nullptr);
+        for (int y=0; y<h; y++)
+          for (int x=0; x<w; x++) {
+            const int i = index(f, x, y);
+            if (background)
+              ASSERT_EQ(i, get_pixel(cel->image(), x, y));
+            // Index 0 is the transparent color of the original sprite
+            ASSERT_EQ(background || i != 0 ? color(i): 0,
+                      loaded_color(sprite, f, cel->image(), x, y))
+              << "Frame " << f << " pixel " << x << "," << y;
+          }
+      }
+      doc->close();
+    }
+  }
+}
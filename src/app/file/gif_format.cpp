@@ -25,6 +25,7 @@
 #include "base/fs.h"
 #include "doc/doc.h"
 #include "doc/octree_map.h"
+#include "doc/worker_pool.h"
 #include "gfx/clip.h"
 #include "render/dithering.h"
 #include "render/ordered_dither.h"
@@ -35,6 +36,10 @@
 #include "gif_options.xml.h"
 
 #include <algorithm>
+#include <deque>
+#include <exception>
+#include <memory>
+#include <unordered_map>
 
 #include <gif_lib.h>
 
@@ -1079,6 +1084,10 @@ public:
       }
     }
 
+    if (m_globalColormap && !m_preservePaletteOrder)
+      m_globalColorIndexes = exactColorIndexes(m_globalColormapPalette,
+                                               m_transparentIndex);
+
     // Create the 3 temporary images (previous/current/next) to
     // compare pixels between them.
     for (int i=0; i<3; ++i)
@@ -1110,47 +1119,124 @@ public:
 #endif
     auto frame_it = frame_beg;
 
-    // In this code "gifFrame" will be the GIF frame, and "frame" will
-    // be the doc::Sprite frame.
-    gifframe_t nframes = totalFrames();
-    for (gifframe_t gifFrame=0; gifFrame<nframes; ++gifFrame) {
-      ASSERT(frame_it != frame_end);
-      frame_t frame = *frame_it;
-      ++frame_it;
-
-      if (gifFrame == 0)
-        renderFrame(frame, m_nextImage);
-      else
-        std::swap(m_previousImage, m_currentImage);
-
-      // Render next frame
-      std::swap(m_currentImage, m_nextImage);
-      if (gifFrame+1 < nframes)
-        renderFrame(*frame_it, m_nextImage);
-
-      gfx::Rect frameBounds = m_spriteBounds;
-      DisposalMethod disposal = DisposalMethod::DO_NOT_DISPOSE;
-
-      // Creation of the deltaImage (difference image result respect
-      // to current VS previous frame image).  At the same time we
-      // must scan the next image, to check if some pixel turns to
-      // transparent (0), if the case, we need to force disposal
-      // method of the current image to RESTORE_BG.  Further, at the
-      // same time, we must check if we can go without color zero (0).
+    // Frames being quantized/mapped in worker threads, they are
+    // written in order from this thread.
+    std::deque<std::shared_ptr<EncodedFrame>> pending;
+    const std::size_t maxPending =
+      2*doc::worker_threads();
 
-      calculateDeltaImageFrameBoundsDisposal(gifFrame, frameBounds, disposal);
-
-      writeImage(gifFrame, frame, frameBounds, disposal,
-                 // Only the last frame in the animation needs the fix
-                 (fix_last_frame_duration && gifFrame == nframes-1));
+    try {
+      // In this code "gifFrame" will be the GIF frame, and "frame" will
+      // be the doc::Sprite frame.
+      gifframe_t nframes = totalFrames();
+      for (gifframe_t gifFrame=0; gifFrame<nframes; ++gifFrame) {
+        ASSERT(frame_it != frame_end);
+        frame_t frame = *frame_it;
+        ++frame_it;
+
+        if (gifFrame == 0)
+          renderFrame(frame, m_nextImage);
+        else
+          std::swap(m_previousImage, m_currentImage);
+
+        // Render next frame
+        std::swap(m_currentImage, m_nextImage);
+        if (gifFrame+1 < nframes)
+          renderFrame(*frame_it, m_nextImage);
+
+        gfx::Rect frameBounds = m_spriteBounds;
+        DisposalMethod disposal = DisposalMethod::DO_NOT_DISPOSE;
+
+        // Creation of the deltaImage (difference image result respect
+        // to current VS previous frame image).  At the same time we
+        // must scan the next image, to check if some pixel turns to
+        // transparent (0), if the case, we need to force disposal
+        // method of the current image to RESTORE_BG.  Further, at the
+        // same time, we must check if we can go without color zero (0).
+
+        calculateDeltaImageFrameBoundsDisposal(gifFrame, frameBounds, disposal);
+
+        auto encodedFrame = std::make_shared<EncodedFrame>();
+        encodedFrame->gifFrame = gifFrame;
+        encodedFrame->frame = frame;
+        encodedFrame->frameBounds = frameBounds;
+        encodedFrame->disposal = disposal;
+        // Only the last frame in the animation needs the fix
+        encodedFrame->fixDuration = (fix_last_frame_duration && gifFrame == nframes-1);
+        encodedFrame->deltaImage = std::move(m_deltaImage);
+
+        // The task is waited before the frame is destroyed
+        EncodedFrame* frameToQuantize = encodedFrame.get();
+        frameToQuantize->task.execute(
+          [this, frameToQuantize]{
+            try {
+              quantizeFrame(*frameToQuantize);
+            }
+            catch (...) {
+              frameToQuantize->error = std::current_exception();
+            }
+          });
+        pending.push_back(encodedFrame);
+
+        while (pending.size() >= maxPending)
+          writeNextImage(pending, nframes);
+      }
 
-      m_fop->setProgress(double(gifFrame+1) / double(nframes));
+      while (!pending.empty())
+        writeNextImage(pending, nframes);
+    }
+    catch (...) {
+      // The worker threads use this encoder
+      for (const auto& encodedFrame : pending)
+        waitFrame(*encodedFrame);
+      throw;
     }
     return true;
   }
 
 private:
 
+  // Frame to be written in the GIF file. The delta image is
+  // quantized/mapped to palette indexes in a worker thread.
+  struct EncodedFrame {
+    gifframe_t gifFrame;
+    frame_t frame;
+    gfx::Rect frameBounds;
+    DisposalMethod disposal;
+    bool fixDuration;
+    std::unique_ptr<Image> deltaImage;
+
+    // Fields filled by quantizeFrame()
+    ImageRef frameImage;
+    Remap remap = Remap(256);
+    // Palette for the local colormap (nullptr if the frame uses the
+    // global colormap)
+    std::unique_ptr<Palette> localPalette;
+    int localTransparent = -1;
+    std::exception_ptr error;
+
+    // Quantizes the frame in a worker thread (or in the calling
+    // thread if no worker started it when we wait for it)
+    doc::WorkerTasks task;
+  };
+
+  void waitFrame(EncodedFrame& encodedFrame) {
+    encodedFrame.task.wait();
+  }
+
+  // Writes the oldest pending frame (waiting the worker thread).
+  void writeNextImage(std::deque<std::shared_ptr<EncodedFrame>>& pending,
+                      const gifframe_t nframes) {
+    std::shared_ptr<EncodedFrame> encodedFrame = pending.front();
+    waitFrame(*encodedFrame);
+    pending.pop_front();
+    if (encodedFrame->error)
+      std::rethrow_exception(encodedFrame->error);
+
+    writeImage(*encodedFrame);
+    m_fop->setProgress(double(encodedFrame->gifFrame+1) / double(nframes));
+  }
+
   void calculateDeltaImageFrameBoundsDisposal(gifframe_t gifFrame,
                                               gfx::Rect& frameBounds,
                                               DisposalMethod& disposal) {
@@ -1250,7 +1336,7 @@ private:
       else
         disposal = DisposalMethod::RESTORE_BGCOLOR;
 
-      // We need to conditionate the deltaImage to the next step: 'writeImage()'
+      // We need to conditionate the deltaImage to the next step: 'quantizeFrame()'
       // To do it, we need to crop deltaImage in frameBounds.
       // If disposal method changed to RESTORE_BGCOLOR deltaImage we need to reproduce ALL the colors of m_currentImage
       // contained in frameBounds (so, we will overwrite delta image with a cropped current image).
@@ -1366,35 +1452,67 @@ private:
   }
 
 
-  void writeImage(const gifframe_t gifFrame,
-                  const frame_t frame,
-                  const gfx::Rect& frameBounds,
-                  const DisposalMethod disposal,
-                  const bool fixDuration) {
+  // Returns the index of the first entry of each color in the
+  // palette (to replace Palette::findExactMatch() calls).
+  static std::unordered_map<color_t, int> exactColorIndexes(const Palette& palette,
+                                                            const int maskIndex) {
+    std::unordered_map<color_t, int> indexes;
+    for (int i=0; i<palette.size(); ++i) {
+      if (i != maskIndex)
+        indexes.emplace(palette.getEntry(i), i);
+    }
+    return indexes;
+  }
+
+  // Converts the delta image of the frame to an indexed image (and
+  // calculates its palette if needed). It's called from worker
+  // threads, so it cannot modify the encoder.
+  void quantizeFrame(EncodedFrame& encodedFrame) const {
+    const gfx::Rect& frameBounds = encodedFrame.frameBounds;
+    Remap& remap = encodedFrame.remap;
+
+    if (m_preservePaletteOrder) {
+      ASSERT(m_globalColormap);
+      encodedFrame.frameImage.reset(encodedFrame.deltaImage.release());
+      encodedFrame.localTransparent = m_transparentIndex;
+      for (int i=0; i<m_globalColormap->ColorCount; ++i)
+        remap.map(i, i);
+      return;
+    }
+
+    int transparentIndex = m_transparentIndex;
     Palette framePalette;
-    if (m_globalColormap)
+    std::unordered_map<color_t, int> frameColorIndexes;
+    const std::unordered_map<color_t, int>* colorIndexes;
+    if (m_globalColormap) {
       framePalette = m_globalColormapPalette;
-    else
-      framePalette = calculatePalette();
+      colorIndexes = &m_globalColorIndexes;
+    }
+    else {
+      framePalette = calculatePalette(encodedFrame.deltaImage.get(),
+                                      transparentIndex);
+      frameColorIndexes = exactColorIndexes(framePalette, transparentIndex);
+      colorIndexes = &frameColorIndexes;
+    }
+
+    // Colors without an exact match are mapped with an octree (only
+    // created if it's needed) and cached.
+    std::unique_ptr<OctreeMap> octree;
+    std::unordered_map<color_t, int> mappedColors;
 
-    OctreeMap octree;
-    octree.regenerateMap(&framePalette, m_transparentIndex);
     ImageRef frameImage(Image::create(IMAGE_INDEXED,
                                       frameBounds.w,
-                                      frameBounds.h,
-                                      m_frameImageBuf));
+                                      frameBounds.h));
 
     // Every frame might use a small portion of the global palette,
     // to optimize the gif file size, we will analize which colors
     // will be used in each processed frame.
     PalettePicks usedColors(framePalette.size());
 
-    int localTransparent = m_transparentIndex;
-    ColorMapObject* colormap = m_globalColormap;
-    Remap remap(256);
+    int localTransparent = transparentIndex;
 
-    if (!m_preservePaletteOrder) {
-      const LockImageBits<RgbTraits> srcBits(m_deltaImage.get());
+    {
+      const LockImageBits<RgbTraits> srcBits(encodedFrame.deltaImage.get());
       LockImageBits<IndexedTraits> dstBits(frameImage.get());
 
       auto srcIt = srcBits.begin();
@@ -1409,18 +1527,28 @@ private:
           int i;
 
           if (rgba_geta(color) >= 128) {
-            i = framePalette.findExactMatch(
-              rgba_getr(color),
-              rgba_getg(color),
-              rgba_getb(color),
-              255,
-              m_transparentIndex);
-            if (i < 0)
-              i = octree.mapColor(color | rgba_a_mask); // alpha=255
+            color |= rgba_a_mask; // alpha=255
+
+            auto it = colorIndexes->find(color);
+            if (it != colorIndexes->end())
+              i = it->second;
+            else {
+              auto it2 = mappedColors.find(color);
+              if (it2 != mappedColors.end())
+                i = it2->second;
+              else {
+                if (!octree) {
+                  octree = std::make_unique<OctreeMap>();
+                  octree->regenerateMap(&framePalette, transparentIndex);
+                }
+                i = octree->mapColor(color);
+                mappedColors[color] = i;
+              }
+            }
           }
           else {
-            if (m_transparentIndex >= 0)
-              i = m_transparentIndex;
+            if (transparentIndex >= 0)
+              i = transparentIndex;
             else
               i = m_bgIndex;
           }
@@ -1437,40 +1565,50 @@ private:
           *dstIt = i;
         }
       }
+    }
 
-      int usedNColors = usedColors.picks();
+    int usedNColors = usedColors.picks();
 
-      for (int i=0; i<remap.size(); ++i)
-        remap.map(i, i);
+    for (int i=0; i<remap.size(); ++i)
+      remap.map(i, i);
 
-      if (!colormap) {
-        Palette reducedPalette(0, usedNColors);
+    if (!m_globalColormap) {
+      auto reducedPalette = std::make_unique<Palette>(0, usedNColors);
 
-        for (int i=0, j=0; i<framePalette.size(); ++i) {
-          if (usedColors[i]) {
-            reducedPalette.setEntry(j, framePalette.getEntry(i));
-            remap.map(i, j);
-            ++j;
-          }
+      for (int i=0, j=0; i<framePalette.size(); ++i) {
+        if (usedColors[i]) {
+          reducedPalette->setEntry(j, framePalette.getEntry(i));
+          remap.map(i, j);
+          ++j;
         }
-
-        colormap = createColorMap(&reducedPalette);
-        if (localTransparent >= 0)
-          localTransparent = remap[localTransparent];
       }
 
-      if (localTransparent >= 0 && m_transparentIndex != localTransparent)
-        remap.map(m_transparentIndex, localTransparent);
-    }
-    else {
-      frameImage.reset(Image::createCopy(m_deltaImage.get()));
-      for (int i=0; i<colormap->ColorCount; ++i)
-        remap.map(i, i);
+      encodedFrame.localPalette = std::move(reducedPalette);
+      if (localTransparent >= 0)
+        localTransparent = remap[localTransparent];
     }
 
+    if (localTransparent >= 0 && transparentIndex != localTransparent)
+      remap.map(transparentIndex, localTransparent);
+
+    encodedFrame.frameImage = frameImage;
+    encodedFrame.localTransparent = localTransparent;
+    encodedFrame.deltaImage.reset();
+  }
+
+  void writeImage(const EncodedFrame& encodedFrame) {
+    const gifframe_t gifFrame = encodedFrame.gifFrame;
+    const gfx::Rect& frameBounds = encodedFrame.frameBounds;
+    const Image* frameImage = encodedFrame.frameImage.get();
+    const Remap& remap = encodedFrame.remap;
+
+    ColorMapObject* colormap =
+      (encodedFrame.localPalette ? createColorMap(encodedFrame.localPalette.get()):
+                                   m_globalColormap);
+
     // Write extension record.
-    writeExtension(gifFrame, frame, localTransparent,
-                   disposal, fixDuration);
+    writeExtension(gifFrame, encodedFrame.frame, encodedFrame.localTransparent,
+                   encodedFrame.disposal, encodedFrame.fixDuration);
 
     // Write the image record.
     if (EGifPutImageDesc(m_gifFile,
@@ -1516,9 +1654,11 @@ private:
       GifFreeMapObject(colormap);
   }
 
-  Palette calculatePalette() {
+  // Creates a palette for the given image, "transparentIndex" is set
+  // to 0 if the palette includes the transparent color, or -1 if not.
+  static Palette calculatePalette(const Image* image, int& transparentIndex) {
     OctreeMap octree;
-    const LockImageBits<RgbTraits> imageBits(m_deltaImage.get());
+    const LockImageBits<RgbTraits> imageBits(image);
     auto it = imageBits.begin(), end = imageBits.end();
     bool maskColorFounded = false;
     for (; it != end; ++it) {
@@ -1534,7 +1674,7 @@ private:
       // If there is a mask color, the OctreeMap::makePalette adds it
       // by default at entry == 0.
       octree.makePalette(&palette, 256, 8);
-      m_transparentIndex = 0;
+      transparentIndex = 0;
       return palette;
     }
     else {
@@ -1544,7 +1684,7 @@ private:
       Palette paletteWithoutMask(0, palette.size() - 1);
       for (int i=0; i < paletteWithoutMask.size(); i++)
         paletteWithoutMask.setEntry(i, palette.entry(i+1));
-      m_transparentIndex = -1;
+      transparentIndex = -1;
       return paletteWithoutMask;
     }
   }
@@ -1597,12 +1737,13 @@ private:
   // have to quantize the palette on each frame.
   ColorMapObject* m_globalColormap;
   Palette m_globalColormapPalette;
+  // Index of each color of the global palette
+  std::unordered_map<color_t, int> m_globalColorIndexes;
   bool m_interlaced;
   int m_loop;
   bool m_preservePaletteOrder;
   gfx::Rect m_lastFrameBounds;
   DisposalMethod m_lastDisposal;
-  ImageBufferPtr m_frameImageBuf;
   ImageRef m_images[3];
   Image* m_previousImage;
   Image* m_currentImage;
@@ -10,9 +10,12 @@
 
 #include "app/render/simple_renderer.h"
 
+#include "app/pref/preferences.h"
 #include "app/ui/editor/editor_render.h"
 #include "app/util/conversion_to_surface.h"
 
+#include <algorithm>
+
 namespace app {
 
 using namespace doc;
@@ -20,6 +23,8 @@ using namespace doc;
 SimpleRenderer::SimpleRenderer()
 {
   m_properties.outputsUnpremultiplied = true;
+  m_render.setParallelRendering(true);
+  m_render.setCompositeCache(&m_cache);
 }
 
 void SimpleRenderer::setRefLayersVisiblity(const bool visible)
@@ -102,6 +107,13 @@ void SimpleRenderer::renderSprite(os::Surface* dstSurface,
   ImageRef dstImage(Image::create(
                       IMAGE_RGB, area.size.w, area.size.h,
                       EditorRender::getRenderImageBuffer()));
+
+  // Memory limit (in MB) for the layers composited below the active
+  // layer
+  m_cache.setMaxMemory(
+    std::size_t(std::max(0, Preferences::instance().experimental.compositeCacheSize()))
+    * 1024 * 1024);
+
   m_render.renderSprite(dstImage.get(), sprite, frame, area);
 
   convert_image_to_surface(dstImage.get(), sprite->palette(frame),
@@ -9,6 +9,7 @@
 #pragma once
 
 #include "app/render/renderer.h"
+#include "render/composite_cache.h"
 
 namespace app {
 
@@ -62,6 +63,7 @@ namespace app {
   private:
     Properties m_properties;
     render::Render m_render;
+    render::CompositeCache m_cache;
   };
 
 } // namespace app
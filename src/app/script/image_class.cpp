@@ -253,6 +253,7 @@ int Image_clear(lua_State* L)
     color = convert_args_into_pixel_color(L, i, img->pixelFormat());
 
   doc::fill_rect(img, rc, color); // Clips the rectangle to the image bounds
+  img->incrementVersion();
   return 0;
 }
 
@@ -268,6 +269,7 @@ int Image_drawPixel(lua_State* L)
   else
     color = convert_args_into_pixel_color(L, 4, img->pixelFormat());
   doc::put_pixel(img, x, y, color);
+  img->incrementVersion();
 
   // Rehash tileset
   if (obj->tilesetId) {
@@ -682,6 +684,7 @@ int Image_set_bytes(lua_State* L)
 
   if (bytes_size == bytes_needed) {
     std::memcpy(img->getPixelAddress(0, 0), bytes, bytes_size);
+    img->incrementVersion();
   }
   else {
     lua_pushfstring(L, "Data size does not match: given %d, needed %d.", bytes_size, bytes_needed);
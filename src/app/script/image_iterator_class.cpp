@@ -1,5 +1,5 @@
 // Aseprite
-// Copyright (C) 2018  Igara Studio S.A.
+// Copyright (C) 2018-2023  Igara Studio S.A.
 // Copyright (C) 2018  David Capello
 //
 // This program is distributed under the terms of
@@ -63,6 +63,9 @@ int ImageIterator_call(lua_State* L)
   // Set value
   else {
     *obj->begin = lua_tointeger(L, 2);
+    // Invalidate cached data of the image (e.g. its hash or the
+    // compressed pixels from the .aseprite file)
+    obj->bits.image()->incrementVersion();
     return 1;
   }
 }
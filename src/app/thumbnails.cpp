@@ -1,5 +1,5 @@
 // Aseprite
-// Copyright (C) 2019-2020  Igara Studio S.A.
+// Copyright (C) 2019-2023  Igara Studio S.A.
 // Copyright (C) 2018  David Capello
 // Copyright (C) 2016  Carlo Caputo
 //
@@ -10,59 +10,82 @@
 #include "config.h"
 #endif
 
+#include "app/thumbnails.h"
+
+#include "app/doc.h"
+#include "app/doc_access.h"
 #include "app/util/conversion_to_surface.h"
+#include "base/thread_pool.h"
 #include "doc/blend_mode.h"
 #include "doc/cel.h"
 #include "doc/layer.h"
+#include "doc/palette.h"
 #include "doc/sprite.h"
+#include "doc/worker_pool.h"
 #include "os/surface.h"
 #include "os/system.h"
 #include "render/render.h"
+#include "ui/system.h"
+
+#include <condition_variable>
+#include <deque>
+#include <mutex>
 
 namespace app {
 namespace thumb {
 
-os::SurfaceRef get_cel_thumbnail(const doc::Cel* cel,
-                                 const gfx::Size& fitInSize)
-{
-  gfx::Size newSize;
+namespace {
 
+gfx::Size calc_thumbnail_size(const doc::Cel* cel,
+                              const gfx::Size& fitInSize)
+{
   if (cel->bounds().w > fitInSize.w ||
       cel->bounds().h > fitInSize.h)
-    newSize = gfx::Rect(cel->bounds()).fitIn(gfx::Rect(fitInSize)).size();
+    return gfx::Rect(cel->bounds()).fitIn(gfx::Rect(fitInSize)).size();
   else
-    newSize = cel->bounds().size();
-
-  if (newSize.w < 1 ||
-      newSize.h < 1)
-    return nullptr;
+    return cel->bounds().size();
+}
 
+// The "cel" and "layer" are used only to render tilemaps.
+doc::ImageRef render_thumbnail_image(const doc::Cel* cel,
+                                     const doc::Sprite* sprite,
+                                     const doc::Image* image,
+                                     const doc::Layer* layer,
+                                     const doc::Palette* palette,
+                                     const gfx::Size& celSize,
+                                     const gfx::Size& newSize)
+{
   doc::ImageRef thumbnailImage(
     doc::Image::create(
       doc::IMAGE_RGB, newSize.w, newSize.h));
 
   render::Render render;
-  render::Projection proj(cel->sprite()->pixelRatio(),
-                          render::Zoom(newSize.w, cel->bounds().w));
+  render::Projection proj(sprite->pixelRatio(),
+                          render::Zoom(newSize.w, celSize.w));
   render.setProjection(proj);
 
-  const doc::Palette* palette = cel->sprite()->palette(cel->frame());
   render.renderCel(
     thumbnailImage.get(),
     cel,
-    cel->sprite(),
-    cel->image(),
-    cel->layer(),
+    sprite,
+    image,
+    layer,
     palette,
-    gfx::Rect(gfx::Point(0, 0), cel->bounds().size()),
+    gfx::Rect(gfx::Point(0, 0), celSize),
     gfx::Clip(gfx::Rect(gfx::Point(0, 0), newSize)),
     255, doc::BlendMode::NORMAL);
 
+  return thumbnailImage;
+}
+
+os::SurfaceRef make_thumbnail_surface(const doc::Image* thumbnailImage,
+                                      const doc::Palette* palette)
+{
   if (os::SurfaceRef thumbnail = os::instance()->makeRgbaSurface(
         thumbnailImage->width(),
         thumbnailImage->height())) {
     convert_image_to_surface(
-      thumbnailImage.get(), palette, thumbnail.get(),
+      thumbnailImage, palette, thumbnail.get(),
       0, 0, 0, 0, thumbnailImage->width(), thumbnailImage->height());
     return thumbnail;
   }
@@ -70,5 +93,324 @@ os::SurfaceRef get_cel_thumbnail(const doc::Cel* cel,
     return nullptr;
 }
 
+} // anonymous namespace
+
+os::SurfaceRef get_cel_thumbnail(const doc::Cel* cel,
+                                 const gfx::Size& fitInSize)
+{
+  const gfx::Size newSize = calc_thumbnail_size(cel, fitInSize);
+  if (newSize.w < 1 ||
+      newSize.h < 1)
+    return nullptr;
+
+  const doc::Palette* palette = cel->sprite()->palette(cel->frame());
+  doc::ImageRef thumbnailImage =
+    render_thumbnail_image(cel, cel->sprite(), cel->image(), cel->layer(),
+                           palette, cel->bounds().size(), newSize);
+
+  return make_thumbnail_surface(thumbnailImage.get(), palette);
+}
+
+//////////////////////////////////////////////////////////////////////
+// CelThumbnailCache
+
+// Data shared with the background task
+struct CelThumbnailCache::State {
+  // Thumbnail to render. The request keeps references to the image
+  // and a copy of the palette, as the cel could be deleted before
+  // the thumbnail is rendered. The document cannot be deleted
+  // because clear() is called before that.
+  struct Request {
+    uint64_t slot;
+    Key key;
+    int generation;
+    Doc* doc;
+    const doc::Sprite* sprite;
+    doc::ImageRef image;
+    std::shared_ptr<doc::Palette> palette;
+  };
+
+  std::mutex mutex;
+  std::condition_variable cv;
+
+  // Incremented by clear() to discard queued requests
+  int generation = 0;
+  bool running = false;         // The render task is running
+  bool lockFailed = false;      // Waiting to retry the queue
+
+  // Latest key requested for each slot, so old requests for the
+  // same slot are skipped (e.g. while the user is drawing in the cel)
+  std::unordered_map<uint64_t, Key> requested;
+  std::deque<Request> queue;
+
+  // Images rendered in the background task, get() converts them to
+  // surfaces.
+  std::unordered_map<uint64_t, std::pair<Key, doc::ImageRef>> ready;
+  bool notifyPending = false;
+
+  // Accessed only from the UI thread
+  std::function<void()> readyCallback;
+  std::function<void()> retryCallback;
+
+  // Starts the render task if it's not running (the mutex must be
+  // locked)
+  void startTask(const std::shared_ptr<State>& self);
+  void renderQueue(const std::shared_ptr<State>& self);
+};
+
+void CelThumbnailCache::State::startTask(const std::shared_ptr<State>& self)
+{
+  if (running || lockFailed || queue.empty())
+    return;
+
+  running = true;
+  doc::worker_pool().execute([self]{ self->renderQueue(self); });
+}
+
+// Renders the queued thumbnails one after another with one weak lock
+// of the document, as a document can be weak locked by one thread
+// only. If the document cannot be locked (e.g. the UI thread needs
+// to modify it, or it's being backed up), the queue is processed
+// again after a while (see CelThumbnailCache::m_retryTimer).
+void CelThumbnailCache::State::renderQueue(const std::shared_ptr<State>& self)
+{
+  bool failed = false;
+  {
+    std::unique_ptr<WeakDocReader> reader;
+    Doc* lockedDoc = nullptr;
+    while (true) {
+      Request req;
+      {
+        const std::lock_guard lock(mutex);
+        if (queue.empty())
+          break;
+
+        req = std::move(queue.front());
+        queue.pop_front();
+        if (req.generation != generation ||
+            requested[req.slot] != req.key)
+          continue;
+      }
+
+      if (!reader || lockedDoc != req.doc) {
+        reader.reset();
+        reader = std::make_unique<WeakDocReader>(req.doc);
+        lockedDoc = req.doc;
+      }
+      if (!reader->isLocked()) {
+        const std::lock_guard lock(mutex);
+        if (req.generation == generation)
+          queue.push_front(std::move(req));
+        lockFailed = failed = true;
+        break;
+      }
+
+      doc::ImageRef thumbnailImage = render_thumbnail_image(
+        nullptr, req.sprite, req.image.get(), nullptr,
+        req.palette.get(), req.key.celSize, req.key.size);
+
+      bool notify = false;
+      {
+        const std::lock_guard lock(mutex);
+        if (req.generation == generation &&
+            requested[req.slot] == req.key) {
+          ready[req.slot] = std::make_pair(req.key, thumbnailImage);
+          if (!notifyPending)
+            notify = notifyPending = true;
+        }
+      }
+
+      if (notify) {
+        ui::execute_from_ui_thread(
+          [self]{
+            {
+              const std::lock_guard lock(self->mutex);
+              self->notifyPending = false;
+            }
+            if (self->readyCallback)
+              self->readyCallback();
+          });
+      }
+    }
+  }
+
+  // The document is not used anymore (the weak lock was released)
+  {
+    const std::lock_guard lock(mutex);
+    running = false;
+  }
+  cv.notify_all();
+
+  if (failed) {
+    ui::execute_from_ui_thread(
+      [self]{
+        if (self->retryCallback)
+          self->retryCallback();
+      });
+  }
+}
+
+CelThumbnailCache::CelThumbnailCache(const std::size_t maxMemory)
+  : m_state(std::make_shared<State>())
+  , m_maxMemory(maxMemory)
+  , m_retryTimer(100)
+{
+  m_state->retryCallback = [this]{ m_retryTimer.start(); };
+  m_retryTimer.Tick.connect([this]{
+    m_retryTimer.stop();
+
+    const std::lock_guard lock(m_state->mutex);
+    m_state->lockFailed = false;
+    m_state->startTask(m_state);
+  });
+}
+
+CelThumbnailCache::~CelThumbnailCache()
+{
+  clear();
+  m_state->readyCallback = nullptr;
+  m_state->retryCallback = nullptr;
+}
+
+void CelThumbnailCache::setReadyCallback(std::function<void()>&& callback)
+{
+  m_state->readyCallback = std::move(callback);
+}
+
+os::SurfaceRef CelThumbnailCache::get(const doc::Cel* cel,
+                                      const gfx::Size& fitInSize)
+{
+  const doc::Image* image = cel->image();
+
+  // Tilemaps depend on the tiles of the tileset which don't have an
+  // easy way to know if they were modified, so we don't cache them.
+  if (image->pixelFormat() == doc::IMAGE_TILEMAP)
+    return get_cel_thumbnail(cel, fitInSize);
+
+  const gfx::Size newSize = calc_thumbnail_size(cel, fitInSize);
+  if (newSize.w < 1 ||
+      newSize.h < 1)
+    return nullptr;
+
+  const doc::Sprite* sprite = cel->sprite();
+  const doc::Palette* palette = sprite->palette(cel->frame());
+
+  Key key;
+  key.imageId = image->id();
+  key.imageVersion = image->version();
+  if (image->pixelFormat() == doc::IMAGE_INDEXED) {
+    key.paletteId = palette->id();
+    key.paletteModifications = palette->getModifications();
+  }
+  key.celSize = cel->bounds().size();
+  key.size = newSize;
+
+  const uint64_t slot = ((uint64_t(cel->id()) << 32) |
+                         (uint64_t(fitInSize.w & 0xffff) << 16) |
+                         (uint64_t(fitInSize.h & 0xffff)));
+
+  auto it = m_slots.find(slot);
+  if (it == m_slots.end()) {
+    m_entries.push_front(Entry());
+    m_entries.front().slot = slot;
+    m_slots[slot] = m_entries.begin();
+  }
+  else if (it->second != m_entries.begin()) {
+    m_entries.splice(m_entries.begin(), m_entries, it->second);
+  }
+  Entry& entry = m_entries.front();
+
+  // Use the thumbnail rendered in the background task
+  {
+    std::pair<Key, doc::ImageRef> result;
+    bool found = false;
+    {
+      const std::lock_guard lock(m_state->mutex);
+      auto r = m_state->ready.find(slot);
+      if (r != m_state->ready.end()) {
+        result = std::move(r->second);
+        m_state->ready.erase(r);
+        found = true;
+      }
+    }
+    if (found) {
+      if (result.first == entry.pendingKey)
+        entry.pending = false;
+      setSurface(entry, result.first,
+                 make_thumbnail_surface(result.second.get(), nullptr));
+    }
+  }
+
+  if (entry.surface && entry.key == key) {
+    shrink();
+    return entry.surface;
+  }
+
+  if (!entry.pending || entry.pendingKey != key) {
+    entry.pending = true;
+    entry.pendingKey = key;
+
+    State::Request req;
+    req.slot = slot;
+    req.key = key;
+    req.doc = static_cast<Doc*>(sprite->document());
+    req.sprite = sprite;
+    req.image = cel->imageRef();
+    if (image->pixelFormat() == doc::IMAGE_INDEXED)
+      req.palette = std::make_shared<doc::Palette>(*palette);
+
+    const std::lock_guard lock(m_state->mutex);
+    req.generation = m_state->generation;
+    m_state->requested[slot] = key;
+    m_state->queue.push_back(std::move(req));
+    m_state->startTask(m_state);
+  }
+
+  // Show the old thumbnail (if any) until the new one is ready
+  os::SurfaceRef surface = entry.surface;
+  shrink();
+  return surface;
+}
+
+void CelThumbnailCache::clear()
+{
+  m_retryTimer.stop();
+  {
+    std::unique_lock lock(m_state->mutex);
+    ++m_state->generation;
+    m_state->lockFailed = false;
+    m_state->requested.clear();
+    m_state->queue.clear();
+    m_state->ready.clear();
+    m_state->cv.wait(lock, [this]{ return !m_state->running; });
+  }
+
+  m_entries.clear();
+  m_slots.clear();
+  m_memory = 0;
+}
+
+void CelThumbnailCache::setSurface(Entry& entry,
+                                   const Key& key,
+                                   os::SurfaceRef&& surface)
+{
+  m_memory -= entry.size;
+  entry.key = key;
+  entry.surface = std::move(surface);
+  entry.size = (entry.surface ? std::size_t(4) * entry.surface->width() * entry.surface->height(): 0);
+  m_memory += entry.size;
+}
+
+// Removes the least recently used thumbnails (except the most recent
+// one) when the cache uses too much memory.
+void CelThumbnailCache::shrink()
+{
+  while (m_memory > m_maxMemory && m_entries.size() > 1) {
+    m_memory -= m_entries.back().size;
+    m_slots.erase(m_entries.back().slot);
+    m_entries.pop_back();
+  }
+}
+
 } // thumb
 } // app
@@ -1,5 +1,5 @@
 // Aseprite
-// Copyright (C) 2019-2020  Igara Studio S.A.
+// Copyright (C) 2019-2023  Igara Studio S.A.
 // Copyright (C) 2016  Carlo Caputo
 //
 // This program is distributed under the terms of
@@ -9,8 +9,17 @@
 #define APP_THUMBNAILS_H_INCLUDED
 #pragma once
 
+#include "doc/object_id.h"
+#include "doc/object_version.h"
 #include "gfx/size.h"
 #include "os/surface.h"
+#include "ui/timer.h"
+
+#include <cstddef>
+#include <functional>
+#include <list>
+#include <memory>
+#include <unordered_map>
 
 namespace doc {
   class Cel;
@@ -26,6 +35,76 @@ namespace thumb {
   os::SurfaceRef get_cel_thumbnail(const doc::Cel* cel,
                                    const gfx::Size& fitInSize);
 
+  // Cache of cel thumbnails (used by the Timeline). New thumbnails
+  // are rendered in a background task (one at a time), and get()
+  // returns the previous thumbnail of the cel (or nullptr) until the
+  // new one is ready.
+  class CelThumbnailCache {
+  public:
+    explicit CelThumbnailCache(const std::size_t maxMemory = 32*1024*1024);
+    ~CelThumbnailCache();
+
+    // Function called from the UI thread when new thumbnails are
+    // ready (e.g. to invalidate the widget that shows them).
+    void setReadyCallback(std::function<void()>&& callback);
+
+    // Returns the thumbnail of the cel to fit in the given size. It
+    // must be called from the UI thread.
+    os::SurfaceRef get(const doc::Cel* cel, const gfx::Size& fitInSize);
+
+    // Removes all thumbnails and waits the background tasks. It must
+    // be called before deleting the document of the cached cels.
+    void clear();
+
+    std::size_t memory() const { return m_memory; }
+
+  private:
+    // Everything that changes the thumbnail of a cel
+    struct Key {
+      doc::ObjectId imageId = 0;
+      doc::ObjectVersion imageVersion = 0;
+      doc::ObjectId paletteId = 0;
+      int paletteModifications = 0;
+      gfx::Size celSize;
+      gfx::Size size;           // Size of the thumbnail
+
+      bool operator==(const Key& o) const {
+        return (imageId == o.imageId &&
+                imageVersion == o.imageVersion &&
+                paletteId == o.paletteId &&
+                paletteModifications == o.paletteModifications &&
+                celSize == o.celSize &&
+                size == o.size);
+      }
+      bool operator!=(const Key& o) const { return !operator==(o); }
+    };
+
+    // Thumbnail of a cel for a specific fitInSize
+    struct Entry {
+      uint64_t slot;
+      Key key;                  // Key of the current surface
+      os::SurfaceRef surface;
+      std::size_t size = 0;     // Bytes used by the surface
+      Key pendingKey;           // Key of the thumbnail being rendered
+      bool pending = false;
+    };
+
+    struct State;
+
+    void setSurface(Entry& entry, const Key& key, os::SurfaceRef&& surface);
+    void shrink();
+
+    std::shared_ptr<State> m_state;
+    std::list<Entry> m_entries; // Most recently used entries first
+    std::unordered_map<uint64_t, std::list<Entry>::iterator> m_slots;
+    std::size_t m_maxMemory;
+    std::size_t m_memory = 0;
+
+    // Restarts the background task when the document couldn't be
+    // locked
+    ui::Timer m_retryTimer;
+  };
+
 } // thumb
 } // app
 
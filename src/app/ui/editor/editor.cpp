@@ -53,6 +53,7 @@
 #include "app/ui/timeline/timeline.h"
 #include "app/ui/toolbar.h"
 #include "app/ui_context.h"
+#include "app/util/conversion_to_surface.h"
 #include "app/util/layer_utils.h"
 #include "app/util/tile_flags_utils.h"
 #include "base/chrono.h"
@@ -677,8 +678,10 @@ void Editor::drawOneSpriteUnclippedRect(ui::Graphics* g, const gfx::Rect& sprite
     m_renderEngine->setupBackground(m_document, IMAGE_RGB);
     m_renderEngine->disableOnionskin();
 
+    bool onionskin = false;
     if ((m_flags & kShowOnionskin) == kShowOnionskin) {
       if (m_docPref.onionskin.active()) {
+        onionskin = true;
         OnionskinOptions opts(
           (m_docPref.onionskin.type() == app::gen::OnionskinType::MERGE ?
            render::OnionskinType::MERGE:
@@ -737,10 +740,30 @@ void Editor::drawOneSpriteUnclippedRect(ui::Graphics* g, const gfx::Rect& sprite
         maxw, maxh, m_document->osColorSpace());
     }
 
-    m_renderEngine->setProjection(
-      newEngine ? render::Projection(): m_proj);
-    m_renderEngine->renderSprite(
-      rendered.get(), m_sprite, m_frame, gfx::Clip(0, 0, rc2));
+    // Use the frame already rendered by the current state (e.g. the
+    // frames prerendered while the animation is playing), it's
+    // rendered with the sprite size as the new render engine does.
+    doc::ImageRef renderedFrame;
+    if (newEngine &&
+        !onionskin &&
+        !renderProperties.renderBgOnScreen &&
+        (!extraCel || extraCel->type() == render::ExtraType::NONE)) {
+      renderedFrame = m_state->getRenderedFrame(this, m_frame);
+      if (renderedFrame && renderedFrame->size() != m_sprite->size())
+        renderedFrame.reset();
+    }
+
+    if (renderedFrame) {
+      convert_image_to_surface(
+        renderedFrame.get(), m_sprite->palette(m_frame), rendered.get(),
+        rc2.x, rc2.y, 0, 0, rc2.w, rc2.h);
+    }
+    else {
+      m_renderEngine->setProjection(
+        newEngine ? render::Projection(): m_proj);
+      m_renderEngine->renderSprite(
+        rendered.get(), m_sprite, m_frame, gfx::Clip(0, 0, rc2));
+    }
 
     m_renderEngine->removeExtraImage();
 
@@ -117,6 +117,7 @@ namespace app {
 
     bool isActive() const { return (m_activeEditor == this); }
     bool isUsingNewRenderEngine() const;
+    int otherLayersOpacity() const;
 
     DocView* getDocView() { return m_docView; }
     void setDocView(DocView* docView) { m_docView = docView; }
@@ -402,8 +403,6 @@ namespace app {
     void invalidateIfActive();
     void updateAutoCelGuides(ui::Message* msg);
 
-    int otherLayersOpacity() const;
-
     // Stack of states. The top element in the stack is the current state (m_state).
     EditorStatesHistory m_statesHistory;
     EditorStatesHistory m_deletedStates;
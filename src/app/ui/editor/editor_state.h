@@ -10,6 +10,8 @@
 #pragma once
 
 #include "base/disable_copying.h"
+#include "doc/frame.h"
+#include "doc/image_ref.h"
 #include "gfx/fwd.h"
 #include "gfx/point.h"
 
@@ -151,6 +153,12 @@ namespace app {
                                                doc::Layer* layer,
                                                bool newState) { }
 
+    // Returns the given frame already rendered by this state (e.g. the
+    // frames prerendered by PlayState), or nullptr if the Editor has
+    // to render it. It must be an RGB image with the sprite size
+    // (including the background).
+    virtual doc::ImageRef getRenderedFrame(Editor* editor, doc::frame_t frame) { return nullptr; }
+
   private:
     DISABLE_COPYING(EditorState);
   };
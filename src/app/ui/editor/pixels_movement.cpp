@@ -33,6 +33,7 @@
 #include "app/util/new_image_from_mask.h"
 #include "app/util/range_utils.h"
 #include "base/pi.h"
+#include "base/thread_pool.h"
 #include "doc/algorithm/flip_image.h"
 #include "doc/algorithm/rotate.h"
 #include "doc/algorithm/rotsprite.h"
@@ -45,8 +46,11 @@
 #include "doc/sprite.h"
 #include "gfx/region.h"
 #include "render/render.h"
+#include "ui/system.h"
 
 #include <algorithm>
+#include <array>
+#include <atomic>
 
 #if _DEBUG
 #define DUMP_INNER_CMDS() dumpInnerCmds()
@@ -56,6 +60,28 @@
 
 namespace app {
 
+namespace {
+
+// Only the last transformation is refined, so one thread is enough
+base::thread_pool& refinement_thread_pool()
+{
+  static base::thread_pool pool(1);
+  return pool;
+}
+
+} // anonymous namespace
+
+// Data shared with the background task that renders the
+// full-quality transformed image
+struct PixelsMovement::Refinement {
+  // Incremented each time the extra cel is redrawn to discard the
+  // image that is being rendered
+  std::atomic<int> generation{0};
+
+  // Accessed only from the UI thread
+  PixelsMovement* owner = nullptr;
+};
+
 PixelsMovement::InnerCmd::InnerCmd(InnerCmd&& c)
   : type(None)
 {
@@ -130,7 +156,10 @@ PixelsMovement::PixelsMovement(
   , m_canHandleFrameChange(false)
   , m_fastMode(false)
   , m_needsRotSpriteRedraw(false)
+  , m_refinement(std::make_shared<Refinement>())
 {
+  m_refinement->owner = this;
+
   double cornerThick = (m_site.tilemapMode() == TilemapMode::Tiles) ?
                           CORNER_THICK_FOR_TILEMAP_MODE :
                           CORNER_THICK_FOR_PIXELS_MODE;
@@ -172,6 +201,12 @@ PixelsMovement::PixelsMovement(
   }
 }
 
+PixelsMovement::~PixelsMovement()
+{
+  cancelRefinement();
+  m_refinement->owner = nullptr;
+}
+
 bool PixelsMovement::editMultipleCels() const
 {
   return
@@ -187,10 +222,13 @@ void PixelsMovement::setDelegate(PixelsMovementDelegate* delegate)
 
 void PixelsMovement::setFastMode(const bool fastMode)
 {
+  // The last preview is replaced by the full-quality image when the
+  // background task finishes (see onRefinementReady()), but if the
+  // task failed we have to use RotSprite from this thread.
   bool redraw = (m_fastMode && !fastMode);
   m_fastMode = fastMode;
   if (m_needsRotSpriteRedraw && redraw) {
-    redrawExtraImage();
+    redrawExtraImage(nullptr, false);
     update_screen_for_document(m_document);
     m_needsRotSpriteRedraw = false;
   }
@@ -792,7 +830,7 @@ void PixelsMovement::stampImage(bool finalStamp)
       currentCel->layer()->isImage() &&
       !currentCel->layer()->canEditPixels()) {
     Transformation initialCelPos(gfx::Rect(m_initialMask0->bounds()), m_currentData.cornerThick());
-    redrawExtraImage(&initialCelPos);
+    redrawExtraImage(&initialCelPos, false);
     stampExtraCelImage();
   }
 
@@ -807,7 +845,7 @@ void PixelsMovement::stampImage(bool finalStamp)
       reproduceAllTransformationsWithInnerCmds();
     }
 
-    redrawExtraImage();
+    redrawExtraImage(nullptr, false);
     stampExtraCelImage();
   }
 
@@ -980,8 +1018,11 @@ void PixelsMovement::setMaskColor(bool opaque, color_t mask_color)
   update_screen_for_document(m_document);
 }
 
-void PixelsMovement::redrawExtraImage(Transformation* transformation)
+void PixelsMovement::redrawExtraImage(Transformation* transformation,
+                                      const bool preview)
 {
+  cancelRefinement();
+
   if (!transformation)
     transformation = &m_currentData;
 
@@ -1027,7 +1068,8 @@ void PixelsMovement::redrawExtraImage(Transformation* transformation)
     // Draw the transformed pixels in the extra-cel which is the chunk
     // of pixels that the user is moving.
     drawImage(*transformation, m_extraCel->image(),
-              gfx::PointF(bounds.origin()), true);
+              gfx::PointF(bounds.origin()), true,
+              preview && transformation == &m_currentData);
   }
 }
 
@@ -1036,10 +1078,126 @@ void PixelsMovement::redrawCurrentMask()
   drawMask(m_currentMask.get(), true);
 }
 
+// Renders the given transformation of "src" over a copy of "base"
+// (the extra cel image with the original layer) with RotSprite in a
+// background thread. The result replaces the extra cel image if the
+// extra cel wasn't redrawn in the meantime.
+void PixelsMovement::startRefinement(
+  const doc::Image* base, const doc::Image* src, const doc::Mask* mask,
+  const Transformation::Corners& corners,
+  const gfx::PointF& leftTop)
+{
+  ASSERT(src == m_originalImage.get());
+
+  m_needsRotSpriteRedraw = false;
+  const int generation = ++m_refinement->generation;
+  const doc::ImageRef image(Image::createCopy(base));
+  const doc::ImageRef srcRef = m_originalImage;
+  const doc::ImageRef maskCopy(mask ? Image::createCopy(mask->bitmap()): nullptr);
+  const std::array<int, 8> pts = {
+    int(corners.leftTop().x-leftTop.x),
+    int(corners.leftTop().y-leftTop.y),
+    int(corners.rightTop().x-leftTop.x),
+    int(corners.rightTop().y-leftTop.y),
+    int(corners.rightBottom().x-leftTop.x),
+    int(corners.rightBottom().y-leftTop.y),
+    int(corners.leftBottom().x-leftTop.x),
+    int(corners.leftBottom().y-leftTop.y) };
+
+  std::shared_ptr<Refinement> refinement = m_refinement;
+  refinement_thread_pool().execute(
+    [refinement, generation, image, srcRef, maskCopy, pts]{
+      // Skip old transformations (e.g. the user is still dragging)
+      auto isCanceled = [&refinement, generation]{
+        return (refinement->generation != generation);
+      };
+      if (isCanceled())
+        return;
+
+      try {
+        doc::algorithm::rotsprite_image(
+          image.get(), srcRef.get(), maskCopy.get(),
+          pts[0], pts[1], pts[2], pts[3],
+          pts[4], pts[5], pts[6], pts[7],
+          isCanceled);
+      }
+      catch (const std::bad_alloc&) {
+        // Keep the preview until the transformation is finished
+        ui::execute_from_ui_thread(
+          [refinement, generation]{
+            if (refinement->owner &&
+                refinement->generation == generation)
+              refinement->owner->onRefinementFailed();
+          });
+        return;
+      }
+
+      if (isCanceled())
+        return;
+
+      ui::execute_from_ui_thread(
+        [refinement, generation, image]{
+          if (refinement->owner &&
+              refinement->generation == generation)
+            refinement->owner->onRefinementReady(image);
+        });
+    });
+}
+
+void PixelsMovement::cancelRefinement()
+{
+  ++m_refinement->generation;
+}
+
+// Called when there is not enough memory to render the image in the
+// background, it's rendered with RotSprite when the fast mode ends
+// (or now if it already ended).
+void PixelsMovement::onRefinementFailed()
+{
+  m_needsRotSpriteRedraw = true;
+  if (m_fastMode)
+    return;
+
+  try {
+    ContextWriter writer(m_reader, 1000);
+    redrawExtraImage(nullptr, false);
+    update_screen_for_document(m_document);
+    m_needsRotSpriteRedraw = false;
+  }
+  catch (const LockedDocException&) {
+    // The document is locked by other thread, so we keep the preview
+  }
+}
+
+void PixelsMovement::onRefinementReady(const doc::ImageRef& image)
+{
+  Image* dst = (m_extraCel ? m_extraCel->image(): nullptr);
+  if (!dst ||
+      dst->pixelFormat() != image->pixelFormat() ||
+      dst->bounds() != image->bounds())
+    return;
+
+  try {
+    ContextWriter writer(m_reader, 1000);
+    dst->copy(image.get(), gfx::Clip(image->bounds()));
+
+    m_document->notifySpritePixelsModified(
+      m_site.sprite(),
+      gfx::Region(m_currentData.transformedBounds()),
+      m_site.frame());
+  }
+  catch (const LockedDocException&) {
+    // The document is locked by other thread, so we keep the preview
+    // (and try to use RotSprite again when the fast mode ends)
+    m_needsRotSpriteRedraw = true;
+  }
+}
+
 void PixelsMovement::drawImage(
   const Transformation& transformation,
   doc::Image* dst, const gfx::PointF& pt,
-  const bool renderOriginalLayer)
+  const bool renderOriginalLayer,
+  const bool preview)
 {
   ASSERT(dst);
 
@@ -1086,12 +1244,15 @@ void PixelsMovement::drawImage(
       else
         maskColor = 0;
     }
-    m_originalImage->setMaskColor(maskColor);
+    if (m_originalImage->maskColor() != maskColor) {
+      detachOriginalImage();
+      m_originalImage->setMaskColor(maskColor);
+    }
 
     drawParallelogram(
       transformation,
       dst, m_originalImage.get(),
-      m_initialMask.get(), corners, pt);
+      m_initialMask.get(), corners, pt, preview);
   }
 }
 
@@ -1123,7 +1284,8 @@ void PixelsMovement::drawParallelogram(
   const Transformation& transformation,
   doc::Image* dst, const doc::Image* src, const doc::Mask* mask,
   const Transformation::Corners& corners,
-  const gfx::PointF& leftTop)
+  const gfx::PointF& leftTop,
+  const bool preview)
 {
   tools::RotationAlgorithm rotAlgo = Preferences::instance().selection.rotationAlgorithm();
 
@@ -1138,9 +1300,14 @@ void PixelsMovement::drawParallelogram(
     rotAlgo = tools::RotationAlgorithm::FAST;
   }
 
-  // Don't use RotSprite if we are in "fast mode"
-  if (rotAlgo == tools::RotationAlgorithm::ROTSPRITE && m_fastMode) {
-    m_needsRotSpriteRedraw = true;
+  // Don't use RotSprite to preview the transformation in the extra
+  // cel, it shows the fast algorithm result until the RotSprite
+  // version is rendered in background ("dst" contains the original
+  // layer yet).
+  if (rotAlgo == tools::RotationAlgorithm::ROTSPRITE && preview) {
+    ASSERT(m_extraCel && dst == m_extraCel->image());
+    ASSERT(&transformation == &m_currentData);
+    startRefinement(dst, src, mask, corners, leftTop);
     rotAlgo = tools::RotationAlgorithm::FAST;
   }
 
@@ -1272,8 +1439,18 @@ void PixelsMovement::hideDocumentMask()
   update_screen_for_document(m_document);
 }
 
+// The original image can be used by the background refinement task,
+// so we have to copy it before modifying it.
+void PixelsMovement::detachOriginalImage()
+{
+  if (m_originalImage.use_count() > 1)
+    m_originalImage.reset(Image::createCopy(m_originalImage.get()));
+}
+
 void PixelsMovement::flipOriginalImage(const doc::algorithm::FlipType flipType)
 {
+  detachOriginalImage();
+
   // Flip the image.
   doc::algorithm::flip_image(
     m_originalImage.get(),
@@ -1292,6 +1469,7 @@ void PixelsMovement::flipOriginalImage(const doc::algorithm::FlipType flipType)
 void PixelsMovement::shiftOriginalImage(const int dx, const int dy,
                                         const double angle)
 {
+  detachOriginalImage();
   doc::algorithm::shift_image(
     m_originalImage.get(), dx, dy, angle);
 }
@@ -1430,7 +1608,7 @@ void PixelsMovement::reproduceAllTransformationsWithInnerCmds()
                            c.data.shift.angle);
         break;
       case InnerCmd::Stamp:
-        redrawExtraImage(c.data.stamp.transformation);
+        redrawExtraImage(c.data.stamp.transformation, false);
         stampExtraCelImage();
         break;
     }
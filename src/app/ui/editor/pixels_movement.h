@@ -74,6 +74,7 @@ namespace app {
                    const Image* moveThis,
                    const Mask* mask,
                    const char* operationName);
+    ~PixelsMovement();
 
     const Site& site() { return m_site; }
 
@@ -138,24 +139,39 @@ namespace app {
     void stampExtraCelImage();
     void onPivotChange();
     void onRotationAlgorithmChange();
-    void redrawExtraImage(Transformation* transformation = nullptr);
+    // Redraws the extra cel with the given transformation (or the
+    // current one). If "preview" is true, RotSprite is rendered in
+    // background and the extra cel shows the fast algorithm result in
+    // the meantime. It must be false to stamp the extra cel image.
+    void redrawExtraImage(Transformation* transformation = nullptr,
+                          const bool preview = true);
     void redrawCurrentMask();
+    void startRefinement(
+      const doc::Image* base, const doc::Image* src, const doc::Mask* mask,
+      const Transformation::Corners& corners,
+      const gfx::PointF& leftTop);
+    void cancelRefinement();
+    void onRefinementFailed();
+    void onRefinementReady(const doc::ImageRef& image);
     void drawImage(
       const Transformation& transformation,
       doc::Image* dst, const gfx::PointF& pt,
-      const bool renderOriginalLayer);
+      const bool renderOriginalLayer,
+      const bool preview = false);
     void drawMask(doc::Mask* dst, bool shrink);
     void drawParallelogram(
       const Transformation& transformation,
       doc::Image* dst, const doc::Image* src, const doc::Mask* mask,
       const Transformation::Corners& corners,
-      const gfx::PointF& leftTop);
+      const gfx::PointF& leftTop,
+      const bool preview = false);
     void drawTransformedTilemap(
       const Transformation& transformation,
       doc::Image* dst, const doc::Image* src, const doc::Mask* mask);
     void updateDocumentMask();
     void hideDocumentMask();
 
+    void detachOriginalImage();
     void flipOriginalImage(const doc::algorithm::FlipType flipType);
     void shiftOriginalImage(const int dx, const int dy,
                             const double angle);
@@ -187,10 +203,18 @@ namespace app {
     ExtraCelRef m_extraCel;
     bool m_canHandleFrameChange;
 
-    // Fast mode is used to give a faster feedback to the user
-    // avoiding RotSprite on each mouse movement.
+    // Fast mode is used while the user drags the transformation
+    // handles. The extra cel always shows a nearest-neighbor preview
+    // until the RotSprite version is rendered in a background thread,
+    // but in fast mode we don't fall back to RotSprite in this thread
+    // if the background task fails.
     bool m_fastMode;
+    // True if the RotSprite image couldn't be rendered in background
+    // (e.g. not enough memory), so it's rendered in this thread when
+    // the fast mode ends.
     bool m_needsRotSpriteRedraw;
+    struct Refinement;
+    std::shared_ptr<Refinement> m_refinement;
 
     // Commands used in the interaction with the transformed pixels.
     // This is used to re-create the whole interaction on each
@@ -18,6 +18,7 @@
 #include "app/tools/ink.h"
 #include "app/ui/editor/editor.h"
 #include "app/ui/editor/editor_customization_delegate.h"
+#include "app/ui/editor/editor_render.h"
 #include "app/ui/editor/scrolling_state.h"
 #include "app/ui/skin/skin_theme.h"
 #include "app/ui_context.h"
@@ -117,6 +118,9 @@ void PlayState::onEnterState(Editor* editor)
     m_nextFrameTime = getNextFrameTime();
     m_curFrameTick = base::current_tick();
     m_playTimer.start();
+
+    m_cache = std::make_unique<PlaybackCache>(m_editor->document());
+    prerenderFrames();
   }
 }
 
@@ -126,6 +130,7 @@ EditorState::LeaveAction PlayState::onLeaveState(Editor* editor, EditorState* ne
   // (we keep playing the animation).
   if (!m_toScroll) {
     m_playTimer.stop();
+    m_cache.reset();
 
     if (m_playOnce || Preferences::instance().general.rewindOnStop())
       m_editor->setFrame(m_refFrame);
@@ -136,6 +141,7 @@ EditorState::LeaveAction PlayState::onLeaveState(Editor* editor, EditorState* ne
 void PlayState::onBeforePopState(Editor* editor)
 {
   m_ctxConn.disconnect();
+  m_cache.reset();
   StateWithWheelBehavior::onBeforePopState(editor);
 }
 
@@ -212,6 +218,14 @@ void PlayState::onRemoveTag(Editor* editor, doc::Tag* tag)
   m_playback.removeReferencesToTag(tag);
 }
 
+doc::ImageRef PlayState::getRenderedFrame(Editor* editor, doc::frame_t frame)
+{
+  if (m_cache && editor == m_editor)
+    return m_cache->frame(frame);
+  else
+    return nullptr;
+}
+
 void PlayState::onPlaybackTick()
 {
   ASSERT(m_playTimer.isRunning());
@@ -236,6 +250,26 @@ void PlayState::onPlaybackTick()
   }
 
   m_curFrameTick = base::current_tick();
+
+  prerenderFrames();
+}
+
+// Starts rendering the next frames of the playback in background
+// threads.
+void PlayState::prerenderFrames()
+{
+  // Frames are rendered with the sprite size, only the new render
+  // engine can use them (the old one renders the zoomed sprite).
+  if (!m_cache ||
+      !m_editor->isUsingNewRenderEngine())
+    return;
+
+  PlaybackCache::Options options;
+  options.bg = EditorRender::getBgOptions(m_editor->document(), doc::IMAGE_RGB);
+  options.newBlend = Preferences::instance().experimental.newBlend();
+  options.nonactiveLayersOpacity = m_editor->otherLayersOpacity();
+  options.selectedLayer = m_editor->layer();
+  m_cache->prerender(m_playback, options);
 }
 
 // Before executing any command, we stop the animation
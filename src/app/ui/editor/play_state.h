@@ -1,5 +1,5 @@
 // Aseprite
-// Copyright (C) 2020-2022  Igara Studio S.A.
+// Copyright (C) 2020-2023  Igara Studio S.A.
 // Copyright (C) 2001-2017  David Capello
 //
 // This program is distributed under the terms of
@@ -9,6 +9,7 @@
 #define APP_UI_EDITOR_PLAY_STATE_H_INCLUDED
 #pragma once
 
+#include "app/ui/editor/playback_cache.h"
 #include "app/ui/editor/state_with_wheel_behavior.h"
 #include "base/time.h"
 #include "doc/frame.h"
@@ -16,6 +17,8 @@
 #include "obs/connection.h"
 #include "ui/timer.h"
 
+#include <memory>
+
 namespace doc {
   class Tag;
 }
@@ -42,9 +45,11 @@ namespace app {
     bool onKeyUp(Editor* editor, ui::KeyMessage* msg) override;
     bool onSetCursor(Editor* editor, const gfx::Point& mouseScreenPos) override;
     void onRemoveTag(Editor* editor, doc::Tag* tag) override;
+    doc::ImageRef getRenderedFrame(Editor* editor, doc::frame_t frame) override;
 
   private:
     void onPlaybackTick();
+    void prerenderFrames();
 
     // ContextObserver
     void onBeforeCommandExecution(CommandExecutionEvent& ev);
@@ -68,6 +73,9 @@ namespace app {
     doc::Tag* m_tag;
 
     obs::scoped_connection m_ctxConn;
+
+    // Next frames rendered in background
+    std::unique_ptr<PlaybackCache> m_cache;
   };
 
 } // namespace app
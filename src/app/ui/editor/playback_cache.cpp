@@ -0,0 +1,283 @@
+// Aseprite
+// Copyright (C) 2023  Igara Studio S.A.
+//
+// This program is distributed under the terms of
+// the End-User License Agreement for Aseprite.
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "app/ui/editor/playback_cache.h"
+
+#include "app/doc.h"
+#include "app/doc_access.h"
+#include "base/thread_pool.h"
+#include "doc/image.h"
+#include "doc/playback.h"
+#include "doc/sprite.h"
+#include "doc/worker_pool.h"
+#include "render/render.h"
+
+#include <algorithm>
+#include <condition_variable>
+#include <mutex>
+#include <set>
+#include <vector>
+
+namespace app {
+
+using namespace doc;
+
+namespace {
+
+// Maximum number of frames to render ahead of the current one
+const int kMaxFramesAhead = 32;
+
+// Pixels rendered between checks to cancel the rendering of a frame
+const int kPixelsPerStrip = 256*1024;
+
+} // anonymous namespace
+
+bool PlaybackCache::Options::operator==(const Options& o) const
+{
+  return (bg.type == o.bg.type &&
+          bg.zoom == o.bg.zoom &&
+          bg.colorPixelFormat == o.bg.colorPixelFormat &&
+          bg.color1 == o.bg.color1 &&
+          bg.color2 == o.bg.color2 &&
+          bg.stripeSize == o.bg.stripeSize &&
+          newBlend == o.newBlend &&
+          nonactiveLayersOpacity == o.nonactiveLayersOpacity &&
+          selectedLayer == o.selectedLayer);
+}
+
+// Data shared with the render task
+struct PlaybackCache::State {
+  std::mutex mutex;
+  std::condition_variable cv;
+
+  // Incremented by invalidate() to discard the frame that is being
+  // rendered
+  int generation = 0;
+  bool running = false;         // The render task is running
+  bool canceled = false;        // The cache is being destroyed
+  frame_t rendering = -1;       // Frame being rendered
+  Options options;
+
+  std::map<frame_t, ImageRef> frames; // Rendered frames
+  std::vector<frame_t> queue;         // Frames to render (in order)
+  std::set<frame_t> wanted;           // Frames to be played soon
+
+  void renderFrames(Doc* doc);
+  ImageRef renderFrame(const WeakDocReader& reader,
+                       const Sprite* sprite,
+                       const frame_t frame,
+                       const int generation,
+                       const Options& options);
+  bool isCanceled(const WeakDocReader& reader,
+                  const int generation);
+};
+
+// Renders the queued frames one after another. Only one task per
+// cache is running at the same time, as a document can be weak
+// locked by one thread only (e.g. a backup of the document cannot
+// be done while we are rendering). The task finishes when the UI
+// thread needs to lock the document or when the queue is empty, and
+// prerender() starts it again.
+void PlaybackCache::State::renderFrames(Doc* doc)
+{
+  {
+    WeakDocReader reader(doc);
+    while (reader.isLocked()) {
+      frame_t frame;
+      int gen;
+      Options opts;
+      {
+        const std::lock_guard lock(mutex);
+        if (canceled || queue.empty())
+          break;
+
+        frame = queue.front();
+        queue.erase(queue.begin());
+        if (frames.find(frame) != frames.end())
+          continue;
+
+        rendering = frame;
+        gen = generation;
+        opts = options;
+      }
+
+      ImageRef image = renderFrame(reader, doc->sprite(), frame, gen, opts);
+
+      const std::lock_guard lock(mutex);
+      rendering = -1;
+      if (image &&
+          generation == gen &&
+          wanted.find(frame) != wanted.end()) {
+        frames[frame] = image;
+      }
+    }
+  }
+
+  // The document is not used anymore (the weak lock was released)
+  {
+    const std::lock_guard lock(mutex);
+    running = false;
+  }
+  cv.notify_all();
+}
+
+// Renders the frame in strips of rows to stop as soon as possible
+// if the rendering is canceled. Returns nullptr if it was canceled.
+ImageRef PlaybackCache::State::renderFrame(const WeakDocReader& reader,
+                                           const Sprite* sprite,
+                                           const frame_t frame,
+                                           const int generation,
+                                           const Options& options)
+{
+  const int w = sprite->width();
+  const int h = sprite->height();
+  const int rowsPerStrip = std::max(1, kPixelsPerStrip / std::max(1, w));
+  ImageRef image(Image::create(IMAGE_RGB, w, h));
+
+  render::Render render;
+  render.setNewBlend(options.newBlend);
+  render.setBgOptions(options.bg);
+  render.setRefLayersVisiblity(true);
+  render.setSelectedLayer(options.selectedLayer);
+  render.setNonactiveLayersOpacity(options.nonactiveLayersOpacity);
+
+  for (int y=0; y<h; y+=rowsPerStrip) {
+    if (isCanceled(reader, generation))
+      return nullptr;
+
+    const gfx::Rect strip(0, y, w, std::min(rowsPerStrip, h-y));
+    render.renderSprite(image.get(), sprite, frame,
+                        gfx::ClipF(gfx::RectF(strip)));
+  }
+
+  // The document could be modified after the last strip
+  if (isCanceled(reader, generation))
+    return nullptr;
+  return image;
+}
+
+bool PlaybackCache::State::isCanceled(const WeakDocReader& reader,
+                                      const int gen)
+{
+  // The UI thread needs to modify the document
+  if (!reader.isLocked())
+    return true;
+
+  const std::lock_guard lock(mutex);
+  return (canceled || generation != gen);
+}
+
+PlaybackCache::PlaybackCache(Doc* doc,
+                             const std::size_t maxMemory)
+  : m_doc(doc)
+  , m_state(std::make_shared<State>())
+  , m_maxMemory(maxMemory)
+{
+  m_doc->add_observer(this);
+}
+
+PlaybackCache::~PlaybackCache()
+{
+  m_doc->remove_observer(this);
+
+  // Wait the render task as it uses the document (it's canceled
+  // between strips, so we don't wait the whole frame)
+  std::unique_lock lock(m_state->mutex);
+  m_state->canceled = true;
+  ++m_state->generation;
+  m_state->frames.clear();
+  m_state->queue.clear();
+  m_state->wanted.clear();
+  m_state->cv.wait(lock, [this]{ return !m_state->running; });
+}
+
+void PlaybackCache::prerender(const doc::Playback& playback,
+                              const Options& options)
+{
+  if (m_options != options) {
+    m_options = options;
+    invalidate();
+  }
+
+  const Sprite* sprite = m_doc->sprite();
+  const std::size_t frameSize =
+    std::size_t(4) * sprite->width() * sprite->height();
+  const int maxFrames =
+    int(std::min<std::size_t>(kMaxFramesAhead,
+                              m_maxMemory / std::max<std::size_t>(1, frameSize)));
+  if (maxFrames < 1)
+    return;
+
+  // Frames that will be played next (in order)
+  std::vector<frame_t> next;
+  std::set<frame_t> wanted;
+  wanted.insert(playback.frame());
+  {
+    doc::Playback copy(playback);
+    for (int i=0; i<kMaxFramesAhead && int(wanted.size()) < maxFrames; ++i) {
+      const frame_t frame = copy.nextFrame();
+      if (copy.isStopped() || frame < 0 || frame > sprite->lastFrame())
+        break;
+      if (wanted.insert(frame).second)
+        next.push_back(frame);
+    }
+  }
+
+  {
+    const std::lock_guard lock(m_state->mutex);
+    m_state->wanted = wanted;
+    m_state->options = options;
+
+    // Discard frames that will not be played soon
+    for (auto it=m_state->frames.begin(); it!=m_state->frames.end(); ) {
+      if (wanted.find(it->first) == wanted.end())
+        it = m_state->frames.erase(it);
+      else
+        ++it;
+    }
+
+    m_state->queue.clear();
+    for (const frame_t frame : next) {
+      if (frame != m_state->rendering &&
+          m_state->frames.find(frame) == m_state->frames.end())
+        m_state->queue.push_back(frame);
+    }
+
+    if (m_state->running || m_state->queue.empty())
+      return;
+    m_state->running = true;
+  }
+
+  Doc* doc = m_doc;
+  std::shared_ptr<State> state = m_state;
+  doc::worker_pool().execute(
+    [state, doc]{
+      state->renderFrames(doc);
+    });
+}
+
+ImageRef PlaybackCache::frame(const frame_t frame) const
+{
+  const std::lock_guard lock(m_state->mutex);
+  auto it = m_state->frames.find(frame);
+  if (it != m_state->frames.end())
+    return it->second;
+  return nullptr;
+}
+
+void PlaybackCache::invalidate()
+{
+  const std::lock_guard lock(m_state->mutex);
+  ++m_state->generation;
+  m_state->frames.clear();
+  m_state->queue.clear();
+}
+
+} // namespace app
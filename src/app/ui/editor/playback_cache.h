@@ -0,0 +1,107 @@
+// Aseprite
+// Copyright (C) 2023  Igara Studio S.A.
+//
+// This program is distributed under the terms of
+// the End-User License Agreement for Aseprite.
+
+#ifndef APP_UI_EDITOR_PLAYBACK_CACHE_H_INCLUDED
+#define APP_UI_EDITOR_PLAYBACK_CACHE_H_INCLUDED
+#pragma once
+
+#include "app/doc_observer.h"
+#include "doc/frame.h"
+#include "doc/image_ref.h"
+#include "render/bg_options.h"
+
+#include <cstddef>
+#include <map>
+#include <memory>
+
+namespace doc {
+  class Layer;
+  class Playback;
+}
+
+namespace app {
+  class Doc;
+
+  // Renders the next frames of an animation playback in a background
+  // task, so the Editor can show each frame in PlayState ticks
+  // without rendering the whole sprite. Frames are rendered with the
+  // sprite size (as the new render engine does) so they can be used
+  // with any zoom level.
+  class PlaybackCache : public DocObserver {
+  public:
+    // Options used by the Editor to render the sprite
+    struct Options {
+      render::BgOptions bg;
+      bool newBlend = false;
+      int nonactiveLayersOpacity = 255;
+      const doc::Layer* selectedLayer = nullptr;
+
+      bool operator==(const Options& o) const;
+      bool operator!=(const Options& o) const { return !operator==(o); }
+    };
+
+    explicit PlaybackCache(Doc* doc,
+                           const std::size_t maxMemory = 128*1024*1024);
+    ~PlaybackCache();
+
+    // Starts rendering the frames that follow the current frame of
+    // the given playback (in the same order that they will be played,
+    // e.g. including ping-pong loops and tag repeats). Frames that
+    // will not be played soon are discarded.
+    void prerender(const doc::Playback& playback,
+                   const Options& options);
+
+    // Returns the rendered frame (an RGB image with the sprite size,
+    // including the background) or nullptr if it's not ready yet.
+    doc::ImageRef frame(const doc::frame_t frame) const;
+
+    // Discards all rendered frames.
+    void invalidate();
+
+  private:
+    // DocObserver impl, any change in the document that could modify
+    // the rendered frames invalidates the cache.
+    void onGeneralUpdate(DocEvent& ev) override { invalidate(); }
+    void onColorSpaceChanged(DocEvent& ev) override { invalidate(); }
+    void onPixelFormatChanged(DocEvent& ev) override { invalidate(); }
+    void onPaletteChanged(DocEvent& ev) override { invalidate(); }
+    void onAddLayer(DocEvent& ev) override { invalidate(); }
+    void onAddFrame(DocEvent& ev) override { invalidate(); }
+    void onAddCel(DocEvent& ev) override { invalidate(); }
+    void onBeforeRemoveLayer(DocEvent& ev) override { invalidate(); }
+    void onRemoveFrame(DocEvent& ev) override { invalidate(); }
+    void onBeforeRemoveCel(DocEvent& ev) override { invalidate(); }
+    void onSpriteSizeChanged(DocEvent& ev) override { invalidate(); }
+    void onSpriteTransparentColorChanged(DocEvent& ev) override { invalidate(); }
+    void onLayerOpacityChange(DocEvent& ev) override { invalidate(); }
+    void onLayerBlendModeChange(DocEvent& ev) override { invalidate(); }
+    void onLayerRestacked(DocEvent& ev) override { invalidate(); }
+    void onLayerMergedDown(DocEvent& ev) override { invalidate(); }
+    void onCelMoved(DocEvent& ev) override { invalidate(); }
+    void onCelCopied(DocEvent& ev) override { invalidate(); }
+    void onCelFrameChanged(DocEvent& ev) override { invalidate(); }
+    void onCelPositionChanged(DocEvent& ev) override { invalidate(); }
+    void onCelOpacityChange(DocEvent& ev) override { invalidate(); }
+    void onCelZIndexChange(DocEvent& ev) override { invalidate(); }
+    void onImagePixelsModified(DocEvent& ev) override { invalidate(); }
+    void onSpritePixelsModified(DocEvent& ev) override { invalidate(); }
+    void onTotalFramesChanged(DocEvent& ev) override { invalidate(); }
+    void onTilesetChanged(DocEvent& ev) override { invalidate(); }
+    void onAfterLayerVisibilityChange(DocEvent& ev) override { invalidate(); }
+    void onRemapTileset(DocEvent& ev, const doc::Remap& remap) override { invalidate(); }
+    void onAfterAddTile(DocEvent& ev) override { invalidate(); }
+
+    struct State;
+
+    Doc* m_doc;
+    std::shared_ptr<State> m_state;
+    std::size_t m_maxMemory;
+    Options m_options;
+  };
+
+} // namespace app
+
+#endif
@@ -273,6 +273,9 @@ Timeline::Timeline(TooltipManager* tooltipManager)
   m_hbar.setTransparent(true);
   m_vbar.setTransparent(true);
   initTheme();
+
+  // Thumbnails are rendered in a background thread
+  m_thumbnails.setReadyCallback([this]{ invalidate(); });
 }
 
 Timeline::~Timeline()
@@ -411,6 +414,9 @@ void Timeline::detachDocument()
     m_document = nullptr;
   }
 
+  // Wait the thumbnails that are being rendered for this document
+  m_thumbnails.clear();
+
   // Reset all pointers to this document, even DocRanges, we don't
   // want to store a pointer to a layer of a document that we are not
   // observing anymore (because the document might be deleted soon).
@@ -2483,7 +2489,7 @@ void Timeline::drawCel(ui::Graphics* g,
         skinTheme()->calcBorder(this, style));
 
     if (!thumb_bounds.isEmpty()) {
-      if (os::SurfaceRef surface = thumb::get_cel_thumbnail(cel, thumb_bounds.size())) {
+      if (os::SurfaceRef surface = m_thumbnails.get(cel, thumb_bounds.size())) {
         const int t = std::clamp(thumb_bounds.w/8, 4, 16);
         draw_checkered_grid(g, thumb_bounds, gfx::Size(t, t), docPref());
 
@@ -2577,7 +2583,7 @@ void Timeline::drawCelOverlay(ui::Graphics* g)
 
   gfx::Rect rc = m_sprite->bounds().fitIn(
     gfx::Rect(m_thumbnailsOverlayBounds).shrink(1));
-  if (os::SurfaceRef surface = thumb::get_cel_thumbnail(cel, rc.size())) {
+  if (os::SurfaceRef surface = m_thumbnails.get(cel, rc.size())) {
     draw_checkered_grid(g, rc, gfx::Size(8, 8)*ui::guiscale(), docPref());
 
     g->drawRgbaSurface(surface.get(),
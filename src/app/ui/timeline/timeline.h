@@ -14,6 +14,7 @@
 #include "app/docs_observer.h"
 #include "app/loop_tag.h"
 #include "app/pref/preferences.h"
+#include "app/thumbnails.h"
 #include "app/ui/editor/editor_observer.h"
 #include "app/ui/input_chain_element.h"
 #include "app/ui/timeline/ani_controls.h"
@@ -454,6 +455,7 @@ namespace app {
     Hit m_thumbnailsOverlayHit;
     gfx::Point m_thumbnailsOverlayDirection;
     obs::connection m_thumbnailsPrefConn;
+    thumb::CelThumbnailCache m_thumbnails;
 
     // Temporal data used to move the range.
     struct MoveRange {
@@ -120,134 +120,17 @@ struct Mod {
   gfx::Region tileRgn;
 };
 
-class DoFlip {
-public:
-  DoFlip(const doc::ImageRef& image,
-         const doc::algorithm::FlipType flipType)
-    : m_image(image.get())
-    , m_flipType(flipType) {
-  }
-  ~DoFlip() {
-    reset();
-  }
-  void flip() {
-    m_flipped = !m_flipped;
-    doc::algorithm::flip_image(m_image,
-                               m_image->bounds(),
-                               m_flipType);
-  }
-  void reset() {
-    if (m_flipped)
-      flip();
-  }
-  bool operator!() const {
-    return !m_flipped;
-  }
-private:
-  doc::Image* m_image;
-  bool m_flipped = false;
-  doc::algorithm::FlipType m_flipType;
-};
-
-// This is a terrible way to find tiles, i.e. flipping several times
-// the image, instead of searching for flipped hashes. In the future
-// we could try to improve it.
 bool find_tile(doc::Tileset* tileset,
-               doc::ImageRef& tileImage,
+               const doc::ImageRef& tileImage,
                doc::tile_index& tileIndex,
                doc::tile_flags& tileFlags)
 {
-  // Find without flags
-  if (tileset->findTileIndex(tileImage, tileIndex)) {
-    tileFlags = 0;
-    return true;
-  }
-
-  if (tileset->matchFlags() == 0) // In case we don't allow flipped tiles
-    return false;
-
-  DoFlip x(tileImage, doc::algorithm::FlipHorizontal);
-
-  // Find with X flip
-  if (tileset->matchFlags() & doc::tile_f_xflip) {
-    x.flip();
-    if (tileset->findTileIndex(tileImage, tileIndex)) {
-      tileFlags = doc::tile_f_xflip;
-      return true;
-    }
-    x.reset();
-  }
-
-  // Find with Y flip
-  DoFlip y(tileImage, doc::algorithm::FlipVertical);
-  if (tileset->matchFlags() & doc::tile_f_yflip) {
-    y.flip();
-    if (tileset->findTileIndex(tileImage, tileIndex)) {
-      tileFlags = doc::tile_f_yflip;
-      return true;
-    }
-
-    if (tileset->matchFlags() & doc::tile_f_xflip) {
-      // Find with X+Y flip
-      x.flip();
-      if (tileset->findTileIndex(tileImage, tileIndex)) {
-        tileFlags = doc::tile_f_xflip | doc::tile_f_yflip;
-        return true;
-      }
-      x.reset();
-    }
-    y.reset();
-  }
-
-  // Check if we can match diagonal flips
-  if ((tileset->matchFlags() & doc::tile_f_dflip) == 0)
-    return false;
-
-  // Find with D flip
-  DoFlip d(tileImage, doc::algorithm::FlipDiagonal);
-  d.flip();
-  if (tileset->findTileIndex(tileImage, tileIndex)) {
-    tileFlags = doc::tile_f_dflip;
-    return true;
-  }
-
-  // Find with X+D flip
-  if (tileset->matchFlags() & doc::tile_f_xflip) {
-    d.reset();
-    x.flip();
-    d.flip();
-    if (tileset->findTileIndex(tileImage, tileIndex)) {
-      tileFlags = doc::tile_f_xflip | doc::tile_f_dflip;
-      return true;
-    }
-
-    // Find with X+Y+D flip
-    if (tileset->matchFlags() & doc::tile_f_yflip) {
-      d.reset();
-      y.flip();
-      d.flip();
-      if (tileset->findTileIndex(tileImage, tileIndex)) {
-        tileFlags = doc::tile_f_xflip | doc::tile_f_yflip | doc::tile_f_dflip;
-        return true;
-      }
-    }
-  }
-
-  // Find with Y+D flip only
-  if (tileset->matchFlags() & doc::tile_f_yflip) {
-    d.reset();
-    x.reset();
-    if (!y)
-      y.flip();
-    d.flip();
-    if (tileset->findTileIndex(tileImage, tileIndex)) {
-      tileFlags =  doc::tile_f_yflip | doc::tile_f_dflip;
-      return true;
-    }
-  }
-
-  // DoFlip destructors will reset the image.
-  return false;
+  // The tileset hash table finds flipped versions of the tile too
+  // (when the tileset allows them) without flipping the image.
+  return tileset->findTileIndex(tileImage,
+                                tileset->matchFlags(),
+                                tileIndex,
+                                tileFlags);
 }
 
 } // anonymous namespace
@@ -0,0 +1,128 @@
+// Aseprite
+// Copyright (C) 2023  Igara Studio S.A.
+//
+// This program is distributed under the terms of
+// the End-User License Agreement for Aseprite.
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "app/util/lazy_cels_evictor.h"
+
+#include "app/context.h"
+#include "app/doc.h"
+#include "app/pref/preferences.h"
+#include "app/site.h"
+#include "doc/cel.h"
+#include "doc/cel_data.h"
+#include "doc/sprite.h"
+#include "ui/system.h"
+
+#include <algorithm>
+#include <climits>
+#include <cstdlib>
+#include <vector>
+
+namespace app {
+
+static std::size_t lazy_cels_memory_limit()
+{
+  return std::size_t(std::max(0, Preferences::instance().cels.lazyLoadCacheSize()))
+    * 1024 * 1024;
+}
+
+LazyCelsEvictor::LazyCelsEvictor(Context* ctx)
+  : m_ctx(ctx)
+{
+  m_ctx->add_observer(this);
+}
+
+LazyCelsEvictor::~LazyCelsEvictor()
+{
+  m_ctx->remove_observer(this);
+}
+
+void LazyCelsEvictor::onActiveSiteChange(const Site& site)
+{
+  if (m_pending ||
+      doc::CelData::lazyImagesMemory() <= lazy_cels_memory_limit())
+    return;
+
+  // Images are unloaded later from the UI event loop, as the code
+  // that changed the active site could be using some image
+  m_pending = true;
+  ui::execute_from_ui_thread([this]{
+    m_pending = false;
+    evict();
+  });
+}
+
+void LazyCelsEvictor::evict()
+{
+  const std::size_t limit = lazy_cels_memory_limit();
+  if (doc::CelData::lazyImagesMemory() <= limit)
+    return;
+
+  // Unload images until we use 3/4 of the limit (so we don't have
+  // to do this again each time a new image is loaded)
+  const std::size_t target = limit / 4 * 3;
+  const Site site = m_ctx->activeSite();
+
+  struct Item {
+    Doc* doc;
+    doc::CelData* celData;
+    int distance;
+  };
+  std::vector<Item> items;
+  for (Doc* doc : m_ctx->documents()) {
+    for (doc::Cel* cel : doc->sprite()->uniqueCels()) {
+      doc::CelData* celData = cel->data();
+      if (!celData->isLazy() || !celData->isImageLoaded())
+        continue;
+
+      int distance = INT_MAX;
+      if (doc == site.document()) {
+        distance = std::abs(cel->frame() - site.frame());
+        // Cels in the active frame are displayed right now
+        if (distance == 0)
+          continue;
+      }
+      items.push_back(Item{ doc, celData, distance });
+    }
+  }
+
+  std::stable_sort(items.begin(), items.end(),
+                   [](const Item& a, const Item& b){
+                     return a.distance > b.distance;
+                   });
+
+  Doc* lockedDoc = nullptr;
+  Doc::LockResult lockResult = Doc::LockResult::Fail;
+  for (const Item& item : items) {
+    if (doc::CelData::lazyImagesMemory() <= target)
+      break;
+
+    if (item.doc != lockedDoc) {
+      if (lockResult != Doc::LockResult::Fail)
+        lockedDoc->unlock(lockResult);
+      lockedDoc = item.doc;
+
+      // Other threads (e.g. rendering or saving the document) could
+      // be using the images, and if we already have the lock (a
+      // reentrant lock) some code in the UI thread could be using
+      // them too.
+      lockResult = lockedDoc->writeLock(0);
+      if (lockResult == Doc::LockResult::Reentrant) {
+        lockedDoc->unlock(lockResult);
+        lockResult = Doc::LockResult::Fail;
+      }
+    }
+    if (lockResult != Doc::LockResult::Fail)
+      item.celData->unloadImage();
+  }
+  if (lockResult != Doc::LockResult::Fail)
+    lockedDoc->unlock(lockResult);
+}
+
+} // namespace app
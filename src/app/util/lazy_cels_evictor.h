@@ -0,0 +1,49 @@
+// Aseprite
+// Copyright (C) 2023  Igara Studio S.A.
+//
+// This program is distributed under the terms of
+// the End-User License Agreement for Aseprite.
+
+#ifndef APP_UTIL_LAZY_CELS_EVICTOR_H_INCLUDED
+#define APP_UTIL_LAZY_CELS_EVICTOR_H_INCLUDED
+#pragma once
+
+#include "app/context_observer.h"
+#include "base/disable_copying.h"
+
+#include <cstddef>
+
+namespace app {
+
+  class Context;
+
+  // Unloads cel images that were decoded lazily (see
+  // FileOpConfig::lazyLoadCels) when they use more memory than the
+  // "cels.lazy_load_cache_size" preference. Only clean images that
+  // are not referenced from other places are unloaded (see
+  // doc::CelData::unloadImage()), starting from the documents that
+  // aren't active and then the frames farthest from the active frame.
+  //
+  // Images are unloaded from the UI thread (when the active site
+  // changes) with the document locked for writing, so no other thread
+  // can be using them.
+  class LazyCelsEvictor : public ContextObserver {
+  public:
+    LazyCelsEvictor(Context* ctx);
+    ~LazyCelsEvictor();
+
+  private:
+    // ContextObserver impl
+    void onActiveSiteChange(const Site& site) override;
+
+    void evict();
+
+    Context* m_ctx;
+    bool m_pending = false;
+
+    DISABLE_COPYING(LazyCelsEvictor);
+  };
+
+} // namespace app
+
+#endif
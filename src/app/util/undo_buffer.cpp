@@ -0,0 +1,380 @@
+// Aseprite
+// Copyright (C) 2023  Igara Studio S.A.
+//
+// This program is distributed under the terms of
+// the End-User License Agreement for Aseprite.
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "app/util/undo_buffer.h"
+
+#include "base/debug.h"
+#include "base/exception.h"
+#include "base/thread_pool.h"
+
+#include "zlib.h"
+
+#include <atomic>
+#include <iterator>
+
+namespace app {
+
+namespace {
+
+std::atomic<std::size_t> g_residentBytes(0);
+std::atomic<std::size_t> g_compressedBytes(0);
+std::atomic<std::size_t> g_spilledBytes(0);
+
+// Only one thread is used to compress/spill undo data, so it
+// doesn't compete with the rendering/filters threads.
+base::thread_pool& undo_thread_pool()
+{
+  static base::thread_pool pool(1);
+  return pool;
+}
+
+int file_seek(FILE* file, const uint64_t pos)
+{
+#ifdef _WIN32
+  return _fseeki64(file, pos, SEEK_SET);
+#else
+  return fseeko(file, off_t(pos), SEEK_SET);
+#endif
+}
+
+} // anonymous namespace
+
+//////////////////////////////////////////////////////////////////////
+// UndoSpillFile
+
+UndoSpillFile::UndoSpillFile()
+  : m_file(std::tmpfile())
+{
+  if (!m_file)
+    throw base::Exception("Cannot create a temporary file for the undo history");
+}
+
+UndoSpillFile::~UndoSpillFile()
+{
+  // The temporary file is deleted automatically
+  fclose(m_file);
+}
+
+uint64_t UndoSpillFile::write(const base::buffer& data)
+{
+  const std::lock_guard lock(m_mutex);
+  const uint64_t size = data.size();
+
+  // Use the smallest free region where the data fits
+  auto best = m_freeRegions.end();
+  for (auto it=m_freeRegions.begin(); it!=m_freeRegions.end(); ++it) {
+    if (it->second >= size &&
+        (best == m_freeRegions.end() || it->second < best->second)) {
+      best = it;
+    }
+  }
+
+  const uint64_t pos = (best != m_freeRegions.end() ? best->first: m_size);
+  if (file_seek(m_file, pos) != 0 ||
+      fwrite(data.data(), 1, size, m_file) != size)
+    throw base::Exception("Error writing the undo history in a temporary file");
+
+  if (best != m_freeRegions.end()) {
+    const uint64_t remaining = best->second - size;
+    m_freeRegions.erase(best);
+    if (remaining > 0)
+      m_freeRegions[pos + size] = remaining;
+    m_freeBytes -= size;
+  }
+  else {
+    m_size += size;
+  }
+  return pos;
+}
+
+void UndoSpillFile::read(const uint64_t pos, base::buffer& data)
+{
+  const std::lock_guard lock(m_mutex);
+  if (file_seek(m_file, pos) != 0 ||
+      fread(data.data(), 1, data.size(), m_file) != data.size())
+    throw base::Exception("Error reading the undo history from a temporary file");
+}
+
+void UndoSpillFile::free(const uint64_t pos, const uint64_t size)
+{
+  if (size == 0)
+    return;
+
+  const std::lock_guard lock(m_mutex);
+  ASSERT(pos + size <= m_size);
+
+  auto it = m_freeRegions.emplace(pos, size).first;
+  m_freeBytes += size;
+
+  // Merge with the next and previous free regions
+  auto next = std::next(it);
+  if (next != m_freeRegions.end() &&
+      it->first + it->second == next->first) {
+    it->second += next->second;
+    m_freeRegions.erase(next);
+  }
+  if (it != m_freeRegions.begin()) {
+    auto prev = std::prev(it);
+    if (prev->first + prev->second == it->first) {
+      prev->second += it->second;
+      m_freeRegions.erase(it);
+    }
+  }
+}
+
+uint64_t UndoSpillFile::size() const
+{
+  const std::lock_guard lock(m_mutex);
+  return m_size;
+}
+
+uint64_t UndoSpillFile::freeBytes() const
+{
+  const std::lock_guard lock(m_mutex);
+  return m_freeBytes;
+}
+
+//////////////////////////////////////////////////////////////////////
+// UndoBuffer
+
+struct UndoBuffer::Data {
+  enum class State { Resident, Compressed, Spilled };
+
+  // Locked by data() and by the background tasks, so the main
+  // thread waits any running task before using the buffer.
+  std::mutex mutex;
+  State state = State::Resident;
+  base::buffer buffer;          // Uncompressed or compressed data
+  std::size_t size = 0;         // Size of the uncompressed data
+  UndoSpillFilePtr file;        // File used to spill the data
+  uint64_t filePos = 0;
+  std::size_t fileSize = 0;
+
+  // Incremented each time data() is used, to discard old tasks
+  // that are still waiting in the thread pool.
+  int generation = 0;
+
+  // True if the data is counted in the global stats
+  bool counted = false;
+
+  void count(const bool add) {
+    if (add == counted)
+      return;
+    counted = add;
+
+    std::atomic<std::size_t>* stat = nullptr;
+    std::size_t bytes = 0;
+    switch (state) {
+      case State::Resident:   stat = &g_residentBytes;   bytes = buffer.size(); break;
+      case State::Compressed: stat = &g_compressedBytes; bytes = buffer.size(); break;
+      case State::Spilled:    stat = &g_spilledBytes;    bytes = fileSize; break;
+    }
+    if (add)
+      *stat += bytes;
+    else
+      *stat -= bytes;
+  }
+
+  // Returns false if the compressed data is not smaller than the
+  // original data (and "force" is false).
+  bool compress(const bool force) {
+    ASSERT(state == State::Resident);
+
+    uLongf len = compressBound(uLong(buffer.size()));
+    base::buffer output(len);
+    if (::compress2((Bytef*)output.data(), &len,
+                    (const Bytef*)buffer.data(), uLong(buffer.size()),
+                    Z_BEST_SPEED) != Z_OK)
+      return false;
+
+    if (!force && len >= buffer.size())
+      return false;
+
+    output.resize(len);
+    output.shrink_to_fit();
+
+    const bool wasCounted = counted;
+    count(false);
+    size = buffer.size();
+    buffer = std::move(output);
+    state = State::Compressed;
+    count(wasCounted);
+    return true;
+  }
+
+  void uncompress() {
+    ASSERT(state == State::Compressed);
+
+    base::buffer output(size);
+    if (size == 0) {
+      count(false);
+      buffer.clear();
+      state = State::Resident;
+      return;
+    }
+
+    uLongf len = uLongf(size);
+    if (::uncompress((Bytef*)output.data(), &len,
+                     (const Bytef*)buffer.data(), uLong(buffer.size())) != Z_OK ||
+        len != size)
+      throw base::Exception("Error uncompressing undo data");
+
+    const bool wasCounted = counted;
+    count(false);
+    buffer = std::move(output);
+    state = State::Resident;
+    count(wasCounted);
+  }
+
+  void spill() {
+    ASSERT(file);
+    if (state == State::Spilled)
+      return;
+    if (state == State::Resident)
+      compress(true);
+    if (state != State::Compressed)
+      return;
+
+    try {
+      filePos = file->write(buffer);
+    }
+    catch (const std::exception&) {
+      // Keep the data compressed in memory
+      return;
+    }
+
+    const bool wasCounted = counted;
+    count(false);
+    fileSize = buffer.size();
+    base::buffer().swap(buffer);
+    state = State::Spilled;
+    count(wasCounted);
+  }
+
+  void load() {
+    if (state == State::Spilled) {
+      const bool wasCounted = counted;
+      count(false);
+      buffer.resize(fileSize);
+      state = State::Compressed;
+      try {
+        file->read(filePos, buffer);
+      }
+      catch (...) {
+        base::buffer().swap(buffer);
+        state = State::Spilled;
+        count(wasCounted);
+        throw;
+      }
+      // The region of the file can be re-used when the data is
+      // spilled again
+      file->free(filePos, fileSize);
+      fileSize = 0;
+      count(wasCounted);
+    }
+    if (state == State::Compressed)
+      uncompress();
+  }
+};
+
+UndoBuffer::UndoBuffer()
+  : m_data(std::make_shared<Data>())
+{
+}
+
+UndoBuffer::~UndoBuffer()
+{
+  // Background tasks keep their own reference to m_data, we just
+  // remove it from the stats.
+  const std::lock_guard lock(m_data->mutex);
+  ++m_data->generation;
+  m_data->count(false);
+  if (m_data->state == Data::State::Spilled) {
+    m_data->file->free(m_data->filePos, m_data->fileSize);
+    m_data->fileSize = 0;
+  }
+}
+
+std::size_t UndoBuffer::size() const
+{
+  return (m_inUse ? m_data->buffer.size(): m_size);
+}
+
+base::buffer& UndoBuffer::data()
+{
+  const std::lock_guard lock(m_data->mutex);
+  ++m_data->generation;
+  m_data->count(false);
+  m_data->load();
+  m_inUse = true;
+  return m_data->buffer;
+}
+
+void UndoBuffer::release()
+{
+  if (!m_inUse)
+    return;
+
+  std::shared_ptr<Data> data = m_data;
+  int generation;
+  {
+    const std::lock_guard lock(data->mutex);
+    m_size = data->size = data->buffer.size();
+    data->count(true);
+    generation = data->generation;
+  }
+  m_inUse = false;
+
+  // Data that was already spilled stays in memory too (it's used by
+  // the current undo state), until spill() is called again.
+  if (m_size >= kMinCompressSize) {
+    undo_thread_pool().execute([data, generation]{
+      const std::lock_guard lock(data->mutex);
+      if (data->generation == generation &&
+          data->state == Data::State::Resident)
+        data->compress(false);
+    });
+  }
+}
+
+void UndoBuffer::spill(const UndoSpillFilePtr& file)
+{
+  ASSERT(!m_inUse);
+  ASSERT(file);
+
+  std::shared_ptr<Data> data = m_data;
+  int generation;
+  {
+    const std::lock_guard lock(data->mutex);
+    if (data->state == Data::State::Spilled)
+      return;
+    generation = data->generation;
+  }
+
+  undo_thread_pool().execute([data, generation, file]{
+    const std::lock_guard lock(data->mutex);
+    if (data->generation == generation) {
+      data->file = file;
+      data->spill();
+    }
+  });
+}
+
+// static
+UndoBuffer::Stats UndoBuffer::stats()
+{
+  Stats stats;
+  stats.resident = g_residentBytes;
+  stats.compressed = g_compressedBytes;
+  stats.spilled = g_spilledBytes;
+  return stats;
+}
+
+} // namespace app
@@ -0,0 +1,113 @@
+// Aseprite
+// Copyright (C) 2023  Igara Studio S.A.
+//
+// This program is distributed under the terms of
+// the End-User License Agreement for Aseprite.
+
+#ifndef APP_UTIL_UNDO_BUFFER_H_INCLUDED
+#define APP_UTIL_UNDO_BUFFER_H_INCLUDED
+#pragma once
+
+#include "base/buffer.h"
+#include "base/disable_copying.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <map>
+#include <memory>
+#include <mutex>
+
+namespace app {
+
+  // Temporary file where the data of old undo states is moved to
+  // reduce the memory used by the undo history. Each document has
+  // its own file (see DocUndo), which is removed when the last
+  // UndoBuffer that uses it is destroyed. Regions of data that are
+  // not used anymore (e.g. the data was loaded again in memory) are
+  // re-used by the next writes.
+  //
+  // This class is thread-safe.
+  class UndoSpillFile {
+  public:
+    UndoSpillFile();
+    ~UndoSpillFile();
+
+    // Writes the data in a free region of the file (or at the end of
+    // the file) and returns its position.
+    uint64_t write(const base::buffer& data);
+
+    // Reads "data.size()" bytes from the given position.
+    void read(const uint64_t pos, base::buffer& data);
+
+    // Marks the given region (returned by write()) as free.
+    void free(const uint64_t pos, const uint64_t size);
+
+    // Size of the file and bytes that are free to be re-used.
+    uint64_t size() const;
+    uint64_t freeBytes() const;
+
+  private:
+    mutable std::mutex m_mutex;
+    FILE* m_file;
+    uint64_t m_size = 0;
+    uint64_t m_freeBytes = 0;
+    // Free regions (position -> size), adjacent regions are merged
+    std::map<uint64_t, uint64_t> m_freeRegions;
+
+    DISABLE_COPYING(UndoSpillFile);
+  };
+
+  typedef std::shared_ptr<UndoSpillFile> UndoSpillFilePtr;
+
+  // Data stored by a Cmd to undo/redo it (e.g. pixels of an image
+  // region). When it's not being used, the data is compressed in a
+  // background thread, and it can be moved to a UndoSpillFile (and
+  // loaded again when it's needed).
+  class UndoBuffer {
+  public:
+    // Bytes used by all UndoBuffers.
+    struct Stats {
+      std::size_t resident = 0;   // Uncompressed data in memory
+      std::size_t compressed = 0; // Compressed data in memory
+      std::size_t spilled = 0;    // Compressed data in spill files
+    };
+
+    // Smaller buffers are not compressed.
+    static constexpr std::size_t kMinCompressSize = 64*1024;
+
+    UndoBuffer();
+    ~UndoBuffer();
+
+    // Size of the uncompressed data.
+    std::size_t size() const;
+
+    // Returns the uncompressed data to read or modify it. It waits
+    // any background task that is using the buffer, and loads the
+    // data from the spill file if it's needed. release() must be
+    // called when the data isn't needed anymore.
+    base::buffer& data();
+
+    // Compresses the data in a background thread (if it's big
+    // enough). Data loaded from the spill file stays in memory until
+    // spill() is called again. The data() reference cannot be used
+    // after this.
+    void release();
+
+    // Moves the data to the given file in a background thread.
+    void spill(const UndoSpillFilePtr& file);
+
+    static Stats stats();
+
+  private:
+    struct Data;
+    std::shared_ptr<Data> m_data;
+    std::size_t m_size = 0;
+    bool m_inUse = false;
+
+    DISABLE_COPYING(UndoBuffer);
+  };
+
+} // namespace app
+
+#endif
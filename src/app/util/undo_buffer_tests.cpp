@@ -0,0 +1,180 @@
+// Aseprite
+// Copyright (C) 2023  Igara Studio S.A.
+//
+// This program is distributed under the terms of
+// the End-User License Agreement for Aseprite.
+
+#include "tests/app_test.h"
+
+#include "app/util/undo_buffer.h"
+
+#include <chrono>
+#include <functional>
+#include <thread>
+
+using namespace app;
+
+namespace {
+
+// Compressible data with some variation for each "seed"
+void fill_buffer(base::buffer& buf, const std::size_t size, const int seed)
+{
+  buf.resize(size);
+  for (std::size_t i=0; i<size; ++i)
+    buf[i] = uint8_t((i / 64) * seed + (i % 7));
+}
+
+bool is_same_buffer(const base::buffer& buf, const std::size_t size, const int seed)
+{
+  base::buffer expected;
+  fill_buffer(expected, size, seed);
+  return (buf == expected);
+}
+
+// Waits the background thread that compresses/spills buffers
+bool wait_until(const std::function<bool()>& pred)
+{
+  for (int i=0; i<1000 && !pred(); ++i)
+    std::this_thread::sleep_for(std::chrono::milliseconds(5));
+  return pred();
+}
+
+} // anonymous namespace
+
+TEST(UndoSpillFile, FreeRegions)
+{
+  UndoSpillFile file;
+  const base::buffer a(100, 1), b(50, 2), c(30, 3);
+
+  EXPECT_EQ(0, file.write(a));
+  EXPECT_EQ(100, file.write(b));
+  EXPECT_EQ(150, file.write(c));
+  EXPECT_EQ(180, file.size());
+
+  // A free region is re-used by smaller data
+  file.free(0, 100);
+  EXPECT_EQ(100, file.freeBytes());
+  EXPECT_EQ(0, file.write(c));
+  EXPECT_EQ(70, file.freeBytes());
+
+  // Adjacent free regions are merged (30..100 + 100..150)
+  file.free(100, 50);
+  EXPECT_EQ(120, file.freeBytes());
+  EXPECT_EQ(30, file.write(a));
+  EXPECT_EQ(20, file.freeBytes());
+  EXPECT_EQ(180, file.size());
+
+  base::buffer data(100);
+  file.read(30, data);
+  EXPECT_EQ(a, data);
+  data.resize(30);
+  file.read(150, data);
+  EXPECT_EQ(c, data);
+
+  // Data bigger than all free regions goes to the end
+  EXPECT_EQ(180, file.write(a));
+  EXPECT_EQ(280, file.size());
+}
+
+TEST(UndoBuffer, CompressSpillAndLoad)
+{
+  const std::size_t size = 4*UndoBuffer::kMinCompressSize;
+  auto file = std::make_shared<UndoSpillFile>();
+  const UndoBuffer::Stats stats0 = UndoBuffer::stats();
+  {
+    UndoBuffer buf;
+    fill_buffer(buf.data(), size, 1);
+    buf.release();
+    EXPECT_EQ(size, buf.size());
+
+    // Compressed in background
+    EXPECT_TRUE(wait_until([&]{
+      return UndoBuffer::stats().compressed > stats0.compressed;
+    }));
+    EXPECT_EQ(stats0.resident, UndoBuffer::stats().resident);
+
+    // Moved to the spill file
+    buf.spill(file);
+    EXPECT_TRUE(wait_until([&]{ return file->size() > 0; }));
+    EXPECT_TRUE(wait_until([&]{
+      return UndoBuffer::stats().spilled == stats0.spilled + file->size();
+    }));
+    EXPECT_EQ(stats0.compressed, UndoBuffer::stats().compressed);
+    const uint64_t fileSize = file->size();
+
+    // Loaded from the spill file (and its region is released)
+    EXPECT_TRUE(is_same_buffer(buf.data(), size, 1));
+    EXPECT_EQ(fileSize, file->freeBytes());
+    EXPECT_EQ(stats0.spilled, UndoBuffer::stats().spilled);
+
+    // Loaded data stays in memory (compressed) when it's released
+    buf.release();
+    EXPECT_TRUE(wait_until([&]{
+      return UndoBuffer::stats().compressed > stats0.compressed;
+    }));
+    EXPECT_EQ(stats0.spilled, UndoBuffer::stats().spilled);
+    EXPECT_EQ(fileSize, file->freeBytes());
+
+    // Spilled again in the same region
+    buf.spill(file);
+    EXPECT_TRUE(wait_until([&]{ return file->freeBytes() == 0; }));
+    EXPECT_EQ(fileSize, file->size());
+
+    // Modified data is spilled again
+    fill_buffer(buf.data(), size, 2);
+    buf.release();
+    buf.spill(file);
+    EXPECT_TRUE(wait_until([&]{
+      return UndoBuffer::stats().spilled > stats0.spilled;
+    }));
+    EXPECT_TRUE(is_same_buffer(buf.data(), size, 2));
+    buf.release();
+  }
+
+  // The region is released when the buffer is destroyed
+  EXPECT_EQ(file->size(), file->freeBytes());
+  EXPECT_TRUE(wait_until([&]{
+    const UndoBuffer::Stats stats = UndoBuffer::stats();
+    return (stats.resident == stats0.resident &&
+            stats.compressed == stats0.compressed &&
+            stats.spilled == stats0.spilled);
+  }));
+}
+
+// Uses the data while background tasks could be compressing/spilling
+// the same buffer: the tasks that were queued before data() must not
+// modify the buffer.
+TEST(UndoBuffer, GenerationRace)
+{
+  const std::size_t size = 2*UndoBuffer::kMinCompressSize;
+  auto file = std::make_shared<UndoSpillFile>();
+  const UndoBuffer::Stats stats0 = UndoBuffer::stats();
+  {
+    UndoBuffer buf;
+    fill_buffer(buf.data(), size, 0);
+    for (int i=1; i<100; ++i) {
+      buf.release();
+      base::buffer& data = buf.data();
+      ASSERT_TRUE(is_same_buffer(data, size, i-1));
+      fill_buffer(data, size, i);
+      buf.release();
+
+      if ((i % 3) == 0)
+        buf.spill(file);
+      // Use the data in some iterations after the task finishes
+      if ((i % 5) == 0)
+        wait_until([&]{ return UndoBuffer::stats().resident == stats0.resident; });
+
+      ASSERT_TRUE(is_same_buffer(buf.data(), size, i));
+    }
+    buf.release();
+  }
+
+  EXPECT_TRUE(wait_until([&]{
+    const UndoBuffer::Stats stats = UndoBuffer::stats();
+    return (stats.resident == stats0.resident &&
+            stats.compressed == stats0.compressed &&
+            stats.spilled == stats0.spilled);
+  }));
+  EXPECT_EQ(file->size(), file->freeBytes());
+}
@@ -22,16 +22,28 @@
 #include "dio/pixel_io.h"
 #include "doc/doc.h"
 #include "doc/util.h"
+#include "doc/worker_pool.h"
 #include "fixmath/fixmath.h"
 #include "fmt/format.h"
 #include "gfx/color_space.h"
 #include "zlib.h"
 
+#include <algorithm>
 #include <cstdio>
+#include <mutex>
 #include <vector>
 
 namespace dio {
 
+// Compressed cel images that are being inflated in background
+// threads (see AsepriteDecoder::inflateCelImage()).
+struct AsepriteDecoder::PendingCelImages {
+  std::mutex mutex;
+  std::vector<std::string> errors;
+  // Destroyed first, so it waits the tasks that use the other fields
+  doc::WorkerTasks tasks;
+};
+
 bool AsepriteDecoder::decode()
 {
   bool ignore_old_color_chunks = false;
@@ -90,6 +102,20 @@ bool AsepriteDecoder::decode()
 
   m_allLayers.clear();
 
+  // Compressed cels are inflated in other threads only if we have
+  // more than one core.
+  if (doc::worker_threads() > 1)
+    m_pendingCelImages = std::make_shared<PendingCelImages>();
+  else
+    m_pendingCelImages.reset();
+
+  // Compressed cels can be decoded lazily if the file is mapped in
+  // memory
+  if (delegate()->lazyLoadCels())
+    m_mappedFile = f()->mappedFile();
+  else
+    m_mappedFile.reset();
+
   int current_level = -1;
   AsepriteExternalFiles extFiles;
 
@@ -310,6 +336,10 @@ bool AsepriteDecoder::decode()
       break;
   }
 
+  // All cel images must be ready before we give the sprite to the
+  // delegate.
+  waitCelImages();
+
   delegate()->onSprite(sprite.release());
   return true;
 }
@@ -799,6 +829,14 @@ void read_compressed_image_templ(FileInterface* f,
   err = inflateEnd(&zstream);
   if (err != Z_OK)
     throw base::Exception("ZLib error %d in inflateEnd().", err);
+
+  // Truncated compressed data (inflate() doesn't return an error in
+  // this case, it just needs more input)
+  if (y < image->height()) {
+    delegate->error(
+      fmt::format("Missing compressed data for {} rows of pixels",
+                  image->height() - y));
+  }
 }
 
 void read_compressed_image(FileInterface* f,
@@ -839,8 +877,137 @@ void read_compressed_image(FileInterface* f,
   }
 }
 
+// Keeps the errors found in a background thread to report them
+// later from the decoder thread. Progress is ignored (it's reported
+// by the decoder thread as chunks are read).
+class ErrorsCollector : public DecodeDelegate {
+public:
+  void error(const std::string& msg) override {
+    m_errors.push_back(msg);
+  }
+  std::vector<std::string>& errors() { return m_errors; }
+private:
+  std::vector<std::string> m_errors;
+};
+
+// Decodes a compressed cel image from the file mapped in memory the
+// first time the image is needed (see doc::CelData::image()).
+class CompressedCelLoader : public doc::ImageLoader {
+public:
+  CompressedCelLoader(const MappedFileRef& file,
+                      const size_t offset,
+                      const size_t size,
+                      const doc::PixelFormat pixelFormat,
+                      const int width,
+                      const int height,
+                      const doc::color_t maskColor,
+                      const AsepriteHeader& header,
+                      const bool cacheCompressed)
+    : m_file(file)
+    , m_offset(offset)
+    , m_size(size)
+    , m_pixelFormat(pixelFormat)
+    , m_width(width)
+    , m_height(height)
+    , m_maskColor(maskColor)
+    , m_header(header)
+    , m_cacheCompressed(cacheCompressed) {
+  }
+
+  doc::ImageRef loadImage() override {
+    // The mapped data is locked while we decode the image
+    MappedFile::Reader reader(m_file);
+    const uint8_t* data = reader.data();
+    if (!data) {
+      doc::ImageLoader::reportError(
+        "The file was modified by other program, the cel image cannot be loaded");
+      return nullptr;
+    }
+    data += m_offset;
+
+    doc::ImageRef image(doc::Image::create(m_pixelFormat, m_width, m_height));
+    image->setMaskColor(m_maskColor);
+    doc::clear_image(image.get(), m_maskColor);
+
+    MemoryFileInterface f(data, m_size);
+    ErrorsCollector errors;
+    read_compressed_image(&f, &errors, image.get(), &m_header, m_size);
+
+    if (!errors.errors().empty()) {
+      for (const std::string& msg : errors.errors())
+        doc::ImageLoader::reportError(msg);
+    }
+    else if (m_cacheCompressed) {
+      image->setCompressedData(base::buffer(data, data+m_size));
+    }
+    return image;
+  }
+
+  doc::PixelFormat pixelFormat() const override {
+    return m_pixelFormat;
+  }
+
+private:
+  MappedFileRef m_file;
+  size_t m_offset;
+  size_t m_size;
+  doc::PixelFormat m_pixelFormat;
+  int m_width;
+  int m_height;
+  doc::color_t m_maskColor;
+  AsepriteHeader m_header;
+  bool m_cacheCompressed;
+};
+
 } // anonymous namespace
 
+void AsepriteDecoder::inflateCelImage(const doc::ImageRef& image,
+                                      base::buffer&& compressed,
+                                      const size_t compressedSize,
+                                      const AsepriteHeader* header,
+                                      const bool cacheCompressed)
+{
+  // The tasks are waited before PendingCelImages is destroyed, so
+  // it's safe even if the decoder is destroyed before the task
+  // finishes (e.g. an exception in the decoder thread).
+  PendingCelImages* pending = m_pendingCelImages.get();
+  pending->tasks.execute(
+    [pending, image, header=*header,
+     compressed=std::move(compressed), compressedSize, cacheCompressed]{
+      MemoryFileInterface f(compressed.data(), compressed.size());
+      ErrorsCollector errors;
+      read_compressed_image(&f, &errors, image.get(), &header, compressedSize);
+
+      // Each image is modified only from this task, so we can
+      // set its compressed data here.
+      if (cacheCompressed && errors.errors().empty())
+        image->setCompressedData(compressed);
+
+      const std::lock_guard lock(pending->mutex);
+      for (std::string& msg : errors.errors())
+        pending->errors.push_back(std::move(msg));
+    });
+}
+
+void AsepriteDecoder::waitCelImages()
+{
+  if (!m_pendingCelImages)
+    return;
+
+  // Cels that weren't started by a worker are inflated in this
+  // thread
+  m_pendingCelImages->tasks.wait();
+
+  std::vector<std::string> errors;
+  {
+    const std::lock_guard lock(m_pendingCelImages->mutex);
+    std::swap(errors, m_pendingCelImages->errors);
+  }
+
+  for (const std::string& msg : errors)
+    delegate()->error(msg);
+}
+
 //////////////////////////////////////////////////////////////////////
 // Cel Chunk
 //////////////////////////////////////////////////////////////////////
@@ -913,6 +1080,9 @@ doc::Cel* AsepriteDecoder::readCelChunk(doc::Sprite* sprite,
           cel.reset(doc::Cel::MakeLink(frame, link));
         }
         else {
+          // The image of the linked cel could be still in progress
+          waitCelImages();
+
           cel.reset(doc::Cel::MakeCopy(frame, link));
           cel->setPosition(x, y);
           cel->setOpacity(opacity);
@@ -932,8 +1102,55 @@ doc::Cel* AsepriteDecoder::readCelChunk(doc::Sprite* sprite,
       int h = read16();
 
       if (w > 0 && h > 0) {
+        // Keep the compressed data to save the image again without
+        // re-compressing it (if it's not modified)
+        const bool cacheCompressed = delegate()->cacheCompressedCels();
+        const size_t dataBeg = f()->tell();
+
+        // Don't decode the image now, just remember where its
+        // compressed data is
+        if (m_mappedFile &&
+            chunk_end > dataBeg &&
+            chunk_end <= m_mappedFile->size()) {
+          auto loader = std::make_shared<CompressedCelLoader>(
+            m_mappedFile, dataBeg, chunk_end - dataBeg,
+            pixelFormat, w, h,
+            (pixelFormat == doc::IMAGE_INDEXED ? header->transparent_index: 0),
+            *header, cacheCompressed);
+          auto celData = std::make_shared<doc::CelData>(
+            loader, gfx::Rect(x, y, w, h));
+          celData->setOpacity(opacity);
+
+          cel = std::make_unique<doc::Cel>(frame, celData);
+          cel->setZIndex(zIndex);
+          break;
+        }
+
         doc::ImageRef image(doc::Image::create(pixelFormat, w, h));
-        read_compressed_image(f(), delegate(), image.get(), header, chunk_end);
+
+        // Inflate the image in a background thread, the cel can be
+        // added to the sprite right now as the image will be ready
+        // before the sprite is returned (see waitCelImages()).
+        if (m_pendingCelImages && chunk_end > dataBeg) {
+          const size_t compressedSize = chunk_end - dataBeg;
+          base::buffer compressed(compressedSize);
+          compressed.resize(f()->readBytes(&compressed[0], compressedSize));
+          inflateCelImage(image, std::move(compressed), compressedSize,
+                          header, cacheCompressed);
+        }
+        else {
+          base::buffer compressed;
+          if (cacheCompressed && chunk_end > dataBeg) {
+            compressed.resize(chunk_end - dataBeg);
+            f()->readBytes(&compressed[0], compressed.size());
+            f()->seek(dataBeg);
+          }
+
+          read_compressed_image(f(), delegate(), image.get(), header, chunk_end);
+
+          if (!compressed.empty())
+            image->setCompressedData(compressed);
+        }
 
         cel = std::make_unique<doc::Cel>(frame, image);
         cel->setPosition(x, y);
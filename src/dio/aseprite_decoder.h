@@ -9,8 +9,11 @@
 #define DIO_ASEPRITE_DECODER_H_INCLUDED
 #pragma once
 
+#include "base/buffer.h"
 #include "dio/decoder.h"
+#include "dio/file_interface.h"
 #include "doc/frame.h"
+#include "doc/image_ref.h"
 #include "doc/layer_list.h"
 #include "doc/pixel_format.h"
 #include "doc/slices.h"
@@ -18,6 +21,7 @@
 #include "doc/tileset.h"
 #include "doc/user_data.h"
 
+#include <memory>
 #include <string>
 #include <vector>
 
@@ -42,6 +46,8 @@ public:
   bool decode() override;
 
 private:
+  struct PendingCelImages;
+
   bool readHeader(AsepriteHeader* header);
   void readFrameHeader(AsepriteFrameHeader* frame_header);
   void readPadding(const int bytes);
@@ -57,6 +63,12 @@ private:
                          doc::PixelFormat pixelFormat,
                          const AsepriteHeader* header,
                          const size_t chunk_end);
+  void inflateCelImage(const doc::ImageRef& image,
+                       base::buffer&& compressed,
+                       const size_t compressedSize,
+                       const AsepriteHeader* header,
+                       const bool cacheCompressed);
+  void waitCelImages();
   void readCelExtraChunk(doc::Cel* cel);
   void readColorProfile(doc::Sprite* sprite);
   void readExternalFiles(AsepriteExternalFiles& extFiles);
@@ -76,6 +88,8 @@ private:
 
   doc::LayerList m_allLayers;
   std::vector<uint32_t> m_tilesetFlags;
+  std::shared_ptr<PendingCelImages> m_pendingCelImages;
+  MappedFileRef m_mappedFile;
 };
 
 } // namespace dio
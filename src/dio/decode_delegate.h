@@ -56,6 +56,20 @@ public:
   virtual bool cacheCompressedTilesets() const {
     return false;
   }
+
+  // Returns true if the compressed data of cel images should be
+  // kept in memory (see doc::Image::setCompressedData()).
+  virtual bool cacheCompressedCels() const {
+    return false;
+  }
+
+  // Returns true if compressed cel images should be decoded the first
+  // time they are used instead of decoding them when the file is
+  // loaded. It works only if the file is mapped in memory (see
+  // FileInterface::mappedFile()).
+  virtual bool lazyLoadCels() const {
+    return false;
+  }
 };
 
 } // namespace dio
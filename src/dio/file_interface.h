@@ -1,4 +1,5 @@
 // Aseprite Document IO Library
+// Copyright (c) 2023 Igara Studio S.A.
 // Copyright (c) 2017-2018 David Capello
 //
 // This file is released under the terms of the MIT license.
@@ -11,9 +12,80 @@
 #include <cstddef>
 #include <cstdint>
 #include <cstdio>
+#include <memory>
+#include <shared_mutex>
+#include <string>
+#include <vector>
 
 namespace dio {
 
+// A read-only file mapped in memory. The data must be accessed with
+// a MappedFile::Reader, so the file can be detached (see detach())
+// from another thread.
+class MappedFile {
+public:
+  MappedFile(const std::string& filename);
+  ~MappedFile();
+
+  // Returns false if the file couldn't be mapped
+  bool isValid() const { return m_data != nullptr; }
+  size_t size() const { return m_size; }
+
+  // Copies the mapped data to a temporary file (or to memory) and
+  // maps that copy, so the original file can be overwritten or
+  // deleted without affecting the data that we can read from this
+  // object.
+  void detach();
+
+  // Detaches all mapped files of the given file (e.g. called before
+  // we write over the file).
+  static void detachAll(const std::string& filename);
+
+  // Locks the mapped data to read it (the data cannot be detached
+  // while it's being read).
+  class Reader {
+  public:
+    Reader(const std::shared_ptr<MappedFile>& file);
+
+    // Returns nullptr if the file was modified by other program after
+    // we've mapped it (reading its data could crash the program).
+    const uint8_t* data() const;
+    size_t size() const { return m_file->m_size; }
+
+  private:
+    std::shared_ptr<MappedFile> m_file;
+    std::shared_lock<std::shared_mutex> m_lock;
+  };
+
+private:
+  bool isSameFile(const std::string& filename) const;
+  bool wasModified() const;
+  void unmap();
+
+  std::string m_filename;
+  const uint8_t* m_data;
+  size_t m_size;
+  // True if the data is not mapped from the original file anymore
+  bool m_detached;
+  // Data detached in memory (if we cannot create a temporary file)
+  std::vector<uint8_t> m_buffer;
+  std::shared_mutex m_mutex;
+#ifdef _WIN32
+  void* m_file;
+  void* m_mapping;
+#else
+  // Identity of the mapped file to know if it was modified
+  uint64_t m_dev;
+  uint64_t m_ino;
+  int64_t m_mtime;
+#endif
+
+  MappedFile(const MappedFile&) = delete;
+  MappedFile& operator=(const MappedFile&) = delete;
+};
+
+using MappedFileRef = std::shared_ptr<MappedFile>;
+
 class FileInterface {
 public:
   virtual ~FileInterface() { }
@@ -34,6 +106,11 @@ public:
   // Writes one byte in the file (or do nothing if ok() = false)
   virtual void write8(uint8_t value) = 0;
 
+  // Returns the file mapped in memory (if it's available), it can be
+  // used to read parts of the file later (e.g. to decode cel images
+  // lazily).
+  virtual MappedFileRef mappedFile() const { return nullptr; }
+
 };
 
 class StdioFileInterface : public FileInterface {
@@ -50,6 +127,34 @@ private:
   bool m_ok;
 };
 
+// Read-only file interface to read bytes from memory.
+class MemoryFileInterface : public FileInterface {
+public:
+  MemoryFileInterface(const uint8_t* data, size_t size);
+  bool ok() const override;
+  size_t tell() override;
+  void seek(size_t absPos) override;
+  uint8_t read8() override;
+  size_t readBytes(uint8_t* buf, size_t n) override;
+  void write8(uint8_t value) override;
+private:
+  const uint8_t* m_data;
+  size_t m_size;
+  size_t m_pos;
+  bool m_ok;
+};
+
+// Read-only file interface to read a file mapped in memory. The
+// mapped data is locked while this object exists.
+class MmapFileInterface : private MappedFile::Reader,
+                          public MemoryFileInterface {
+public:
+  MmapFileInterface(const MappedFileRef& file);
+  MappedFileRef mappedFile() const override;
+private:
+  MappedFileRef m_file;
+};
+
 } // namespace dio
 
 #endif
@@ -0,0 +1,313 @@
+// Aseprite Document IO Library
+// Copyright (c) 2023 Igara Studio S.A.
+//
+// This file is released under the terms of the MIT license.
+// Read LICENSE.txt for more information.
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "dio/file_interface.h"
+
+#ifdef _WIN32
+  #include "base/fs.h"
+  #include "base/string.h"
+  #include <windows.h>
+#else
+  #include <fcntl.h>
+  #include <sys/mman.h>
+  #include <sys/stat.h>
+  #include <unistd.h>
+#endif
+
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <mutex>
+
+namespace dio {
+
+//////////////////////////////////////////////////////////////////////
+// MappedFile
+
+// All mapped files (to detach them before overwriting a file)
+static std::mutex g_mappedFilesMutex;
+static std::vector<MappedFile*> g_mappedFiles;
+
+#ifdef _WIN32
+
+MappedFile::MappedFile(const std::string& filename)
+  : m_filename(base::normalize_path(filename))
+  , m_data(nullptr)
+  , m_size(0)
+  , m_detached(false)
+  , m_file(INVALID_HANDLE_VALUE)
+  , m_mapping(nullptr)
+{
+  m_file = CreateFileW(base::from_utf8(filename).c_str(),
+                       GENERIC_READ, FILE_SHARE_READ, nullptr,
+                       OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+  if (m_file != INVALID_HANDLE_VALUE) {
+    LARGE_INTEGER size;
+    if (GetFileSizeEx(m_file, &size) && size.QuadPart > 0) {
+      m_mapping = CreateFileMappingW(m_file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+      if (m_mapping) {
+        m_data = (const uint8_t*)MapViewOfFile(m_mapping, FILE_MAP_READ, 0, 0, 0);
+        if (m_data)
+          m_size = size_t(size.QuadPart);
+      }
+    }
+  }
+
+  const std::lock_guard lock(g_mappedFilesMutex);
+  g_mappedFiles.push_back(this);
+}
+
+void MappedFile::unmap()
+{
+  if (m_data && m_buffer.empty())
+    UnmapViewOfFile(m_data);
+  if (m_mapping)
+    CloseHandle(m_mapping);
+  if (m_file != INVALID_HANDLE_VALUE)
+    CloseHandle(m_file);
+  m_data = nullptr;
+  m_mapping = nullptr;
+  m_file = INVALID_HANDLE_VALUE;
+}
+
+bool MappedFile::isSameFile(const std::string& filename) const
+{
+  return (base::compare_filenames(m_filename,
+                                  base::normalize_path(filename)) == 0);
+}
+
+// The file is opened without FILE_SHARE_WRITE/DELETE, so it cannot
+// be modified by other programs while it's mapped.
+bool MappedFile::wasModified() const
+{
+  return false;
+}
+
+void MappedFile::detach()
+{
+  const std::unique_lock lock(m_mutex);
+  if (!m_data || m_detached)
+    return;
+
+  // The original file cannot be written while it's opened, so we
+  // keep the data in memory
+  std::vector<uint8_t> buffer(m_data, m_data+m_size);
+  unmap();
+  m_buffer = std::move(buffer);
+  m_data = m_buffer.data();
+  m_detached = true;
+}
+
+#else
+
+MappedFile::MappedFile(const std::string& filename)
+  : m_filename(filename)
+  , m_data(nullptr)
+  , m_size(0)
+  , m_detached(false)
+  , m_dev(0)
+  , m_ino(0)
+  , m_mtime(0)
+{
+  int fd = open(filename.c_str(), O_RDONLY);
+  if (fd >= 0) {
+    struct stat sb;
+    if (fstat(fd, &sb) == 0 && sb.st_size > 0) {
+      void* data = mmap(nullptr, sb.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+      if (data != MAP_FAILED) {
+        m_data = (const uint8_t*)data;
+        m_size = size_t(sb.st_size);
+        m_dev = uint64_t(sb.st_dev);
+        m_ino = uint64_t(sb.st_ino);
+        m_mtime = int64_t(sb.st_mtime);
+      }
+    }
+
+    // The mapping is still valid after closing the file descriptor
+    close(fd);
+  }
+
+  const std::lock_guard lock(g_mappedFilesMutex);
+  g_mappedFiles.push_back(this);
+}
+
+void MappedFile::unmap()
+{
+  if (m_data && m_buffer.empty())
+    munmap((void*)m_data, m_size);
+  m_data = nullptr;
+}
+
+// Compares device/inode numbers, so links or different paths to the
+// same file are detected too.
+bool MappedFile::isSameFile(const std::string& filename) const
+{
+  struct stat sb;
+  return (stat(filename.c_str(), &sb) == 0 &&
+          uint64_t(sb.st_dev) == m_dev &&
+          uint64_t(sb.st_ino) == m_ino);
+}
+
+// If the file is truncated, reading the mapped pages beyond the end
+// of the file raises a SIGBUS, so we check that the file is the same
+// before reading it. (There is still a small window of time where
+// other program can modify the file, but FileOp calls detachAll()
+// before overwriting a file from our side.)
+bool MappedFile::wasModified() const
+{
+  if (m_detached)
+    return false;
+
+  struct stat sb;
+  return (stat(m_filename.c_str(), &sb) != 0 ||
+          uint64_t(sb.st_dev) != m_dev ||
+          uint64_t(sb.st_ino) != m_ino ||
+          size_t(sb.st_size) != m_size ||
+          int64_t(sb.st_mtime) != m_mtime);
+}
+
+void MappedFile::detach()
+{
+  const std::unique_lock lock(m_mutex);
+  if (!m_data || m_detached || wasModified())
+    return;
+
+  // Copy the data to a temporary file (which is already deleted from
+  // the file system) to avoid keeping a big file in memory
+  const uint8_t* data = nullptr;
+  if (FILE* tmp = std::tmpfile()) {
+    if (std::fwrite(m_data, 1, m_size, tmp) == m_size &&
+        std::fflush(tmp) == 0) {
+      void* p = mmap(nullptr, m_size, PROT_READ, MAP_PRIVATE, fileno(tmp), 0);
+      if (p != MAP_FAILED)
+        data = (const uint8_t*)p;
+    }
+    std::fclose(tmp);
+  }
+
+  if (data) {
+    unmap();
+    m_data = data;
+  }
+  else {
+    std::vector<uint8_t> buffer(m_data, m_data+m_size);
+    unmap();
+    m_buffer = std::move(buffer);
+    m_data = m_buffer.data();
+  }
+  m_detached = true;
+}
+
+#endif
+
+MappedFile::~MappedFile()
+{
+  {
+    const std::lock_guard lock(g_mappedFilesMutex);
+    auto it = std::find(g_mappedFiles.begin(), g_mappedFiles.end(), this);
+    if (it != g_mappedFiles.end())
+      g_mappedFiles.erase(it);
+  }
+  unmap();
+}
+
+// static
+void MappedFile::detachAll(const std::string& filename)
+{
+  const std::lock_guard lock(g_mappedFilesMutex);
+  for (MappedFile* file : g_mappedFiles) {
+    if (file->isValid() && file->isSameFile(filename))
+      file->detach();
+  }
+}
+
+MappedFile::Reader::Reader(const std::shared_ptr<MappedFile>& file)
+  : m_file(file)
+  , m_lock(file->m_mutex)
+{
+}
+
+const uint8_t* MappedFile::Reader::data() const
+{
+  if (m_file->wasModified())
+    return nullptr;
+  return m_file->m_data;
+}
+
+//////////////////////////////////////////////////////////////////////
+// MemoryFileInterface
+
+MemoryFileInterface::MemoryFileInterface(const uint8_t* data, size_t size)
+  : m_data(data)
+  , m_size(size)
+  , m_pos(0)
+  , m_ok(data != nullptr)
+{
+}
+
+bool MemoryFileInterface::ok() const
+{
+  return m_ok;
+}
+
+size_t MemoryFileInterface::tell()
+{
+  return m_pos;
+}
+
+void MemoryFileInterface::seek(size_t absPos)
+{
+  m_pos = absPos;
+}
+
+uint8_t MemoryFileInterface::read8()
+{
+  if (m_pos < m_size)
+    return m_data[m_pos++];
+
+  m_ok = false;
+  return 0;
+}
+
+size_t MemoryFileInterface::readBytes(uint8_t* buf, size_t n)
+{
+  const size_t n2 = (m_pos < m_size ? std::min(n, m_size - m_pos): 0);
+  if (n2 > 0) {
+    std::memcpy(buf, m_data+m_pos, n2);
+    m_pos += n2;
+  }
+  if (n2 != n)
+    m_ok = false;
+  return n2;
+}
+
+void MemoryFileInterface::write8(uint8_t value)
+{
+  // Read-only
+  m_ok = false;
+}
+
+//////////////////////////////////////////////////////////////////////
+// MmapFileInterface
+
+MmapFileInterface::MmapFileInterface(const MappedFileRef& file)
+  : MappedFile::Reader(file)
+  , MemoryFileInterface(MappedFile::Reader::data(),
+                        MappedFile::Reader::size())
+  , m_file(file)
+{
+}
+
+MappedFileRef MmapFileInterface::mappedFile() const
+{
+  return m_file;
+}
+
+} // namespace dio
@@ -1,5 +1,5 @@
 // Aseprite Document Library
-// Copyright (c) 2019  Igara Studio S.A.
+// Copyright (c) 2019-2023  Igara Studio S.A.
 // Copyright (c) 2001-2018 David Capello
 //
 // This file is released under the terms of the MIT license.
@@ -16,32 +16,331 @@
 #include "doc/palette.h"
 #include "doc/primitives_fast.h"
 #include "doc/rgbmap.h"
+#include "doc/worker_pool.h"
 #include "gfx/point.h"
 
+#include <algorithm>
 #include <cmath>
+#include <cstring>
+#include <vector>
+
+#if defined(__x86_64__) || defined(_WIN64)
+  #define DOC_RESIZE_IMAGE_SSE2 1
+  #include <emmintrin.h>
+#endif
 
 namespace doc {
 namespace algorithm {
 
+namespace {
+
+// Number of destination rows processed by each task
+const int kRowsPerChunk = 16;
+
+// Fixed-point weights of the resampler (the sum of all weights of
+// one destination pixel is kWeightOne)
+const int kWeightBits = 14;
+const int kWeightOne = (1 << kWeightBits);
+
+// The horizontal pass keeps 7 fractional bits so the values (up to
+// 255<<7) fit in a int16 for the vertical pass.
+const int kHorzShift = kWeightBits - 7;
+const int kVertShift = kWeightBits + 7;
+
+// Source pixels (and their weights) used to calculate each
+// destination pixel in one axis.
+struct ResizeFilter {
+  std::vector<int> start;       // First source pixel
+  std::vector<int> count;       // Number of source pixels
+  std::vector<int16_t> weights; // "taps" weights for each destination pixel
+  int taps = 0;
+
+  ResizeFilter(const int srcSize, const int dstSize);
+};
+
+// Uses bilinear interpolation to upscale (with the same pixel
+// coordinates of the old bilinear implementation: corners of the
+// source and destination images are aligned), and area averaging to
+// downscale (the destination pixel is the average of all the source
+// pixels that it covers).
+ResizeFilter::ResizeFilter(const int srcSize, const int dstSize)
+  : start(dstSize)
+  , count(dstSize)
+{
+  if (dstSize >= srcSize) {
+    taps = 2;
+    weights.resize(dstSize*taps, 0);
+
+    const double du = (dstSize > 1 ? double(srcSize-1) / double(dstSize-1): 0.0);
+    for (int x=0; x<dstSize; ++x) {
+      const double u = x * du;
+      const int u0 = std::min(int(std::floor(u)), srcSize-1);
+      const int w1 = std::clamp(int((u - u0) * kWeightOne + 0.5), 0, kWeightOne);
+
+      start[x] = u0;
+      if (u0 < srcSize-1 && w1 > 0) {
+        count[x] = 2;
+        weights[x*taps] = kWeightOne - w1;
+        weights[x*taps+1] = w1;
+      }
+      else {
+        count[x] = 1;
+        weights[x*taps] = kWeightOne;
+      }
+    }
+  }
+  else {
+    const double ratio = double(srcSize) / double(dstSize);
+    taps = int(std::ceil(ratio)) + 1;
+    weights.resize(dstSize*taps, 0);
+
+    for (int x=0; x<dstSize; ++x) {
+      const double a = x * ratio;
+      const double b = std::min<double>(srcSize, (x+1) * ratio);
+      const int u0 = std::min(int(std::floor(a)), srcSize-1);
+      const int u1 = std::clamp(int(std::ceil(b)), u0+1, srcSize);
+
+      start[x] = u0;
+      count[x] = u1 - u0;
+      ASSERT(count[x] <= taps);
+
+      int16_t* w = &weights[x*taps];
+      int sum = 0, biggest = 0;
+      for (int i=0; i<count[x]; ++i) {
+        const double overlap =
+          std::min<double>(b, u0+i+1) - std::max<double>(a, u0+i);
+        w[i] = int16_t(std::max(0.0, overlap / ratio) * kWeightOne + 0.5);
+        sum += w[i];
+        if (w[i] > w[biggest])
+          biggest = i;
+      }
+      // Fix rounding errors so the sum of the weights is exactly 1.0
+      w[biggest] += kWeightOne - sum;
+    }
+  }
+}
+
+// Horizontal pass: resamples one source row of "Channels" bytes per
+// pixel (RGBA or GRAYA) to dstWidth pixels of 16-bit channels.
+template<int Channels>
+void resize_row_horz(const uint8_t* src, uint16_t* dst,
+                     const ResizeFilter& filter)
+{
+  const int dstWidth = int(filter.start.size());
+  for (int x=0; x<dstWidth; ++x, dst+=Channels) {
+    const uint8_t* s = src + filter.start[x]*Channels;
+    const int16_t* w = &filter.weights[x*filter.taps];
+    const int n = filter.count[x];
+
+    int acc[Channels] = { 0 };
+    for (int i=0; i<n; ++i, s+=Channels)
+      for (int c=0; c<Channels; ++c)
+        acc[c] += int(s[c]) * w[i];
+
+    for (int c=0; c<Channels; ++c)
+      dst[c] = uint16_t((acc[c] + (1 << (kHorzShift-1))) >> kHorzShift);
+  }
+}
+
+// Vertical pass: combines "n" rows of the horizontal pass with
+// their weights, and stores the 8-bit channels in the destination
+// row (which has the same byte layout of RGBA/GRAYA pixels).
+void resize_row_vert(const uint16_t* const* rows, const int16_t* weights,
+                     const int n, uint8_t* dst, const int size,
+                     std::vector<int>& acc)
+{
+  int i = 0;
+
+#if DOC_RESIZE_IMAGE_SSE2
+  const __m128i zero = _mm_setzero_si128();
+  const __m128i round = _mm_set1_epi32(1 << (kVertShift-1));
+  for (; i+8<=size; i+=8) {
+    __m128i lo = round;
+    __m128i hi = round;
+    for (int k=0; k<n; ++k) {
+      // The values are less than 0x8000 and the high 16 bits of the
+      // weight are zero, so _mm_madd_epi16() gives the 32-bit product.
+      const __m128i w = _mm_set1_epi32(weights[k]);
+      const __m128i v = _mm_loadu_si128((const __m128i*)(rows[k]+i));
+      lo = _mm_add_epi32(lo, _mm_madd_epi16(_mm_unpacklo_epi16(v, zero), w));
+      hi = _mm_add_epi32(hi, _mm_madd_epi16(_mm_unpackhi_epi16(v, zero), w));
+    }
+    lo = _mm_srli_epi32(lo, kVertShift);
+    hi = _mm_srli_epi32(hi, kVertShift);
+    const __m128i v16 = _mm_packs_epi32(lo, hi);
+    _mm_storel_epi64((__m128i*)(dst+i), _mm_packus_epi16(v16, v16));
+  }
+#endif
+
+  if (i < size) {
+    // Generic version (the compiler can vectorize these loops)
+    acc.resize(size);
+    std::fill(acc.begin()+i, acc.end(), 1 << (kVertShift-1));
+    for (int k=0; k<n; ++k) {
+      const uint16_t* row = rows[k];
+      const int w = weights[k];
+      for (int j=i; j<size; ++j)
+        acc[j] += int(row[j]) * w;
+    }
+    for (; i<size; ++i)
+      dst[i] = uint8_t(std::min(255, acc[i] >> kVertShift));
+  }
+}
+
+// Separable fixed-point resampler for RGB and grayscale images. Each
+// chunk of destination rows calculates the horizontal pass of the
+// source rows that it needs, and then the vertical pass of each
+// destination row.
+void resize_image_separable(const Image* src, Image* dst)
+{
+  ASSERT(src->pixelFormat() == dst->pixelFormat());
+  ASSERT(src->pixelFormat() == IMAGE_RGB ||
+         src->pixelFormat() == IMAGE_GRAYSCALE);
+
+  const int channels = src->bytesPerPixel();
+  const int rowSize = dst->width()*channels;
+  const ResizeFilter horz(src->width(), dst->width());
+  const ResizeFilter vert(src->height(), dst->height());
+
+  for_each_row_band(
+    dst->width(), dst->height(), kRowsPerChunk, true,
+    [src, dst, channels, rowSize, &horz, &vert](const int y1, const int y2){
+      const int sy1 = vert.start[y1];
+      const int sy2 = vert.start[y2-1] + vert.count[y2-1];
+
+      std::vector<uint16_t> horzRows(std::size_t(sy2-sy1) * rowSize);
+      for (int sy=sy1; sy<sy2; ++sy) {
+        const uint8_t* srcRow = src->getPixelAddress(0, sy);
+        uint16_t* horzRow = &horzRows[std::size_t(sy-sy1) * rowSize];
+        if (channels == 4)
+          resize_row_horz<4>(srcRow, horzRow, horz);
+        else
+          resize_row_horz<2>(srcRow, horzRow, horz);
+      }
+
+      std::vector<const uint16_t*> rows(vert.taps);
+      std::vector<int> acc;
+      for (int y=y1; y<y2; ++y) {
+        const int n = vert.count[y];
+        for (int k=0; k<n; ++k)
+          rows[k] = &horzRows[std::size_t(vert.start[y]+k-sy1) * rowSize];
+
+        resize_row_vert(rows.data(), &vert.weights[y*vert.taps], n,
+                        dst->getPixelAddress(0, y), rowSize, acc);
+      }
+    });
+}
+
 template<typename ImageTraits>
 void resize_image_nearest(const Image* src, Image* dst)
 {
   double x_ratio = double(src->width()) / double(dst->width());
   double y_ratio = double(src->height()) / double(dst->height());
-  double px, py;
 
-  LockImageBits<ImageTraits> dstBits(dst);
-  auto dstIt = dstBits.begin();
+  // Source X coordinate of each destination column
+  std::vector<int> srcX(dst->width());
+  for (int x=0; x<dst->width(); ++x)
+    srcX[x] = int(std::floor(x * x_ratio));
+
+  for_each_row_band(
+    dst->width(), dst->height(), kRowsPerChunk, true,
+    [src, dst, y_ratio, &srcX](const int y1, const int y2){
+      for (int y=y1; y<y2; ++y) {
+        const int py = int(std::floor(y * y_ratio));
+
+        if constexpr (ImageTraits::pixel_format == IMAGE_BITMAP) {
+          for (int x=0; x<dst->width(); ++x)
+            put_pixel_fast<ImageTraits>(
+              dst, x, y, get_pixel_fast<ImageTraits>(src, srcX[x], py));
+        }
+        else {
+          auto srcRow = (typename ImageTraits::const_address_t)src->getPixelAddress(0, py);
+          auto dstRow = (typename ImageTraits::address_t)dst->getPixelAddress(0, y);
+          for (int x=0; x<dst->width(); ++x)
+            dstRow[x] = srcRow[srcX[x]];
+        }
+      }
+    });
+}
+
+// TODO optimize this
+void resize_image_bilinear_indexed(const Image* src,
+                                   Image* dst,
+                                   const Palette* pal,
+                                   const RgbMap* rgbmap,
+                                   const color_t maskColor)
+{
+  uint32_t color[4];
+  double u, v, du, dv;
+  int u_floor, u_floor2;
+  int v_floor, v_floor2;
+  int x, y;
 
-  for (int y=0; y<dst->height(); ++y) {
-    py = std::floor(y * y_ratio);
-    for (int x=0; x<dst->width(); ++x, ++dstIt) {
-      px = std::floor(x * x_ratio);
-      *dstIt = get_pixel_fast<ImageTraits>(src, int(px), int(py));
+  u = v = 0.0;
+  du = (src->width()-1) * 1.0 / (dst->width()-1);
+  dv = (src->height()-1) * 1.0 / (dst->height()-1);
+  for (y=0; y<dst->height(); ++y) {
+    for (x=0; x<dst->width(); ++x) {
+      u_floor = (int)std::floor(u);
+      v_floor = (int)std::floor(v);
+
+      if (u_floor > src->width()-1) {
+        u_floor = src->width()-1;
+        u_floor2 = src->width()-1;
+      }
+      else if (u_floor == src->width()-1)
+        u_floor2 = u_floor;
+      else
+        u_floor2 = u_floor+1;
+
+      if (v_floor > src->height()-1) {
+        v_floor = src->height()-1;
+        v_floor2 = src->height()-1;
+      }
+      else if (v_floor == src->height()-1)
+        v_floor2 = v_floor;
+      else
+        v_floor2 = v_floor+1;
+
+      // get the four colors
+      color[0] = src->getPixel(u_floor,  v_floor);
+      color[1] = src->getPixel(u_floor2, v_floor);
+      color[2] = src->getPixel(u_floor,  v_floor2);
+      color[3] = src->getPixel(u_floor2, v_floor2);
+
+      // calculate the interpolated color
+      double u1 = u - u_floor;
+      double v1 = v - v_floor;
+      double u2 = 1 - u1;
+      double v2 = 1 - v1;
+
+      // Convert index to RGBA values
+      for (int i=0; i<4; ++i) {
+        if (color[i] == maskColor)
+          color[i] = pal->getEntry(color[i]) & rgba_rgb_mask; // Set alpha = 0
+        else
+          color[i] = pal->getEntry(color[i]);
+      }
+
+      int r = int((rgba_getr(color[0])*u2 + rgba_getr(color[1])*u1)*v2 +
+                  (rgba_getr(color[2])*u2 + rgba_getr(color[3])*u1)*v1);
+      int g = int((rgba_getg(color[0])*u2 + rgba_getg(color[1])*u1)*v2 +
+                  (rgba_getg(color[2])*u2 + rgba_getg(color[3])*u1)*v1);
+      int b = int((rgba_getb(color[0])*u2 + rgba_getb(color[1])*u1)*v2 +
+                  (rgba_getb(color[2])*u2 + rgba_getb(color[3])*u1)*v1);
+      int a = int((rgba_geta(color[0])*u2 + rgba_geta(color[1])*u1)*v2 +
+                  (rgba_geta(color[2])*u2 + rgba_geta(color[3])*u1)*v1);
+
+      dst->putPixel(x, y, rgbmap->mapColor(r, g, b, a));
+      u += du;
     }
+    u = 0.0;
+    v += dv;
   }
 }
 
+} // anonymous namespace
+
 void resize_image(const Image* src,
                   Image* dst,
                   const ResizeMethod method,
@@ -51,7 +350,6 @@ void resize_image(const Image* src,
 {
   switch (method) {
 
-    // TODO optimize this
     case RESIZE_METHOD_NEAREST_NEIGHBOR: {
       ASSERT(src->pixelFormat() == dst->pixelFormat());
 
@@ -64,111 +362,34 @@ void resize_image(const Image* src,
       break;
     }
 
-    // TODO optimize this
     case RESIZE_METHOD_BILINEAR: {
-      uint32_t color[4], dst_color = 0;
-      double u, v, du, dv;
-      int u_floor, u_floor2;
-      int v_floor, v_floor2;
-      int x, y;
-
-      // We cannot do interpolations between RGB values on indexed
-      // images without a palette/rgbmap.
-      if (dst->pixelFormat() == IMAGE_INDEXED &&
-          (!pal || !rgbmap)) {
-        resize_image(
-          src, dst,
-          RESIZE_METHOD_NEAREST_NEIGHBOR,
-          pal, rgbmap, maskColor);
-        return;
-      }
-
-      u = v = 0.0;
-      du = (src->width()-1) * 1.0 / (dst->width()-1);
-      dv = (src->height()-1) * 1.0 / (dst->height()-1);
-      for (y=0; y<dst->height(); ++y) {
-        for (x=0; x<dst->width(); ++x) {
-          u_floor = (int)std::floor(u);
-          v_floor = (int)std::floor(v);
-
-          if (u_floor > src->width()-1) {
-            u_floor = src->width()-1;
-            u_floor2 = src->width()-1;
+      switch (dst->pixelFormat()) {
+
+        case IMAGE_RGB:
+        case IMAGE_GRAYSCALE:
+          resize_image_separable(src, dst);
+          break;
+
+        case IMAGE_INDEXED:
+          // We cannot do interpolations between RGB values on indexed
+          // images without a palette/rgbmap.
+          if (!pal || !rgbmap) {
+            resize_image(
+              src, dst,
+              RESIZE_METHOD_NEAREST_NEIGHBOR,
+              pal, rgbmap, maskColor);
           }
-          else if (u_floor == src->width()-1)
-            u_floor2 = u_floor;
-          else
-            u_floor2 = u_floor+1;
-
-          if (v_floor > src->height()-1) {
-            v_floor = src->height()-1;
-            v_floor2 = src->height()-1;
+          else {
+            resize_image_bilinear_indexed(src, dst, pal, rgbmap, maskColor);
           }
-          else if (v_floor == src->height()-1)
-            v_floor2 = v_floor;
-          else
-            v_floor2 = v_floor+1;
-
-          // get the four colors
-          color[0] = src->getPixel(u_floor,  v_floor);
-          color[1] = src->getPixel(u_floor2, v_floor);
-          color[2] = src->getPixel(u_floor,  v_floor2);
-          color[3] = src->getPixel(u_floor2, v_floor2);
-
-          // calculate the interpolated color
-          double u1 = u - u_floor;
-          double v1 = v - v_floor;
-          double u2 = 1 - u1;
-          double v2 = 1 - v1;
-
-          switch (dst->pixelFormat()) {
-            case IMAGE_RGB: {
-              int r = int((rgba_getr(color[0])*u2 + rgba_getr(color[1])*u1)*v2 +
-                          (rgba_getr(color[2])*u2 + rgba_getr(color[3])*u1)*v1);
-              int g = int((rgba_getg(color[0])*u2 + rgba_getg(color[1])*u1)*v2 +
-                          (rgba_getg(color[2])*u2 + rgba_getg(color[3])*u1)*v1);
-              int b = int((rgba_getb(color[0])*u2 + rgba_getb(color[1])*u1)*v2 +
-                          (rgba_getb(color[2])*u2 + rgba_getb(color[3])*u1)*v1);
-              int a = int((rgba_geta(color[0])*u2 + rgba_geta(color[1])*u1)*v2 +
-                          (rgba_geta(color[2])*u2 + rgba_geta(color[3])*u1)*v1);
-              dst_color = rgba(r, g, b, a);
-              break;
-            }
-            case IMAGE_GRAYSCALE: {
-              int v = int((graya_getv(color[0])*u2 + graya_getv(color[1])*u1)*v2 +
-                          (graya_getv(color[2])*u2 + graya_getv(color[3])*u1)*v1);
-              int a = int((graya_geta(color[0])*u2 + graya_geta(color[1])*u1)*v2 +
-                          (graya_geta(color[2])*u2 + graya_geta(color[3])*u1)*v1);
-              dst_color = graya(v, a);
-              break;
-            }
-            case IMAGE_INDEXED: {
-              // Convert index to RGBA values
-              for (int i=0; i<4; ++i) {
-                if (color[i] == maskColor)
-                  color[i] = pal->getEntry(color[i]) & rgba_rgb_mask; // Set alpha = 0
-                else
-                  color[i] = pal->getEntry(color[i]);
-              }
-
-              int r = int((rgba_getr(color[0])*u2 + rgba_getr(color[1])*u1)*v2 +
-                          (rgba_getr(color[2])*u2 + rgba_getr(color[3])*u1)*v1);
-              int g = int((rgba_getg(color[0])*u2 + rgba_getg(color[1])*u1)*v2 +
-                          (rgba_getg(color[2])*u2 + rgba_getg(color[3])*u1)*v1);
-              int b = int((rgba_getb(color[0])*u2 + rgba_getb(color[1])*u1)*v2 +
-                          (rgba_getb(color[2])*u2 + rgba_getb(color[3])*u1)*v1);
-              int a = int((rgba_geta(color[0])*u2 + rgba_geta(color[1])*u1)*v2 +
-                          (rgba_geta(color[2])*u2 + rgba_geta(color[3])*u1)*v1);
-              dst_color = rgbmap->mapColor(r, g, b, a);
-              break;
-            }
-          }
-
-          dst->putPixel(x, y, dst_color);
-          u += du;
-        }
-        u = 0.0;
-        v += dv;
+          break;
+
+        case IMAGE_BITMAP:
+          resize_image(
+            src, dst,
+            RESIZE_METHOD_NEAREST_NEIGHBOR,
+            pal, rgbmap, maskColor);
+          break;
       }
       break;
     }
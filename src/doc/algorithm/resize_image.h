@@ -1,5 +1,5 @@
 // Aseprite Document Library
-// Copyright (c) 2019  Igara Studio S.A.
+// Copyright (c) 2019-2023  Igara Studio S.A.
 // Copyright (c) 2001-2018 David Capello
 //
 // This file is released under the terms of the MIT license.
@@ -21,6 +21,8 @@ namespace doc {
 
     enum ResizeMethod {
       RESIZE_METHOD_NEAREST_NEIGHBOR,
+      // Bilinear interpolation to upscale and area averaging to
+      // downscale (for RGB and grayscale images)
       RESIZE_METHOD_BILINEAR,
       RESIZE_METHOD_ROTSPRITE,
     };
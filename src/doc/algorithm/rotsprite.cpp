@@ -9,171 +9,292 @@
 #include "config.h"
 #endif
 
-#include "doc/algorithm/rotate.h"
+#include "doc/algorithm/rotsprite.h"
+
+#include "doc/blend_funcs.h"
 #include "doc/image_impl.h"
-#include "doc/primitives.h"
+#include "doc/worker_pool.h"
+#include "gfx/rect.h"
 
 #include <algorithm>
-#include <memory>
+#include <atomic>
+#include <cmath>
+#include <vector>
 
 namespace doc {
 namespace algorithm {
 
+namespace {
+
+// Size of the destination tiles that each thread processes
+const int kTileSize = 64;
+
+// Maximum number of pixels of the scratch buffer that caches the
+// first Scale2x pass of the source area used by one tile (when the
+// source is scaled down a lot, the area can be too big to cache it)
+const int kMaxScratchPixels = 16*kTileSize*kTileSize;
+
 // More information about EPX/Scale2x:
 // http://en.wikipedia.org/wiki/Pixel_art_scaling_algorithms#EPX.2FScale2.C3.97.2FAdvMAME2.C3.97
 // http://scale2x.sourceforge.net/algorithm.html
 // http://scale2x.sourceforge.net/scale2xandepx.html
-template<typename ImageTraits>
-static void image_scale2x_tpl(Image* dst, const Image* src, int src_w, int src_h)
+//
+// Returns the pixel (x, y) of an image scaled with Scale2x, where
+// "get(u, v)" returns the pixels of the original image of w*h size:
+//
+//   A
+// C P B
+//   D
+//
+template<typename Getter>
+inline color_t scale2x_pixel(const int x, const int y,
+                             const int w, const int h,
+                             const Getter& get)
 {
-#if 0      // TODO complete this implementation that should be faster
-           // than using a lot of get/put_pixel_fast calls.
-  int dst_w = src_w*2;
-  int dst_h = src_h*2;
-
-  LockImageBits<ImageTraits> dstBits(dst, Image::WriteLock, gfx::Rect(0, 0, dst_w, dst_h));
-  const LockImageBits<ImageTraits> srcBits(src);
-
-  LockImageBits<ImageTraits>::iterator dstRow0_it = dstBits.begin();
-  LockImageBits<ImageTraits>::iterator dstRow1_it = dstBits.begin();
-  LockImageBits<ImageTraits>::iterator dstRow0_end = dstBits.end();
-  LockImageBits<ImageTraits>::iterator dstRow1_end = dstBits.end();
-
-  // Iterators:
-  //   A
-  // C P B
-  //   D
-  //
-  // These iterators are displaced through src image and are modified in this way:
-  //
-  // P: is the simplest one, we just start from (0, 0) to srcEnd.
-  // A: starts from row 0 (so A = P in the first row), then we start
-  //    again from the row 0.
-  // B: It starts from (1, row) and in the last pixel we don't moved it.
-  // C: It starts from (0, 0) and then it is moved with a delay.
-  // D: It starts from row 1 and continues until we reach the last
-  //    row, in that case we start D iterator again.
-  //
-  LockImageBits<ImageTraits>::const_iterator itP, itA, itB, itC, itD, savedD;
-  LockImageBits<ImageTraits>::const_iterator srcEnd = srcBits.end();
-  color_t P, A, B, C, D;
-
-  // Adjust iterators
-  itP = itA = itB = itC = itD = savedD = srcBits.begin();
-  dstRow1_it += dst_w;
-  itD += src->width();
-
-  for (int y=0; y<src_h; ++y) {
-    if (y == 1) itA = srcBits.begin();
-    if (y == src_h-2) savedD = itD;
-    if (y == src_h-1) itD = savedD;
-    ++itB;
-
-    for (int x=0; x<src_w; ++x) {
-      ASSERT(itP != srcEnd);
-      ASSERT(itA != srcEnd);
-      ASSERT(itB != srcEnd);
-      ASSERT(itC != srcEnd);
-      ASSERT(itD != srcEnd);
-      ASSERT(dstRow0_it != dstRow0_end);
-      ASSERT(dstRow1_it != dstRow1_end);
-
-      P = *itP;
-      A = *itA;                 // y-1
-      B = *itB;                 // x+1
-      C = *itC;                 // x-1
-      D = *itD;                 // y+1
-
-      *dstRow0_it = (C == A && C != D && A != B ? A: P);
-      ++dstRow0_it;
-      *dstRow0_it = (A == B && A != C && B != D ? B: P);
-      ++dstRow0_it;
-
-      *dstRow1_it = (D == C && D != B && C != A ? C: P);
-      ++dstRow1_it;
-      *dstRow1_it = (B == D && B != A && D != C ? D: P);
-      ++dstRow1_it;
-
-      ++itP;
-      ++itA;
-      if (x < src_w-2) ++itB;
-      if (x > 0) ++itC;
-      ++itD;
-    }
+  const int u = (x >> 1);
+  const int v = (y >> 1);
+  const color_t P = get(u, v);
+  const color_t A = (v > 0 ? get(u, v-1): P);
+  const color_t B = (u < w-1 ? get(u+1, v): P);
+  const color_t C = (u > 0 ? get(u-1, v): P);
+  const color_t D = (v < h-1 ? get(u, v+1): P);
+
+  if ((y & 1) == 0) {
+    if ((x & 1) == 0)
+      return (C == A && C != D && A != B ? A: P);
+    else
+      return (A == B && A != C && B != D ? B: P);
+  }
+  else {
+    if ((x & 1) == 0)
+      return (D == C && D != B && C != A ? C: P);
+    else
+      return (B == D && B != A && D != C ? D: P);
+  }
+}
+
+// Returns pixels of the source image scaled 8x with three Scale2x
+// passes, calculating only the Scale2x neighbourhood of each pixel
+// instead of the whole 8x image. The first pass of the source area
+// used by each tile is cached in a scratch buffer, so each thread
+// needs its own sampler.
+template<typename ImageTraits>
+class Scale2xSampler {
+public:
+  Scale2xSampler(const Image* src)
+    : m_src(src)
+    , m_w(src->width())
+    , m_h(src->height()) {
+  }
 
-    // Adjust iterators for the next two rows.
-    ++itB;
-    ++itC;
-    dstRow0_it += dst_w;
-    if (y < src_h-1)
-      dstRow1_it += dst_w;
-  }
-
-  // ASSERT(itP == srcEnd);
-  // ASSERT(itA == srcEnd);
-  // ASSERT(itB == srcEnd);
-  // ASSERT(itC == srcEnd);
-  // ASSERT(itD == srcEnd);
-  ASSERT(dstRow0_it == dstRow0_end);
-  ASSERT(dstRow1_it == dstRow1_end);
-#else
-
-#define A c[0]
-#define B c[1]
-#define C c[2]
-#define D c[3]
-#define P c[4]
-
-  LockImageBits<ImageTraits> dstBits(dst, gfx::Rect(0, 0, src_w*2, src_h*2));
-  auto dstIt = dstBits.begin();
-  auto dstIt2 = dstIt;
-
-  color_t c[5];
-  for (int y=0; y<src_h; ++y) {
-    dstIt2 += src_w*2;
-    for (int x=0; x<src_w; ++x) {
-      P = get_pixel_fast<ImageTraits>(src, x, y);
-      A = (y > 0 ? get_pixel_fast<ImageTraits>(src, x, y-1): P);
-      B = (x < src_w-1 ? get_pixel_fast<ImageTraits>(src, x+1, y): P);
-      C = (x > 0 ? get_pixel_fast<ImageTraits>(src, x-1, y): P);
-      D = (y < src_h-1 ? get_pixel_fast<ImageTraits>(src, x, y+1): P);
-
-      *dstIt = (C == A && C != D && A != B ? A: P);
-      ++dstIt;
-      *dstIt = (A == B && A != C && B != D ? B: P);
-      ++dstIt;
-
-      *dstIt2 = (D == C && D != B && C != A ? C: P);
-      ++dstIt2;
-      *dstIt2 = (B == D && B != A && D != C ? D: P);
-      ++dstIt2;
+  // Prepares the scratch buffer to sample the given area of the 8x
+  // image.
+  void prepare(const gfx::Rect& area) {
+    // Each pixel of a Scale2x pass depends on the previous pass
+    // pixel (and its 4 neighbours), so we need 2 extra pixels
+    // around the area of the 2x image.
+    m_cached = gfx::Rect(gfx::Point((area.x >> 2) - 2,
+                                    (area.y >> 2) - 2),
+                         gfx::Point(((area.x2()-1) >> 2) + 3,
+                                    ((area.y2()-1) >> 2) + 3))
+      .createIntersection(gfx::Rect(0, 0, m_w*2, m_h*2));
+
+    if (m_cached.w*m_cached.h > kMaxScratchPixels) {
+      m_cached = gfx::Rect();
+      return;
     }
-    dstIt += src_w*2;
+
+    m_scratch.resize(m_cached.w*m_cached.h);
+    auto it = m_scratch.begin();
+    for (int y=m_cached.y; y<m_cached.y2(); ++y)
+      for (int x=m_cached.x; x<m_cached.x2(); ++x, ++it)
+        *it = pixel2x(x, y);
   }
 
-#endif
+  // Returns the pixel (x, y) of the 8x image
+  color_t operator()(const int x, const int y) const {
+    return scale2x_pixel(
+      x, y, m_w*4, m_h*4,
+      [this](const int u, const int v){ return pixel4x(u, v); });
+  }
+
+private:
+  color_t pixel2x(const int x, const int y) const {
+    return scale2x_pixel(
+      x, y, m_w, m_h,
+      [this](const int u, const int v){
+        return get_pixel_fast<ImageTraits>(m_src, u, v);
+      });
+  }
+
+  color_t cachedPixel2x(const int x, const int y) const {
+    if (m_cached.contains(gfx::Point(x, y)))
+      return m_scratch[(y-m_cached.y)*m_cached.w + (x-m_cached.x)];
+    else
+      return pixel2x(x, y);
+  }
+
+  color_t pixel4x(const int x, const int y) const {
+    return scale2x_pixel(
+      x, y, m_w*2, m_h*2,
+      [this](const int u, const int v){ return cachedPixel2x(u, v); });
+  }
+
+  const Image* m_src;
+  const int m_w, m_h;
+  gfx::Rect m_cached;
+  std::vector<color_t> m_scratch;
+};
+
+// Same blending rules used by the parallelogram() delegates
+template<typename ImageTraits>
+inline void put_rotsprite_pixel(Image* dst, const int x, const int y,
+                                const color_t c, const color_t maskColor)
+{
+  if constexpr (ImageTraits::pixel_format == IMAGE_RGB) {
+    if (rgba_geta(maskColor) == 0 ||
+        (c & rgba_rgb_mask) != (maskColor & rgba_rgb_mask)) {
+      put_pixel_fast<ImageTraits>(
+        dst, x, y,
+        rgba_blender_normal(get_pixel_fast<ImageTraits>(dst, x, y), c));
+    }
+  }
+  else if constexpr (ImageTraits::pixel_format == IMAGE_GRAYSCALE) {
+    if (graya_geta(maskColor) == 0 ||
+        (c & graya_v_mask) != (maskColor & graya_v_mask)) {
+      put_pixel_fast<ImageTraits>(
+        dst, x, y,
+        graya_blender_normal(get_pixel_fast<ImageTraits>(dst, x, y), c));
+    }
+  }
+  else if constexpr (ImageTraits::pixel_format == IMAGE_INDEXED) {
+    if (c != maskColor)
+      put_pixel_fast<ImageTraits>(dst, x, y, c);
+  }
+  else {
+    if (c != 0)
+      put_pixel_fast<ImageTraits>(dst, x, y, c);
+  }
 }
 
-static void image_scale2x(Image* dst, const Image* src, int src_w, int src_h)
+// Inverse of the affine transformation that maps the source image
+// to the destination parallelogram. It converts the center of a
+// destination pixel to coordinates in the 8x source image.
+struct InverseMap {
+  double x0, y0;                // Destination corner of the source origin
+  double sx_dx, sx_dy;          // Change of the 8x source X coordinate
+  double sy_dx, sy_dy;          // Change of the 8x source Y coordinate
+
+  double sx(const double x, const double y) const {
+    return (x-x0)*sx_dx + (y-y0)*sx_dy;
+  }
+  double sy(const double x, const double y) const {
+    return (x-x0)*sy_dx + (y-y0)*sy_dy;
+  }
+};
+
+template<typename ImageTraits>
+void rotsprite_tile(Image* bmp, const Image* spr, const Image* mask,
+                    const InverseMap& map,
+                    const gfx::Rect& tile,
+                    Scale2xSampler<ImageTraits>& sampler)
 {
-  switch (src->pixelFormat()) {
-    case IMAGE_RGB:       image_scale2x_tpl<RgbTraits>(dst, src, src_w, src_h); break;
-    case IMAGE_GRAYSCALE: image_scale2x_tpl<GrayscaleTraits>(dst, src, src_w, src_h); break;
-    case IMAGE_INDEXED:   image_scale2x_tpl<IndexedTraits>(dst, src, src_w, src_h); break;
-    case IMAGE_BITMAP:    image_scale2x_tpl<BitmapTraits>(dst, src, src_w, src_h); break;
+  const int w8 = spr->width()*8;
+  const int h8 = spr->height()*8;
+
+  // Area of the 8x source image used by this tile
+  double x1 = w8, y1 = h8, x2 = 0, y2 = 0;
+  for (const gfx::Point& pt : { tile.origin(),
+                                gfx::Point(tile.x2(), tile.y),
+                                gfx::Point(tile.x, tile.y2()),
+                                tile.point2() }) {
+    const double sx = map.sx(pt.x, pt.y);
+    const double sy = map.sy(pt.x, pt.y);
+    x1 = std::min(x1, sx);
+    y1 = std::min(y1, sy);
+    x2 = std::max(x2, sx);
+    y2 = std::max(y2, sy);
+  }
+  const gfx::Rect area =
+    gfx::Rect(gfx::Point(int(std::floor(std::max(0.0, x1))),
+                         int(std::floor(std::max(0.0, y1)))),
+              gfx::Point(int(std::floor(std::min<double>(w8-1, x2)))+1,
+                         int(std::floor(std::min<double>(h8-1, y2)))+1))
+    .createIntersection(gfx::Rect(0, 0, w8, h8));
+  if (area.isEmpty())
+    return;
+
+  sampler.prepare(area);
+
+  const color_t maskColor = spr->maskColor();
+  const gfx::Rect maskBounds = (mask ? mask->bounds(): gfx::Rect());
+
+  for (int y=tile.y; y<tile.y2(); ++y) {
+    double sx = map.sx(tile.x+0.5, y+0.5);
+    double sy = map.sy(tile.x+0.5, y+0.5);
+
+    for (int x=tile.x; x<tile.x2(); ++x,
+           sx += map.sx_dx,
+           sy += map.sy_dx) {
+      if (sx < 0.0 || sy < 0.0 || sx >= w8 || sy >= h8)
+        continue;
+
+      const int u = int(sx);
+      const int v = int(sy);
+      if (mask &&
+          (!maskBounds.contains(gfx::Point(u >> 3, v >> 3)) ||
+           !get_pixel_fast<BitmapTraits>(mask, u >> 3, v >> 3)))
+        continue;
+
+      put_rotsprite_pixel<ImageTraits>(bmp, x, y, sampler(u, v), maskColor);
+    }
   }
 }
 
-void rotsprite_image(Image* bmp, const Image* spr, const Image* mask,
-  int x1, int y1, int x2, int y2,
-  int x3, int y3, int x4, int y4)
+template<typename ImageTraits>
+void rotsprite_image_tpl(Image* bmp, const Image* spr, const Image* mask,
+                         const InverseMap& map,
+                         const gfx::Rect& bounds,
+                         const std::function<bool()>& isCanceled)
 {
-  static ImageBufferPtr buf[3]; // TODO non-thread safe
+  // Tiles are aligned to kTileSize in the destination image so two
+  // threads never modify the same byte of a bitmap.
+  std::vector<gfx::Rect> tiles;
+  for (int y=bounds.y - (bounds.y % kTileSize); y<bounds.y2(); y+=kTileSize)
+    for (int x=bounds.x - (bounds.x % kTileSize); x<bounds.x2(); x+=kTileSize)
+      tiles.push_back(gfx::Rect(x, y, kTileSize, kTileSize)
+                      .createIntersection(bounds));
+
+  std::atomic<int> nextTile(0);
+  auto processNextTiles = [bmp, spr, mask, &map, &tiles, &nextTile, &isCanceled]{
+    Scale2xSampler<ImageTraits> sampler(spr);
+    int i;
+    while ((i = nextTile++) < int(tiles.size())) {
+      if (isCanceled && isCanceled()) {
+        nextTile = int(tiles.size());
+        break;
+      }
+      rotsprite_tile<ImageTraits>(bmp, spr, mask, map, tiles[i], sampler);
+    }
+  };
+
+  // The calling thread processes tiles too
+  run_in_workers(std::min(worker_threads(), int(tiles.size())),
+                 processNextTiles);
+}
 
-  for (int i=0; i<3; ++i)
-    if (!buf[i])
-      buf[i].reset(new ImageBuffer(1));
+} // anonymous namespace
 
+// The source image is mapped to the (x1,y1)-(x2,y2)-(x3,y3)-(x4,y4)
+// parallelogram as if it were scaled 8x with Scale2x, rotated, and
+// scaled down again to the original size. Instead of creating the 8x
+// images (64 times the source and destination areas), each
+// destination pixel samples the 8x source pixel under its center.
+void rotsprite_image(Image* bmp, const Image* spr, const Image* mask,
+  int x1, int y1, int x2, int y2,
+  int x3, int y3, int x4, int y4,
+  const std::function<bool()>& isCanceled)
+{
   int xmin = std::min(x1, std::min(x2, std::min(x3, x4)));
   int xmax = std::max(x1, std::max(x2, std::max(x3, x4)));
   int ymin = std::min(y1, std::min(y2, std::min(y3, y4)));
@@ -181,51 +302,44 @@ void rotsprite_image(Image* bmp, const Image* spr, const Image* mask,
   int rot_width = xmax - xmin;
   int rot_height = ymax - ymin;
 
-  if (rot_width == 0 || rot_height == 0)
+  if (rot_width == 0 || rot_height == 0 ||
+      spr->width() == 0 || spr->height() == 0)
     return;
 
-  int scale = 8;
-  std::unique_ptr<Image> bmp_copy(Image::create(bmp->pixelFormat(), rot_width*scale, rot_height*scale, buf[0]));
-  std::unique_ptr<Image> tmp_copy(Image::create(spr->pixelFormat(), spr->width()*scale, spr->height()*scale, buf[1]));
-  std::unique_ptr<Image> spr_copy(Image::create(spr->pixelFormat(), spr->width()*scale, spr->height()*scale, buf[2]));
-  std::unique_ptr<Image> msk_copy;
-
-  color_t maskColor = spr->maskColor();
-
-  bmp_copy->setMaskColor(maskColor);
-  tmp_copy->setMaskColor(maskColor);
-  spr_copy->setMaskColor(maskColor);
-
-  spr_copy->clear(maskColor);
-  spr_copy->copy(spr, gfx::Clip(spr->bounds()));
+  const gfx::Rect bounds =
+    gfx::Rect(xmin, ymin, rot_width, rot_height).createIntersection(bmp->bounds());
+  if (bounds.isEmpty())
+    return;
 
-  for (int i=0; i<3; ++i) {
-    // clear_image(tmp_copy, maskColor);
-    image_scale2x(tmp_copy.get(), spr_copy.get(), spr->width()*(1<<i), spr->height()*(1<<i));
-    spr_copy->copy(tmp_copy.get(), gfx::Clip(tmp_copy->bounds()));
-  }
+  // Source X and Y axes in the destination image
+  const double ux = x2-x1, uy = y2-y1;
+  const double vx = x4-x1, vy = y4-y1;
+  const double det = ux*vy - uy*vx;
+  if (det == 0.0)
+    return;
 
-  if (mask) {
-    // Same ImageBuffer than tmp_copy
-    msk_copy.reset(Image::create(IMAGE_BITMAP, mask->width()*scale, mask->height()*scale, buf[1]));
-    clear_image(msk_copy.get(), 0);
-    scale_image(msk_copy.get(), mask,
-                0, 0, msk_copy->width(), msk_copy->height(),
-                0, 0, mask->width(), mask->height());
+  InverseMap map;
+  map.x0 = x1;
+  map.y0 = y1;
+  map.sx_dx =  8.0*spr->width()*vy / det;
+  map.sx_dy = -8.0*spr->width()*vx / det;
+  map.sy_dx = -8.0*spr->height()*uy / det;
+  map.sy_dy =  8.0*spr->height()*ux / det;
+
+  switch (bmp->pixelFormat()) {
+    case IMAGE_RGB:
+      rotsprite_image_tpl<RgbTraits>(bmp, spr, mask, map, bounds, isCanceled);
+      break;
+    case IMAGE_GRAYSCALE:
+      rotsprite_image_tpl<GrayscaleTraits>(bmp, spr, mask, map, bounds, isCanceled);
+      break;
+    case IMAGE_INDEXED:
+      rotsprite_image_tpl<IndexedTraits>(bmp, spr, mask, map, bounds, isCanceled);
+      break;
+    case IMAGE_BITMAP:
+      rotsprite_image_tpl<BitmapTraits>(bmp, spr, mask, map, bounds, isCanceled);
+      break;
   }
-
-  clear_image(bmp_copy.get(), maskColor);
-  parallelogram(
-    bmp_copy.get(), spr_copy.get(), msk_copy.get(),
-    (x1-xmin)*scale, (y1-ymin)*scale, (x2-xmin)*scale, (y2-ymin)*scale,
-    (x3-xmin)*scale, (y3-ymin)*scale, (x4-xmin)*scale, (y4-ymin)*scale);
-
-  scale_image(bmp, bmp_copy.get(),
-              std::max(0, xmin),
-              std::max(0, ymin),
-              std::clamp(rot_width, 0, std::max(0, bmp->width() - std::max(0, xmin))),
-              std::clamp(rot_height, 0, std::max(0, bmp->height() - std::max(0, ymin))),
-              0, 0, bmp_copy->width(), bmp_copy->height());
 }
 
 } // namespace algorithm
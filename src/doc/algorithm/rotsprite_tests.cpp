@@ -0,0 +1,386 @@
+// Aseprite Document Library
+// Copyright (c) 2023  Igara Studio S.A.
+//
+// This file is released under the terms of the MIT license.
+// Read LICENSE.txt for more information.
+
+#include "gtest/gtest.h"
+
+#include "doc/algorithm/rotsprite.h"
+
+#include "doc/algorithm/resize_image.h"
+#include "doc/image.h"
+#include "doc/image_ref.h"
+#include "doc/primitives.h"
+
+#include <atomic>
+#include <cmath>
+
+using namespace doc;
+using namespace doc::algorithm;
+
+namespace {
+
+enum class Rotation { R0, R90, R180 };
+
+// Maps the whole "src" image to "dst" rotated clockwise.
+void rotate(Image* dst, const Image* src, const Image* mask,
+            const Rotation rot)
+{
+  const int w = src->width();
+  const int h = src->height();
+  switch (rot) {
+    case Rotation::R0:
+      rotsprite_image(dst, src, mask, 0, 0, w, 0, w, h, 0, h);
+      break;
+    case Rotation::R90:
+      rotsprite_image(dst, src, mask, h, 0, h, w, 0, w, 0, 0);
+      break;
+    case Rotation::R180:
+      rotsprite_image(dst, src, mask, w, h, 0, h, 0, 0, w, 0);
+      break;
+  }
+}
+
+// Source pixel that should be in the (x, y) pixel of the destination.
+gfx::Point source_point(const Image* src, const Rotation rot,
+                        const int x, const int y)
+{
+  switch (rot) {
+    case Rotation::R90:
+      return gfx::Point(y, src->height()-1-x);
+    case Rotation::R180:
+      return gfx::Point(src->width()-1-x, src->height()-1-y);
+    default:
+      return gfx::Point(x, y);
+  }
+}
+
+void expect_rotated(const Image* dst, const Image* src, const Rotation rot)
+{
+  for (int y=0; y<dst->height(); ++y)
+    for (int x=0; x<dst->width(); ++x) {
+      const gfx::Point pt = source_point(src, rot, x, y);
+      ASSERT_EQ(get_pixel(src, pt.x, pt.y), get_pixel(dst, x, y))
+        << "Pixel " << x << "," << y << " rotation=" << int(rot);
+    }
+}
+
+// Fills the image with a different color in each pixel, so Scale2x
+// doesn't modify the image (it only replaces pixels that have two
+// neighbours of the same color) and the result of RotSprite must be
+// an exact copy/rotation of the source.
+void fill_unique_colors(Image* image)
+{
+  for (int y=0; y<image->height(); ++y)
+    for (int x=0; x<image->width(); ++x) {
+      color_t c = 0;
+      switch (image->pixelFormat()) {
+        case IMAGE_RGB:     c = rgba(x, y, 128, 255); break;
+        case IMAGE_INDEXED: c = y*image->width() + x; break;
+      }
+      put_pixel(image, x, y, c);
+    }
+}
+
+// Pixel art with runs of pixels, blocks, and diagonal lines (so
+// Scale2x modifies the image).
+void fill_pixel_art(Image* image)
+{
+  const color_t colors[] = { rgba(0, 0, 0, 255),
+                             rgba(255, 0, 0, 255),
+                             rgba(0, 255, 0, 255),
+                             rgba(0, 0, 255, 255) };
+  for (int y=0; y<image->height(); ++y)
+    for (int x=0; x<image->width(); ++x) {
+      int i = ((x/5 + y/3) & 1);
+      if ((x+y) % 7 == 0)
+        i = 2;
+      else if ((x-y+1000) % 9 == 0)
+        i = 3;
+      put_pixel(image, x, y, colors[i]);
+    }
+}
+
+// Reference Scale2x of the whole image (the first implementation of
+// rotsprite_image() created the 8x image with three of these passes)
+void image_scale2x(Image* dst, const Image* src)
+{
+  const int w = src->width();
+  const int h = src->height();
+  for (int y=0; y<h; ++y)
+    for (int x=0; x<w; ++x) {
+      const color_t P = get_pixel(src, x, y);
+      const color_t A = (y > 0 ? get_pixel(src, x, y-1): P);
+      const color_t B = (x < w-1 ? get_pixel(src, x+1, y): P);
+      const color_t C = (x > 0 ? get_pixel(src, x-1, y): P);
+      const color_t D = (y < h-1 ? get_pixel(src, x, y+1): P);
+      put_pixel(dst, 2*x,   2*y,   C == A && C != D && A != B ? A: P);
+      put_pixel(dst, 2*x+1, 2*y,   A == B && A != C && B != D ? B: P);
+      put_pixel(dst, 2*x,   2*y+1, D == C && D != B && C != A ? C: P);
+      put_pixel(dst, 2*x+1, 2*y+1, B == D && B != A && D != C ? D: P);
+    }
+}
+
+ImageRef image_scale8x(const Image* src)
+{
+  ImageRef img(Image::createCopy(src));
+  for (int i=0; i<3; ++i) {
+    ImageRef img2x(Image::create(src->pixelFormat(),
+                                 img->width()*2, img->height()*2));
+    image_scale2x(img2x.get(), img.get());
+    img = img2x;
+  }
+  return img;
+}
+
+// Maps "src" to the (x1,y1)-(x2,y2)-(x2+x4-x1,y2+y4-y1)-(x4,y4)
+// parallelogram of "dst" and compares each pixel with the 8x
+// reference image under the pixel center. If "exact" is false, the
+// pixels whose center is too near to the border of a 8x pixel are
+// not compared (rounding errors can select the other pixel).
+void expect_rotsprite_reference(Image* dst, const Image* src,
+                                const int x1, const int y1,
+                                const int x2, const int y2,
+                                const int x4, const int y4,
+                                const bool exact)
+{
+  const color_t bg = rgba(255, 255, 255, 255);
+  clear_image(dst, bg);
+  rotsprite_image(dst, src, nullptr,
+                  x1, y1, x2, y2, x2+x4-x1, y2+y4-y1, x4, y4);
+
+  const ImageRef ref = image_scale8x(src);
+  const double ux = x2-x1, uy = y2-y1;
+  const double vx = x4-x1, vy = y4-y1;
+  const double det = ux*vy - uy*vx;
+  int compared = 0;
+
+  for (int y=0; y<dst->height(); ++y)
+    for (int x=0; x<dst->width(); ++x) {
+      const double px = x+0.5-x1;
+      const double py = y+0.5-y1;
+      const double sx = (px*vy - py*vx) / det * ref->width();
+      const double sy = (ux*py - uy*px) / det * ref->height();
+      if (!exact &&
+          (std::fabs(sx - std::round(sx)) < 1e-6 ||
+           std::fabs(sy - std::round(sy)) < 1e-6))
+        continue;
+
+      color_t expected = bg;
+      if (sx >= 0.0 && sy >= 0.0 && sx < ref->width() && sy < ref->height())
+        expected = get_pixel(ref.get(), int(sx), int(sy));
+
+      ASSERT_EQ(expected, get_pixel(dst, x, y)) << "Pixel " << x << "," << y;
+      ++compared;
+    }
+
+  EXPECT_GT(compared, dst->width()*dst->height()/2);
+}
+
+} // anonymous namespace
+
+TEST(RotSprite, Identity)
+{
+  ImageRef src(Image::create(IMAGE_RGB, 150, 70));
+  ImageRef dst(Image::create(IMAGE_RGB, 150, 70));
+  fill_unique_colors(src.get());
+  clear_image(dst.get(), 0);
+
+  rotate(dst.get(), src.get(), nullptr, Rotation::R0);
+  expect_rotated(dst.get(), src.get(), Rotation::R0);
+}
+
+TEST(RotSprite, Rotate90And180)
+{
+  ImageRef src(Image::create(IMAGE_RGB, 150, 70));
+  fill_unique_colors(src.get());
+
+  ImageRef dst90(Image::create(IMAGE_RGB, 70, 150));
+  clear_image(dst90.get(), 0);
+  rotate(dst90.get(), src.get(), nullptr, Rotation::R90);
+  expect_rotated(dst90.get(), src.get(), Rotation::R90);
+
+  ImageRef dst180(Image::create(IMAGE_RGB, 150, 70));
+  clear_image(dst180.get(), 0);
+  rotate(dst180.get(), src.get(), nullptr, Rotation::R180);
+  expect_rotated(dst180.get(), src.get(), Rotation::R180);
+}
+
+TEST(RotSprite, MaskedSource)
+{
+  const color_t bg = rgba(255, 255, 255, 255);
+  ImageRef src(Image::create(IMAGE_RGB, 40, 30));
+  ImageRef mask(Image::create(IMAGE_BITMAP, 40, 30));
+  fill_unique_colors(src.get());
+  for (int y=0; y<mask->height(); ++y)
+    for (int x=0; x<mask->width(); ++x)
+      put_pixel(mask.get(), x, y, ((x+2*y) % 3) != 0 ? 1: 0);
+
+  for (Rotation rot : { Rotation::R0, Rotation::R180 }) {
+    ImageRef dst(Image::create(IMAGE_RGB, 40, 30));
+    clear_image(dst.get(), bg);
+    rotate(dst.get(), src.get(), mask.get(), rot);
+
+    for (int y=0; y<dst->height(); ++y)
+      for (int x=0; x<dst->width(); ++x) {
+        const gfx::Point pt = source_point(src.get(), rot, x, y);
+        ASSERT_EQ(get_pixel(mask.get(), pt.x, pt.y) ?
+                  get_pixel(src.get(), pt.x, pt.y): bg,
+                  get_pixel(dst.get(), x, y));
+      }
+  }
+}
+
+TEST(RotSprite, SkipRgbMaskColor)
+{
+  const color_t bg = rgba(255, 255, 255, 255);
+  const color_t maskColor = rgba(255, 0, 255, 255);
+  ImageRef src(Image::create(IMAGE_RGB, 40, 30));
+  fill_unique_colors(src.get());
+  src->setMaskColor(maskColor);
+  // Isolated pixels with the mask color (Scale2x doesn't modify them)
+  auto is_masked = [](const int x, const int y) {
+    return (x % 5) == 0 && (y % 5) == 0;
+  };
+  for (int y=0; y<src->height(); ++y)
+    for (int x=0; x<src->width(); ++x)
+      if (is_masked(x, y))
+        put_pixel(src.get(), x, y, maskColor);
+
+  ImageRef dst(Image::create(IMAGE_RGB, 40, 30));
+  clear_image(dst.get(), bg);
+  rotate(dst.get(), src.get(), nullptr, Rotation::R0);
+
+  for (int y=0; y<dst->height(); ++y)
+    for (int x=0; x<dst->width(); ++x)
+      ASSERT_EQ(is_masked(x, y) ? bg: get_pixel(src.get(), x, y),
+                get_pixel(dst.get(), x, y));
+}
+
+TEST(RotSprite, Indexed)
+{
+  ImageRef src(Image::create(IMAGE_INDEXED, 16, 15));
+  fill_unique_colors(src.get());
+
+  for (Rotation rot : { Rotation::R0, Rotation::R90, Rotation::R180 }) {
+    ImageRef dst(rot == Rotation::R90 ?
+                 Image::create(IMAGE_INDEXED, 15, 16):
+                 Image::create(IMAGE_INDEXED, 16, 15));
+    // Index 0 is the mask color, it's not copied but the
+    // destination is already 0 there
+    clear_image(dst.get(), 0);
+    rotate(dst.get(), src.get(), nullptr, rot);
+    expect_rotated(dst.get(), src.get(), rot);
+  }
+}
+
+// Bitmaps pack 8 pixels in each byte, and destination tiles (64x64
+// pixels) are processed in parallel.
+TEST(RotSprite, BitmapTileSeams)
+{
+  ImageRef src(Image::create(IMAGE_BITMAP, 150, 70));
+  // Vertical lines (uniform columns are not modified by Scale2x)
+  for (int y=0; y<src->height(); ++y)
+    for (int x=0; x<src->width(); ++x)
+      put_pixel(src.get(), x, y, (x % 3) == 0 || (x % 7) == 0 ? 1: 0);
+
+  for (Rotation rot : { Rotation::R0, Rotation::R90, Rotation::R180 }) {
+    ImageRef dst(rot == Rotation::R90 ?
+                 Image::create(IMAGE_BITMAP, 70, 150):
+                 Image::create(IMAGE_BITMAP, 150, 70));
+    clear_image(dst.get(), 0);
+    rotate(dst.get(), src.get(), nullptr, rot);
+    expect_rotated(dst.get(), src.get(), rot);
+  }
+}
+
+// RESIZE_METHOD_ROTSPRITE uses rotsprite_image() too, so each
+// destination pixel takes the 8x source pixel under its center.
+TEST(RotSprite, Resize)
+{
+  ImageRef src(Image::create(IMAGE_RGB, 20, 10));
+  fill_unique_colors(src.get());
+
+  ImageRef dst2x(Image::create(IMAGE_RGB, 40, 20));
+  clear_image(dst2x.get(), 0);
+  resize_image(src.get(), dst2x.get(), RESIZE_METHOD_ROTSPRITE,
+               nullptr, nullptr, 0);
+  for (int y=0; y<dst2x->height(); ++y)
+    for (int x=0; x<dst2x->width(); ++x)
+      ASSERT_EQ(get_pixel(src.get(), x/2, y/2),
+                get_pixel(dst2x.get(), x, y));
+
+  // When the image is scaled down, the center of the destination
+  // pixel is in the bottom-right pixel of each 2x2 source block.
+  ImageRef dst05x(Image::create(IMAGE_RGB, 10, 5));
+  clear_image(dst05x.get(), 0);
+  resize_image(src.get(), dst05x.get(), RESIZE_METHOD_ROTSPRITE,
+               nullptr, nullptr, 0);
+  for (int y=0; y<dst05x->height(); ++y)
+    for (int x=0; x<dst05x->width(); ++x)
+      ASSERT_EQ(get_pixel(src.get(), 2*x+1, 2*y+1),
+                get_pixel(dst05x.get(), x, y));
+}
+
+TEST(RotSprite, Scale2xReference)
+{
+  ImageRef src(Image::create(IMAGE_RGB, 40, 30));
+  fill_pixel_art(src.get());
+
+  // Scaled 2x (the pixel centers are in exact 8x coordinates)
+  ImageRef dst2x(Image::create(IMAGE_RGB, 80, 60));
+  expect_rotsprite_reference(dst2x.get(), src.get(),
+                             0, 0, 80, 0, 0, 60, true);
+
+  // Rotated 90 degrees and scaled 2x
+  ImageRef dst90(Image::create(IMAGE_RGB, 60, 80));
+  expect_rotsprite_reference(dst90.get(), src.get(),
+                             60, 0, 60, 80, 0, 0, true);
+
+  // Rotated and skewed in a destination bigger than one tile
+  ImageRef dstRot(Image::create(IMAGE_RGB, 100, 90));
+  expect_rotsprite_reference(dstRot.get(), src.get(),
+                             30, 2, 97, 33, 7, 52, false);
+}
+
+// The source area used by the tile is too big to be cached in the
+// scratch buffer (more than kMaxScratchPixels pixels of the first
+// Scale2x pass).
+TEST(RotSprite, Scale2xReferenceWithoutScratch)
+{
+  ImageRef src(Image::create(IMAGE_RGB, 150, 150));
+  fill_pixel_art(src.get());
+
+  ImageRef dst(Image::create(IMAGE_RGB, 16, 16));
+  expect_rotsprite_reference(dst.get(), src.get(),
+                             0, 0, 16, 0, 0, 16, true);
+}
+
+TEST(RotSprite, Canceled)
+{
+  ImageRef src(Image::create(IMAGE_RGB, 150, 70));
+  ImageRef dst(Image::create(IMAGE_RGB, 150, 70));
+  fill_unique_colors(src.get());
+  clear_image(dst.get(), 0);
+
+  // Nothing is rendered if the first tile is canceled
+  rotsprite_image(dst.get(), src.get(), nullptr,
+                  0, 0, 150, 0, 150, 70, 0, 70,
+                  []{ return true; });
+  EXPECT_TRUE(is_plain_image(dst.get(), 0));
+
+  // Cancel after 3 of the 6 tiles
+  std::atomic<int> tiles(0);
+  rotsprite_image(dst.get(), src.get(), nullptr,
+                  0, 0, 150, 0, 150, 70, 0, 70,
+                  [&tiles]{ return ++tiles > 3; });
+  EXPECT_FALSE(is_plain_image(dst.get(), 0));
+  EXPECT_FALSE(is_same_image(dst.get(), src.get()));
+}
+
+int main(int argc, char** argv)
+{
+  ::testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
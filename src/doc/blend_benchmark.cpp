@@ -9,9 +9,13 @@
 #endif
 
 #include "doc/blend_funcs.h"
+#include "doc/blend_row.h"
 
 #include <benchmark/benchmark.h>
 
+#include <random>
+#include <vector>
+
 using namespace doc;
 
 static void CustomArguments(benchmark::internal::Benchmark* b) {
@@ -53,4 +57,76 @@ BENCHMARK_TEMPLATE(BM_Rgba, rgba_blender_hsl_saturation)->Apply(CustomArguments)
 BENCHMARK_TEMPLATE(BM_Rgba, rgba_blender_hsl_color)->Apply(CustomArguments);
 BENCHMARK_TEMPLATE(BM_Rgba, rgba_blender_hsl_luminosity)->Apply(CustomArguments);
 
+// Row blenders, the first argument is the BlendRowSimd (0=scalar,
+// 1=SSE2, 2=AVX2, 3=NEON) to compare the speedup of each instruction
+// set against the scalar version (one BlendFunc call per pixel).
+static void RowArguments(benchmark::internal::Benchmark* b) {
+  for (int simd=int(BlendRowSimd::None); simd<=int(BlendRowSimd::NEON); ++simd)
+    b->Args({ simd, 4096 });
+}
+
+template<typename pixel_t>
+static void fill_random_row(std::vector<pixel_t>& row, std::mt19937& gen)
+{
+  std::uniform_int_distribution<uint32_t> dist;
+  for (auto& px : row)
+    px = pixel_t(dist(gen));
+}
+
+template<BlendMode M>
+void BM_RgbaRow(benchmark::State& state) {
+  const BlendRowSimd simd = BlendRowSimd(state.range(0));
+  const int n = state.range(1);
+  RgbaBlendRowFunc func = get_rgba_row_blender(simd, M, true);
+  if (!func) {
+    state.SkipWithError("Instruction set not available");
+    return;
+  }
+  std::mt19937 gen(1);
+  std::vector<uint32_t> dst(n), src(n);
+  fill_random_row(dst, gen);
+  fill_random_row(src, gen);
+  while (state.KeepRunning()) {
+    func(&dst[0], &src[0], n, 200, 0);
+    benchmark::DoNotOptimize(dst[0]);
+  }
+  state.SetItemsProcessed(state.iterations() * n);
+}
+
+template<BlendMode M>
+void BM_GrayaRow(benchmark::State& state) {
+  const BlendRowSimd simd = BlendRowSimd(state.range(0));
+  const int n = state.range(1);
+  GrayaBlendRowFunc func = get_graya_row_blender(simd, M, true);
+  if (!func) {
+    state.SkipWithError("Instruction set not available");
+    return;
+  }
+  std::mt19937 gen(1);
+  std::vector<uint16_t> dst(n), src(n);
+  fill_random_row(dst, gen);
+  fill_random_row(src, gen);
+  while (state.KeepRunning()) {
+    func(&dst[0], &src[0], n, 200, 0);
+    benchmark::DoNotOptimize(dst[0]);
+  }
+  state.SetItemsProcessed(state.iterations() * n);
+}
+
+BENCHMARK_TEMPLATE(BM_RgbaRow, BlendMode::NORMAL)->Apply(RowArguments);
+BENCHMARK_TEMPLATE(BM_RgbaRow, BlendMode::MULTIPLY)->Apply(RowArguments);
+BENCHMARK_TEMPLATE(BM_RgbaRow, BlendMode::SCREEN)->Apply(RowArguments);
+BENCHMARK_TEMPLATE(BM_RgbaRow, BlendMode::OVERLAY)->Apply(RowArguments);
+BENCHMARK_TEMPLATE(BM_RgbaRow, BlendMode::DARKEN)->Apply(RowArguments);
+BENCHMARK_TEMPLATE(BM_RgbaRow, BlendMode::LIGHTEN)->Apply(RowArguments);
+BENCHMARK_TEMPLATE(BM_RgbaRow, BlendMode::HARD_LIGHT)->Apply(RowArguments);
+BENCHMARK_TEMPLATE(BM_RgbaRow, BlendMode::DIFFERENCE)->Apply(RowArguments);
+BENCHMARK_TEMPLATE(BM_RgbaRow, BlendMode::EXCLUSION)->Apply(RowArguments);
+BENCHMARK_TEMPLATE(BM_RgbaRow, BlendMode::ADDITION)->Apply(RowArguments);
+BENCHMARK_TEMPLATE(BM_RgbaRow, BlendMode::SUBTRACT)->Apply(RowArguments);
+BENCHMARK_TEMPLATE(BM_GrayaRow, BlendMode::NORMAL)->Apply(RowArguments);
+BENCHMARK_TEMPLATE(BM_GrayaRow, BlendMode::MULTIPLY)->Apply(RowArguments);
+BENCHMARK_TEMPLATE(BM_GrayaRow, BlendMode::SCREEN)->Apply(RowArguments);
+BENCHMARK_TEMPLATE(BM_GrayaRow, BlendMode::ADDITION)->Apply(RowArguments);
+
 BENCHMARK_MAIN();
@@ -0,0 +1,276 @@
+// Aseprite Document Library
+// Copyright (c) 2023 Igara Studio S.A.
+//
+// This file is released under the terms of the MIT license.
+// Read LICENSE.txt for more information.
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "doc/blend_row.h"
+
+#include "base/debug.h"
+#include "doc/blend_funcs.h"
+#include "doc/blend_row_simd.h"
+
+#if defined(__x86_64__) || defined(_WIN64)
+  #define DOC_BLEND_ROW_SSE2 1
+  #include <emmintrin.h>
+  #if defined(_MSC_VER)
+    #include <intrin.h>
+  #endif
+#elif defined(__aarch64__) || defined(_M_ARM64)
+  #define DOC_BLEND_ROW_NEON 1
+  #include <arm_neon.h>
+#endif
+
+namespace doc {
+
+// Defined in blend_row_avx2.cpp (they return nullptr if the file was
+// compiled without AVX2 support)
+RgbaBlendRowFunc get_rgba_row_blender_avx2(BlendMode blendMode, const bool newBlend);
+GrayaBlendRowFunc get_graya_row_blender_avx2(BlendMode blendMode, const bool newBlend);
+
+namespace {
+
+//////////////////////////////////////////////////////////////////////
+// Scalar implementation
+
+template<typename pixel_t, BlendFunc (*get_blender)(BlendMode, const bool),
+         BlendMode blendMode, bool newBlend>
+void blend_row_scalar(pixel_t* dst, const pixel_t* src,
+                      int n, int opacity, color_t maskColor)
+{
+  static const BlendFunc blender = get_blender(blendMode, newBlend);
+  for (; n>0; --n, ++dst, ++src) {
+    if (*src != maskColor)
+      *dst = (*blender)(*dst, *src, opacity);
+  }
+}
+
+template<typename pixel_t, BlendFunc (*get_blender)(BlendMode, const bool)>
+auto get_row_blender_scalar(BlendMode blendMode, const bool newBlend)
+  -> void (*)(pixel_t*, const pixel_t*, int, int, color_t)
+{
+#define ROW(mode) (newBlend ? blend_row_scalar<pixel_t, get_blender, BlendMode::mode, true>: \
+                              blend_row_scalar<pixel_t, get_blender, BlendMode::mode, false>)
+  switch (blendMode) {
+    case BlendMode::MERGE:          return ROW(MERGE);
+    case BlendMode::NEG_BW:         return ROW(NEG_BW);
+    case BlendMode::RED_TINT:       return ROW(RED_TINT);
+    case BlendMode::BLUE_TINT:      return ROW(BLUE_TINT);
+    case BlendMode::DST_OVER:       return ROW(DST_OVER);
+    case BlendMode::NORMAL:         return ROW(NORMAL);
+    case BlendMode::MULTIPLY:       return ROW(MULTIPLY);
+    case BlendMode::SCREEN:         return ROW(SCREEN);
+    case BlendMode::OVERLAY:        return ROW(OVERLAY);
+    case BlendMode::DARKEN:         return ROW(DARKEN);
+    case BlendMode::LIGHTEN:        return ROW(LIGHTEN);
+    case BlendMode::COLOR_DODGE:    return ROW(COLOR_DODGE);
+    case BlendMode::COLOR_BURN:     return ROW(COLOR_BURN);
+    case BlendMode::HARD_LIGHT:     return ROW(HARD_LIGHT);
+    case BlendMode::SOFT_LIGHT:     return ROW(SOFT_LIGHT);
+    case BlendMode::DIFFERENCE:     return ROW(DIFFERENCE);
+    case BlendMode::EXCLUSION:      return ROW(EXCLUSION);
+    case BlendMode::HSL_HUE:        return ROW(HSL_HUE);
+    case BlendMode::HSL_SATURATION: return ROW(HSL_SATURATION);
+    case BlendMode::HSL_COLOR:      return ROW(HSL_COLOR);
+    case BlendMode::HSL_LUMINOSITY: return ROW(HSL_LUMINOSITY);
+    case BlendMode::ADDITION:       return ROW(ADDITION);
+    case BlendMode::SUBTRACT:       return ROW(SUBTRACT);
+    case BlendMode::DIVIDE:         return ROW(DIVIDE);
+    default:                        return ROW(SRC);
+  }
+#undef ROW
+}
+
+//////////////////////////////////////////////////////////////////////
+// SSE2 (always available on x86-64)
+
+#if DOC_BLEND_ROW_SSE2
+
+struct Sse2 {
+  using reg = __m128i;
+  enum { size = 4 };
+
+  static reg set1(int v) { return _mm_set1_epi32(v); }
+  static reg load32(const uint32_t* p) { return _mm_loadu_si128((const __m128i*)p); }
+  static void store32(uint32_t* p, reg r) { _mm_storeu_si128((__m128i*)p, r); }
+  static reg load16(const uint16_t* p) {
+    return _mm_unpacklo_epi16(_mm_loadl_epi64((const __m128i*)p), _mm_setzero_si128());
+  }
+  static void store16(uint16_t* p, reg r) {
+    // Sign-extend the lower 16 bits so _mm_packs_epi32() doesn't saturate
+    r = _mm_srai_epi32(_mm_slli_epi32(r, 16), 16);
+    _mm_storel_epi64((__m128i*)p, _mm_packs_epi32(r, r));
+  }
+  static reg add(reg a, reg b) { return _mm_add_epi32(a, b); }
+  static reg sub(reg a, reg b) { return _mm_sub_epi32(a, b); }
+  static reg and_(reg a, reg b) { return _mm_and_si128(a, b); }
+  static reg or_(reg a, reg b) { return _mm_or_si128(a, b); }
+  static reg cmpeq(reg a, reg b) { return _mm_cmpeq_epi32(a, b); }
+  static reg cmpgt(reg a, reg b) { return _mm_cmpgt_epi32(a, b); }
+  // SSE2 doesn't have a 32-bit multiplication, but as the values fit
+  // in 16 bits (and the high 16 bits of one operand are zero), we can
+  // use _mm_madd_epi16() to get the 32-bit product.
+  static reg mul(reg a, reg b) { return _mm_madd_epi16(a, b); }
+  static reg min(reg a, reg b) { return _mm_min_epi16(a, b); }
+  static reg max(reg a, reg b) { return _mm_max_epi16(a, b); }
+  static reg select(reg m, reg a, reg b) {
+    return _mm_or_si128(_mm_and_si128(m, a), _mm_andnot_si128(m, b));
+  }
+  template<int N> static reg srli(reg a) { return _mm_srli_epi32(a, N); }
+  template<int N> static reg slli(reg a) { return _mm_slli_epi32(a, N); }
+  template<int N> static reg srai(reg a) { return _mm_srai_epi32(a, N); }
+  static reg div(reg a, reg b) {
+    return _mm_cvttps_epi32(_mm_div_ps(_mm_cvtepi32_ps(a), _mm_cvtepi32_ps(b)));
+  }
+};
+
+bool cpu_has_avx2()
+{
+#if defined(_MSC_VER)
+  int info[4];
+  __cpuid(info, 0);
+  if (info[0] < 7)
+    return false;
+  __cpuid(info, 1);
+  // OSXSAVE and AVX bits, and the OS must save the YMM registers
+  if ((info[2] & ((1 << 27) | (1 << 28))) != ((1 << 27) | (1 << 28)) ||
+      (_xgetbv(0) & 6) != 6)
+    return false;
+  __cpuidex(info, 7, 0);
+  return (info[1] & (1 << 5)) ? true: false;
+#elif defined(__GNUC__)
+  return __builtin_cpu_supports("avx2");
+#else
+  return false;
+#endif
+}
+
+#endif // DOC_BLEND_ROW_SSE2
+
+//////////////////////////////////////////////////////////////////////
+// NEON (always available on ARM64)
+
+#if DOC_BLEND_ROW_NEON
+
+struct Neon {
+  using reg = int32x4_t;
+  enum { size = 4 };
+
+  static reg set1(int v) { return vdupq_n_s32(v); }
+  static reg load32(const uint32_t* p) { return vreinterpretq_s32_u32(vld1q_u32(p)); }
+  static void store32(uint32_t* p, reg r) { vst1q_u32(p, vreinterpretq_u32_s32(r)); }
+  static reg load16(const uint16_t* p) { return vreinterpretq_s32_u32(vmovl_u16(vld1_u16(p))); }
+  static void store16(uint16_t* p, reg r) { vst1_u16(p, vmovn_u32(vreinterpretq_u32_s32(r))); }
+  static reg add(reg a, reg b) { return vaddq_s32(a, b); }
+  static reg sub(reg a, reg b) { return vsubq_s32(a, b); }
+  static reg and_(reg a, reg b) { return vandq_s32(a, b); }
+  static reg or_(reg a, reg b) { return vorrq_s32(a, b); }
+  static reg cmpeq(reg a, reg b) { return vreinterpretq_s32_u32(vceqq_s32(a, b)); }
+  static reg cmpgt(reg a, reg b) { return vreinterpretq_s32_u32(vcgtq_s32(a, b)); }
+  static reg mul(reg a, reg b) { return vmulq_s32(a, b); }
+  static reg min(reg a, reg b) { return vminq_s32(a, b); }
+  static reg max(reg a, reg b) { return vmaxq_s32(a, b); }
+  static reg select(reg m, reg a, reg b) { return vbslq_s32(vreinterpretq_u32_s32(m), a, b); }
+  template<int N> static reg srli(reg a) {
+    return vreinterpretq_s32_u32(vshrq_n_u32(vreinterpretq_u32_s32(a), N));
+  }
+  template<int N> static reg slli(reg a) { return vshlq_n_s32(a, N); }
+  template<int N> static reg srai(reg a) { return vshrq_n_s32(a, N); }
+  static reg div(reg a, reg b) {
+    return vcvtq_s32_f32(vdivq_f32(vcvtq_f32_s32(a), vcvtq_f32_s32(b)));
+  }
+};
+
+#endif // DOC_BLEND_ROW_NEON
+
+BlendRowSimd detect_blend_row_simd()
+{
+#if DOC_BLEND_ROW_SSE2
+  if (cpu_has_avx2() &&
+      get_rgba_row_blender_avx2(BlendMode::NORMAL, true))
+    return BlendRowSimd::AVX2;
+  return BlendRowSimd::SSE2;
+#elif DOC_BLEND_ROW_NEON
+  return BlendRowSimd::NEON;
+#else
+  return BlendRowSimd::None;
+#endif
+}
+
+} // anonymous namespace
+
+BlendRowSimd best_blend_row_simd()
+{
+  static const BlendRowSimd simd = detect_blend_row_simd();
+  return simd;
+}
+
+RgbaBlendRowFunc get_rgba_row_blender(BlendMode blendMode, const bool newBlend)
+{
+  RgbaBlendRowFunc func =
+    get_rgba_row_blender(best_blend_row_simd(), blendMode, newBlend);
+  if (!func)
+    func = get_row_blender_scalar<uint32_t, get_rgba_blender>(blendMode, newBlend);
+  return func;
+}
+
+GrayaBlendRowFunc get_graya_row_blender(BlendMode blendMode, const bool newBlend)
+{
+  GrayaBlendRowFunc func =
+    get_graya_row_blender(best_blend_row_simd(), blendMode, newBlend);
+  if (!func)
+    func = get_row_blender_scalar<uint16_t, get_graya_blender>(blendMode, newBlend);
+  return func;
+}
+
+RgbaBlendRowFunc get_rgba_row_blender(BlendRowSimd simd, BlendMode blendMode, const bool newBlend)
+{
+  switch (simd) {
+    case BlendRowSimd::None:
+      return get_row_blender_scalar<uint32_t, get_rgba_blender>(blendMode, newBlend);
+#if DOC_BLEND_ROW_SSE2
+    case BlendRowSimd::SSE2:
+      return get_rgba_row_blender_simd<Sse2>(blendMode, newBlend);
+    case BlendRowSimd::AVX2:
+      if (best_blend_row_simd() == BlendRowSimd::AVX2)
+        return get_rgba_row_blender_avx2(blendMode, newBlend);
+      break;
+#endif
+#if DOC_BLEND_ROW_NEON
+    case BlendRowSimd::NEON:
+      return get_rgba_row_blender_simd<Neon>(blendMode, newBlend);
+#endif
+    default:
+      break;
+  }
+  return nullptr;
+}
+
+GrayaBlendRowFunc get_graya_row_blender(BlendRowSimd simd, BlendMode blendMode, const bool newBlend)
+{
+  switch (simd) {
+    case BlendRowSimd::None:
+      return get_row_blender_scalar<uint16_t, get_graya_blender>(blendMode, newBlend);
+#if DOC_BLEND_ROW_SSE2
+    case BlendRowSimd::SSE2:
+      return get_graya_row_blender_simd<Sse2>(blendMode, newBlend);
+    case BlendRowSimd::AVX2:
+      if (best_blend_row_simd() == BlendRowSimd::AVX2)
+        return get_graya_row_blender_avx2(blendMode, newBlend);
+      break;
+#endif
+#if DOC_BLEND_ROW_NEON
+    case BlendRowSimd::NEON:
+      return get_graya_row_blender_simd<Neon>(blendMode, newBlend);
+#endif
+    default:
+      break;
+  }
+  return nullptr;
+}
+
+} // namespace doc
@@ -0,0 +1,52 @@
+// Aseprite Document Library
+// Copyright (c) 2023 Igara Studio S.A.
+//
+// This file is released under the terms of the MIT license.
+// Read LICENSE.txt for more information.
+
+#ifndef DOC_BLEND_ROW_H_INCLUDED
+#define DOC_BLEND_ROW_H_INCLUDED
+#pragma once
+
+#include "doc/blend_mode.h"
+#include "doc/color.h"
+
+namespace doc {
+
+  // Blends "n" pixels from "src" into "dst" (in-place). Pixels of
+  // "src" equal to "maskColor" are skipped. The result is bit-exact
+  // with calling the BlendFunc returned by get_rgba_blender() (or
+  // get_graya_blender()) for each pixel.
+  typedef void (*RgbaBlendRowFunc)(uint32_t* dst, const uint32_t* src,
+                                   int n, int opacity, color_t maskColor);
+  typedef void (*GrayaBlendRowFunc)(uint16_t* dst, const uint16_t* src,
+                                    int n, int opacity, color_t maskColor);
+
+  // Instruction sets that can be used by the row blenders.
+  enum class BlendRowSimd {
+    None,                       // Scalar (one BlendFunc call per pixel)
+    SSE2,
+    AVX2,
+    NEON,
+  };
+
+  // Returns the best instruction set available in the current CPU.
+  BlendRowSimd best_blend_row_simd();
+
+  // Returns the row blender for the given blend mode using the best
+  // instruction set available. Blend modes without a SIMD kernel
+  // (e.g. HSL modes) fall back to the scalar implementation, so
+  // these functions never return nullptr.
+  RgbaBlendRowFunc get_rgba_row_blender(BlendMode blendMode, const bool newBlend);
+  GrayaBlendRowFunc get_graya_row_blender(BlendMode blendMode, const bool newBlend);
+
+  // Returns the row blender for a specific instruction set, or
+  // nullptr if the instruction set is not available or the blend
+  // mode doesn't have a kernel for it. Used for tests and
+  // benchmarks.
+  RgbaBlendRowFunc get_rgba_row_blender(BlendRowSimd simd, BlendMode blendMode, const bool newBlend);
+  GrayaBlendRowFunc get_graya_row_blender(BlendRowSimd simd, BlendMode blendMode, const bool newBlend);
+
+} // namespace doc
+
+#endif
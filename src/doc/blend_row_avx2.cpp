@@ -0,0 +1,89 @@
+// Aseprite Document Library
+// Copyright (c) 2023 Igara Studio S.A.
+//
+// This file is released under the terms of the MIT license.
+// Read LICENSE.txt for more information.
+//
+// This file is compiled with AVX2 instructions enabled (see
+// CMakeLists.txt), its functions are used only when the CPU supports
+// AVX2 (see best_blend_row_simd()).
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "doc/blend_row.h"
+
+#if defined(__AVX2__)
+  #include "doc/blend_row_simd.h"
+  #include <immintrin.h>
+#endif
+
+namespace doc {
+
+#if defined(__AVX2__)
+
+namespace {
+
+struct Avx2 {
+  using reg = __m256i;
+  enum { size = 8 };
+
+  static reg set1(int v) { return _mm256_set1_epi32(v); }
+  static reg load32(const uint32_t* p) { return _mm256_loadu_si256((const __m256i*)p); }
+  static void store32(uint32_t* p, reg r) { _mm256_storeu_si256((__m256i*)p, r); }
+  static reg load16(const uint16_t* p) {
+    return _mm256_cvtepu16_epi32(_mm_loadu_si128((const __m128i*)p));
+  }
+  static void store16(uint16_t* p, reg r) {
+    // _mm256_packus_epi32() packs each 128-bit lane separately, so we
+    // have to join the 64-bit elements 0 and 2 after packing.
+    r = _mm256_and_si256(r, _mm256_set1_epi32(0xffff));
+    r = _mm256_permute4x64_epi64(_mm256_packus_epi32(r, r), 0x08);
+    _mm_storeu_si128((__m128i*)p, _mm256_castsi256_si128(r));
+  }
+  static reg add(reg a, reg b) { return _mm256_add_epi32(a, b); }
+  static reg sub(reg a, reg b) { return _mm256_sub_epi32(a, b); }
+  static reg and_(reg a, reg b) { return _mm256_and_si256(a, b); }
+  static reg or_(reg a, reg b) { return _mm256_or_si256(a, b); }
+  static reg cmpeq(reg a, reg b) { return _mm256_cmpeq_epi32(a, b); }
+  static reg cmpgt(reg a, reg b) { return _mm256_cmpgt_epi32(a, b); }
+  static reg mul(reg a, reg b) { return _mm256_mullo_epi32(a, b); }
+  static reg min(reg a, reg b) { return _mm256_min_epi32(a, b); }
+  static reg max(reg a, reg b) { return _mm256_max_epi32(a, b); }
+  static reg select(reg m, reg a, reg b) { return _mm256_blendv_epi8(b, a, m); }
+  template<int N> static reg srli(reg a) { return _mm256_srli_epi32(a, N); }
+  template<int N> static reg slli(reg a) { return _mm256_slli_epi32(a, N); }
+  template<int N> static reg srai(reg a) { return _mm256_srai_epi32(a, N); }
+  static reg div(reg a, reg b) {
+    return _mm256_cvttps_epi32(_mm256_div_ps(_mm256_cvtepi32_ps(a), _mm256_cvtepi32_ps(b)));
+  }
+};
+
+} // anonymous namespace
+
+RgbaBlendRowFunc get_rgba_row_blender_avx2(BlendMode blendMode, const bool newBlend)
+{
+  return get_rgba_row_blender_simd<Avx2>(blendMode, newBlend);
+}
+
+GrayaBlendRowFunc get_graya_row_blender_avx2(BlendMode blendMode, const bool newBlend)
+{
+  return get_graya_row_blender_simd<Avx2>(blendMode, newBlend);
+}
+
+#else
+
+RgbaBlendRowFunc get_rgba_row_blender_avx2(BlendMode blendMode, const bool newBlend)
+{
+  return nullptr;
+}
+
+GrayaBlendRowFunc get_graya_row_blender_avx2(BlendMode blendMode, const bool newBlend)
+{
+  return nullptr;
+}
+
+#endif
+
+} // namespace doc
@@ -0,0 +1,406 @@
+// Aseprite Document Library
+// Copyright (c) 2023 Igara Studio S.A.
+//
+// This file is released under the terms of the MIT license.
+// Read LICENSE.txt for more information.
+
+#ifndef DOC_BLEND_ROW_SIMD_H_INCLUDED
+#define DOC_BLEND_ROW_SIMD_H_INCLUDED
+#pragma once
+
+// Generic SIMD kernels for row blenders. This header is included from
+// each translation unit that instantiates the kernels for one
+// instruction set (blend_row.cpp for SSE2/NEON, blend_row_avx2.cpp
+// for AVX2), so everything here must be in an anonymous namespace to
+// avoid mixing instantiations compiled with different CPU flags.
+//
+// The kernels are the vectorized versions of the functions in
+// blend_funcs.cpp and must return exactly the same values. Each
+// pixel channel is unpacked into its own 32-bit lane, and all
+// operations are done using integers (except the division in the
+// normal blend mode, which is done with floats that are precise
+// enough to get the truncated integer result).
+//
+// A "V" class must define:
+//
+//   V::reg                 Register with V::size 32-bit signed lanes
+//   V::set1(int)
+//   V::load32(const uint32_t*) / V::store32(uint32_t*, reg)
+//   V::load16(const uint16_t*) / V::store16(uint16_t*, reg)
+//   V::add/sub/and_/or_/cmpeq/cmpgt(reg, reg)
+//   V::mul/min/max(reg, reg)   Lanes must contain values in the int16 range
+//                              (and at least one mul operand must be >= 0)
+//   V::select(mask, a, b)      mask ? a: b
+//   V::srli<N>/slli<N>/srai<N>(reg)
+//   V::div(reg, reg)           Division truncated toward zero (like C ints)
+
+#include "doc/blend_mode.h"
+#include "doc/blend_row.h"
+#include "doc/color.h"
+
+#include <cstring>
+
+namespace doc {
+namespace {
+
+// Pixel format of the row (RGBA or GRAYA)
+
+struct RgbaRow {
+  using pixel_t = uint32_t;
+  enum { channels = 3, a_shift = 24 };
+  static constexpr int color_mask = 0x00ffffff;
+  template<class V> static typename V::reg load(const pixel_t* p) { return V::load32(p); }
+  template<class V> static void store(pixel_t* p, typename V::reg r) { V::store32(p, r); }
+};
+
+struct GrayaRow {
+  using pixel_t = uint16_t;
+  enum { channels = 1, a_shift = 8 };
+  static constexpr int color_mask = 0x00ff;
+  template<class V> static typename V::reg load(const pixel_t* p) { return V::load16(p); }
+  template<class V> static void store(pixel_t* p, typename V::reg r) { V::store16(p, r); }
+};
+
+// Pixels unpacked in one register per channel.
+template<class V, class T>
+struct Unpacked {
+  using R = typename V::reg;
+  R c[T::channels];
+  R a;
+
+  Unpacked(R px) {
+    const R ff = V::set1(0xff);
+    c[0] = V::and_(px, ff);
+    if constexpr (T::channels == 3) {
+      c[1] = V::and_(V::template srli<8>(px), ff);
+      c[2] = V::and_(V::template srli<16>(px), ff);
+    }
+    a = V::and_(V::template srli<T::a_shift>(px), ff);
+  }
+};
+
+// Packs channels truncating them to 8 bits (as rgba()/graya() do).
+template<class V, class T>
+inline typename V::reg pack(const typename V::reg* c, typename V::reg a)
+{
+  using R = typename V::reg;
+  const R ff = V::set1(0xff);
+  R px = V::and_(c[0], ff);
+  if constexpr (T::channels == 3) {
+    px = V::or_(px, V::template slli<8>(V::and_(c[1], ff)));
+    px = V::or_(px, V::template slli<16>(V::and_(c[2], ff)));
+  }
+  return V::or_(px, V::template slli<T::a_shift>(V::and_(a, ff)));
+}
+
+// Same as pixman MUL_UN8() (a can be negative)
+template<class V>
+inline typename V::reg mul_un8(typename V::reg a, typename V::reg b)
+{
+  using R = typename V::reg;
+  const R t = V::add(V::mul(a, b), V::set1(0x80));
+  return V::template srai<8>(V::add(V::template srai<8>(t), t));
+}
+
+template<class V>
+inline typename V::reg is_zero(typename V::reg a)
+{
+  return V::cmpeq(a, V::set1(0));
+}
+
+// rgba_blender_normal() / graya_blender_normal()
+template<class V, class T>
+inline typename V::reg blend_normal(typename V::reg b,
+                                    typename V::reg s,
+                                    typename V::reg opacity)
+{
+  using R = typename V::reg;
+  const Unpacked<V, T> B(b), S(s);
+
+  const R Sa = mul_un8<V>(S.a, opacity);
+  const R Ra = V::sub(V::add(Sa, B.a), mul_un8<V>(B.a, Sa));
+  R Rc[T::channels];
+  for (int i=0; i<T::channels; ++i)
+    Rc[i] = V::add(B.c[i], V::div(V::mul(V::sub(S.c[i], B.c[i]), Sa), Ra));
+
+  // Transparent backdrop
+  const R r1 = V::or_(V::and_(s, V::set1(T::color_mask)),
+                      V::template slli<T::a_shift>(Sa));
+
+  R r = pack<V, T>(Rc, Ra);
+  r = V::select(is_zero<V>(S.a), b, r);
+  r = V::select(is_zero<V>(B.a), r1, r);
+  return r;
+}
+
+// rgba_blender_merge() / graya_blender_merge()
+template<class V, class T>
+inline typename V::reg blend_merge(typename V::reg b,
+                                   typename V::reg s,
+                                   typename V::reg opacity)
+{
+  using R = typename V::reg;
+  const Unpacked<V, T> B(b), S(s);
+
+  const R Ba0 = is_zero<V>(B.a);
+  const R Sa0 = is_zero<V>(S.a);
+  const R Ra = V::add(B.a, mul_un8<V>(V::sub(S.a, B.a), opacity));
+  const R Ra0 = is_zero<V>(Ra);
+  R Rc[T::channels];
+  for (int i=0; i<T::channels; ++i) {
+    R v = V::add(B.c[i], mul_un8<V>(V::sub(S.c[i], B.c[i]), opacity));
+    v = V::select(Sa0, B.c[i], v);
+    v = V::select(Ba0, S.c[i], v);
+    Rc[i] = V::select(Ra0, V::set1(0), v);
+  }
+  return pack<V, T>(Rc, Ra);
+}
+
+//////////////////////////////////////////////////////////////////////
+// Separable blend modes (applied to each color channel)
+
+struct Multiply {
+  template<class V> static typename V::reg f(typename V::reg b, typename V::reg s) {
+    return mul_un8<V>(b, s);
+  }
+};
+
+struct Screen {
+  template<class V> static typename V::reg f(typename V::reg b, typename V::reg s) {
+    return V::sub(V::add(b, s), mul_un8<V>(b, s));
+  }
+};
+
+struct HardLight {
+  template<class V> static typename V::reg f(typename V::reg b, typename V::reg s) {
+    const typename V::reg s2 = V::template slli<1>(s);
+    const typename V::reg s3 = V::sub(s2, V::set1(255));
+    return V::select(V::cmpgt(V::set1(128), s),
+                     mul_un8<V>(b, s2),
+                     V::sub(V::add(b, s3), mul_un8<V>(b, s3)));
+  }
+};
+
+struct Overlay {
+  template<class V> static typename V::reg f(typename V::reg b, typename V::reg s) {
+    return HardLight::f<V>(s, b);
+  }
+};
+
+struct Darken {
+  template<class V> static typename V::reg f(typename V::reg b, typename V::reg s) {
+    return V::min(b, s);
+  }
+};
+
+struct Lighten {
+  template<class V> static typename V::reg f(typename V::reg b, typename V::reg s) {
+    return V::max(b, s);
+  }
+};
+
+struct Difference {
+  template<class V> static typename V::reg f(typename V::reg b, typename V::reg s) {
+    return V::sub(V::max(b, s), V::min(b, s));
+  }
+};
+
+struct Exclusion {
+  template<class V> static typename V::reg f(typename V::reg b, typename V::reg s) {
+    const typename V::reg t = mul_un8<V>(b, s);
+    return V::sub(V::add(b, s), V::add(t, t));
+  }
+};
+
+struct Addition {
+  template<class V> static typename V::reg f(typename V::reg b, typename V::reg s) {
+    return V::min(V::add(b, s), V::set1(255));
+  }
+};
+
+struct Subtract {
+  template<class V> static typename V::reg f(typename V::reg b, typename V::reg s) {
+    return V::max(V::sub(b, s), V::set1(0));
+  }
+};
+
+// Returns the source pixel with its color replaced with the result
+// of the separable blend mode (e.g. "src = rgba(r, g, b, 0) | (src &
+// rgba_a_mask)" in blend_funcs.cpp).
+template<class V, class T, class F>
+inline typename V::reg blend_src_color(typename V::reg b, typename V::reg s)
+{
+  using R = typename V::reg;
+  const Unpacked<V, T> B(b), S(s);
+  R c[T::channels];
+  for (int i=0; i<T::channels; ++i)
+    c[i] = F::template f<V>(B.c[i], S.c[i]);
+  return V::or_(pack<V, T>(c, V::set1(0)),
+                V::and_(s, V::set1(int(0xffu << T::a_shift))));
+}
+
+//////////////////////////////////////////////////////////////////////
+// Blend operations for a whole pack of pixels
+
+struct OpSrc {
+  template<class V, class T>
+  static typename V::reg blend(typename V::reg b, typename V::reg s, typename V::reg opacity) {
+    return s;
+  }
+};
+
+struct OpMerge {
+  template<class V, class T>
+  static typename V::reg blend(typename V::reg b, typename V::reg s, typename V::reg opacity) {
+    return blend_merge<V, T>(b, s, opacity);
+  }
+};
+
+struct OpNormal {
+  template<class V, class T>
+  static typename V::reg blend(typename V::reg b, typename V::reg s, typename V::reg opacity) {
+    return blend_normal<V, T>(b, s, opacity);
+  }
+};
+
+struct OpNormalDstOver {
+  template<class V, class T>
+  static typename V::reg blend(typename V::reg b, typename V::reg s, typename V::reg opacity) {
+    const typename V::reg Sa = mul_un8<V>(Unpacked<V, T>(s).a, opacity);
+    s = V::or_(V::and_(s, V::set1(T::color_mask)),
+               V::template slli<T::a_shift>(Sa));
+    return blend_normal<V, T>(s, b, V::set1(255));
+  }
+};
+
+// Old blend method, e.g. rgba_blender_multiply()
+template<class F>
+struct OpSeparable {
+  template<class V, class T>
+  static typename V::reg blend(typename V::reg b, typename V::reg s, typename V::reg opacity) {
+    return blend_normal<V, T>(b, blend_src_color<V, T, F>(b, s), opacity);
+  }
+};
+
+// New blend method, e.g. rgba_blender_multiply_n()
+template<class F>
+struct OpSeparableN {
+  template<class V, class T>
+  static typename V::reg blend(typename V::reg b, typename V::reg s, typename V::reg opacity) {
+    using R = typename V::reg;
+    const R normal = blend_normal<V, T>(b, s, opacity);
+    const R blend = blend_normal<V, T>(b, blend_src_color<V, T, F>(b, s), opacity);
+    const R Ba = Unpacked<V, T>(b).a;
+    const R normalToBlendMerge = blend_merge<V, T>(normal, blend, Ba);
+    const R srcTotalAlpha = mul_un8<V>(Unpacked<V, T>(s).a, opacity);
+    const R compositeAlpha = mul_un8<V>(Ba, srcTotalAlpha);
+    return V::select(is_zero<V>(Ba), normal,
+                     blend_merge<V, T>(normalToBlendMerge, blend, compositeAlpha));
+  }
+};
+
+//////////////////////////////////////////////////////////////////////
+// Row kernel
+
+template<class V, class T, class Op>
+void blend_row_simd(typename T::pixel_t* dst,
+                    const typename T::pixel_t* src,
+                    int n, int opacity, color_t maskColor)
+{
+  using R = typename V::reg;
+  using pixel_t = typename T::pixel_t;
+
+  const R op = V::set1(opacity);
+  const R mask = V::set1(int(maskColor));
+
+  auto blendPack = [&](pixel_t* d, const pixel_t* s) {
+    const R b = T::template load<V>(d);
+    const R p = T::template load<V>(s);
+    const R r = Op::template blend<V, T>(b, p, op);
+    T::template store<V>(d, V::select(V::cmpeq(p, mask), b, r));
+  };
+
+  int x = 0;
+  for (; x+V::size<=n; x+=V::size)
+    blendPack(dst+x, src+x);
+
+  // Remaining pixels are blended in a temporary pack
+  if (x < n) {
+    pixel_t d[V::size], s[V::size];
+    const int rest = n-x;
+    std::memset(d, 0, sizeof(d));
+    std::memset(s, 0, sizeof(s));
+    std::memcpy(d, dst+x, sizeof(pixel_t)*rest);
+    std::memcpy(s, src+x, sizeof(pixel_t)*rest);
+    blendPack(d, s);
+    std::memcpy(dst+x, d, sizeof(pixel_t)*rest);
+  }
+}
+
+// Returns the SIMD kernel that matches the BlendFunc returned by
+// get_rgba_blender(), or nullptr if there is no kernel for it.
+template<class V>
+RgbaBlendRowFunc get_rgba_row_blender_simd(BlendMode blendMode, const bool newBlend)
+{
+#define ROW(op) blend_row_simd<V, RgbaRow, op>
+#define ROW_SEP(f) (newBlend ? ROW(OpSeparableN<f>): ROW(OpSeparable<f>))
+  switch (blendMode) {
+    case BlendMode::SRC:            return ROW(OpSrc);
+    case BlendMode::MERGE:          return ROW(OpMerge);
+    case BlendMode::DST_OVER:       return ROW(OpNormalDstOver);
+    case BlendMode::NORMAL:         return ROW(OpNormal);
+    case BlendMode::MULTIPLY:       return ROW_SEP(Multiply);
+    case BlendMode::SCREEN:         return ROW_SEP(Screen);
+    case BlendMode::OVERLAY:        return ROW_SEP(Overlay);
+    case BlendMode::DARKEN:         return ROW_SEP(Darken);
+    case BlendMode::LIGHTEN:        return ROW_SEP(Lighten);
+    case BlendMode::HARD_LIGHT:     return ROW_SEP(HardLight);
+    case BlendMode::DIFFERENCE:     return ROW_SEP(Difference);
+    case BlendMode::EXCLUSION:      return ROW_SEP(Exclusion);
+    case BlendMode::ADDITION:       return ROW_SEP(Addition);
+    case BlendMode::SUBTRACT:       return ROW_SEP(Subtract);
+    default:                        return nullptr;
+  }
+#undef ROW_SEP
+#undef ROW
+}
+
+// Same as get_rgba_row_blender_simd() but matching get_graya_blender()
+template<class V>
+GrayaBlendRowFunc get_graya_row_blender_simd(BlendMode blendMode, const bool newBlend)
+{
+#define ROW(op) blend_row_simd<V, GrayaRow, op>
+#define ROW_SEP(f) (newBlend ? ROW(OpSeparableN<f>): ROW(OpSeparable<f>))
+  switch (blendMode) {
+    case BlendMode::SRC:            return ROW(OpSrc);
+    case BlendMode::MERGE:          return ROW(OpMerge);
+    case BlendMode::DST_OVER:       return ROW(OpNormalDstOver);
+    case BlendMode::NORMAL:
+    case BlendMode::RED_TINT:
+    case BlendMode::BLUE_TINT:
+    case BlendMode::HSL_HUE:
+    case BlendMode::HSL_SATURATION:
+    case BlendMode::HSL_COLOR:
+    case BlendMode::HSL_LUMINOSITY: return ROW(OpNormal);
+    case BlendMode::MULTIPLY:       return ROW_SEP(Multiply);
+    case BlendMode::SCREEN:         return ROW_SEP(Screen);
+    case BlendMode::OVERLAY:        return ROW_SEP(Overlay);
+    case BlendMode::DARKEN:         return ROW_SEP(Darken);
+    case BlendMode::LIGHTEN:        return ROW_SEP(Lighten);
+    case BlendMode::HARD_LIGHT:     return ROW_SEP(HardLight);
+    case BlendMode::DIFFERENCE:     return ROW_SEP(Difference);
+    case BlendMode::EXCLUSION:      return ROW_SEP(Exclusion);
+    // get_graya_blender() uses graya_blender_exclusion_n for ADDITION
+    case BlendMode::ADDITION:       return (newBlend ? ROW(OpSeparableN<Exclusion>):
+                                                       ROW(OpSeparable<Addition>));
+    case BlendMode::SUBTRACT:       return ROW_SEP(Subtract);
+    default:                        return nullptr;
+  }
+#undef ROW_SEP
+#undef ROW
+}
+
+} // anonymous namespace
+} // namespace doc
+
+#endif
@@ -0,0 +1,162 @@
+// Aseprite Document Library
+// Copyright (c) 2023 Igara Studio S.A.
+//
+// This file is released under the terms of the MIT license.
+// Read LICENSE.txt for more information.
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <gtest/gtest.h>
+
+#include "doc/blend_funcs.h"
+#include "doc/blend_row.h"
+
+#include <random>
+#include <vector>
+
+using namespace doc;
+
+namespace {
+
+const BlendMode kModes[] = {
+  BlendMode::SRC, BlendMode::MERGE, BlendMode::NEG_BW,
+  BlendMode::RED_TINT, BlendMode::BLUE_TINT, BlendMode::DST_OVER,
+  BlendMode::NORMAL, BlendMode::MULTIPLY, BlendMode::SCREEN,
+  BlendMode::OVERLAY, BlendMode::DARKEN, BlendMode::LIGHTEN,
+  BlendMode::COLOR_DODGE, BlendMode::COLOR_BURN, BlendMode::HARD_LIGHT,
+  BlendMode::SOFT_LIGHT, BlendMode::DIFFERENCE, BlendMode::EXCLUSION,
+  BlendMode::HSL_HUE, BlendMode::HSL_SATURATION, BlendMode::HSL_COLOR,
+  BlendMode::HSL_LUMINOSITY, BlendMode::ADDITION, BlendMode::SUBTRACT,
+  BlendMode::DIVIDE
+};
+
+const BlendRowSimd kSimds[] = {
+  BlendRowSimd::None, BlendRowSimd::SSE2, BlendRowSimd::AVX2, BlendRowSimd::NEON
+};
+
+// Random pixels with a high probability of having special alpha
+// values (0 and 255) that take different paths in the blenders.
+template<typename pixel_t>
+std::vector<pixel_t> random_row(std::mt19937& gen, int n, int alphaShift)
+{
+  std::uniform_int_distribution<uint32_t> dist;
+  std::vector<pixel_t> row(n);
+  for (auto& px : row) {
+    uint32_t c = dist(gen);
+    switch (c % 4) {
+      case 0: c &= ~(0xffu << alphaShift); break;
+      case 1: c |= (0xffu << alphaShift); break;
+    }
+    px = pixel_t(c);
+  }
+  return row;
+}
+
+} // anonymous namespace
+
+TEST(BlendRow, RgbaMatchesBlendFuncs)
+{
+  std::mt19937 gen(1);
+  const color_t maskColor = 0;
+
+  for (BlendRowSimd simd : kSimds) {
+    for (BlendMode mode : kModes) {
+      for (bool newBlend : { false, true }) {
+        RgbaBlendRowFunc rowFunc = get_rgba_row_blender(simd, mode, newBlend);
+        if (!rowFunc)
+          continue;
+
+        BlendFunc func = get_rgba_blender(mode, newBlend);
+        for (int opacity : { 0, 1, 127, 128, 254, 255 }) {
+          for (int n : { 1, 3, 4, 7, 8, 9, 31, 64, 1001 }) {
+            std::vector<uint32_t> dst = random_row<uint32_t>(gen, n, 24);
+            std::vector<uint32_t> src = random_row<uint32_t>(gen, n, 24);
+            std::vector<uint32_t> expected = dst;
+            for (int i=0; i<n; ++i) {
+              if (src[i] != maskColor)
+                expected[i] = func(expected[i], src[i], opacity);
+            }
+
+            rowFunc(dst.data(), src.data(), n, opacity, maskColor);
+            for (int i=0; i<n; ++i) {
+              ASSERT_EQ(expected[i], dst[i])
+                << "simd=" << int(simd) << " mode=" << int(mode)
+                << " newBlend=" << newBlend << " opacity=" << opacity
+                << " i=" << i << " src=" << std::hex << src[i];
+            }
+          }
+        }
+      }
+    }
+  }
+}
+
+TEST(BlendRow, GrayaMatchesBlendFuncs)
+{
+  std::mt19937 gen(2);
+  const color_t maskColor = 0;
+
+  for (BlendRowSimd simd : kSimds) {
+    for (BlendMode mode : kModes) {
+      for (bool newBlend : { false, true }) {
+        GrayaBlendRowFunc rowFunc = get_graya_row_blender(simd, mode, newBlend);
+        if (!rowFunc)
+          continue;
+
+        BlendFunc func = get_graya_blender(mode, newBlend);
+        for (int opacity : { 0, 1, 127, 128, 254, 255 }) {
+          for (int n : { 1, 3, 4, 7, 8, 9, 31, 64, 1001 }) {
+            std::vector<uint16_t> dst = random_row<uint16_t>(gen, n, 8);
+            std::vector<uint16_t> src = random_row<uint16_t>(gen, n, 8);
+            std::vector<uint16_t> expected = dst;
+            for (int i=0; i<n; ++i) {
+              if (src[i] != maskColor)
+                expected[i] = func(expected[i], src[i], opacity);
+            }
+
+            rowFunc(dst.data(), src.data(), n, opacity, maskColor);
+            for (int i=0; i<n; ++i) {
+              ASSERT_EQ(expected[i], dst[i])
+                << "simd=" << int(simd) << " mode=" << int(mode)
+                << " newBlend=" << newBlend << " opacity=" << opacity
+                << " i=" << i << " src=" << std::hex << src[i];
+            }
+          }
+        }
+      }
+    }
+  }
+}
+
+TEST(BlendRow, SkipsMaskColor)
+{
+  const color_t maskColor = rgba(255, 0, 255, 255);
+  std::vector<uint32_t> dst(13, rgba(10, 20, 30, 255));
+  std::vector<uint32_t> src(13, rgba(200, 100, 50, 255));
+  src[0] = src[5] = src[12] = maskColor;
+
+  for (BlendRowSimd simd : kSimds) {
+    RgbaBlendRowFunc rowFunc = get_rgba_row_blender(simd, BlendMode::SRC, true);
+    if (!rowFunc)
+      continue;
+
+    std::vector<uint32_t> res = dst;
+    rowFunc(res.data(), src.data(), int(res.size()), 255, maskColor);
+    for (int i=0; i<int(res.size()); ++i) {
+      if (src[i] == maskColor)
+        EXPECT_EQ(dst[i], res[i]);
+      else
+        EXPECT_EQ(src[i], res[i]);
+    }
+  }
+}
+
+TEST(BlendRow, AlwaysHasRowBlender)
+{
+  for (BlendMode mode : kModes) {
+    EXPECT_TRUE(get_rgba_row_blender(mode, true) != nullptr);
+    EXPECT_TRUE(get_graya_row_blender(mode, true) != nullptr);
+  }
+}
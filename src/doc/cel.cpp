@@ -172,11 +172,10 @@ Grid Cel::grid() const
 
 void Cel::fixupImage()
 {
-  // Change the mask color to the sprite mask color
-  if (m_layer && image()) {
-    image()->setMaskColor((image()->pixelFormat() == IMAGE_TILEMAP) ?
-                            notile : m_layer->sprite()->transparentColor());
-    ASSERT(m_data);
+  // Change the mask color to the sprite mask color (lazy images
+  // are not loaded here, they get the mask color when they're loaded)
+  if (m_layer && m_data && (m_data->isLazy() || image())) {
+    m_data->setMaskColor(m_layer->sprite()->transparentColor());
     m_data->adjustBounds(m_layer);
   }
 }
@@ -1,5 +1,5 @@
 // Aseprite Document Library
-// Copyright (c) 2019-2022 Igara Studio S.A.
+// Copyright (c) 2019-2023 Igara Studio S.A.
 // Copyright (c) 2001-2016 David Capello
 //
 // This file is released under the terms of the MIT license.
@@ -14,12 +14,18 @@
 #include "doc/image.h"
 #include "doc/layer.h"
 #include "doc/layer_tilemap.h"
+#include "doc/primitives.h"
 #include "doc/sprite.h"
+#include "doc/tile.h"
 #include "doc/tileset.h"
 #include "gfx/rect.h"
 
+#include <atomic>
+
 namespace doc {
 
+static std::atomic<std::size_t> g_lazyImagesMemory(0);
+
 CelData::CelData(const ImageRef& image)
   : WithUserData(ObjectType::CelData)
   , m_image(image)
@@ -31,9 +37,22 @@ CelData::CelData(const ImageRef& image)
 {
 }
 
+CelData::CelData(const ImageLoaderRef& loader, const gfx::Rect& bounds)
+  : WithUserData(ObjectType::CelData)
+  , m_lazy(std::make_unique<LazyImage>())
+  , m_opacity(255)
+  , m_bounds(bounds)
+  , m_boundsF(nullptr)
+{
+  ASSERT(loader);
+  m_lazy->loader = loader;
+}
+
+// The copy doesn't load its image lazily, both cel data will share
+// the same loaded image.
 CelData::CelData(const CelData& celData)
   : WithUserData(ObjectType::CelData)
-  , m_image(celData.m_image)
+  , m_image(celData.imageRef())
   , m_opacity(celData.m_opacity)
   , m_bounds(celData.m_bounds)
   , m_boundsF(celData.m_boundsF ? std::make_unique<gfx::RectF>(*celData.m_boundsF):
@@ -43,16 +62,122 @@ CelData::CelData(const CelData& celData)
 
 CelData::~CelData()
 {
+  releaseLazy();
+}
+
+int CelData::getMemSize() const
+{
+  if (m_lazy && !m_image)
+    return sizeof(CelData);
+
+  ASSERT(m_image);
+  return sizeof(CelData) + m_image->getMemSize();
 }
 
 void CelData::setImage(const ImageRef& image, Layer* layer)
 {
   ASSERT(image.get());
 
+  releaseLazy();
   m_image = image;
   adjustBounds(layer);
 }
 
+bool CelData::isImageLoaded() const
+{
+  if (!m_lazy)
+    return true;
+
+  const std::lock_guard lock(m_lazy->mutex);
+  return (m_image != nullptr);
+}
+
+bool CelData::imageLoadFailed() const
+{
+  if (!m_lazy)
+    return false;
+
+  const std::lock_guard lock(m_lazy->mutex);
+  return (!m_image && m_lazy->placeholder);
+}
+
+bool CelData::unloadImage()
+{
+  if (!m_lazy)
+    return false;
+
+  const std::lock_guard lock(m_lazy->mutex);
+  if (!m_image ||
+      m_image.use_count() > 1 ||
+      m_image->version() != m_lazy->version ||
+      calculate_image_hash64(m_image.get()) != m_lazy->hash) {
+    return false;
+  }
+
+  m_lazy->id = m_image->id();
+  m_image.reset();
+  g_lazyImagesMemory -= m_lazy->memSize;
+  m_lazy->memSize = 0;
+  return true;
+}
+
+// static
+std::size_t CelData::lazyImagesMemory()
+{
+  return g_lazyImagesMemory;
+}
+
+// The image (if it's loaded) is not lazy anymore
+void CelData::releaseLazy()
+{
+  if (m_lazy) {
+    g_lazyImagesMemory -= m_lazy->memSize;
+    m_lazy.reset();
+  }
+}
+
+const ImageRef& CelData::lazyImage() const
+{
+  ASSERT(m_lazy);
+  const std::lock_guard lock(m_lazy->mutex);
+  if (!m_image) {
+    ImageRef image = m_lazy->loader->loadImage();
+    if (!image) {
+      // The same placeholder is returned until the image can be
+      // loaded (it's not released as raw pointers to it can be
+      // kept by the caller)
+      if (!m_lazy->placeholder) {
+        m_lazy->placeholder.reset(
+          Image::create(m_lazy->loader->pixelFormat(),
+                        m_bounds.w, m_bounds.h));
+        m_lazy->placeholder->setMaskColor(m_lazy->maskColor);
+        clear_image(m_lazy->placeholder.get(), m_lazy->maskColor);
+      }
+      return m_lazy->placeholder;
+    }
+
+    m_image = image;
+    ASSERT(m_image->width() == m_bounds.w);
+    ASSERT(m_image->height() == m_bounds.h);
+    ASSERT(m_image->pixelFormat() != IMAGE_TILEMAP);
+    m_image->setMaskColor(m_lazy->maskColor);
+
+    // Keep the same ID/version that the image had the first time it
+    // was loaded (as the image can be referenced by ID)
+    if (m_lazy->id) {
+      m_image->setId(m_lazy->id);
+      m_image->setVersion(m_lazy->version);
+    }
+    else {
+      m_lazy->version = m_image->version();
+    }
+    m_lazy->hash = calculate_image_hash64(m_image.get());
+    m_lazy->memSize = m_image->getMemSize();
+    g_lazyImagesMemory += m_lazy->memSize;
+  }
+  return m_image;
+}
+
 void CelData::setPosition(const gfx::Point& pos)
 {
   m_bounds.setOrigin(pos);
@@ -60,8 +185,25 @@ void CelData::setPosition(const gfx::Point& pos)
     m_boundsF->setOrigin(gfx::PointF(pos));
 }
 
+void CelData::setMaskColor(const color_t color)
+{
+  if (m_lazy) {
+    const std::lock_guard lock(m_lazy->mutex);
+    m_lazy->maskColor = color;
+  }
+  if (m_image) {
+    m_image->setMaskColor(m_image->pixelFormat() == IMAGE_TILEMAP ?
+                            notile: color);
+  }
+}
+
 void CelData::adjustBounds(Layer* layer)
 {
+  // Lazy images are not tilemaps and the bounds already have their
+  // size, so we don't need to load them
+  if (m_lazy && !isImageLoaded())
+    return;
+
   ASSERT(m_image);
   if (m_image->pixelFormat() == IMAGE_TILEMAP) {
     Tileset* tileset = nullptr;
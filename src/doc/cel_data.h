@@ -1,5 +1,5 @@
 // Aseprite Document Library
-// Copyright (C) 2019-2022  Igara Studio S.A.
+// Copyright (C) 2019-2023  Igara Studio S.A.
 // Copyright (C) 2001-2016  David Capello
 //
 // This file is released under the terms of the MIT license.
@@ -9,12 +9,17 @@
 #define DOC_CEL_DATA_H_INCLUDED
 #pragma once
 
+#include "doc/color.h"
+#include "doc/image_loader.h"
 #include "doc/image_ref.h"
 #include "doc/object.h"
 #include "doc/with_user_data.h"
 #include "gfx/rect.h"
 
+#include <cstddef>
+#include <cstdint>
 #include <memory>
+#include <mutex>
 
 namespace doc {
 
@@ -27,24 +32,63 @@ namespace doc {
     CelData(const CelData& celData);
     ~CelData();
 
+    // Creates a cel data with an image that will be loaded with the
+    // given loader the first time it's needed (see image()). The
+    // bounds must match the size of the image to load (which cannot
+    // be a tilemap).
+    CelData(const ImageLoaderRef& loader, const gfx::Rect& bounds);
+
     gfx::Point position() const { return m_bounds.origin(); }
     const gfx::Rect& bounds() const { return m_bounds; }
     int opacity() const { return m_opacity; }
-    Image* image() const { return const_cast<Image*>(m_image.get()); };
-    ImageRef imageRef() const { return m_image; }
+    Image* image() const {
+      return const_cast<Image*>(m_lazy ? lazyImage().get(): m_image.get());
+    };
+    ImageRef imageRef() const {
+      return (m_lazy ? lazyImage(): m_image);
+    }
+
+    // Lazy images: isImageLoaded() returns false if the image will be
+    // loaded the next time it's accessed. unloadImage() releases the
+    // image if it can be loaded again from the image loader (i.e. its
+    // pixels were not modified and it's not referenced from other
+    // places), returning true in that case. It must be called when no
+    // other thread is using the image (raw Image pointers are
+    // invalidated), e.g. with the document locked for writing.
+    bool isLazy() const { return m_lazy != nullptr; }
+    bool isImageLoaded() const;
+    void loadImage() const { image(); }
+    bool unloadImage();
+
+    // Returns true if the lazy image couldn't be loaded (e.g. the
+    // file was modified by other program). In that case image()
+    // returns an empty placeholder that is never kept as the cel
+    // image (the loader is used again the next time), so the cel
+    // must not be saved.
+    bool imageLoadFailed() const;
+
+    // Total memory (in bytes) used by the loaded images of all lazy
+    // cel data (to know when some images should be unloaded).
+    static std::size_t lazyImagesMemory();
 
     // Returns a rectangle with the bounds of the image (width/height
     // of the image) in the position of the cel (useful to compare
     // active tilemap bounds when we have to change the tilemap cel
     // bounds).
     gfx::Rect imageBounds() const {
+      const Image* img = image();
       return gfx::Rect(m_bounds.x,
                        m_bounds.y,
-                       m_image->width(),
-                       m_image->height());
+                       img->width(),
+                       img->height());
     }
 
     void setImage(const ImageRef& image, Layer* layer);
+
+    // Changes the mask color of the image (notile for tilemaps). A
+    // lazy image that is not loaded yet gets this mask color each
+    // time it's loaded.
+    void setMaskColor(color_t color);
     void setPosition(const gfx::Point& pos);
 
     void setOpacity(int opacity) {
@@ -80,15 +124,34 @@ namespace doc {
       return m_boundsF != nullptr;
     }
 
-    virtual int getMemSize() const override {
-      ASSERT(m_image);
-      return sizeof(CelData) + m_image->getMemSize();
-    }
+    virtual int getMemSize() const override;
 
     void adjustBounds(Layer* layer);
 
   private:
-    ImageRef m_image;
+    struct LazyImage {
+      ImageLoaderRef loader;
+      std::mutex mutex;
+      // ID and version of the loaded image, restored in the image
+      // when it's loaded again after unloadImage()
+      ObjectId id = 0;
+      ObjectVersion version = 0;
+      // Hash of the loaded pixels (to know if the image was modified
+      // in-place without incrementing its version) and the memory
+      // counted in lazyImagesMemory()
+      uint64_t hash = 0;
+      std::size_t memSize = 0;
+      color_t maskColor = 0;
+      // Image returned when the loader fails
+      ImageRef placeholder;
+    };
+
+    void releaseLazy();
+
+    const ImageRef& lazyImage() const;
+
+    mutable ImageRef m_image;
+    std::unique_ptr<LazyImage> m_lazy;
     int m_opacity;
     gfx::Rect m_bounds;
 
@@ -0,0 +1,204 @@
+// Aseprite Document Library
+// Copyright (c) 2023 Igara Studio S.A.
+//
+// This file is released under the terms of the MIT license.
+// Read LICENSE.txt for more information.
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <gtest/gtest.h>
+
+#include "doc/cel.h"
+#include "doc/cel_data.h"
+#include "doc/image.h"
+#include "doc/layer.h"
+#include "doc/primitives.h"
+#include "doc/sprite.h"
+
+#include <memory>
+
+using namespace doc;
+
+namespace {
+
+class TestLoader : public ImageLoader {
+public:
+  int loads = 0;
+  bool fail = false;
+
+  ImageRef loadImage() override {
+    ++loads;
+    if (fail)
+      return nullptr;
+    ImageRef image(Image::create(IMAGE_RGB, 4, 3));
+    clear_image(image.get(), rgba(255, 0, 0, 255));
+    return image;
+  }
+
+  PixelFormat pixelFormat() const override {
+    return IMAGE_RGB;
+  }
+};
+
+} // anonymous namespace
+
+TEST(CelData, LazyImage)
+{
+  auto loader = std::make_shared<TestLoader>();
+  CelData celData(loader, gfx::Rect(2, 3, 4, 3));
+
+  // The image is not loaded until it's needed
+  EXPECT_FALSE(celData.isImageLoaded());
+  EXPECT_EQ(gfx::Rect(2, 3, 4, 3), celData.bounds());
+  EXPECT_EQ(0, loader->loads);
+
+  Image* image = celData.image();
+  ASSERT_TRUE(image != nullptr);
+  EXPECT_TRUE(celData.isImageLoaded());
+  EXPECT_EQ(rgba(255, 0, 0, 255), get_pixel(image, 0, 0));
+  EXPECT_EQ(image, celData.image());
+  EXPECT_EQ(1, loader->loads);
+
+  // Unload and load it again keeping the same ID
+  const ObjectId id = image->id();
+  EXPECT_TRUE(celData.unloadImage());
+  EXPECT_FALSE(celData.isImageLoaded());
+  EXPECT_EQ(id, celData.image()->id());
+  EXPECT_EQ(2, loader->loads);
+
+  // Referenced images cannot be unloaded
+  {
+    ImageRef ref = celData.imageRef();
+    EXPECT_FALSE(celData.unloadImage());
+  }
+
+  // Images modified in-place (even without incrementing the
+  // version) cannot be unloaded
+  put_pixel(celData.image(), 1, 0, rgba(0, 255, 0, 255));
+  EXPECT_FALSE(celData.unloadImage());
+  EXPECT_EQ(rgba(0, 255, 0, 255), get_pixel(celData.image(), 1, 0));
+
+  put_pixel(celData.image(), 0, 0, rgba(0, 0, 255, 255));
+  celData.image()->incrementVersion();
+  EXPECT_FALSE(celData.unloadImage());
+  EXPECT_EQ(rgba(0, 0, 255, 255), get_pixel(celData.image(), 0, 0));
+  EXPECT_EQ(2, loader->loads);
+}
+
+TEST(CelData, LazyImagesMemory)
+{
+  const std::size_t mem0 = CelData::lazyImagesMemory();
+  auto loader = std::make_shared<TestLoader>();
+  {
+    CelData celData(loader, gfx::Rect(0, 0, 4, 3));
+    EXPECT_EQ(mem0, CelData::lazyImagesMemory());
+
+    const std::size_t size = celData.image()->getMemSize();
+    EXPECT_EQ(mem0 + size, CelData::lazyImagesMemory());
+    EXPECT_TRUE(celData.unloadImage());
+    EXPECT_EQ(mem0, CelData::lazyImagesMemory());
+
+    celData.loadImage();
+    EXPECT_EQ(mem0 + size, CelData::lazyImagesMemory());
+
+    // A new image is not lazy anymore
+    celData.setImage(ImageRef(Image::create(IMAGE_RGB, 4, 3)), nullptr);
+    EXPECT_FALSE(celData.isLazy());
+    EXPECT_EQ(mem0, CelData::lazyImagesMemory());
+  }
+  {
+    CelData celData(loader, gfx::Rect(0, 0, 4, 3));
+    celData.loadImage();
+  }
+  EXPECT_EQ(mem0, CelData::lazyImagesMemory());
+}
+
+TEST(CelData, CopyLazyImage)
+{
+  auto loader = std::make_shared<TestLoader>();
+  CelData celData(loader, gfx::Rect(0, 0, 4, 3));
+  CelData copy(celData);
+
+  // Both cel data share the same loaded image
+  EXPECT_EQ(1, loader->loads);
+  EXPECT_EQ(celData.image(), copy.image());
+  EXPECT_FALSE(celData.unloadImage());
+  EXPECT_FALSE(copy.unloadImage());
+}
+
+TEST(CelData, LazyImageMaskColor)
+{
+  auto loader = std::make_shared<TestLoader>();
+  CelData celData(loader, gfx::Rect(2, 3, 4, 3));
+
+  // Adjusting the bounds or the mask color doesn't load the image
+  celData.setMaskColor(rgba(255, 0, 0, 255));
+  celData.adjustBounds(nullptr);
+  EXPECT_FALSE(celData.isImageLoaded());
+  EXPECT_EQ(gfx::Rect(2, 3, 4, 3), celData.bounds());
+  EXPECT_EQ(0, loader->loads);
+
+  // The mask color is restored each time the image is loaded
+  EXPECT_EQ(rgba(255, 0, 0, 255), celData.image()->maskColor());
+  EXPECT_TRUE(celData.unloadImage());
+  EXPECT_EQ(rgba(255, 0, 0, 255), celData.image()->maskColor());
+
+  celData.setMaskColor(0);
+  EXPECT_EQ(0, celData.image()->maskColor());
+  EXPECT_TRUE(celData.unloadImage());
+  EXPECT_EQ(0, celData.image()->maskColor());
+  EXPECT_EQ(3, loader->loads);
+}
+
+TEST(CelData, AddLazyCelToLayer)
+{
+  auto loader = std::make_shared<TestLoader>();
+  Sprite sprite(ImageSpec(ColorMode::RGB, 4, 3), 256);
+  auto layer = new LayerImage(&sprite);
+  sprite.root()->addLayer(layer);
+
+  auto celData = std::make_shared<CelData>(loader, gfx::Rect(1, 1, 4, 3));
+  layer->addCel(new Cel(0, celData));
+  EXPECT_FALSE(celData->isImageLoaded());
+  EXPECT_EQ(0, loader->loads);
+  EXPECT_EQ(sprite.transparentColor(), celData->image()->maskColor());
+}
+
+TEST(CelData, LazyImageLoadFailed)
+{
+  auto loader = std::make_shared<TestLoader>();
+  loader->fail = true;
+  CelData celData(loader, gfx::Rect(0, 0, 4, 3));
+  celData.setMaskColor(rgba(0, 0, 0, 0));
+
+  // An empty placeholder is returned, but it's never kept as the
+  // loaded image
+  EXPECT_FALSE(celData.imageLoadFailed());
+  Image* placeholder = celData.image();
+  ASSERT_TRUE(placeholder != nullptr);
+  EXPECT_EQ(4, placeholder->width());
+  EXPECT_EQ(3, placeholder->height());
+  EXPECT_EQ(rgba(0, 0, 0, 0), get_pixel(placeholder, 0, 0));
+  EXPECT_TRUE(celData.imageLoadFailed());
+  EXPECT_FALSE(celData.isImageLoaded());
+  EXPECT_FALSE(celData.unloadImage());
+
+  // The loader is used again the next time
+  EXPECT_EQ(placeholder, celData.image());
+  EXPECT_EQ(2, loader->loads);
+
+  loader->fail = false;
+  EXPECT_NE(placeholder, celData.image());
+  EXPECT_EQ(rgba(255, 0, 0, 255), get_pixel(celData.image(), 0, 0));
+  EXPECT_FALSE(celData.imageLoadFailed());
+  EXPECT_TRUE(celData.isImageLoaded());
+  EXPECT_EQ(3, loader->loads);
+}
+
+int main(int argc, char** argv)
+{
+  ::testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
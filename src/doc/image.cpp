@@ -1,5 +1,5 @@
 // Aseprite Document Library
-// Copyright (c) 2018-2020 Igara Studio S.A.
+// Copyright (c) 2018-2023 Igara Studio S.A.
 // Copyright (c) 2001-2016 David Capello
 //
 // This file is released under the terms of the MIT license.
@@ -18,8 +18,12 @@
 #include "doc/primitives.h"
 #include "doc/rgbmap.h"
 
+#include <atomic>
+
 namespace doc {
 
+static std::atomic<std::size_t> g_compressedDataMemory(0);
+
 Image::Image(const ImageSpec& spec)
   : Object(ObjectType::Image)
   , m_spec(spec)
@@ -28,11 +32,44 @@ Image::Image(const ImageSpec& spec)
 
 Image::~Image()
 {
+  discardCompressedData();
 }
 
 int Image::getMemSize() const
 {
-  return sizeof(Image) + rowBytes()*height();
+  return sizeof(Image) + rowBytes()*height() + m_compressedData.size();
+}
+
+void Image::discardCompressedData()
+{
+  if (!m_compressedData.empty()) {
+    g_compressedDataMemory -= m_compressedData.size();
+    m_compressedData.clear();
+    m_compressedData.shrink_to_fit();
+    m_compressedDataVersion = 0;
+  }
+}
+
+void Image::setCompressedData(const base::buffer& buffer) const
+{
+  if (!buffer.empty()) {
+    g_compressedDataMemory -= m_compressedData.size();
+    g_compressedDataMemory += buffer.size();
+    m_compressedData = buffer;
+    m_compressedDataVersion = version();
+  }
+}
+
+bool Image::hasValidCompressedData() const
+{
+  return (!m_compressedData.empty() &&
+          m_compressedDataVersion == version());
+}
+
+// static
+std::size_t Image::compressedDataMemory()
+{
+  return g_compressedDataMemory;
 }
 
 // static
@@ -9,6 +9,7 @@
 #define DOC_IMAGE_H_INCLUDED
 #pragma once
 
+#include "base/buffer.h"
 #include "doc/color.h"
 #include "doc/color_mode.h"
 #include "doc/image_buffer.h"
@@ -19,6 +20,8 @@
 #include "gfx/rect.h"
 #include "gfx/size.h"
 
+#include <cstdint>
+
 namespace doc {
 
   template<typename ImageTraits> class ImageBits;
@@ -72,6 +75,22 @@ namespace doc {
 
     virtual int getMemSize() const override;
 
+    // Compressed pixels of this image as they were loaded from (or
+    // saved in) a .aseprite file, so unmodified images can be saved
+    // again without compressing them. Use hasValidCompressedData()
+    // before re-using the data: it's valid while the version() doesn't
+    // change, so code that modifies pixels in-place must call
+    // incrementVersion().
+    void discardCompressedData();
+    void setCompressedData(const base::buffer& buffer) const;
+    bool hasValidCompressedData() const;
+    const base::buffer& compressedData() const { return m_compressedData; }
+    ObjectVersion compressedDataVersion() const { return m_compressedDataVersion; }
+
+    // Total memory (in bytes) used by the compressed data of all
+    // images (to avoid caching more data when this is too high).
+    static std::size_t compressedDataMemory();
+
     template<typename ImageTraits>
     ImageBits<ImageTraits> lockBits(LockType lockType, const gfx::Rect& bounds) {
       return ImageBits<ImageTraits>(this, bounds);
@@ -107,6 +126,8 @@ namespace doc {
 
   private:
     ImageSpec m_spec;
+    mutable base::buffer m_compressedData;
+    mutable ObjectVersion m_compressedDataVersion = 0;
   };
 
 } // namespace doc
@@ -0,0 +1,39 @@
+// Aseprite Document Library
+// Copyright (c) 2023 Igara Studio S.A.
+//
+// This file is released under the terms of the MIT license.
+// Read LICENSE.txt for more information.
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "doc/image_loader.h"
+
+#include "base/log.h"
+
+#include <mutex>
+
+namespace doc {
+
+static std::mutex g_errorHandlerMutex;
+static ImageLoader::ErrorHandler g_errorHandler;
+
+// static
+void ImageLoader::setErrorHandler(const ErrorHandler& handler)
+{
+  const std::lock_guard lock(g_errorHandlerMutex);
+  g_errorHandler = handler;
+}
+
+// static
+void ImageLoader::reportError(const std::string& msg)
+{
+  LOG(ERROR, "DOC: Error loading image: %s\n", msg.c_str());
+
+  const std::lock_guard lock(g_errorHandlerMutex);
+  if (g_errorHandler)
+    g_errorHandler(msg);
+}
+
+} // namespace doc
@@ -0,0 +1,49 @@
+// Aseprite Document Library
+// Copyright (c) 2023 Igara Studio S.A.
+//
+// This file is released under the terms of the MIT license.
+// Read LICENSE.txt for more information.
+
+#ifndef DOC_IMAGE_LOADER_H_INCLUDED
+#define DOC_IMAGE_LOADER_H_INCLUDED
+#pragma once
+
+#include "doc/image_ref.h"
+#include "doc/pixel_format.h"
+
+#include <functional>
+#include <memory>
+#include <string>
+
+namespace doc {
+
+  // Creates an image on demand (e.g. decoding it from a file). Used
+  // by CelData to load cel images lazily, the first time they are
+  // needed.
+  class ImageLoader {
+  public:
+    virtual ~ImageLoader() { }
+
+    // Returns a new image with its pixels. It can be called from any
+    // thread and several times (if the image is unloaded). If the
+    // pixels cannot be decoded, the image is returned anyway (with
+    // the pixels that could be decoded) and the problem is reported
+    // with reportError(). Returns nullptr if the data of the image is
+    // not available anymore (e.g. the file was modified).
+    virtual ImageRef loadImage() = 0;
+
+    // Pixel format of the image to load.
+    virtual PixelFormat pixelFormat() const = 0;
+
+    // Errors are logged and sent to the handler (e.g. to show them to
+    // the user). The handler can be called from any thread.
+    using ErrorHandler = std::function<void(const std::string& msg)>;
+    static void setErrorHandler(const ErrorHandler& handler);
+    static void reportError(const std::string& msg);
+  };
+
+  using ImageLoaderRef = std::shared_ptr<ImageLoader>;
+
+} // namespace doc
+
+#endif
@@ -1,5 +1,5 @@
 // Aseprite Document Library
-// Copyright (c) 2018 Igara Studio S.A.
+// Copyright (c) 2018-2023 Igara Studio S.A.
 // Copyright (c) 2001-2018 David Capello
 //
 // This file is released under the terms of the MIT license.
@@ -225,6 +225,43 @@ TYPED_TEST(ImageAllTypes, FillRect)
   }
 }
 
+// preprocess_transparent_pixels() increments the version only when
+// it modifies pixels
+TEST(Image, PreprocessTransparentPixelsVersion)
+{
+  std::unique_ptr<Image> image(Image::create(IMAGE_RGB, 8, 8));
+  clear_image(image.get(), rgba(0, 0, 0, 255));
+
+  const ObjectVersion ver = image->version();
+  preprocess_transparent_pixels(image.get());
+  EXPECT_EQ(ver, image->version());
+  put_pixel(image.get(), 4, 4, rgba(255, 255, 255, 0));
+  preprocess_transparent_pixels(image.get());
+  EXPECT_NE(ver, image->version());
+  EXPECT_EQ(0, get_pixel(image.get(), 4, 4));
+}
+
+TEST(Image, ValidCompressedData)
+{
+  std::unique_ptr<Image> image(Image::create(IMAGE_INDEXED, 9, 5));
+  clear_image(image.get(), 1);
+  EXPECT_FALSE(image->hasValidCompressedData());
+
+  const uint8_t data[] = { 1, 2, 3 };
+  image->setCompressedData(base::buffer(data, data+3));
+  EXPECT_TRUE(image->hasValidCompressedData());
+
+  // Pixels modified in-place must increment the version
+  put_pixel(image.get(), 8, 4, 2);
+  image->incrementVersion();
+  EXPECT_FALSE(image->hasValidCompressedData());
+
+  image->setCompressedData(base::buffer(data, data+3));
+  EXPECT_TRUE(image->hasValidCompressedData());
+  image->discardCompressedData();
+  EXPECT_FALSE(image->hasValidCompressedData());
+}
+
 int main(int argc, char** argv)
 {
   ::testing::InitGoogleTest(&argc, argv);
@@ -253,8 +253,9 @@ int LayerImage::getMemSize() const
     const Cel* cel = *it;
     size += cel->getMemSize();
 
-    const Image* image = cel->image();
-    size += image->getMemSize();
+    // Lazy images that are not loaded yet don't use memory
+    if (cel->data()->isImageLoaded())
+      size += cel->image()->getMemSize();
   }
 
   return size;
@@ -342,9 +343,11 @@ void LayerImage::addCel(Cel* cel)
 {
   ASSERT(cel);
   ASSERT(cel->data() && "The cel doesn't contain CelData");
-  ASSERT(cel->image());
   ASSERT(sprite());
-  ASSERT(cel->image()->pixelFormat() == sprite()->pixelFormat() ||
+  // Lazy images are not loaded just to check them
+  ASSERT(cel->data()->isLazy() || cel->image());
+  ASSERT(cel->data()->isLazy() ||
+         cel->image()->pixelFormat() == sprite()->pixelFormat() ||
          cel->image()->pixelFormat() == IMAGE_TILEMAP);
 
   CelIterator it = findFirstCelIteratorAfter(cel->frame());
@@ -323,27 +323,32 @@ bool Palette::findExactMatch(color_t color) const
 //////////////////////////////////////////////////////////////////////
 // Based on Allegro's bestfit_color
 
-static std::vector<uint32_t> col_diff;
-static uint32_t* col_diff_g;
-static uint32_t* col_diff_r;
-static uint32_t* col_diff_b;
-static uint32_t* col_diff_a;
-
-void Palette::initBestfit()
+void Palette::updateBestfitTable() const
 {
-  col_diff.resize(4*128, 0);
-  col_diff_g = &col_diff[128*0];
-  col_diff_r = &col_diff[128*1];
-  col_diff_b = &col_diff[128*2];
-  col_diff_a = &col_diff[128*3];
-
-  for (int i=1; i<64; ++i) {
-    int k = i * i;
-    col_diff_g[i] = col_diff_g[128-i] = k * 59 * 59;
-    col_diff_r[i] = col_diff_r[128-i] = k * 30 * 30;
-    col_diff_b[i] = col_diff_b[128-i] = k * 11 * 11;
-    col_diff_a[i] = col_diff_a[128-i] = k * 8 * 8;
+  const std::lock_guard lock(m_bestfitMutex);
+  if (m_bestfitModifications == m_modifications)
+    return;
+
+  // Sort entries by the green component (5 bits) in 32 groups
+  const int size = std::min(256, int(m_colors.size()));
+  m_bestfitGroups.assign(33, 0);
+  for (int i=0; i<size; ++i)
+    ++m_bestfitGroups[(rgba_getg(m_colors[i])>>3)+1];
+  for (int g=0; g<32; ++g)
+    m_bestfitGroups[g+1] += m_bestfitGroups[g];
+
+  std::vector<int> next(m_bestfitGroups.begin(), m_bestfitGroups.end()-1);
+  m_bestfitEntries.resize(size);
+  for (int i=0; i<size; ++i) {
+    const color_t c = m_colors[i];
+    BestfitEntry& entry = m_bestfitEntries[next[rgba_getg(c)>>3]++];
+    entry.r = (rgba_getr(c)>>3) * 30;
+    entry.b = (rgba_getb(c)>>3) * 11;
+    entry.a = (rgba_geta(c)>>3) * 8;
+    entry.index = i;
   }
+
+  m_bestfitModifications = m_modifications;
 }
 
 // Auxiliary function for rgbToOtherSpace()
@@ -425,8 +430,6 @@ int Palette::findBestfit(int r, int g, int b, int a, int mask_index) const
   FitCriteria fc = FitCriteria::OLD;
 
   if (fc == FitCriteria::OLD) {
-    ASSERT(!col_diff.empty());
-
     r >>= 3;
     g >>= 3;
     b >>= 3;
@@ -436,33 +439,48 @@ int Palette::findBestfit(int r, int g, int b, int a, int mask_index) const
     if (a == 0 && mask_index >= 0)
       return mask_index;
 
-    int bestfit = 0;
+    if (m_bestfitModifications != m_modifications)
+      updateBestfitTable();
+
+    // Entries are grouped by their green component (the component
+    // with the biggest weight), so we start looking in the group of
+    // the given "g" and continue with the neighbor groups until the
+    // green difference alone is bigger than the best distance found.
+    const int wr = r * 30;
+    const int wb = b * 11;
+    const int wa = a * 8;
+    const BestfitEntry* entries = m_bestfitEntries.data();
+    int bestfit = -1;
     int lowest = std::numeric_limits<int>::max();
-    int size = std::min(256, int(m_colors.size()));
-
-    for (int i=0; i<size; ++i) {
-      color_t rgb = m_colors[i];
-
-      int coldiff = col_diff_g[((rgba_getg(rgb)>>3) - g) & 127];
-      if (coldiff < lowest) {
-        coldiff += col_diff_r[(((rgba_getr(rgb)>>3) - r) & 127)];
-        if (coldiff < lowest) {
-          coldiff += col_diff_b[(((rgba_getb(rgb)>>3) - b) & 127)];
-          if (coldiff < lowest) {
-            coldiff += col_diff_a[(((rgba_geta(rgb)>>3) - a) & 127)];
-            if (coldiff < lowest && i != mask_index) {
-              if (coldiff == 0)
-                return i;
-
-              bestfit = i;
-              lowest = coldiff;
-            }
-          }
+
+    auto checkGroup = [&](const int gi, const int dg2) {
+      const BestfitEntry* it = entries + m_bestfitGroups[gi];
+      const BestfitEntry* end = entries + m_bestfitGroups[gi+1];
+      for (; it != end; ++it) {
+        const int dr = it->r - wr;
+        const int db = it->b - wb;
+        const int da = it->a - wa;
+        const int coldiff = dg2 + dr*dr + db*db + da*da;
+        if ((coldiff < lowest ||
+             (coldiff == lowest && it->index < bestfit)) &&
+            it->index != mask_index) {
+          bestfit = it->index;
+          lowest = coldiff;
         }
       }
+    };
+
+    for (int k=0; k<32; ++k) {
+      const int dg2 = (k*59) * (k*59);
+      if (dg2 > lowest)
+        break;
+      if (g-k >= 0)
+        checkGroup(g-k, dg2);
+      if (k > 0 && g+k < 32)
+        checkGroup(g+k, dg2);
     }
 
-    return bestfit;
+    return (bestfit >= 0 ? bestfit: 0);
   }
 
   if (a == 0 && mask_index >= 0)
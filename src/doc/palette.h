@@ -15,6 +15,8 @@
 #include "doc/object.h"
 #include "doc/palette_gradient_type.h"
 
+#include <atomic>
+#include <mutex>
 #include <vector>
 #include <string>
 
@@ -24,8 +26,6 @@ namespace doc {
 
   class Palette : public Object {
   public:
-    static void initBestfit();
-
     Palette();
     Palette(frame_t frame, int ncolors);
     Palette(const Palette& palette);
@@ -115,12 +115,28 @@ namespace doc {
     const std::string& getEntryName(const int i) const;
 
   private:
+    void updateBestfitTable() const;
+
     frame_t m_frame;
     std::vector<color_t> m_colors;
     std::vector<std::string> m_names;
     int m_modifications;
     std::string m_filename; // If the palette is associated with a file.
     std::string m_comment; // Some extra comment from the .gpl file (author, website, etc.).
+
+    // Index used by findBestfit() to find the closest entry without
+    // comparing the whole palette. Entries are sorted by their green
+    // component, m_bestfitGroups[g] is the first entry with green
+    // component == g (in 5 bits). It's re-created in findBestfit()
+    // when m_modifications changes.
+    struct BestfitEntry {
+      int r, b, a;              // Weighted R/B/A components
+      int index;
+    };
+    mutable std::vector<BestfitEntry> m_bestfitEntries;
+    mutable std::vector<int> m_bestfitGroups;
+    mutable std::atomic<int> m_bestfitModifications = -1;
+    mutable std::mutex m_bestfitMutex;
   };
 
 } // namespace doc
@@ -0,0 +1,108 @@
+// Aseprite Document Library
+// Copyright (c) 2023 Igara Studio S.A.
+//
+// This file is released under the terms of the MIT license.
+// Read LICENSE.txt for more information.
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <gtest/gtest.h>
+
+#include "doc/palette.h"
+
+#include <limits>
+#include <random>
+
+using namespace doc;
+
+namespace {
+
+// Original linear search of Palette::findBestfit() used as reference.
+int reference_bestfit(const Palette& pal, int r, int g, int b, int a, int mask_index)
+{
+  r >>= 3;
+  g >>= 3;
+  b >>= 3;
+  a >>= 3;
+
+  if (a == 0 && mask_index >= 0)
+    return mask_index;
+
+  int bestfit = 0;
+  int lowest = std::numeric_limits<int>::max();
+  const int size = std::min(256, pal.size());
+
+  for (int i=0; i<size; ++i) {
+    const color_t c = pal.getEntry(i);
+    const int dr = (rgba_getr(c)>>3) - r;
+    const int dg = (rgba_getg(c)>>3) - g;
+    const int db = (rgba_getb(c)>>3) - b;
+    const int da = (rgba_geta(c)>>3) - a;
+    const int coldiff =
+      dg*dg*59*59 + dr*dr*30*30 + db*db*11*11 + da*da*8*8;
+    if (coldiff < lowest && i != mask_index) {
+      bestfit = i;
+      lowest = coldiff;
+    }
+  }
+  return bestfit;
+}
+
+} // anonymous namespace
+
+TEST(Palette, FindBestfitIsEqualToLinearSearch)
+{
+  std::mt19937 gen(1);
+  std::uniform_int_distribution<int> dist(0, 255);
+
+  for (int ncolors : { 1, 2, 16, 255, 256, 300 }) {
+    Palette pal(frame_t(0), ncolors);
+    for (int i=0; i<ncolors; ++i) {
+      // Use few different values to get repeated entries/distances
+      pal.setEntry(i, rgba(dist(gen) & 0xf0, dist(gen) & 0xf0,
+                           dist(gen) & 0xf0, (i % 8) ? 255: dist(gen)));
+    }
+
+    for (int j=0; j<2000; ++j) {
+      const int r = dist(gen), g = dist(gen), b = dist(gen);
+      const int a = (j % 4 ? 255: dist(gen));
+      for (int mask_index : { -1, 0, 1, ncolors-1 }) {
+        ASSERT_EQ(reference_bestfit(pal, r, g, b, a, mask_index),
+                  pal.findBestfit(r, g, b, a, mask_index))
+          << "ncolors=" << ncolors << " mask_index=" << mask_index
+          << " rgba=" << r << "," << g << "," << b << "," << a;
+      }
+    }
+  }
+}
+
+TEST(Palette, FindBestfitAfterModifications)
+{
+  Palette pal(frame_t(0), 4);
+  pal.setEntry(0, rgba(0, 0, 0, 255));
+  pal.setEntry(1, rgba(255, 0, 0, 255));
+  pal.setEntry(2, rgba(0, 255, 0, 255));
+  pal.setEntry(3, rgba(0, 0, 255, 255));
+  EXPECT_EQ(1, pal.findBestfit(250, 10, 10, 255, -1));
+
+  pal.setEntry(1, rgba(0, 0, 128, 255));
+  EXPECT_EQ(0, pal.findBestfit(250, 10, 10, 255, -1));
+
+  pal.resize(5);
+  pal.setEntry(4, rgba(240, 0, 0, 255));
+  EXPECT_EQ(4, pal.findBestfit(250, 10, 10, 255, -1));
+
+  Palette copy(pal);
+  EXPECT_EQ(4, copy.findBestfit(250, 10, 10, 255, -1));
+  copy.makeBlack();
+  EXPECT_EQ(0, copy.findBestfit(250, 10, 10, 255, -1));
+  EXPECT_EQ(4, pal.findBestfit(250, 10, 10, 255, -1));
+}
+
+int main(int argc, char** argv)
+{
+  ::testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
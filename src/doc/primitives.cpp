@@ -23,6 +23,7 @@
 
 #include <city.h>
 
+#include <algorithm>
 #include <stdexcept>
 
 #if defined(__x86_64__) || defined(_WIN64)
@@ -622,16 +623,39 @@ uint32_t calculate_image_hash(const Image* img, const gfx::Rect& bounds)
   return 0;
 }
 
+uint64_t calculate_image_hash64(const Image* image)
+{
+  // std::min() for bitmaps (8 pixels per byte)
+  const std::size_t widthBytes =
+    std::min<std::size_t>(image->bytesPerPixel() * image->width(),
+                          image->rowBytes());
+  if (widthBytes == image->rowBytes()) {
+    return CityHash64((const char*)image->getPixelAddress(0, 0),
+                      widthBytes * image->height());
+  }
+
+  uint64_t h = 0;
+  for (int y=0; y<image->height(); ++y) {
+    h = CityHash64WithSeed((const char*)image->getPixelAddress(0, y),
+                           widthBytes, h);
+  }
+  return h;
+}
+
 void preprocess_transparent_pixels(Image* image)
 {
+  bool modified = false;
+
   switch (image->pixelFormat()) {
 
     case IMAGE_RGB: {
       LockImageBits<RgbTraits> bits(image);
       auto it = bits.begin(), end = bits.end();
       for (; it != end; ++it) {
-        if (rgba_geta(*it) == 0)
+        if (rgba_geta(*it) == 0 && *it != 0) {
           *it = 0;
+          modified = true;
+        }
       }
       break;
     }
@@ -640,13 +664,19 @@ void preprocess_transparent_pixels(Image* image)
       LockImageBits<GrayscaleTraits> bits(image);
       auto it = bits.begin(), end = bits.end();
       for (; it != end; ++it) {
-        if (graya_geta(*it) == 0)
+        if (graya_geta(*it) == 0 && *it != 0) {
           *it = 0;
+          modified = true;
+        }
       }
       break;
     }
 
   }
+
+  // Invalidate data cached for the current version (e.g. tile hashes)
+  if (modified)
+    image->incrementVersion();
 }
 
 } // namespace doc
@@ -57,8 +57,14 @@ namespace doc {
   uint32_t calculate_image_hash(const Image* image,
                                 const gfx::Rect& bounds);
 
+  // 64-bit hash of all the visible pixels of the image (e.g. to check
+  // if cached data of the image is still valid, where a 32-bit hash
+  // would be too weak to compare the pixels of thousands of cels).
+  uint64_t calculate_image_hash64(const Image* image);
+
   // Sets RGB values to 0 when alpha=0 (to match images with alpha=0
-  // in tilesets/calculate_image_hash)
+  // in tilesets/calculate_image_hash). The image version is
+  // incremented if some pixel is modified.
   void preprocess_transparent_pixels(Image* image);
 
 } // namespace doc
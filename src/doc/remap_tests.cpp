@@ -166,9 +166,6 @@ TEST(Remap, BetweenPalettesDontChangeMaskForced)
 
 TEST(Remap, BetweenPalettesNonInvertible)
 {
-  // create_remap_to_change_palette() uses findBestfit()
-  doc::Palette::initBestfit();
-
   Palette a(frame_t(0), 4);
   Palette b(frame_t(0), 3);
 
@@ -1,5 +1,5 @@
 // Aseprite Document Library
-// Copyright (c) 2022 Igara Studio S.A.
+// Copyright (c) 2022-2023 Igara Studio S.A.
 // Copyright (c) 2001-2016 David Capello
 //
 // This file is released under the terms of the MIT license.
@@ -86,6 +86,82 @@ TEST(ResizeImage, NearestNeighborInterp)
   ASSERT_EQ(0, count_diff_between_images(src.get(), dst2.get()));
 }
 
+TEST(ResizeImage, BilinearSameSize)
+{
+  ImageRef src(create_image_from_data(IMAGE_RGB, test_image_scaled_9x9_bilinear, 9, 9));
+  ImageRef dst(Image::create(IMAGE_RGB, 9, 9));
+  algorithm::resize_image(src.get(), dst.get(),
+                          algorithm::RESIZE_METHOD_BILINEAR,
+                          nullptr, nullptr, -1);
+  ASSERT_EQ(0, count_diff_between_images(src.get(), dst.get()));
+}
+
+TEST(ResizeImage, BilinearUpscale)
+{
+  ImageRef src(Image::create(IMAGE_GRAYSCALE, 2, 1));
+  put_pixel(src.get(), 0, 0, graya(0, 255));
+  put_pixel(src.get(), 1, 0, graya(200, 255));
+
+  ImageRef dst(Image::create(IMAGE_GRAYSCALE, 5, 1));
+  algorithm::resize_image(src.get(), dst.get(),
+                          algorithm::RESIZE_METHOD_BILINEAR,
+                          nullptr, nullptr, -1);
+  EXPECT_EQ(graya(0, 255), get_pixel(dst.get(), 0, 0));
+  EXPECT_EQ(graya(50, 255), get_pixel(dst.get(), 1, 0));
+  EXPECT_EQ(graya(100, 255), get_pixel(dst.get(), 2, 0));
+  EXPECT_EQ(graya(150, 255), get_pixel(dst.get(), 3, 0));
+  EXPECT_EQ(graya(200, 255), get_pixel(dst.get(), 4, 0));
+}
+
+TEST(ResizeImage, BilinearDownscaleAveragesArea)
+{
+  // 6x3 image with 3x3 blocks of different colors
+  ImageRef src(Image::create(IMAGE_RGB, 6, 3));
+  for (int y=0; y<3; ++y)
+    for (int x=0; x<6; ++x)
+      put_pixel(src.get(), x, y,
+                x < 3 ? rgba(0, 90, 0, 255):
+                        rgba(30, 60, (x+y) % 2 ? 255: 0, 0));
+
+  ImageRef dst(Image::create(IMAGE_RGB, 2, 1));
+  algorithm::resize_image(src.get(), dst.get(),
+                          algorithm::RESIZE_METHOD_BILINEAR,
+                          nullptr, nullptr, -1);
+  EXPECT_EQ(rgba(0, 90, 0, 255), get_pixel(dst.get(), 0, 0));
+  EXPECT_EQ(rgba(30, 60, 142, 0), get_pixel(dst.get(), 1, 0)); // 5*255/9 = 141.7
+}
+
+TEST(ResizeImage, BilinearBigImage)
+{
+  // Big enough to be resized in several threads
+  ImageRef src(Image::create(IMAGE_RGB, 300, 300));
+  for (int y=0; y<src->height(); ++y)
+    for (int x=0; x<src->width(); ++x)
+      put_pixel(src.get(), x, y, rgba(x % 256, y % 256, 128, 255));
+
+  ImageRef dst(Image::create(IMAGE_RGB, 600, 600));
+  algorithm::resize_image(src.get(), dst.get(),
+                          algorithm::RESIZE_METHOD_BILINEAR,
+                          nullptr, nullptr, -1);
+
+  ImageRef dst2(Image::create(IMAGE_RGB, 300, 300));
+  algorithm::resize_image(dst.get(), dst2.get(),
+                          algorithm::RESIZE_METHOD_BILINEAR,
+                          nullptr, nullptr, -1);
+
+  for (int y=0; y<dst2->height(); ++y)
+    for (int x=0; x<dst2->width(); ++x) {
+      const color_t a = get_pixel(src.get(), x, y);
+      const color_t b = get_pixel(dst2.get(), x, y);
+      ASSERT_EQ(128, rgba_getb(b));
+      ASSERT_EQ(255, rgba_geta(b));
+      if (x % 256 > 0 && x % 256 < 255)
+        ASSERT_NEAR(rgba_getr(a), rgba_getr(b), 1);
+      if (y % 256 > 0 && y % 256 < 255)
+        ASSERT_NEAR(rgba_getg(a), rgba_getg(b), 1);
+    }
+}
+
 #if 0                           // TODO complete this test
 TEST(ResizeImage, BilinearInterpRGBType)
 {
@@ -1,5 +1,5 @@
 // Aseprite Document Library
-// Copyright (c) 2020-2022 Igara Studio S.A.
+// Copyright (c) 2020-2023 Igara Studio S.A.
 //
 // This file is released under the terms of the MIT license.
 // Read LICENSE.txt for more information.
@@ -27,6 +27,10 @@ namespace doc {
 
     virtual int maskIndex() const = 0;
 
+    // Returns true if mapColor() can be called from several threads
+    // at the same time (i.e. it doesn't fill the map lazily).
+    virtual bool isThreadSafe() const { return false; }
+
     int mapColor(const int r,
                  const int g,
                  const int b,
@@ -1,5 +1,5 @@
 // Aseprite Document Library
-// Copyright (c) 2020 Igara Studio S.A.
+// Copyright (c) 2020-2023 Igara Studio S.A.
 // Copyright (c) 2001-2015 David Capello
 //
 // This file is released under the terms of the MIT license.
@@ -13,6 +13,12 @@
 
 #include "doc/color_scales.h"
 #include "doc/palette.h"
+#include "doc/worker_pool.h"
+
+#include <algorithm>
+#include <atomic>
+#include <list>
+#include <mutex>
 
 namespace doc {
 
@@ -22,8 +28,101 @@ namespace doc {
 #define ASIZE   8
 #define MAPSIZE (RSIZE*GSIZE*BSIZE*ASIZE)
 
+namespace {
+
+// Maximum number of tables kept in memory (each one uses 256KB).
+const int kMaxTables = 16;
+
+// Tables shared by all RgbMapRGB5A3 instances. They are identified
+// by the palette colors (instead of the palette ID) so copies of
+// the same palette (e.g. from the exporter or other documents)
+// share the same table too.
+struct TableEntry {
+  std::vector<color_t> colors;
+  int maskIndex;
+  std::shared_ptr<const RgbMapRGB5A3::Table> table;
+};
+
+std::mutex g_tablesMutex;
+std::list<TableEntry> g_tables; // Most recently used first
+
+bool has_same_colors(const std::vector<color_t>& colors,
+                     const Palette* palette)
+{
+  return (int(colors.size()) == palette->size() &&
+          std::equal(colors.begin(), colors.end(),
+                     palette->rawColorsData()));
+}
+
+// Calculates all entries of the table, each thread takes the next
+// plane of the table (all colors with the same red component)
+// until there are no more planes.
+std::shared_ptr<const RgbMapRGB5A3::Table>
+create_table(const Palette* palette, const int maskIndex)
+{
+  auto table = std::make_shared<RgbMapRGB5A3::Table>(MAPSIZE);
+  uint8_t* map = table->data();
+
+  std::atomic<int> nextPlane(0);
+  auto calcNextPlanes = [palette, maskIndex, map, &nextPlane]{
+    int r;
+    while ((r = nextPlane++) < RSIZE) {
+      const int r8 = scale_5bits_to_8bits(r);
+      for (int g=0; g<GSIZE; ++g) {
+        const int g8 = scale_5bits_to_8bits(g);
+        for (int b=0; b<BSIZE; ++b) {
+          const int b8 = scale_5bits_to_8bits(b);
+          for (int a=0; a<ASIZE; ++a) {
+            const int i = a | (b << 3) | (g << 8) | (r << 13);
+            map[i] = palette->findBestfit(r8, g8, b8,
+                                          scale_3bits_to_8bits(a),
+                                          maskIndex);
+          }
+        }
+      }
+    }
+  };
+
+  // The calling thread calculates planes too
+  run_in_workers(std::min(RSIZE, worker_threads()), calcNextPlanes);
+  return table;
+}
+
+std::shared_ptr<const RgbMapRGB5A3::Table>
+get_table(const Palette* palette, const int maskIndex)
+{
+  // The mutex is kept locked while the table is created so other
+  // threads asking for the same table wait for it instead of
+  // creating it again.
+  const std::lock_guard lock(g_tablesMutex);
+
+  for (auto it=g_tables.begin(), end=g_tables.end(); it!=end; ++it) {
+    if (it->maskIndex == maskIndex &&
+        has_same_colors(it->colors, palette)) {
+      if (it != g_tables.begin())
+        g_tables.splice(g_tables.begin(), g_tables, it);
+      return g_tables.front().table;
+    }
+  }
+
+  auto table = create_table(palette, maskIndex);
+  g_tables.push_front(
+    TableEntry{ std::vector<color_t>(palette->rawColorsData(),
+                                     palette->rawColorsData()+palette->size()),
+                maskIndex, table });
+
+  // Tables that are still in use by a RgbMapRGB5A3 are kept alive
+  // by its shared_ptr.
+  while (g_tables.size() > kMaxTables)
+    g_tables.pop_back();
+
+  return table;
+}
+
+} // anonymous namespace
+
 RgbMapRGB5A3::RgbMapRGB5A3()
-  : m_map(MAPSIZE)
+  : m_map(nullptr)
   , m_palette(nullptr)
   , m_modifications(0)
   , m_maskIndex(0)
@@ -42,19 +141,8 @@ void RgbMapRGB5A3::regenerateMap(const Palette* palette, int maskIndex)
   m_modifications = palette->getModifications();
   m_maskIndex = maskIndex;
 
-  // Mark all entries as invalid (need to be regenerated)
-  for (uint16_t& entry : m_map)
-    entry |= INVALID;
-}
-
-int RgbMapRGB5A3::generateEntry(int i, int r, int g, int b, int a) const
-{
-  return m_map[i] =
-    m_palette->findBestfit(
-      scale_5bits_to_8bits(r>>3),
-      scale_5bits_to_8bits(g>>3),
-      scale_5bits_to_8bits(b>>3),
-      scale_3bits_to_8bits(a>>5), m_maskIndex);
+  m_table = get_table(palette, maskIndex);
+  m_map = m_table->data();
 }
 
 } // namespace doc
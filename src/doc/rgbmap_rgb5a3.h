@@ -1,5 +1,5 @@
 // Aseprite Document Library
-// Copyright (c) 2020-2022 Igara Studio S.A.
+// Copyright (c) 2020-2023 Igara Studio S.A.
 // Copyright (c) 2001-2016 David Capello
 //
 // This file is released under the terms of the MIT license.
@@ -14,6 +14,8 @@
 #include "doc/object.h"
 #include "doc/rgbmap.h"
 
+#include <cstdint>
+#include <memory>
 #include <vector>
 
 namespace doc {
@@ -21,32 +23,37 @@ namespace doc {
   class Palette;
 
   // It acts like a cache for Palette:findBestfit() calls.
+  //
+  // The whole table is calculated (using several threads) when the
+  // map is regenerated, and it's shared by all RgbMapRGB5A3
+  // instances that use a palette with the same colors and mask
+  // index. As the table is never modified after that, mapColor() can
+  // be called from several threads at the same time.
   class RgbMapRGB5A3 : public RgbMap {
-    // Bit activated on m_map entries that aren't yet calculated.
-    const int INVALID = 256;
-
   public:
+    typedef std::vector<uint8_t> Table;
+
     RgbMapRGB5A3();
 
     // RgbMap impl
     void regenerateMap(const Palette* palette, int maskIndex) override;
     int mapColor(const color_t rgba) const override {
+      ASSERT(m_map);
       const int r = rgba_getr(rgba);
       const int g = rgba_getg(rgba);
       const int b = rgba_getb(rgba);
       const int a = rgba_geta(rgba);
       // bits -> bbbbbgggggrrrrraaa
       const int i = (a>>5) | ((b>>3) << 3) | ((g>>3) << 8) | ((r>>3) << 13);
-      const int v = m_map[i];
-      return (v & INVALID) ? generateEntry(i, r, g, b, a): v;
+      return m_map[i];
     }
 
     int maskIndex() const override { return m_maskIndex; }
+    bool isThreadSafe() const override { return true; }
 
   private:
-    int generateEntry(int i, int r, int g, int b, int a) const;
-
-    mutable std::vector<uint16_t> m_map;
+    std::shared_ptr<const Table> m_table;
+    const uint8_t* m_map;
     const Palette* m_palette;
     int m_modifications;
     int m_maskIndex;
@@ -0,0 +1,105 @@
+// Aseprite Document Library
+// Copyright (c) 2023 Igara Studio S.A.
+//
+// This file is released under the terms of the MIT license.
+// Read LICENSE.txt for more information.
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <gtest/gtest.h>
+
+#include "doc/color_scales.h"
+#include "doc/palette.h"
+#include "doc/rgbmap_rgb5a3.h"
+
+#include <random>
+#include <thread>
+#include <vector>
+
+using namespace doc;
+
+namespace {
+
+Palette random_palette(std::mt19937& gen, int ncolors)
+{
+  std::uniform_int_distribution<int> dist(0, 255);
+  Palette pal(frame_t(0), ncolors);
+  for (int i=0; i<ncolors; ++i)
+    pal.setEntry(i, rgba(dist(gen), dist(gen), dist(gen),
+                         (i % 4) ? 255: dist(gen)));
+  return pal;
+}
+
+void expect_bestfit(const RgbMapRGB5A3& rgbmap, const Palette& pal,
+                    const int maskIndex)
+{
+  for (int r=0; r<32; ++r)
+    for (int g=0; g<32; ++g)
+      for (int b=0; b<32; ++b)
+        for (int a=0; a<8; ++a) {
+          const int r8 = scale_5bits_to_8bits(r);
+          const int g8 = scale_5bits_to_8bits(g);
+          const int b8 = scale_5bits_to_8bits(b);
+          const int a8 = scale_3bits_to_8bits(a);
+          ASSERT_EQ(pal.findBestfit(r8, g8, b8, a8, maskIndex),
+                    rgbmap.mapColor(rgba(r8, g8, b8, a8)));
+        }
+}
+
+} // anonymous namespace
+
+TEST(RgbMapRGB5A3, MapsToBestfit)
+{
+  std::mt19937 gen(1);
+  Palette pal = random_palette(gen, 32);
+
+  RgbMapRGB5A3 rgbmap;
+  for (int maskIndex : { -1, 0, 5 }) {
+    rgbmap.regenerateMap(&pal, maskIndex);
+    EXPECT_EQ(maskIndex, rgbmap.maskIndex());
+    expect_bestfit(rgbmap, pal, maskIndex);
+  }
+
+  // The table is re-calculated when the palette is modified
+  pal.setEntry(3, rgba(255, 0, 0, 255));
+  rgbmap.regenerateMap(&pal, 0);
+  EXPECT_EQ(3, rgbmap.mapColor(rgba(255, 0, 0, 255)));
+  expect_bestfit(rgbmap, pal, 0);
+}
+
+TEST(RgbMapRGB5A3, MapColorFromSeveralThreads)
+{
+  std::mt19937 gen(2);
+  Palette pal = random_palette(gen, 256);
+  Palette copy(pal);
+
+  RgbMapRGB5A3 a, b;
+  a.regenerateMap(&pal, 0);
+  b.regenerateMap(&copy, 0);
+  expect_bestfit(b, pal, 0);
+
+  // Map colors from several threads at the same time
+  std::vector<std::thread> threads;
+  std::vector<int> mismatches(4, 0);
+  for (int t=0; t<4; ++t) {
+    threads.emplace_back([&a, &b, &mismatches, t]{
+      for (int i=t; i<(1<<24); i+=4*97) {
+        const color_t c = rgba((i>>16) & 0xff, (i>>8) & 0xff, i & 0xff, 255);
+        if (a.mapColor(c) != b.mapColor(c))
+          ++mismatches[t];
+      }
+    });
+  }
+  for (auto& thread : threads)
+    thread.join();
+  for (int n : mismatches)
+    EXPECT_EQ(0, n);
+}
+
+int main(int argc, char** argv)
+{
+  ::testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
@@ -18,6 +18,7 @@
 #include "doc/remap.h"
 #include "doc/sprite.h"
 
+#include <algorithm>
 #include <memory>
 
 #define TS_TRACE(...) // TRACE(__VA_ARGS__)
@@ -27,6 +28,16 @@ namespace doc {
 // static
 UserData Tileset::kNoUserData;
 
+const TileHashes& Tileset::Tile::getHashes() const
+{
+  if (!hasHashes || hashesVersion != image->version()) {
+    hashes = calculate_tile_hashes(image.get());
+    hashesVersion = image->version();
+    hasHashes = true;
+  }
+  return hashes;
+}
+
 Tileset::Tileset(Sprite* sprite,
                  const Grid& grid,
                  const tileset_index ntiles)
@@ -45,9 +56,8 @@ Tileset::Tileset(Sprite* sprite,
   //ASSERT(sprite);
 
   for (tile_index ti=0; ti<ntiles; ++ti) {
-    ImageRef tile = makeEmptyTile();
-    m_tiles[ti].image = tile;
-    hashImage(ti, tile);
+    m_tiles[ti].image = makeEmptyTile();
+    hashTile(ti);
   }
 }
 
@@ -176,9 +186,10 @@ void Tileset::set(const tile_index ti,
 
   preprocess_transparent_pixels(image.get());
   m_tiles[ti].image = image;
+  m_tiles[ti].hasHashes = false;
 
   if (!m_hash.empty())
-    hashImage(ti, image);
+    hashTile(ti);
 }
 
 tile_index Tileset::add(const ImageRef& image,
@@ -193,7 +204,7 @@ tile_index Tileset::add(const ImageRef& image,
 
   const tile_index newIndex = tile_index(m_tiles.size()-1);
   if (!m_hash.empty())
-    hashImage(newIndex, image);
+    hashTile(newIndex);
   return newIndex;
 }
 
@@ -218,11 +229,11 @@ void Tileset::insert(const tile_index ti,
   if (!m_hash.empty()) {
     // Fix all indexes in the hash that are greater than "ti"
     for (auto& it : m_hash)
-      if (it.second >= ti)
-        ++it.second;
+      if (it.second.ti >= ti)
+        ++it.second.ti;
 
     // And now we can add the new image with the "ti" index
-    hashImage(ti, image);
+    hashTile(ti);
   }
 }
 
@@ -253,67 +264,88 @@ void Tileset::setExternal(const std::string& filename,
 bool Tileset::findTileIndex(const ImageRef& tileImage,
                             tile_index& ti)
 {
+  tile_flags tf;
+  return findTileIndex(tileImage, 0, ti, tf);
+}
+
+bool Tileset::findTileIndex(const ImageRef& tileImage,
+                            const tile_flags matchFlags,
+                            tile_index& ti,
+                            tile_flags& tf)
+{
+  // Order used to find flipped tiles
+  static const tile_flags kFlipsOrder[] = {
+    0,
+    tile_f_xflip,
+    tile_f_yflip,
+    tile_f_xflip | tile_f_yflip,
+    tile_f_dflip,
+    tile_f_xflip | tile_f_dflip,
+    tile_f_xflip | tile_f_yflip | tile_f_dflip,
+    tile_f_yflip | tile_f_dflip
+  };
+
+  ti = notile;
+  tf = 0;
+
   ASSERT(tileImage);
-  if (!tileImage) {
-    ti = notile;
+  if (!tileImage)
     return false;
-  }
 
   auto& h = hashTable(); // Don't use m_hash directly in case that
                          // we've to regenerate the hash table.
 
-  auto it = h.find(tileImage);
-  if (it != h.end()) {
-    ti = it->second;
-    return true;
-  }
-  else {
-    ti = notile;
+  // All the flipped versions of the image have the same canonical
+  // hash, so one lookup gives us all the candidates.
+  const TileHashes hashes = calculate_tile_hashes(tileImage.get());
+  const auto range = h.equal_range(hashes.canonical);
+  if (range.first == range.second)
     return false;
+
+  for (const tile_flags flags : kFlipsOrder) {
+    if ((flags & ~matchFlags) ||
+        ((flags & tile_f_dflip) && !hashes.square))
+      continue;
+
+    const uint64_t hash = hashes.flipped[tile_flips_index(flags)];
+    for (auto it=range.first; it!=range.second; ++it) {
+      const TilesetHashItem& item = it->second;
+      if (item.hash == hash &&
+          (ti == notile || item.ti < ti) &&
+          is_same_flipped_image(m_tiles[item.ti].image.get(),
+                                tileImage.get(), flags)) {
+        ti = item.ti;
+      }
+    }
+    if (ti != notile) {
+      tf = flags;
+      return true;
+    }
   }
+  return false;
 }
 
 void Tileset::notifyTileContentChange(const tile_index ti)
 {
-#if 0 // TODO Try to do less work
-
   ASSERT(ti >= 0 && ti < size());
-
-  // If two or more tiles are exactly the same, they will have the
-  // same hash, so the m_hash table can be smaller than the m_tiles
-  // array.
-  if (m_hash.size() < m_tiles.size()) {
-    // Count how many hash elements are poiting to this tile index
-    int tilesWithSameHash = 0;
-    for (auto item : m_hash)
-      if (item.second == ti)
-        ++tilesWithSameHash;
-
-    // In this case we re-generate the whole hash table because one or
-    // more tiles tile are using the hash of the modified tile.
-    if (tilesWithSameHash >= 2) {
-      rehash();
-      return;
-    }
+  if (ti < 0 || ti >= size() || !m_tiles[ti].image) {
+    rehash();
+    return;
   }
 
-  // In other case we can do a fast-path, just removing and
-  // re-adding the tile to the hash table.
+  // The tile image was modified externally, so we increment its
+  // version to invalidate its cached hashes.
+  Image* image = m_tiles[ti].image.get();
+  image->incrementVersion();
+  preprocess_transparent_pixels(image);
+
+  // All tiles (even equal ones) have their own item in the hash
+  // table, so we can just re-add the modified tile.
   removeFromHash(ti, false);
   if (!m_hash.empty())
-    hashImage(ti, m_tiles[ti]);
-
-#else // Regenerate the whole hash map (at the moment this is the
-      // only way to make it work correctly)
-
-  (void)ti;                     // unused
-
-  if (ti >= 0 && ti < m_tiles.size() && m_tiles[ti].image)
-    preprocess_transparent_pixels(m_tiles[ti].image.get());
-
-  rehash();
+    hashTile(ti);
 
-#endif
+  discardCompressedData();
 }
 
 void Tileset::notifyRegenerateEmptyTile()
@@ -322,8 +354,10 @@ void Tileset::notifyRegenerateEmptyTile()
     return;
 
   ImageRef image = get(doc::notile);
-  if (image)
+  if (image) {
     doc::clear_image(image.get(), image->maskColor());
+    image->incrementVersion();
+  }
   rehash();
 }
 
@@ -332,13 +366,13 @@ void Tileset::removeFromHash(const tile_index ti,
 {
   auto end = m_hash.end();
   for (auto it=m_hash.begin(); it!=end; ) {
-    if (it->second == ti) {
+    if (it->second.ti == ti) {
       it = m_hash.erase(it);
       end = m_hash.end();
     }
     else {
-      if (adjustIndexes && it->second > ti)
-        --it->second;
+      if (adjustIndexes && it->second.ti > ti)
+        --it->second.ti;
       ++it;
     }
   }
@@ -352,39 +386,29 @@ void Tileset::assertValidHashTable()
   if (m_hash.empty())
     return;
 
-  // If two or more tiles are exactly the same, they will have the
-  // same hash, so the m_hash table can be smaller than the m_tiles
-  // array.
-  if (m_hash.size() < m_tiles.size()) {
-    for (tile_index ti=0; ti<tile_index(m_tiles.size()); ++ti) {
-      auto it = m_hash.find(m_tiles[ti].image);
-      ASSERT(it != m_hash.end());
-
-      // If the hash doesn't match, it is because other tile is equal
-      // to this one.
-      if (it->second != ti) {
-        ASSERT(is_same_image(it->first.get(), m_tiles[it->second].image.get()));
-      }
-    }
-  }
-  else if (m_hash.size() == m_tiles.size()) {
-    for (tile_index ti=0; ti<tile_index(m_tiles.size()); ++ti) {
-      auto it = m_hash.find(m_tiles[ti].image);
-      ASSERT(it != m_hash.end());
-      ASSERT(it->second == ti);
+  // Each tile (even if two or more tiles are exactly the same) must
+  // be in the hash table with its current hashes.
+  ASSERT(m_hash.size() == m_tiles.size());
+  for (tile_index ti=0; ti<tile_index(m_tiles.size()); ++ti) {
+    const TileHashes hashes = calculate_tile_hashes(m_tiles[ti].image.get());
+    const auto range = m_hash.equal_range(hashes.canonical);
+    auto it = std::find_if(range.first, range.second,
+                           [ti](const auto& item){
+                             return (item.second.ti == ti);
+                           });
+    ASSERT(it != range.second);
+    if (it != range.second) {
+      ASSERT(it->second.hash == hashes.flipped[0]);
     }
   }
-  else {
-    ASSERT(false && "The hash table cannot contain more tiles than the tileset");
-  }
 }
 #endif
 
-void Tileset::hashImage(const tile_index ti,
-                        const ImageRef& tileImage)
+void Tileset::hashTile(const tile_index ti)
 {
-  if (m_hash.find(tileImage) == m_hash.end())
-    m_hash[tileImage] = ti;
+  const TileHashes& hashes = m_tiles[ti].getHashes();
+  m_hash.insert(std::make_pair(hashes.canonical,
+                               TilesetHashItem{ ti, hashes.flipped[0] }));
 }
 
 void Tileset::rehash()
@@ -404,7 +428,7 @@ TilesetHashTable& Tileset::hashTable()
     // Re-hash/create the whole hash table from scratch
     tile_index ti = 0;
     for (auto& tile : m_tiles)
-      hashImage(ti++, tile.image);
+      hashTile(ti++);
   }
   return m_hash;
 }
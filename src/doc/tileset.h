@@ -28,9 +28,15 @@ namespace doc {
     struct Tile {
       ImageRef image;
       UserData data;
+      // Cached hashes of "image" for its "hashesVersion", so the hash
+      // table can be re-created without hashing unchanged tiles.
+      mutable TileHashes hashes;
+      mutable ObjectVersion hashesVersion = 0;
+      mutable bool hasHashes = false;
       Tile() { }
       Tile(const ImageRef& image,
            const UserData& data) : image(image), data(data) { }
+      const TileHashes& getHashes() const;
     };
     static UserData kNoUserData;
 
@@ -127,6 +133,16 @@ namespace doc {
     bool findTileIndex(const ImageRef& tileImage,
                        tile_index& ti);
 
+    // Same as findTileIndex() but it can find a tile that flipped
+    // with any combination of the given "matchFlags" is equal to
+    // "tileImage". The flags to use with that tile are returned in
+    // "tf". Tiles without flips are preferred, then flips in this
+    // order: X, Y, X+Y, D, X+D, X+Y+D, Y+D.
+    bool findTileIndex(const ImageRef& tileImage,
+                       const tile_flags matchFlags,
+                       tile_index& ti,
+                       tile_flags& tf);
+
     // Must be called when a tile image was modified externally, so
     // the hash elements are re-calculated for that specific tile.
     void notifyTileContentChange(const tile_index ti);
@@ -145,8 +161,7 @@ namespace doc {
   private:
     void removeFromHash(const tile_index ti,
                         const bool adjustIndexes);
-    void hashImage(const tile_index ti,
-                   const ImageRef& tileImage);
+    void hashTile(const tile_index ti);
     void rehash();
     TilesetHashTable& hashTable();
 
@@ -0,0 +1,142 @@
+// Aseprite Document Library
+// Copyright (c) 2023  Igara Studio S.A.
+//
+// This file is released under the terms of the MIT license.
+// Read LICENSE.txt for more information.
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "doc/tileset_hash_table.h"
+
+#include "doc/dispatch.h"
+#include "doc/image.h"
+#include "doc/image_impl.h"
+#include "doc/primitives_fast.h"
+
+#include <algorithm>
+#include <vector>
+
+namespace doc {
+
+namespace {
+
+// Returns a pseudo-random odd factor for each pixel position. The
+// hash of an image is the sum of each pixel value multiplied by the
+// factor of its position, so we can calculate the hash of all flips
+// at the same time (each flip only moves pixels to other positions).
+const std::vector<uint64_t>& position_factors(const int npixels)
+{
+  thread_local std::vector<uint64_t> factors;
+  if (int(factors.size()) < npixels) {
+    int i = int(factors.size());
+    factors.resize(npixels);
+    for (; i<npixels; ++i) {
+      // splitmix64 finalizer
+      uint64_t z = uint64_t(i+1) * 0x9e3779b97f4a7c15ull;
+      z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+      z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+      factors[i] = (z ^ (z >> 31)) | 1;
+    }
+  }
+  return factors;
+}
+
+// Position of the pixel (x, y) of an image of w*h in the image
+// flipped with the "tf" flags.
+inline int flipped_pos(int x, int y, const int w, const int h,
+                       const tile_flags tf)
+{
+  if (tf & tile_f_xflip) x = w-x-1;
+  if (tf & tile_f_yflip) y = h-y-1;
+  if (tf & tile_f_dflip) return x*h + y;
+  return y*w + x;
+}
+
+template<typename ImageTraits>
+TileHashes calculate_tile_hashes_templ(const Image* image)
+{
+  const int w = image->width();
+  const int h = image->height();
+  const std::vector<uint64_t>& factors = position_factors(w*h);
+
+  TileHashes hashes;
+  hashes.square = (w == h);
+  std::fill(std::begin(hashes.flipped), std::end(hashes.flipped), 0);
+
+  // tile_f_dflip is the first bit of the flips index, so we skip odd
+  // indexes (diagonal flips) for non-square images.
+  const int step = (hashes.square ? 1: 2);
+
+  for (int y=0; y<h; ++y) {
+    for (int x=0; x<w; ++x) {
+      const uint64_t c = get_pixel_fast<ImageTraits>(image, x, y);
+      for (int i=0; i<kTileFlipsCount; i+=step) {
+        hashes.flipped[i] +=
+          c * factors[flipped_pos(x, y, w, h, tile_flips_from_index(i))];
+      }
+    }
+  }
+
+  hashes.canonical = hashes.flipped[0];
+  for (int i=step; i<kTileFlipsCount; i+=step)
+    hashes.canonical = std::min(hashes.canonical, hashes.flipped[i]);
+  return hashes;
+}
+
+template<typename ImageTraits>
+bool is_same_flipped_image_templ(const Image* tile,
+                                 const Image* image,
+                                 const tile_flags tf)
+{
+  const int w = image->width();
+  const int h = image->height();
+  if (tf & tile_f_dflip) {
+    if (tile->width() != h || tile->height() != w)
+      return false;
+  }
+  else if (tile->width() != w || tile->height() != h)
+    return false;
+
+  const int tw = tile->width();
+  for (int y=0; y<h; ++y) {
+    for (int x=0; x<w; ++x) {
+      const int pos = flipped_pos(x, y, w, h, tf);
+      if (!ImageTraits::same_color(
+            get_pixel_fast<ImageTraits>(tile, pos % tw, pos / tw),
+            get_pixel_fast<ImageTraits>(image, x, y)))
+        return false;
+    }
+  }
+  return true;
+}
+
+} // anonymous namespace
+
+TileHashes calculate_tile_hashes(const Image* image)
+{
+  DOC_DISPATCH_BY_COLOR_MODE(
+    image->colorMode(),
+    calculate_tile_hashes_templ,
+    image);
+  ASSERT(false);
+  return TileHashes();
+}
+
+bool is_same_flipped_image(const Image* tile,
+                           const Image* image,
+                           const tile_flags tf)
+{
+  if (tile->pixelFormat() != image->pixelFormat())
+    return false;
+
+  DOC_DISPATCH_BY_COLOR_MODE(
+    image->colorMode(),
+    is_same_flipped_image_templ,
+    tile, image, tf);
+  ASSERT(false);
+  return false;
+}
+
+} // namespace doc
@@ -1,5 +1,5 @@
 // Aseprite Document Library
-// Copyright (c) 2019  Igara Studio S.A.
+// Copyright (c) 2019-2023  Igara Studio S.A.
 //
 // This file is released under the terms of the MIT license.
 // Read LICENSE.txt for more information.
@@ -10,19 +10,60 @@
 
 #include "doc/image.h"
 #include "doc/image_ref.h"
-#include "doc/images_map.h"
 #include "doc/primitives.h"
 #include "doc/tile.h"
 
+#include <cstdint>
 #include <unordered_map>
 
 namespace doc {
 
-  // A hash table used to match Image pixels data <-> tileset index
-  typedef std::unordered_map<ImageRef,
-                             tile_index,
-                             details::image_hash,
-                             details::image_eq> TilesetHashTable;
+  // Number of combinations of tile_f_xflip/yflip/dflip flags.
+  const int kTileFlipsCount = 8;
+
+  inline int tile_flips_index(const tile_flags tf) {
+    return int((tf & tile_f_mask) >> 29);
+  }
+
+  inline tile_flags tile_flips_from_index(const int i) {
+    return (tile_flags(i) << 29) & tile_f_mask;
+  }
+
+  // Hashes of an image flipped with each combination of tile flags.
+  // They are calculated in one pass over the pixels without flipping
+  // the image (diagonal flips are only used with square images).
+  struct TileHashes {
+    // flipped[tile_flips_index(tf)] is the hash of the image flipped
+    // with "tf" flags (in the same order as get_tile_pixel() uses to
+    // read the pixels of a flipped tile).
+    uint64_t flipped[kTileFlipsCount];
+
+    // Minimum hash of all the valid flips. It's the same for all the
+    // flipped versions of the same image.
+    uint64_t canonical;
+
+    // True if the image is square and diagonal flips are valid.
+    bool square;
+  };
+
+  TileHashes calculate_tile_hashes(const Image* image);
+
+  // Returns true if "tile" is equal to "image" flipped with the "tf"
+  // flags, without creating a flipped copy of "image".
+  bool is_same_flipped_image(const Image* tile,
+                             const Image* image,
+                             const tile_flags tf);
+
+  struct TilesetHashItem {
+    tile_index ti;
+    uint64_t hash;              // TileHashes::flipped[0] of the tile
+  };
+
+  // A hash table used to match Image pixels data <-> tileset index.
+  // Tiles are indexed by their TileHashes::canonical hash, so all
+  // the flipped versions of a tile are found with one lookup.
+  typedef std::unordered_multimap<uint64_t,
+                                  TilesetHashItem> TilesetHashTable;
 
 } // namespace doc
 
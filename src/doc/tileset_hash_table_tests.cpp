@@ -0,0 +1,125 @@
+// Aseprite Document Library
+// Copyright (c) 2023 Igara Studio S.A.
+//
+// This file is released under the terms of the MIT license.
+// Read LICENSE.txt for more information.
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <gtest/gtest.h>
+
+#include "doc/algorithm/flip_image.h"
+#include "doc/image.h"
+#include "doc/primitives.h"
+#include "doc/tileset_hash_table.h"
+
+#include <memory>
+#include <random>
+
+using namespace doc;
+
+namespace {
+
+ImageRef random_image(std::mt19937& gen, PixelFormat format, int w, int h)
+{
+  std::uniform_int_distribution<int> dist(0, 255);
+  ImageRef image(Image::create(format, w, h));
+  for (int y=0; y<h; ++y) {
+    for (int x=0; x<w; ++x) {
+      color_t c;
+      switch (format) {
+        case IMAGE_RGB:       c = rgba(dist(gen), dist(gen), dist(gen), 255); break;
+        case IMAGE_GRAYSCALE: c = graya(dist(gen), 255); break;
+        default:              c = dist(gen); break;
+      }
+      put_pixel(image.get(), x, y, c);
+    }
+  }
+  return image;
+}
+
+// Flips the image in the same order that tile flips are undone in
+// the tilemap (X, Y, and then D).
+ImageRef flipped_copy(const Image* image, const tile_flags tf)
+{
+  ImageRef copy(Image::createCopy(image));
+  if (tf & tile_f_xflip)
+    algorithm::flip_image(copy.get(), copy->bounds(), algorithm::FlipHorizontal);
+  if (tf & tile_f_yflip)
+    algorithm::flip_image(copy.get(), copy->bounds(), algorithm::FlipVertical);
+  if (tf & tile_f_dflip)
+    algorithm::flip_image(copy.get(), copy->bounds(), algorithm::FlipDiagonal);
+  return copy;
+}
+
+} // anonymous namespace
+
+TEST(TilesetHashTable, HashesOfAllFlips)
+{
+  std::mt19937 gen(1);
+  for (PixelFormat format : { IMAGE_RGB, IMAGE_GRAYSCALE, IMAGE_INDEXED }) {
+    ImageRef image = random_image(gen, format, 16, 16);
+    const TileHashes hashes = calculate_tile_hashes(image.get());
+    EXPECT_TRUE(hashes.square);
+
+    for (int i=0; i<kTileFlipsCount; ++i) {
+      const tile_flags tf = tile_flips_from_index(i);
+      EXPECT_EQ(i, tile_flips_index(tf));
+
+      ImageRef flipped = flipped_copy(image.get(), tf);
+      const TileHashes flippedHashes = calculate_tile_hashes(flipped.get());
+      EXPECT_EQ(hashes.flipped[i], flippedHashes.flipped[0]);
+      EXPECT_EQ(hashes.canonical, flippedHashes.canonical);
+
+      for (int j=0; j<kTileFlipsCount; ++j) {
+        EXPECT_EQ(i == j,
+                  is_same_flipped_image(flipped.get(), image.get(),
+                                        tile_flips_from_index(j)))
+          << "i=" << i << " j=" << j;
+      }
+    }
+  }
+}
+
+TEST(TilesetHashTable, NonSquareImages)
+{
+  std::mt19937 gen(2);
+  ImageRef image = random_image(gen, IMAGE_RGB, 8, 4);
+  const TileHashes hashes = calculate_tile_hashes(image.get());
+  EXPECT_FALSE(hashes.square);
+
+  for (tile_flags tf : { tile_flags(0),
+                         tile_f_xflip,
+                         tile_f_yflip,
+                         tile_f_xflip | tile_f_yflip }) {
+    ImageRef flipped = flipped_copy(image.get(), tf);
+    const TileHashes flippedHashes = calculate_tile_hashes(flipped.get());
+    EXPECT_EQ(hashes.flipped[tile_flips_index(tf)], flippedHashes.flipped[0]);
+    EXPECT_EQ(hashes.canonical, flippedHashes.canonical);
+    EXPECT_TRUE(is_same_flipped_image(flipped.get(), image.get(), tf));
+  }
+
+  EXPECT_FALSE(is_same_flipped_image(image.get(), image.get(), tile_f_dflip));
+}
+
+TEST(TilesetHashTable, SymmetricImages)
+{
+  // An empty image is equal to all its flipped versions
+  ImageRef image(Image::create(IMAGE_RGB, 4, 4));
+  clear_image(image.get(), 0);
+
+  const TileHashes hashes = calculate_tile_hashes(image.get());
+  for (int i=0; i<kTileFlipsCount; ++i) {
+    EXPECT_EQ(hashes.canonical, hashes.flipped[i]);
+    EXPECT_TRUE(is_same_flipped_image(image.get(), image.get(),
+                                      tile_flips_from_index(i)));
+  }
+}
+
+int main(int argc, char** argv)
+{
+  ::testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
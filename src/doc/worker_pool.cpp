@@ -0,0 +1,186 @@
+// Aseprite Document Library
+// Copyright (c) 2023  Igara Studio S.A.
+//
+// This file is released under the terms of the MIT license.
+// Read LICENSE.txt for more information.
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "doc/worker_pool.h"
+
+#include "base/thread_pool.h"
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <mutex>
+#include <thread>
+
+namespace doc {
+
+struct WorkerTasks::Task {
+  enum class State { Queued, Running, Done };
+
+  std::mutex mutex;
+  std::condition_variable doneCV;
+  State state = State::Queued;
+  std::function<void()> func;
+  std::exception_ptr error;
+
+  // Executes the task if nobody started it yet. Called from the
+  // worker thread and from the thread that waits the task.
+  void run() {
+    {
+      const std::lock_guard lock(mutex);
+      if (state != State::Queued)
+        return;
+      state = State::Running;
+    }
+
+    // The task is marked as done even if it throws, so the threads
+    // waiting it don't block forever.
+    std::exception_ptr err;
+    try {
+      func();
+    }
+    catch (...) {
+      err = std::current_exception();
+    }
+
+    const std::lock_guard lock(mutex);
+    func = nullptr;
+    error = err;
+    state = State::Done;
+    doneCV.notify_all();
+  }
+
+  // Returns the exception thrown by the task (if any)
+  std::exception_ptr wait() {
+    run();
+
+    std::unique_lock lock(mutex);
+    doneCV.wait(lock, [this]{ return state == State::Done; });
+    return error;
+  }
+};
+
+base::thread_pool& worker_pool()
+{
+  static base::thread_pool pool(std::max(1, worker_threads()-1));
+  return pool;
+}
+
+int worker_threads()
+{
+  static const int n =
+    std::max(1, int(std::thread::hardware_concurrency()));
+  return n;
+}
+
+WorkerTasks::WorkerTasks()
+{
+}
+
+WorkerTasks::~WorkerTasks()
+{
+  waitAll();
+}
+
+void WorkerTasks::execute(std::function<void()>&& func)
+{
+  auto task = std::make_shared<Task>();
+  task->func = std::move(func);
+  m_tasks.push_back(task);
+
+  // The worker keeps a reference to the task, as it could be
+  // executed (and the group destroyed) before the worker takes it.
+  worker_pool().execute([task]{ task->run(); });
+}
+
+void WorkerTasks::wait()
+{
+  if (std::exception_ptr error = waitAll())
+    std::rethrow_exception(error);
+}
+
+std::exception_ptr WorkerTasks::waitAll()
+{
+  std::exception_ptr first;
+  for (auto& task : m_tasks) {
+    std::exception_ptr error = task->wait();
+    if (error && !first)
+      first = error;
+  }
+  m_tasks.clear();
+  return first;
+}
+
+void run_in_workers(const int nthreads,
+                    const std::function<void()>& work)
+{
+  WorkerTasks tasks;
+  for (int i=1; i<nthreads; ++i)
+    tasks.execute([&work]{ work(); });
+
+  // The calling thread works too, and then executes the tasks that
+  // weren't started yet (they return immediately as there is no
+  // more work to do).
+  work();
+  tasks.wait();
+}
+
+bool for_each_row_band(const int width, const int height,
+                       const int rowsPerBand,
+                       const bool parallel,
+                       const std::function<void(int y1, int y2)>& processRows,
+                       const std::function<bool(int doneRows)>& canContinue)
+{
+  if (width < 1 || height < 1)
+    return true;
+
+  const int bandRows = std::clamp(rowsPerBand, 1, height);
+  const int nbands = (height + bandRows - 1) / bandRows;
+  const int nthreads =
+    (!parallel || int64_t(width)*height < kMinPixelsForWorkers ?
+     1: std::clamp(worker_threads(), 1, nbands));
+
+  std::atomic<int> nextBand(0);
+  std::atomic<int> doneRows(0);
+  std::atomic<bool> canceled(false);
+
+  auto processNextBand = [height, nbands, bandRows, &processRows,
+                          &nextBand, &doneRows, &canceled]() -> bool {
+    int i;
+    if (canceled || (i = nextBand++) >= nbands)
+      return false;
+
+    const int y1 = i*bandRows;
+    const int y2 = std::min(height, y1+bandRows);
+    processRows(y1, y2);
+    doneRows += y2-y1;
+    return true;
+  };
+
+  WorkerTasks tasks;
+  for (int i=1; i<nthreads; ++i) {
+    tasks.execute([&processNextBand]{
+      while (processNextBand())
+        ;
+    });
+  }
+
+  // The calling thread processes bands too, and it's the only one
+  // that calls canContinue().
+  do {
+    if (canContinue && !canContinue(doneRows))
+      canceled = true;
+  } while (processNextBand());
+  tasks.wait();
+
+  return !canceled;
+}
+
+} // namespace doc
@@ -0,0 +1,90 @@
+// Aseprite Document Library
+// Copyright (c) 2023  Igara Studio S.A.
+//
+// This file is released under the terms of the MIT license.
+// Read LICENSE.txt for more information.
+
+#ifndef DOC_WORKER_POOL_H_INCLUDED
+#define DOC_WORKER_POOL_H_INCLUDED
+#pragma once
+
+#include <exception>
+#include <functional>
+#include <memory>
+#include <vector>
+
+namespace base {
+  class thread_pool;
+}
+
+namespace doc {
+
+  // Returns the pool of threads shared by all the parallel algorithms
+  // (hardware_concurrency()-1 threads, at least one). Tasks that are
+  // waited by other threads should be executed with WorkerTasks
+  // instead of calling worker_pool().execute() directly.
+  base::thread_pool& worker_pool();
+
+  // Number of threads that can do some parallel work at the same
+  // time: the workers of the pool plus the calling thread.
+  int worker_threads();
+
+  // A group of tasks executed in the shared worker pool. If a task
+  // wasn't started by a worker when we wait() for it, it's executed
+  // in the calling thread, so a task can wait other tasks (nested
+  // parallel work) without deadlocks even when all workers are busy.
+  //
+  // If a task throws an exception, it's rethrown by wait() (after
+  // waiting all the other tasks).
+  class WorkerTasks {
+  public:
+    WorkerTasks();
+    WorkerTasks(const WorkerTasks&) = delete;
+    WorkerTasks& operator=(const WorkerTasks&) = delete;
+
+    // Waits all the tasks (they can reference data of the owner),
+    // ignoring their exceptions.
+    ~WorkerTasks();
+
+    void execute(std::function<void()>&& func);
+
+    // Waits (or executes) all the tasks in the same order they were
+    // added, and rethrows the first exception thrown by a task.
+    void wait();
+
+  private:
+    struct Task;
+    std::exception_ptr waitAll();
+
+    std::vector<std::shared_ptr<Task>> m_tasks;
+  };
+
+  // Calls work() from the calling thread and from nthreads-1 workers
+  // of the shared pool. work() must take items from some shared
+  // counter until there are no more items. Returns when all the
+  // work() calls finish, rethrowing the first exception thrown by
+  // them.
+  void run_in_workers(const int nthreads,
+                      const std::function<void()>& work);
+
+  // Images with less pixels than this are processed by
+  // for_each_row_band() in the calling thread only.
+  const int kMinPixelsForWorkers = 256*256;
+
+  // Calls processRows(y1, y2) for each band of "rowsPerBand" rows
+  // [y1, y2) of an image with the given size. If "parallel" is true,
+  // the bands of big images are processed with run_in_workers(), so
+  // processRows() must be thread-safe.
+  //
+  // canContinue(doneRows) is called only from the calling thread
+  // (between bands), if it returns false the remaining bands are
+  // skipped. Returns false if the work was canceled.
+  bool for_each_row_band(const int width, const int height,
+                         const int rowsPerBand,
+                         const bool parallel,
+                         const std::function<void(int y1, int y2)>& processRows,
+                         const std::function<bool(int doneRows)>& canContinue = nullptr);
+
+} // namespace doc
+
+#endif
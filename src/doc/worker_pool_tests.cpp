@@ -0,0 +1,150 @@
+// Aseprite Document Library
+// Copyright (c) 2023  Igara Studio S.A.
+//
+// This file is released under the terms of the MIT license.
+// Read LICENSE.txt for more information.
+
+#include "gtest/gtest.h"
+
+#include "doc/worker_pool.h"
+
+#include <atomic>
+#include <new>
+#include <stdexcept>
+#include <vector>
+
+using namespace doc;
+
+TEST(WorkerPool, RunInWorkers)
+{
+  const int n = 1000;
+  std::vector<int> items(n, 0);
+  std::atomic<int> next(0);
+
+  run_in_workers(worker_threads(), [&items, &next]{
+    int i;
+    while ((i = next++) < n)
+      ++items[i];
+  });
+
+  for (int i=0; i<n; ++i)
+    EXPECT_EQ(1, items[i]);
+}
+
+TEST(WorkerPool, WaitInOrder)
+{
+  std::vector<int> values(100, 0);
+  {
+    WorkerTasks tasks;
+    for (int i=0; i<int(values.size()); ++i)
+      tasks.execute([&values, i]{ values[i] = i+1; });
+    tasks.wait();
+
+    for (int i=0; i<int(values.size()); ++i)
+      EXPECT_EQ(i+1, values[i]);
+
+    // The group can be used again after wait()
+    tasks.execute([&values]{ values[0] = -1; });
+  }
+  // The destructor waits the pending tasks
+  EXPECT_EQ(-1, values[0]);
+}
+
+// Each task of the pool waits other tasks, which would be a deadlock
+// if the waiting thread didn't execute the tasks that are still in
+// the queue.
+TEST(WorkerPool, NestedTasks)
+{
+  const int n = 4*worker_threads();
+  std::atomic<int> count(0);
+
+  run_in_workers(n, [&count]{
+    std::atomic<int> next(0);
+    run_in_workers(worker_threads(), [&count, &next]{
+      while (next++ < 16)
+        ++count;
+    });
+  });
+
+  EXPECT_EQ(16*n, count);
+}
+
+// An exception in a task doesn't block the threads waiting it, and
+// it's rethrown by wait() after waiting the other tasks.
+TEST(WorkerPool, Exceptions)
+{
+  std::atomic<int> done(0);
+  WorkerTasks tasks;
+  for (int i=0; i<8; ++i) {
+    tasks.execute([&done, i]{
+      if (i == 3)
+        throw std::runtime_error("task error");
+      ++done;
+    });
+  }
+  EXPECT_THROW(tasks.wait(), std::runtime_error);
+  EXPECT_EQ(7, done);
+
+  // Nothing to rethrow once the tasks were waited
+  EXPECT_NO_THROW(tasks.wait());
+
+  std::atomic<int> next(0);
+  EXPECT_THROW(
+    run_in_workers(worker_threads()+1, [&next]{
+      if (next++ == 1)
+        throw std::bad_alloc();
+    }),
+    std::bad_alloc);
+}
+
+TEST(WorkerPool, RowBands)
+{
+  for (const bool parallel : { false, true }) {
+    const int w = 300, h = 1001;
+    std::vector<int> rows(h, 0);
+    EXPECT_TRUE(
+      for_each_row_band(w, h, 16, parallel, [&rows](int y1, int y2){
+        ASSERT_LT(y1, y2);
+        ASSERT_LE(y2-y1, 16);
+        for (int y=y1; y<y2; ++y)
+          ++rows[y];
+      }));
+
+    for (int y=0; y<h; ++y)
+      EXPECT_EQ(1, rows[y]);
+  }
+
+  // Empty images and band sizes out of range
+  EXPECT_TRUE(for_each_row_band(0, 10, 4, true, [](int, int){ FAIL(); }));
+  int count = 0;
+  EXPECT_TRUE(for_each_row_band(10, 10, 0, true, [&count](int y1, int y2){
+    EXPECT_EQ(1, y2-y1);
+    ++count;
+  }));
+  EXPECT_EQ(10, count);
+}
+
+// The remaining bands of a huge image (its pixel count doesn't fit
+// in an int) are skipped when the work is canceled.
+TEST(WorkerPool, RowBandsCanceled)
+{
+  const int h = 65536;
+  std::atomic<int> bands(0);
+  int calls = 0;
+  EXPECT_FALSE(
+    for_each_row_band(
+      65536, h, 1, true,
+      [&bands](int, int){ ++bands; },
+      [&calls](int){
+        return (++calls < 2);
+      }));
+  EXPECT_EQ(2, calls);
+  EXPECT_GE(bands, 1);
+  EXPECT_LT(bands, h);
+}
+
+int main(int argc, char** argv)
+{
+  ::testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
@@ -1,5 +1,5 @@
 // Aseprite
-// Copyright (C) 2019  Igara Studio S.A.
+// Copyright (C) 2019-2023  Igara Studio S.A.
 // Copyright (C) 2001-2015  David Capello
 //
 // This program is distributed under the terms of
@@ -28,6 +28,7 @@ namespace filters {
     void applyToRgba(FilterManager* filterMgr);
     void applyToGrayscale(FilterManager* filterMgr);
     void applyToIndexed(FilterManager* filterMgr);
+    bool isThreadSafe() const { return true; }
 
   private:
     void generateMap();
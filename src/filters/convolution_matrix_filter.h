@@ -1,5 +1,5 @@
 // Aseprite
-// Copyright (C) 2019  Igara Studio S.A.
+// Copyright (C) 2019-2023  Igara Studio S.A.
 // Copyright (C) 2001-2016  David Capello
 //
 // This program is distributed under the terms of
@@ -33,6 +33,7 @@ namespace filters {
     void applyToRgba(FilterManager* filterMgr);
     void applyToGrayscale(FilterManager* filterMgr);
     void applyToIndexed(FilterManager* filterMgr);
+    bool isThreadSafe() const { return true; }
 
   private:
     std::shared_ptr<ConvolutionMatrix> m_matrix;
@@ -1,5 +1,5 @@
 // Aseprite
-// Copyright (C) 2019  Igara Studio S.A.
+// Copyright (C) 2019-2023  Igara Studio S.A.
 // Copyright (C) 2001-2015  David Capello
 //
 // This program is distributed under the terms of
@@ -44,6 +44,11 @@ namespace filters {
 
     // Applies the filter to the color palette.
     virtual void applyToPalette(FilterManager* filterMgr) { }
+
+    // Returns true if applyToRgba/Grayscale/Indexed() can be called
+    // from several threads at the same time to process different
+    // rows (i.e. they don't modify the state of the filter).
+    virtual bool isThreadSafe() const { return false; }
   };
 
   // Filter that support applying it only to palette colors.
@@ -1,5 +1,5 @@
 // Aseprite
-// Copyright (C) 2019  Igara Studio S.A.
+// Copyright (C) 2019-2023  Igara Studio S.A.
 // Copyright (C) 2017-2018  David Capello
 //
 // This program is distributed under the terms of
@@ -35,6 +35,7 @@ namespace filters {
     void applyToRgba(FilterManager* filterMgr) override;
     void applyToGrayscale(FilterManager* filterMgr) override;
     void applyToIndexed(FilterManager* filterMgr) override;
+    bool isThreadSafe() const override { return true; }
 
   private:
     void onApplyToPalette(FilterManager* filterMgr,
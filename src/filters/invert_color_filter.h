@@ -1,4 +1,5 @@
 // Aseprite
+// Copyright (C) 2023  Igara Studio S.A.
 // Copyright (C) 2001-2015  David Capello
 //
 // This program is distributed under the terms of
@@ -19,6 +20,7 @@ namespace filters {
     void applyToRgba(FilterManager* filterMgr);
     void applyToGrayscale(FilterManager* filterMgr);
     void applyToIndexed(FilterManager* filterMgr);
+    bool isThreadSafe() const { return true; }
   };
 
 } // namespace filters
@@ -1,5 +1,5 @@
 // Aseprite
-// Copyright (C) 2020  Igara Studio S.A.
+// Copyright (C) 2020-2023  Igara Studio S.A.
 // Copyright (C) 2001-2017  David Capello
 //
 // This program is distributed under the terms of
@@ -21,6 +21,7 @@
 #include "filters/tiled_mode.h"
 
 #include <algorithm>
+#include <iterator>
 
 namespace filters {
 
@@ -87,10 +88,221 @@ namespace {
       c++;
     }
   };
-};
+
+  // Histogram of the values of one channel inside the filter window,
+  // used to calculate the median incrementally (Huang's algorithm).
+  class ChannelHistogram {
+  public:
+    void reset(const int n) {
+      std::fill(std::begin(m_count), std::end(m_count), 0);
+      m_median = 0;
+      m_below = 0;
+      m_half = n/2;
+    }
+
+    void add(const int v) {
+      ++m_count[v];
+      if (v < m_median)
+        ++m_below;
+    }
+
+    void remove(const int v) {
+      --m_count[v];
+      if (v < m_median)
+        --m_below;
+    }
+
+    // Returns the same value as the n/2 element of the sorted values.
+    int median() {
+      while (m_below > m_half) {
+        --m_median;
+        m_below -= m_count[m_median];
+      }
+      while (m_below + m_count[m_median] <= m_half) {
+        m_below += m_count[m_median];
+        ++m_median;
+      }
+      return m_median;
+    }
+
+  private:
+    int m_count[256];
+    int m_median;               // Current median value
+    int m_below;                // Number of values < m_median
+    int m_half;
+  };
+
+  struct RgbaChannels {
+    enum { N = 4 };
+    bool enabled[N];
+
+    RgbaChannels(const Target target)
+      : enabled{ (target & TARGET_RED_CHANNEL) != 0,
+                 (target & TARGET_GREEN_CHANNEL) != 0,
+                 (target & TARGET_BLUE_CHANNEL) != 0,
+                 (target & TARGET_ALPHA_CHANNEL) != 0 } { }
+
+    void get(const RgbTraits::pixel_t c, int* v) const {
+      v[0] = rgba_getr(c);
+      v[1] = rgba_getg(c);
+      v[2] = rgba_getb(c);
+      v[3] = rgba_geta(c);
+    }
+  };
+
+  struct GrayscaleChannels {
+    enum { N = 2 };
+    bool enabled[N];
+
+    GrayscaleChannels(const Target target)
+      : enabled{ (target & TARGET_GRAY_CHANNEL) != 0,
+                 (target & TARGET_ALPHA_CHANNEL) != 0 } { }
+
+    void get(const GrayscaleTraits::pixel_t c, int* v) const {
+      v[0] = graya_getv(c);
+      v[1] = graya_geta(c);
+    }
+  };
+
+  struct IndexedChannels {
+    enum { N = 4 };
+    const Palette* pal;
+    bool index;
+    bool enabled[N];
+
+    IndexedChannels(const Palette* pal, const Target target)
+      : pal(pal)
+      , index((target & TARGET_INDEX_CHANNEL) != 0)
+      , enabled{ index || (target & TARGET_RED_CHANNEL) != 0,
+                 !index && (target & TARGET_GREEN_CHANNEL) != 0,
+                 !index && (target & TARGET_BLUE_CHANNEL) != 0,
+                 !index && (target & TARGET_ALPHA_CHANNEL) != 0 } { }
+
+    void get(const IndexedTraits::pixel_t c, int* v) const {
+      if (index) {
+        v[0] = c;
+      }
+      else {
+        const color_t rgb = pal->getEntry(c);
+        v[0] = rgba_getr(rgb);
+        v[1] = rgba_getg(rgb);
+        v[2] = rgba_getb(rgb);
+        v[3] = rgba_geta(rgb);
+      }
+    }
+  };
+
+  // Histograms of the pixels in the filter window of one row. It
+  // samples the same pixels as get_neighboring_pixels() (with the same
+  // clamping/wrapping for each TiledMode), but when it's moved to the
+  // next pixel only one column is removed and one column is added.
+  template<typename Traits, typename Channels>
+  class MedianWindow {
+  public:
+    MedianWindow(const Image* src,
+                 const int width, const int height,
+                 const TiledMode tiledMode,
+                 const int y,
+                 const Channels& channels)
+      : m_channels(channels)
+      , m_width(width)
+      , m_centerX(width/2)
+      , m_imageWidth(src->width())
+      , m_tiledX((int(tiledMode) & int(TiledMode::X_AXIS)) != 0)
+      , m_rows(height)
+      , m_x(0)
+      , m_valid(false) {
+      const int h = src->height();
+      const bool tiledY = ((int(tiledMode) & int(TiledMode::Y_AXIS)) != 0);
+      for (int t=0; t<height; ++t) {
+        int r = y - height/2 + t;
+        if (tiledY) {
+          r %= h;
+          if (r < 0)
+            r += h;
+        }
+        else
+          r = std::clamp(r, 0, h-1);
+        m_rows[t] = (typename Traits::const_address_t)src->getPixelAddress(0, r);
+      }
+
+      // A window wider than the image cannot be moved incrementally
+      // because get_neighboring_pixels() samples the left-most column
+      // more times in that case (see column()).
+      m_canSlide = (m_tiledX || m_width <= m_imageWidth);
+    }
+
+    void moveTo(const int x) {
+      if (m_valid && x == m_x)
+        return;
+
+      if (m_valid && m_canSlide && x > m_x && x - m_x < m_width) {
+        for (int i=m_x+1; i<=x; ++i) {
+          updateColumn(column(i-1, 0), -1);
+          updateColumn(column(i, m_width-1), +1);
+        }
+      }
+      else {
+        const int n = m_width * int(m_rows.size());
+        for (int i=0; i<Channels::N; ++i)
+          m_hist[i].reset(n);
+        for (int t=0; t<m_width; ++t)
+          updateColumn(column(x, t), +1);
+      }
+
+      m_x = x;
+      m_valid = true;
+    }
+
+    int median(const int i) { return m_hist[i].median(); }
+
+  private:
+    // Returns the "t" column of the window to calculate the pixel "x"
+    // (equivalent to the get_neighboring_pixels() iteration).
+    int column(const int x, const int t) const {
+      const int start = x - m_centerX;
+      if (m_tiledX) {
+        const int c = (start + t) % m_imageWidth;
+        return (c < 0 ? c + m_imageWidth: c);
+      }
+      else if (start < 0)
+        return std::max(0, std::min(t, m_imageWidth-1) + start);
+      else
+        return std::min(start + t, m_imageWidth-1);
+    }
+
+    void updateColumn(const int col, const int delta) {
+      int v[Channels::N];
+      for (auto row : m_rows) {
+        m_channels.get(row[col], v);
+        for (int i=0; i<Channels::N; ++i) {
+          if (!m_channels.enabled[i])
+            continue;
+          if (delta > 0)
+            m_hist[i].add(v[i]);
+          else
+            m_hist[i].remove(v[i]);
+        }
+      }
+    }
+
+    const Channels& m_channels;
+    const int m_width;
+    const int m_centerX;
+    const int m_imageWidth;
+    const bool m_tiledX;
+    bool m_canSlide;
+    std::vector<typename Traits::const_address_t> m_rows;
+    ChannelHistogram m_hist[Channels::N];
+    int m_x;
+    bool m_valid;
+  };
+
+} // anonymous namespace
 
 MedianFilter::MedianFilter()
-  : m_tiledMode(TiledMode::NONE)
+  : m_algorithm(Algorithm::Histogram)
+  , m_tiledMode(TiledMode::NONE)
   , m_width(1)
   , m_height(1)
   , m_ncolors(0)
@@ -98,6 +310,11 @@ MedianFilter::MedianFilter()
 {
 }
 
+void MedianFilter::setAlgorithm(Algorithm algorithm)
+{
+  m_algorithm = algorithm;
+}
+
 void MedianFilter::setTiledMode(TiledMode tiled)
 {
   m_tiledMode = tiled;
@@ -122,6 +339,86 @@ const char* MedianFilter::getName()
 }
 
 void MedianFilter::applyToRgba(FilterManager* filterMgr)
+{
+  if (m_algorithm == Algorithm::Sort) {
+    applyToRgbaWithSort(filterMgr);
+    return;
+  }
+
+  const Image* src = filterMgr->getSourceImage();
+  const RgbaChannels channels(filterMgr->getTarget());
+  MedianWindow<RgbTraits, RgbaChannels> window(
+    src, m_width, m_height, m_tiledMode, filterMgr->y(), channels);
+
+  FILTER_LOOP_THROUGH_ROW_BEGIN(uint32_t) {
+    window.moveTo(x);
+
+    const color_t color = get_pixel_fast<RgbTraits>(src, x, y);
+    *dst_address = rgba(
+      (target & TARGET_RED_CHANNEL   ? window.median(0): rgba_getr(color)),
+      (target & TARGET_GREEN_CHANNEL ? window.median(1): rgba_getg(color)),
+      (target & TARGET_BLUE_CHANNEL  ? window.median(2): rgba_getb(color)),
+      (target & TARGET_ALPHA_CHANNEL ? window.median(3): rgba_geta(color)));
+  }
+  FILTER_LOOP_THROUGH_ROW_END()
+}
+
+void MedianFilter::applyToGrayscale(FilterManager* filterMgr)
+{
+  if (m_algorithm == Algorithm::Sort) {
+    applyToGrayscaleWithSort(filterMgr);
+    return;
+  }
+
+  const Image* src = filterMgr->getSourceImage();
+  const GrayscaleChannels channels(filterMgr->getTarget());
+  MedianWindow<GrayscaleTraits, GrayscaleChannels> window(
+    src, m_width, m_height, m_tiledMode, filterMgr->y(), channels);
+
+  FILTER_LOOP_THROUGH_ROW_BEGIN(uint16_t) {
+    window.moveTo(x);
+
+    const color_t color = get_pixel_fast<GrayscaleTraits>(src, x, y);
+    *dst_address = graya(
+      (target & TARGET_GRAY_CHANNEL  ? window.median(0): graya_getv(color)),
+      (target & TARGET_ALPHA_CHANNEL ? window.median(1): graya_geta(color)));
+  }
+  FILTER_LOOP_THROUGH_ROW_END()
+}
+
+void MedianFilter::applyToIndexed(FilterManager* filterMgr)
+{
+  if (m_algorithm == Algorithm::Sort) {
+    applyToIndexedWithSort(filterMgr);
+    return;
+  }
+
+  const Image* src = filterMgr->getSourceImage();
+  const Palette* pal = filterMgr->getIndexedData()->getPalette();
+  const RgbMap* rgbmap = filterMgr->getIndexedData()->getRgbMap();
+  const IndexedChannels channels(pal, filterMgr->getTarget());
+  MedianWindow<IndexedTraits, IndexedChannels> window(
+    src, m_width, m_height, m_tiledMode, filterMgr->y(), channels);
+
+  FILTER_LOOP_THROUGH_ROW_BEGIN(uint8_t) {
+    window.moveTo(x);
+
+    if (target & TARGET_INDEX_CHANNEL) {
+      *dst_address = window.median(0);
+    }
+    else {
+      const color_t color = pal->getEntry(get_pixel_fast<IndexedTraits>(src, x, y));
+      *dst_address = rgbmap->mapColor(
+        (target & TARGET_RED_CHANNEL   ? window.median(0): rgba_getr(color)),
+        (target & TARGET_GREEN_CHANNEL ? window.median(1): rgba_getg(color)),
+        (target & TARGET_BLUE_CHANNEL  ? window.median(2): rgba_getb(color)),
+        (target & TARGET_ALPHA_CHANNEL ? window.median(3): rgba_geta(color)));
+    }
+  }
+  FILTER_LOOP_THROUGH_ROW_END()
+}
+
+void MedianFilter::applyToRgbaWithSort(FilterManager* filterMgr)
 {
   const Image* src = filterMgr->getSourceImage();
   int color, r, g, b, a;
@@ -167,7 +464,7 @@ void MedianFilter::applyToRgba(FilterManager* filterMgr)
   FILTER_LOOP_THROUGH_ROW_END()
 }
 
-void MedianFilter::applyToGrayscale(FilterManager* filterMgr)
+void MedianFilter::applyToGrayscaleWithSort(FilterManager* filterMgr)
 {
   const Image* src = filterMgr->getSourceImage();
   int color, k, a;
@@ -199,7 +496,7 @@ void MedianFilter::applyToGrayscale(FilterManager* filterMgr)
   FILTER_LOOP_THROUGH_ROW_END()
 }
 
-void MedianFilter::applyToIndexed(FilterManager* filterMgr)
+void MedianFilter::applyToIndexedWithSort(FilterManager* filterMgr)
 {
   const Image* src = filterMgr->getSourceImage();
   const Palette* pal = filterMgr->getIndexedData()->getPalette();
@@ -232,7 +529,7 @@ void MedianFilter::applyToIndexed(FilterManager* filterMgr)
         g = m_channel[1][m_ncolors/2];
       }
       else
-        g = rgba_getg(pal->getEntry(color));
+        g = rgba_getg(color);
 
       if (target & TARGET_BLUE_CHANNEL) {
         std::sort(m_channel[2].begin(), m_channel[2].end());
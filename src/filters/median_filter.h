@@ -1,4 +1,5 @@
 // Aseprite
+// Copyright (C) 2023  Igara Studio S.A.
 // Copyright (C) 2001-2016  David Capello
 //
 // This program is distributed under the terms of
@@ -18,11 +19,22 @@ namespace filters {
 
   class MedianFilter : public Filter {
   public:
+    enum class Algorithm {
+      // Sorts all the pixels in the window of each pixel. It's kept
+      // only to compare results/performance with the histogram.
+      Sort,
+      // Updates a histogram of the window incrementally (only one
+      // column of pixels is added/removed for each pixel).
+      Histogram,
+    };
+
     MedianFilter();
 
+    void setAlgorithm(Algorithm algorithm);
     void setTiledMode(TiledMode tiled);
     void setSize(int width, int height);
 
+    Algorithm getAlgorithm() const { return m_algorithm; }
     TiledMode getTiledMode() const { return m_tiledMode; }
     int getWidth() const { return m_width; }
     int getHeight() const { return m_height; }
@@ -32,8 +44,14 @@ namespace filters {
     void applyToRgba(FilterManager* filterMgr);
     void applyToGrayscale(FilterManager* filterMgr);
     void applyToIndexed(FilterManager* filterMgr);
+    bool isThreadSafe() const { return m_algorithm == Algorithm::Histogram; }
 
   private:
+    void applyToRgbaWithSort(FilterManager* filterMgr);
+    void applyToGrayscaleWithSort(FilterManager* filterMgr);
+    void applyToIndexedWithSort(FilterManager* filterMgr);
+
+    Algorithm m_algorithm;
     TiledMode m_tiledMode;
     int m_width;
     int m_height;
@@ -0,0 +1,63 @@
+// Aseprite
+// Copyright (C) 2023  Igara Studio S.A.
+//
+// This program is distributed under the terms of
+// the End-User License Agreement for Aseprite.
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "doc/algorithm/random_image.h"
+#include "doc/image_ref.h"
+#include "filters/median_filter.h"
+#include "filters/test_filter_manager.h"
+
+#include <benchmark/benchmark.h>
+
+using namespace doc;
+using namespace filters;
+
+template<MedianFilter::Algorithm algorithm>
+void BM_MedianFilter(benchmark::State& state) {
+  const auto pf = (PixelFormat)state.range(0);
+  const int w = state.range(1);
+  const int h = state.range(2);
+  const int size = state.range(3);
+
+  ImageRef src(Image::create(pf, w, h));
+  ImageRef dst(Image::create(pf, w, h));
+  doc::algorithm::random_image(src.get());
+
+  MedianFilter filter;
+  filter.setAlgorithm(algorithm);
+  filter.setSize(size, size);
+  filter.setTiledMode(TiledMode::NONE);
+
+  for (auto _ : state) {
+    TestFilterManager filterMgr(src.get(), dst.get(), TARGET_ALL_CHANNELS);
+    filterMgr.apply(&filter);
+  }
+}
+
+#define DEFARGS()                                                \
+  ->Args({ IMAGE_RGB, 256, 256, 3 })                             \
+  ->Args({ IMAGE_RGB, 256, 256, 7 })                             \
+  ->Args({ IMAGE_RGB, 256, 256, 15 })                            \
+  ->Args({ IMAGE_RGB, 256, 256, 31 })                            \
+  ->Args({ IMAGE_GRAYSCALE, 256, 256, 3 })                       \
+  ->Args({ IMAGE_GRAYSCALE, 256, 256, 7 })                       \
+  ->Args({ IMAGE_GRAYSCALE, 256, 256, 15 })                      \
+  ->Args({ IMAGE_GRAYSCALE, 256, 256, 31 })
+
+BENCHMARK_TEMPLATE(BM_MedianFilter, MedianFilter::Algorithm::Sort)
+  DEFARGS()
+  ->Unit(benchmark::kMillisecond)
+  ->UseRealTime();
+
+BENCHMARK_TEMPLATE(BM_MedianFilter, MedianFilter::Algorithm::Histogram)
+  DEFARGS()
+  ->Unit(benchmark::kMillisecond)
+  ->UseRealTime();
+
+BENCHMARK_MAIN();
@@ -0,0 +1,122 @@
+// Aseprite
+// Copyright (C) 2023  Igara Studio S.A.
+//
+// This program is distributed under the terms of
+// the End-User License Agreement for Aseprite.
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <gtest/gtest.h>
+
+#include "doc/algorithm/random_image.h"
+#include "doc/image_ref.h"
+#include "doc/palette.h"
+#include "doc/palette_picks.h"
+#include "doc/primitives.h"
+#include "doc/rgbmap.h"
+#include "filters/filter_indexed_data.h"
+#include "filters/median_filter.h"
+#include "filters/test_filter_manager.h"
+
+using namespace doc;
+using namespace filters;
+
+namespace {
+
+class TestRgbMap : public RgbMap {
+public:
+  void regenerateMap(const Palette* palette, const int maskIndex) override { }
+  int mapColor(const color_t c) const override {
+    return (rgba_getr(c) ^ rgba_getg(c) ^ rgba_getb(c) ^ rgba_geta(c));
+  }
+  int maskIndex() const override { return -1; }
+};
+
+class TestIndexedData : public FilterIndexedData {
+public:
+  TestIndexedData() : m_palette(0, 256) {
+    for (int i=0; i<256; ++i)
+      m_palette.setEntry(i, rgba(i, 255-i, (i*7) & 255, (i*13) & 255));
+  }
+  const Palette* getPalette() const override { return &m_palette; }
+  const RgbMap* getRgbMap() const override { return &m_rgbmap; }
+  Palette* getNewPalette() override { return nullptr; }
+  PalettePicks getPalettePicks() override { return PalettePicks(); }
+private:
+  Palette m_palette;
+  TestRgbMap m_rgbmap;
+};
+
+ImageRef apply_median(const Image* src,
+                      const MedianFilter::Algorithm algorithm,
+                      const int w, const int h,
+                      const TiledMode tiledMode,
+                      const Target target,
+                      const int skipRuns)
+{
+  MedianFilter filter;
+  filter.setAlgorithm(algorithm);
+  filter.setSize(w, h);
+  filter.setTiledMode(tiledMode);
+
+  TestIndexedData indexedData;
+  ImageRef dst(Image::createCopy(src));
+  TestFilterManager filterMgr(src, dst.get(), target, &indexedData);
+  filterMgr.setSkipRuns(skipRuns);
+  filterMgr.apply(&filter);
+  return dst;
+}
+
+} // anonymous namespace
+
+TEST(MedianFilter, HistogramIsEqualToSort)
+{
+  const struct {
+    PixelFormat pf;
+    Target target;
+  } formats[] = {
+    { IMAGE_RGB, TARGET_ALL_CHANNELS },
+    { IMAGE_RGB, TARGET_RED_CHANNEL | TARGET_ALPHA_CHANNEL },
+    { IMAGE_GRAYSCALE, TARGET_ALL_CHANNELS },
+    { IMAGE_INDEXED, TARGET_INDEX_CHANNEL },
+    { IMAGE_INDEXED, TARGET_ALL_CHANNELS },
+  };
+  const TiledMode tiledModes[] = {
+    TiledMode::NONE, TiledMode::X_AXIS, TiledMode::Y_AXIS, TiledMode::BOTH
+  };
+  const gfx::Size windowSizes[] = { { 1, 1 }, { 3, 3 }, { 2, 5 }, { 7, 4 }, { 31, 31 } };
+  const gfx::Size imageSizes[] = { { 1, 1 }, { 5, 3 }, { 37, 29 } };
+
+  for (const auto& fmt : formats) {
+    for (const gfx::Size& imgSize : imageSizes) {
+      ImageRef src(Image::create(fmt.pf, imgSize.w, imgSize.h));
+      doc::algorithm::random_image(src.get());
+
+      for (TiledMode tiledMode : tiledModes) {
+        for (const gfx::Size& winSize : windowSizes) {
+          for (int skipRuns : { 0, 2, 40 }) {
+            ImageRef expected = apply_median(src.get(), MedianFilter::Algorithm::Sort,
+                                             winSize.w, winSize.h, tiledMode,
+                                             fmt.target, skipRuns);
+            ImageRef result = apply_median(src.get(), MedianFilter::Algorithm::Histogram,
+                                           winSize.w, winSize.h, tiledMode,
+                                           fmt.target, skipRuns);
+            ASSERT_EQ(0, count_diff_between_images(expected.get(), result.get()))
+              << "pf=" << int(fmt.pf) << " target=" << fmt.target
+              << " image=" << imgSize.w << "x" << imgSize.h
+              << " window=" << winSize.w << "x" << winSize.h
+              << " tiled=" << int(tiledMode) << " skip=" << skipRuns;
+          }
+        }
+      }
+    }
+  }
+}
+
+int main(int argc, char** argv)
+{
+  ::testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
@@ -0,0 +1,79 @@
+// Aseprite
+// Copyright (C) 2023  Igara Studio S.A.
+//
+// This program is distributed under the terms of
+// the End-User License Agreement for Aseprite.
+
+#ifndef FILTERS_TEST_FILTER_MANAGER_H_INCLUDED
+#define FILTERS_TEST_FILTER_MANAGER_H_INCLUDED
+#pragma once
+
+#include "base/task.h"
+#include "doc/image.h"
+#include "filters/filter.h"
+#include "filters/filter_manager.h"
+
+namespace filters {
+
+  // FilterManager to apply a filter to a whole image in tests and
+  // benchmarks. Optionally it can skip runs of pixels (as if there
+  // were a selection).
+  class TestFilterManager : public FilterManager {
+  public:
+    TestFilterManager(const doc::Image* src,
+                      doc::Image* dst,
+                      const Target target,
+                      FilterIndexedData* indexedData = nullptr)
+      : m_src(src)
+      , m_dst(dst)
+      , m_target(target)
+      , m_indexedData(indexedData) {
+    }
+
+    // Skips alternated runs of "n" pixels (0 to apply the filter to
+    // all pixels).
+    void setSkipRuns(const int n) { m_skipRuns = n; }
+
+    void apply(Filter* filter) {
+      for (m_y=0; m_y<m_src->height(); ++m_y) {
+        m_pixel = 0;
+        switch (m_src->pixelFormat()) {
+          case doc::IMAGE_RGB:       filter->applyToRgba(this); break;
+          case doc::IMAGE_GRAYSCALE: filter->applyToGrayscale(this); break;
+          case doc::IMAGE_INDEXED:   filter->applyToIndexed(this); break;
+          default: break;
+        }
+      }
+    }
+
+    doc::PixelFormat pixelFormat() const override { return m_src->pixelFormat(); }
+    const void* getSourceAddress() override { return m_src->getPixelAddress(0, m_y); }
+    void* getDestinationAddress() override { return m_dst->getPixelAddress(0, m_y); }
+    int getWidth() override { return m_src->width(); }
+    Target getTarget() override { return m_target; }
+    FilterIndexedData* getIndexedData() override { return m_indexedData; }
+    bool skipPixel() override {
+      const int i = m_pixel++;
+      return (m_skipRuns > 0 && (i / m_skipRuns) % 2 == 1);
+    }
+    const doc::Image* getSourceImage() override { return m_src; }
+    int x() const override { return 0; }
+    int y() const override { return m_y; }
+    bool isFirstRow() const override { return m_y == 0; }
+    bool isMaskActive() const override { return m_skipRuns > 0; }
+    base::task_token& taskToken() const override { return m_token; }
+
+  private:
+    const doc::Image* m_src;
+    doc::Image* m_dst;
+    Target m_target;
+    FilterIndexedData* m_indexedData;
+    int m_y = 0;
+    int m_pixel = 0;
+    int m_skipRuns = 0;
+    mutable base::task_token m_token;
+  };
+
+} // namespace filters
+
+#endif
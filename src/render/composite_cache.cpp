@@ -0,0 +1,166 @@
+// Aseprite Render Library
+// Copyright (c) 2023 Igara Studio S.A.
+//
+// This file is released under the terms of the MIT license.
+// Read LICENSE.txt for more information.
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "render/composite_cache.h"
+
+#include <algorithm>
+#include <atomic>
+
+namespace render {
+
+namespace {
+
+std::atomic<int> g_hits(0);
+std::atomic<int> g_misses(0);
+std::atomic<int> g_evictions(0);
+std::atomic<int> g_entries(0);
+std::atomic<std::size_t> g_memory(0);
+
+// Removes entries of a cache from the total stats
+void remove_from_totals(const int entries, const std::size_t memory)
+{
+  g_entries -= entries;
+  g_memory -= memory;
+}
+
+} // anonymous namespace
+
+CompositeCache::CompositeCache(const std::size_t maxMemory)
+  : m_maxMemory(maxMemory)
+{
+}
+
+CompositeCache::~CompositeCache()
+{
+  remove_from_totals(m_stats.entries, m_stats.memory);
+}
+
+std::size_t CompositeCache::maxMemory() const
+{
+  const std::lock_guard lock(m_mutex);
+  return m_maxMemory;
+}
+
+void CompositeCache::setMaxMemory(const std::size_t maxMemory)
+{
+  const std::lock_guard lock(m_mutex);
+  m_maxMemory = maxMemory;
+  shrink(m_maxMemory);
+}
+
+doc::ImageRef CompositeCache::get(const Key& key,
+                                  const std::function<doc::ImageRef()>& create)
+{
+  std::unique_lock lock(m_mutex);
+
+  while (true) {
+    for (auto it=m_entries.begin(), end=m_entries.end(); it!=end; ++it) {
+      if (it->key == key) {
+        if (it != m_entries.begin())
+          m_entries.splice(m_entries.begin(), m_entries, it);
+        ++m_stats.hits;
+        ++g_hits;
+        return m_entries.front().image;
+      }
+    }
+
+    // Wait the image if another thread (e.g. other tile of the same
+    // render) is creating it, and look for it again (it might not
+    // be stored if it's too big).
+    if (std::find(m_creating.begin(), m_creating.end(), key) == m_creating.end())
+      break;
+    m_createdCV.wait(lock);
+  }
+
+  ++m_stats.misses;
+  ++g_misses;
+  m_creating.push_back(key);
+  lock.unlock();
+
+  doc::ImageRef image;
+  std::exception_ptr error;
+  try {
+    image = create();
+  }
+  catch (...) {
+    error = std::current_exception();
+  }
+
+  lock.lock();
+  m_creating.erase(std::find(m_creating.begin(), m_creating.end(), key));
+  m_createdCV.notify_all();
+
+  if (error)
+    std::rethrow_exception(error);
+  if (!image)
+    return image;
+
+  const std::size_t size = image->getMemSize();
+  if (size > m_maxMemory)
+    return image;
+
+  shrink(m_maxMemory - size);
+  m_entries.push_front(Entry{ key, image, size });
+  m_stats.memory += size;
+  ++m_stats.entries;
+  g_memory += size;
+  ++g_entries;
+  return image;
+}
+
+void CompositeCache::clear()
+{
+  const std::lock_guard lock(m_mutex);
+  m_entries.clear();
+  remove_from_totals(m_stats.entries, m_stats.memory);
+  m_stats.memory = 0;
+  m_stats.entries = 0;
+}
+
+CompositeCache::Stats CompositeCache::stats() const
+{
+  const std::lock_guard lock(m_mutex);
+  return m_stats;
+}
+
+void CompositeCache::resetStats()
+{
+  const std::lock_guard lock(m_mutex);
+  m_stats.hits = 0;
+  m_stats.misses = 0;
+  m_stats.evictions = 0;
+}
+
+// static
+CompositeCache::Stats CompositeCache::totalStats()
+{
+  Stats stats;
+  stats.hits = g_hits;
+  stats.misses = g_misses;
+  stats.evictions = g_evictions;
+  stats.entries = g_entries;
+  stats.memory = g_memory;
+  return stats;
+}
+
+void CompositeCache::shrink(const std::size_t maxMemory)
+{
+  while (!m_entries.empty() && m_stats.memory > maxMemory) {
+    const std::size_t size = m_entries.back().size;
+    m_stats.memory -= size;
+    --m_stats.entries;
+    ++m_stats.evictions;
+    ++g_evictions;
+    remove_from_totals(1, size);
+    m_entries.pop_back();
+  }
+}
+
+} // namespace render
@@ -0,0 +1,89 @@
+// Aseprite Render Library
+// Copyright (c) 2023 Igara Studio S.A.
+//
+// This file is released under the terms of the MIT license.
+// Read LICENSE.txt for more information.
+
+#ifndef RENDER_COMPOSITE_CACHE_H_INCLUDED
+#define RENDER_COMPOSITE_CACHE_H_INCLUDED
+#pragma once
+
+#include "doc/image_ref.h"
+
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <list>
+#include <mutex>
+#include <vector>
+
+namespace render {
+
+  // Cache of partially composited images (e.g. all the layers below
+  // the active layer flattened in one image) used by Render to avoid
+  // blending again layers that didn't change between two renders.
+  //
+  // Each entry is identified by a key that must contain everything
+  // that can modify the result (object IDs/versions, opacities,
+  // blend modes, projection, etc.). Entries are discarded in LRU
+  // order when the memory used by the cache exceeds the limit.
+  //
+  // This class is thread-safe.
+  class CompositeCache {
+  public:
+    typedef std::vector<uint64_t> Key;
+
+    struct Stats {
+      int hits = 0;
+      int misses = 0;
+      int evictions = 0;
+      int entries = 0;
+      std::size_t memory = 0;
+    };
+
+    static constexpr std::size_t kDefaultMaxMemory = 256*1024*1024;
+
+    CompositeCache(const std::size_t maxMemory = kDefaultMaxMemory);
+    ~CompositeCache();
+
+    std::size_t maxMemory() const;
+    void setMaxMemory(const std::size_t maxMemory);
+
+    // Returns the image associated to the given key. If it's not in
+    // the cache, it's created with the "create" function (without
+    // locking the cache) and stored (if it fits in the memory
+    // limit). Other threads asking for the same key wait this image
+    // instead of creating it again.
+    doc::ImageRef get(const Key& key,
+                      const std::function<doc::ImageRef()>& create);
+
+    void clear();
+
+    Stats stats() const;
+    void resetStats();
+
+    // Sum of the stats of all the caches (e.g. to show them in the
+    // UI, each editor has its own cache).
+    static Stats totalStats();
+
+  private:
+    struct Entry {
+      Key key;
+      doc::ImageRef image;
+      std::size_t size;
+    };
+
+    void shrink(const std::size_t maxMemory);
+
+    mutable std::mutex m_mutex;
+    std::condition_variable m_createdCV;
+    std::list<Entry> m_entries; // Most recently used first
+    std::vector<Key> m_creating; // Keys being created by other threads
+    std::size_t m_maxMemory;
+    Stats m_stats;
+  };
+
+} // namespace render
+
+#endif
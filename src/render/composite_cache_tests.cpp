@@ -0,0 +1,173 @@
+// Aseprite Render Library
+// Copyright (c) 2023 Igara Studio S.A.
+//
+// This file is released under the terms of the MIT license.
+// Read LICENSE.txt for more information.
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <gtest/gtest.h>
+
+#include "render/composite_cache.h"
+
+#include "doc/image.h"
+
+#include <atomic>
+#include <chrono>
+#include <thread>
+#include <vector>
+
+using namespace doc;
+using namespace render;
+
+namespace {
+
+ImageRef make_image(int w, int h)
+{
+  return ImageRef(Image::create(IMAGE_RGB, w, h));
+}
+
+} // anonymous namespace
+
+TEST(CompositeCache, HitsAndMisses)
+{
+  CompositeCache cache;
+  int created = 0;
+  auto create = [&created]{
+    ++created;
+    return make_image(4, 4);
+  };
+
+  ImageRef a = cache.get({ 1, 2 }, create);
+  ImageRef b = cache.get({ 1, 2 }, create);
+  ImageRef c = cache.get({ 1, 3 }, create);
+  EXPECT_EQ(a, b);
+  EXPECT_NE(a, c);
+  EXPECT_EQ(2, created);
+
+  CompositeCache::Stats stats = cache.stats();
+  EXPECT_EQ(1, stats.hits);
+  EXPECT_EQ(2, stats.misses);
+  EXPECT_EQ(0, stats.evictions);
+  EXPECT_EQ(2, stats.entries);
+  EXPECT_EQ(std::size_t(a->getMemSize() + c->getMemSize()), stats.memory);
+
+  cache.clear();
+  stats = cache.stats();
+  EXPECT_EQ(0, stats.entries);
+  EXPECT_EQ(0, stats.memory);
+
+  cache.get({ 1, 2 }, create);
+  EXPECT_EQ(3, created);
+}
+
+TEST(CompositeCache, EvictsLeastRecentlyUsed)
+{
+  const std::size_t size = make_image(8, 8)->getMemSize();
+  CompositeCache cache(2*size);
+  auto create = []{ return make_image(8, 8); };
+
+  ImageRef a = cache.get({ 1 }, create);
+  ImageRef b = cache.get({ 2 }, create);
+  EXPECT_EQ(a, cache.get({ 1 }, create)); // Now 2 is the LRU entry
+  cache.get({ 3 }, create);               // Evicts 2
+
+  CompositeCache::Stats stats = cache.stats();
+  EXPECT_EQ(1, stats.evictions);
+  EXPECT_EQ(2, stats.entries);
+  EXPECT_EQ(2*size, stats.memory);
+
+  EXPECT_EQ(a, cache.get({ 1 }, create));
+  EXPECT_NE(b, cache.get({ 2 }, create));
+
+  // Reducing the limit evicts entries too
+  cache.setMaxMemory(size);
+  stats = cache.stats();
+  EXPECT_EQ(1, stats.entries);
+  EXPECT_EQ(size, stats.memory);
+
+  // Images bigger than the limit are not stored
+  cache.resetStats();
+  cache.get({ 4 }, []{ return make_image(16, 16); });
+  stats = cache.stats();
+  EXPECT_EQ(1, stats.misses);
+  EXPECT_EQ(0, stats.evictions);
+  EXPECT_EQ(1, stats.entries);
+}
+
+// The image is created without locking the cache, so the "create"
+// function can use the same cache (e.g. other parts of the render).
+TEST(CompositeCache, CreateWithoutLock)
+{
+  CompositeCache cache;
+  ImageRef inner;
+  ImageRef outer = cache.get({ 1 }, [&cache, &inner]{
+    inner = cache.get({ 2 }, []{ return make_image(2, 2); });
+    return make_image(4, 4);
+  });
+  EXPECT_EQ(outer, cache.get({ 1 }, []{ return make_image(1, 1); }));
+  EXPECT_EQ(inner, cache.get({ 2 }, []{ return make_image(1, 1); }));
+  EXPECT_EQ(2, cache.stats().entries);
+}
+
+// Threads asking for the same key wait the image that is being
+// created by other thread.
+TEST(CompositeCache, SameKeyInThreads)
+{
+  CompositeCache cache;
+  std::atomic<int> created(0);
+  auto create = [&created]{
+    ++created;
+    std::this_thread::sleep_for(std::chrono::milliseconds(20));
+    return make_image(4, 4);
+  };
+
+  ImageRef images[4];
+  std::vector<std::thread> threads;
+  for (ImageRef& image : images)
+    threads.emplace_back([&cache, &create, &image]{
+      image = cache.get({ 1 }, create);
+    });
+  for (std::thread& thread : threads)
+    thread.join();
+
+  EXPECT_EQ(1, created);
+  for (ImageRef& image : images)
+    EXPECT_EQ(images[0], image);
+  EXPECT_EQ(1, cache.stats().misses);
+  EXPECT_EQ(3, cache.stats().hits);
+}
+
+TEST(CompositeCache, TotalStats)
+{
+  const CompositeCache::Stats stats0 = CompositeCache::totalStats();
+  const std::size_t size = make_image(8, 8)->getMemSize();
+  {
+    CompositeCache a, b;
+    a.get({ 1 }, []{ return make_image(8, 8); });
+    b.get({ 1 }, []{ return make_image(8, 8); });
+    b.get({ 1 }, []{ return make_image(8, 8); });
+
+    const CompositeCache::Stats stats = CompositeCache::totalStats();
+    EXPECT_EQ(stats0.hits+1, stats.hits);
+    EXPECT_EQ(stats0.misses+2, stats.misses);
+    EXPECT_EQ(stats0.entries+2, stats.entries);
+    EXPECT_EQ(stats0.memory+2*size, stats.memory);
+
+    a.clear();
+    EXPECT_EQ(stats0.entries+1, CompositeCache::totalStats().entries);
+  }
+
+  // Entries of destroyed caches are not counted
+  const CompositeCache::Stats stats = CompositeCache::totalStats();
+  EXPECT_EQ(stats0.entries, stats.entries);
+  EXPECT_EQ(stats0.memory, stats.memory);
+}
+
+int main(int argc, char** argv)
+{
+  ::testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
@@ -1,5 +1,5 @@
 // Aseprite Render Library
-// Copyright (c) 2019-2022  Igara Studio S.A
+// Copyright (c) 2019-2023  Igara Studio S.A
 // Copyright (c) 2017 David Capello
 //
 // This file is released under the terms of the MIT license.
@@ -114,4 +114,22 @@ doc::color_t ErrorDiffusionDither::ditherRgbToIndex2D(
   return index;
 }
 
+// Calls the ErrorDiffusionDither::ditherRgbToIndex2D() directly
+// (without the virtual dispatch) for each pixel.
+void ErrorDiffusionDither::ditherRgbRowToIndex2D(
+  doc::IndexedTraits::pixel_t* dstRow,
+  const int width, const int y,
+  const doc::RgbMap* rgbmap,
+  const doc::Palette* palette)
+{
+  if (y & 1) {                  // Odd row: go from right-to-left
+    for (int x=width-1; x>=0; --x)
+      dstRow[x] = ErrorDiffusionDither::ditherRgbToIndex2D(x, y, rgbmap, palette);
+  }
+  else {                        // Even row: go from left-to-right
+    for (int x=0; x<width; ++x)
+      dstRow[x] = ErrorDiffusionDither::ditherRgbToIndex2D(x, y, rgbmap, palette);
+  }
+}
+
 } // namespace render
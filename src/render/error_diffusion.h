@@ -1,5 +1,5 @@
 // Aseprite Render Library
-// Copyright (c) 2019 Igara Studio S.A
+// Copyright (c) 2019-2023  Igara Studio S.A.
 // Copyright (c) 2017 David Capello
 //
 // This file is released under the terms of the MIT license.
@@ -30,6 +30,11 @@ namespace render {
       const int x, const int y,
       const doc::RgbMap* rgbmap,
       const doc::Palette* palette) override;
+    void ditherRgbRowToIndex2D(
+      doc::IndexedTraits::pixel_t* dstRow,
+      const int width, const int y,
+      const doc::RgbMap* rgbmap,
+      const doc::Palette* palette) override;
   private:
     int m_transparentIndex;
     const doc::Image* m_srcImage;
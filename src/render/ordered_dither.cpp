@@ -1,5 +1,5 @@
 // Aseprite Render Library
-// Copyright (c) 2019-2022  Igara Studio S.A.
+// Copyright (c) 2019-2023  Igara Studio S.A.
 // Copyright (c) 2017 David Capello
 //
 // This file is released under the terms of the MIT license.
@@ -13,6 +13,7 @@
 
 #include "render/dithering.h"
 #include "render/dithering_matrix.h"
+#include "render/row_bands.h"
 
 #include <algorithm>
 #include <limits>
@@ -40,6 +41,34 @@ static int colorDistance(int r1, int g1, int b1, int a1,
   return result;
 }
 
+void DitheringAlgorithmBase::ditherRgbRowToIndex(
+  const DitheringMatrix& matrix,
+  const doc::RgbTraits::pixel_t* srcRow,
+  doc::IndexedTraits::pixel_t* dstRow,
+  const int width, const int y,
+  const doc::RgbMap* rgbmap,
+  const doc::Palette* palette)
+{
+  for (int x=0; x<width; ++x)
+    dstRow[x] = ditherRgbPixelToIndex(matrix, srcRow[x], x, y, rgbmap, palette);
+}
+
+void DitheringAlgorithmBase::ditherRgbRowToIndex2D(
+  doc::IndexedTraits::pixel_t* dstRow,
+  const int width, const int y,
+  const doc::RgbMap* rgbmap,
+  const doc::Palette* palette)
+{
+  if (zigZag() && (y & 1)) {    // Odd row: go from right-to-left
+    for (int x=width-1; x>=0; --x)
+      dstRow[x] = ditherRgbToIndex2D(x, y, rgbmap, palette);
+  }
+  else {                        // Even row: go from left-to-right
+    for (int x=0; x<width; ++x)
+      dstRow[x] = ditherRgbToIndex2D(x, y, rgbmap, palette);
+  }
+}
+
 OrderedDither::OrderedDither(int transparentIndex)
   : m_transparentIndex(transparentIndex)
 {
@@ -119,6 +148,21 @@ doc::color_t OrderedDither::ditherRgbPixelToIndex(
                           nearest1idx);
 }
 
+// Calls the OrderedDither::ditherRgbPixelToIndex() directly (without
+// the virtual dispatch) for each pixel.
+void OrderedDither::ditherRgbRowToIndex(
+  const DitheringMatrix& matrix,
+  const doc::RgbTraits::pixel_t* srcRow,
+  doc::IndexedTraits::pixel_t* dstRow,
+  const int width, const int y,
+  const doc::RgbMap* rgbmap,
+  const doc::Palette* palette)
+{
+  for (int x=0; x<width; ++x)
+    dstRow[x] = OrderedDither::ditherRgbPixelToIndex(
+      matrix, srcRow[x], x, y, rgbmap, palette);
+}
+
 OrderedDither2::OrderedDither2(int transparentIndex)
   : m_transparentIndex(transparentIndex)
 {
@@ -227,6 +271,19 @@ doc::color_t OrderedDither2::ditherRgbPixelToIndex(
     return index;
 }
 
+void OrderedDither2::ditherRgbRowToIndex(
+  const DitheringMatrix& matrix,
+  const doc::RgbTraits::pixel_t* srcRow,
+  doc::IndexedTraits::pixel_t* dstRow,
+  const int width, const int y,
+  const doc::RgbMap* rgbmap,
+  const doc::Palette* palette)
+{
+  for (int x=0; x<width; ++x)
+    dstRow[x] = OrderedDither2::ditherRgbPixelToIndex(
+      matrix, srcRow[x], x, y, rgbmap, palette);
+}
+
 void dither_rgb_image_to_indexed(
   DitheringAlgorithmBase& algorithm,
   const Dithering& dithering,
@@ -242,58 +299,38 @@ void dither_rgb_image_to_indexed(
   algorithm.start(srcImage, dstImage, dithering.factor());
 
   if (algorithm.dimensions() == 1) {
-    const doc::LockImageBits<doc::RgbTraits> srcBits(srcImage);
-    doc::LockImageBits<doc::IndexedTraits> dstBits(dstImage);
-    auto srcIt = srcBits.begin();
-    auto dstIt = dstBits.begin();
-
-    for (int y=0; y<h; ++y) {
-      for (int x=0; x<w; ++x, ++srcIt, ++dstIt) {
-        ASSERT(srcIt != srcBits.end());
-        ASSERT(dstIt != dstBits.end());
-        *dstIt = algorithm.ditherRgbPixelToIndex(
-          dithering.matrix(), *srcIt, x, y, rgbmap, palette);
-
-        if (delegate) {
-          if (!delegate->continueTask())
-            return;
-        }
-      }
-
-      if (delegate) {
-        delegate->notifyTaskProgress(
-          double(y+1) / double(h));
-      }
-    }
+    // Each pixel depends only on its position, so the rows can be
+    // dithered in parallel if the rgbmap can be used from several
+    // threads (Palette::findBestfit() is thread-safe).
+    const bool parallel = (!rgbmap || rgbmap->isThreadSafe());
+
+    if (!for_each_row_band(
+          w, h, parallel, delegate,
+          [&algorithm, &dithering, srcImage, dstImage, w,
+           rgbmap, palette](const int y1, const int y2){
+            for (int y=y1; y<y2; ++y) {
+              algorithm.ditherRgbRowToIndex(
+                dithering.matrix(),
+                doc::get_pixel_address_fast<doc::RgbTraits>(srcImage, 0, y),
+                doc::get_pixel_address_fast<doc::IndexedTraits>(dstImage, 0, y),
+                w, y, rgbmap, palette);
+            }
+          }))
+      return;
   }
   else {
-    auto dstIt = doc::get_pixel_address_fast<doc::IndexedTraits>(dstImage, 0, 0);
-    const bool zigZag = algorithm.zigZag();
-
+    // The error of each pixel is propagated to the next pixels (in
+    // zig-zag order), so the rows must be dithered sequentially.
     for (int y=0; y<h; ++y) {
-      if (zigZag && (y & 1)) { // Odd row: go from right-to-left
-        dstIt += w-1;
-        for (int x=w-1; x>=0; --x, --dstIt) {
-          ASSERT(dstIt == doc::get_pixel_address_fast<doc::IndexedTraits>(dstImage, x, y));
-          *dstIt = algorithm.ditherRgbToIndex2D(x, y, rgbmap, palette);
-          if (delegate) {
-            if (!delegate->continueTask())
-              return;
-          }
-        }
-        dstIt += w+1;
-      }
-      else {                    // Even row: go fromo left-to-right
-        for (int x=0; x<w; ++x, ++dstIt) {
-          ASSERT(dstIt == doc::get_pixel_address_fast<doc::IndexedTraits>(dstImage, x, y));
-          *dstIt = algorithm.ditherRgbToIndex2D(x, y, rgbmap, palette);
-
-          if (delegate) {
-            if (!delegate->continueTask())
-              return;
-          }
-        }
+      if (delegate) {
+        if (!delegate->continueTask())
+          return;
       }
+
+      algorithm.ditherRgbRowToIndex2D(
+        doc::get_pixel_address_fast<doc::IndexedTraits>(dstImage, 0, y),
+        w, y, rgbmap, palette);
+
       if (delegate) {
         delegate->notifyTaskProgress(
           double(y+1) / double(h));
@@ -1,5 +1,5 @@
 // Aseprite Render Library
-// Copyright (c) 2019 Igara Studio S.A.
+// Copyright (c) 2019-2023  Igara Studio S.A.
 // Copyright (c) 2001-2017 David Capello
 //
 // This file is released under the terms of the MIT license.
@@ -47,6 +47,25 @@ namespace render {
       const int x, const int y,
       const doc::RgbMap* rgbmap,
       const doc::Palette* palette) { return 0; }
+
+    // Dithers a whole row of pixels (for 1-dimensional algorithms).
+    // It can be called from several threads at the same time for
+    // different rows.
+    virtual void ditherRgbRowToIndex(
+      const DitheringMatrix& matrix,
+      const doc::RgbTraits::pixel_t* srcRow,
+      doc::IndexedTraits::pixel_t* dstRow,
+      const int width, const int y,
+      const doc::RgbMap* rgbmap,
+      const doc::Palette* palette);
+
+    // Dithers a whole row of pixels (for 2-dimensional algorithms)
+    // from right-to-left in odd rows if zigZag() is true.
+    virtual void ditherRgbRowToIndex2D(
+      doc::IndexedTraits::pixel_t* dstRow,
+      const int width, const int y,
+      const doc::RgbMap* rgbmap,
+      const doc::Palette* palette);
   };
 
   class OrderedDither : public DitheringAlgorithmBase {
@@ -59,6 +78,13 @@ namespace render {
       const int y,
       const doc::RgbMap* rgbmap,
       const doc::Palette* palette) override;
+    void ditherRgbRowToIndex(
+      const DitheringMatrix& matrix,
+      const doc::RgbTraits::pixel_t* srcRow,
+      doc::IndexedTraits::pixel_t* dstRow,
+      const int width, const int y,
+      const doc::RgbMap* rgbmap,
+      const doc::Palette* palette) override;
   private:
     int m_transparentIndex;
   };
@@ -73,6 +99,13 @@ namespace render {
       const int y,
       const doc::RgbMap* rgbmap,
       const doc::Palette* palette) override;
+    void ditherRgbRowToIndex(
+      const DitheringMatrix& matrix,
+      const doc::RgbTraits::pixel_t* srcRow,
+      doc::IndexedTraits::pixel_t* dstRow,
+      const int width, const int y,
+      const doc::RgbMap* rgbmap,
+      const doc::Palette* palette) override;
   private:
     int m_transparentIndex;
   };
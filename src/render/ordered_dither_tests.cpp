@@ -1,5 +1,5 @@
 // Aseprite Render Library
-// Copyright (c) 2019 Igara Studio S.A.
+// Copyright (c) 2019-2023  Igara Studio S.A.
 // Copyright (c) 2001-2017 David Capello
 //
 // This file is released under the terms of the MIT license.
@@ -11,12 +11,113 @@
 
 #include <gtest/gtest.h>
 
+#include "doc/image.h"
+#include "doc/image_ref.h"
+#include "doc/palette.h"
+#include "doc/primitives.h"
+#include "doc/rgbmap_rgb5a3.h"
+#include "render/dithering.h"
 #include "render/dithering_matrix.h"
+#include "render/error_diffusion.h"
 #include "render/ordered_dither.h"
+#include "render/quantization.h"
+#include "render/task_delegate.h"
+
+#include <cstdint>
+#include <memory>
 
 using namespace doc;
 using namespace render;
 
+namespace {
+
+// Images with more than 256x256 pixels are processed in parallel
+const int kWidth = 300;
+const int kHeight = 260;
+
+ImageRef make_rgb_image()
+{
+  ImageRef image(Image::create(IMAGE_RGB, kWidth, kHeight));
+  uint32_t seed = 1;
+  for (int y=0; y<kHeight; ++y)
+    for (int x=0; x<kWidth; ++x) {
+      seed = seed*1103515245 + 12345;
+      const int v = int(seed >> 8);
+      put_pixel(image.get(), x, y,
+                rgba(v & 255, (v >> 8) & 255, (x+y) & 255,
+                     ((v >> 16) & 15) == 0 ? 0: 255));
+    }
+  return image;
+}
+
+std::unique_ptr<Palette> make_palette()
+{
+  std::unique_ptr<Palette> palette(new Palette(frame_t(0), 64));
+  for (int i=0; i<palette->size(); ++i)
+    palette->setEntry(i, rgba((i*37) & 255, (i*91) & 255, (i*13) & 255, 255));
+  return palette;
+}
+
+// Dithers pixel by pixel in only one thread (as the dithering was
+// done before it was processed by rows).
+void serial_dither(DitheringAlgorithmBase& algorithm,
+                   const Dithering& dithering,
+                   const Image* src, Image* dst,
+                   const RgbMap* rgbmap,
+                   const Palette* palette)
+{
+  algorithm.start(src, dst, dithering.factor());
+  if (algorithm.dimensions() == 1) {
+    for (int y=0; y<src->height(); ++y)
+      for (int x=0; x<src->width(); ++x)
+        put_pixel(dst, x, y,
+                  algorithm.ditherRgbPixelToIndex(
+                    dithering.matrix(), get_pixel(src, x, y),
+                    x, y, rgbmap, palette));
+  }
+  else {
+    for (int y=0; y<src->height(); ++y) {
+      if (algorithm.zigZag() && (y & 1)) {
+        for (int x=src->width()-1; x>=0; --x)
+          put_pixel(dst, x, y, algorithm.ditherRgbToIndex2D(x, y, rgbmap, palette));
+      }
+      else {
+        for (int x=0; x<src->width(); ++x)
+          put_pixel(dst, x, y, algorithm.ditherRgbToIndex2D(x, y, rgbmap, palette));
+      }
+    }
+  }
+  algorithm.finish();
+}
+
+template<typename Algorithm>
+void expect_same_dithering(const RgbMap* rgbmap, const Palette* palette)
+{
+  const ImageRef src = make_rgb_image();
+  const Dithering dithering(DitheringAlgorithm::Ordered, BayerMatrix(8), 0.5);
+
+  ImageRef expected(Image::create(IMAGE_INDEXED, kWidth, kHeight));
+  ImageRef result(Image::create(IMAGE_INDEXED, kWidth, kHeight));
+  {
+    Algorithm algorithm(0);
+    serial_dither(algorithm, dithering, src.get(), expected.get(), rgbmap, palette);
+  }
+  {
+    Algorithm algorithm(0);
+    dither_rgb_image_to_indexed(algorithm, dithering,
+                                src.get(), result.get(), rgbmap, palette);
+  }
+  EXPECT_TRUE(is_same_image(expected.get(), result.get()));
+}
+
+class CancelDelegate : public TaskDelegate {
+public:
+  void notifyTaskProgress(double progress) override { }
+  bool continueTask() override { return false; }
+};
+
+} // anonymous namespace
+
 TEST(BayerMatrix, CheckD2)
 {
   BayerMatrix matrix(2);
@@ -65,6 +166,91 @@ TEST(BayerMatrix, CheckD8)
       EXPECT_EQ(expected[c++], matrix(i, j));
 }
 
+TEST(Dithering, OrderedDitherRows)
+{
+  const auto palette = make_palette();
+  RgbMapRGB5A3 rgbmap;
+  rgbmap.regenerateMap(palette.get(), 0);
+
+  expect_same_dithering<OrderedDither>(nullptr, palette.get());
+  expect_same_dithering<OrderedDither>(&rgbmap, palette.get());
+}
+
+TEST(Dithering, OrderedDither2Rows)
+{
+  const auto palette = make_palette();
+  RgbMapRGB5A3 rgbmap;
+  rgbmap.regenerateMap(palette.get(), 0);
+
+  expect_same_dithering<OrderedDither2>(nullptr, palette.get());
+  expect_same_dithering<OrderedDither2>(&rgbmap, palette.get());
+}
+
+TEST(Dithering, ErrorDiffusionDitherRows)
+{
+  const auto palette = make_palette();
+  RgbMapRGB5A3 rgbmap;
+  rgbmap.regenerateMap(palette.get(), 0);
+
+  expect_same_dithering<ErrorDiffusionDither>(nullptr, palette.get());
+  expect_same_dithering<ErrorDiffusionDither>(&rgbmap, palette.get());
+}
+
+TEST(Dithering, ConvertPixelFormat)
+{
+  const ImageRef src = make_rgb_image();
+  const auto palette = make_palette();
+  RgbMapRGB5A3 rgbmap;
+  rgbmap.regenerateMap(palette.get(), 0);
+
+  // RGB -> Indexed
+  for (const RgbMap* map : { (const RgbMap*)nullptr, (const RgbMap*)&rgbmap }) {
+    ImageRef result(
+      convert_pixel_format(src.get(), nullptr, IMAGE_INDEXED, Dithering(),
+                           map, palette.get(), false, 0));
+    for (int y=0; y<kHeight; ++y)
+      for (int x=0; x<kWidth; ++x) {
+        const color_t c = get_pixel(src.get(), x, y);
+        const color_t expected =
+          (rgba_geta(c) == 0 ? 0:
+           map ? map->mapColor(c):
+           palette->findBestfit(rgba_getr(c), rgba_getg(c), rgba_getb(c),
+                                rgba_geta(c), 0));
+        ASSERT_EQ(expected, get_pixel(result.get(), x, y));
+      }
+  }
+
+  // RGB -> Grayscale
+  ImageRef result(
+    convert_pixel_format(src.get(), nullptr, IMAGE_GRAYSCALE, Dithering(),
+                         nullptr, palette.get(), false, 0));
+  for (int y=0; y<kHeight; ++y)
+    for (int x=0; x<kWidth; ++x)
+      ASSERT_EQ(rgba_to_graya_using_luma(get_pixel(src.get(), x, y)),
+                get_pixel(result.get(), x, y));
+}
+
+TEST(Dithering, CancelConversion)
+{
+  const ImageRef src = make_rgb_image();
+  const auto palette = make_palette();
+  CancelDelegate delegate;
+
+  // Nothing is converted if the task is canceled from the beginning
+  ImageRef dst(Image::create(IMAGE_INDEXED, kWidth, kHeight));
+  clear_image(dst.get(), 255);
+  convert_pixel_format(src.get(), dst.get(), IMAGE_INDEXED, Dithering(),
+                       nullptr, palette.get(), false, 0, nullptr, &delegate);
+  EXPECT_TRUE(is_plain_image(dst.get(), 255));
+
+  OrderedDither2 algorithm(0);
+  dither_rgb_image_to_indexed(algorithm,
+                              Dithering(DitheringAlgorithm::Ordered, BayerMatrix(8)),
+                              src.get(), dst.get(), nullptr, palette.get(),
+                              &delegate);
+  EXPECT_TRUE(is_plain_image(dst.get(), 255));
+}
+
 int main(int argc, char** argv)
 {
   ::testing::InitGoogleTest(&argc, argv);
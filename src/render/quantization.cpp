@@ -1,5 +1,5 @@
 // Aseprite Render Library
-// Copyright (c) 2019-2022  Igara Studio S.A.
+// Copyright (c) 2019-2023  Igara Studio S.A.
 // Copyright (c) 2001-2018  David Capello
 //
 // This file is released under the terms of the MIT license.
@@ -22,6 +22,7 @@
 #include "render/error_diffusion.h"
 #include "render/ordered_dither.h"
 #include "render/render.h"
+#include "render/row_bands.h"
 #include "render/task_delegate.h"
 
 #include <algorithm>
@@ -186,214 +187,225 @@ Image* convert_pixel_format(
       toGray = &rgba_to_graya_using_luma;
   }
 
-  color_t c;
-  int r, g, b, a;
+  // RGB -> RGB, Grayscale -> Grayscale
+  if (image->pixelFormat() == new_image->pixelFormat() &&
+      (image->pixelFormat() == IMAGE_RGB ||
+       image->pixelFormat() == IMAGE_GRAYSCALE)) {
+    new_image->copy(image, gfx::Clip(image->bounds()));
+    return new_image;
+  }
 
-  switch (image->pixelFormat()) {
+  // Each pixel is converted independently, so bands of rows can be
+  // converted in parallel (if the rgbmap can be used from several
+  // threads).
+  const bool parallel =
+    (new_image->pixelFormat() != IMAGE_INDEXED ||
+     !rgbmap || rgbmap->isThreadSafe());
 
-    case IMAGE_RGB: {
-      const LockImageBits<RgbTraits> srcBits(image);
-      auto src_it = srcBits.begin(), src_end = srcBits.end();
+  for_each_row_band(
+    image->width(), image->height(), parallel, delegate,
+    [image, new_image, rgbmap, palette, is_background,
+     new_mask_color, toGray](const int y1, const int y2){
+      const gfx::Rect rows(0, y1, image->width(), y2-y1);
+      color_t c;
+      int r, g, b, a;
 
-      switch (new_image->pixelFormat()) {
+      switch (image->pixelFormat()) {
 
-        // RGB -> RGB
-        case IMAGE_RGB:
-          new_image->copy(image, gfx::Clip(image->bounds()));
-          break;
+        case IMAGE_RGB: {
+          const LockImageBits<RgbTraits> srcBits(image, rows);
+          auto src_it = srcBits.begin(), src_end = srcBits.end();
 
-        // RGB -> Grayscale
-        case IMAGE_GRAYSCALE: {
-          LockImageBits<GrayscaleTraits> dstBits(new_image, Image::WriteLock);
-          auto dst_it = dstBits.begin();
+          switch (new_image->pixelFormat()) {
+
+            // RGB -> Grayscale
+            case IMAGE_GRAYSCALE: {
+              LockImageBits<GrayscaleTraits> dstBits(new_image, Image::WriteLock, rows);
+              auto dst_it = dstBits.begin();
 #ifdef _DEBUG
-          auto dst_end = dstBits.end();
-          ASSERT(toGray);
+              auto dst_end = dstBits.end();
+              ASSERT(toGray);
 #endif
-          for (; src_it != src_end; ++src_it, ++dst_it) {
-            ASSERT(dst_it != dst_end);
-            *dst_it = (*toGray)(*src_it);
-          }
-          ASSERT(dst_it == dst_end);
-          break;
-        }
+              for (; src_it != src_end; ++src_it, ++dst_it) {
+                ASSERT(dst_it != dst_end);
+                *dst_it = (*toGray)(*src_it);
+              }
+              ASSERT(dst_it == dst_end);
+              break;
+            }
 
-        // RGB -> Indexed
-        case IMAGE_INDEXED: {
-          LockImageBits<IndexedTraits> dstBits(new_image, Image::WriteLock);
-          auto dst_it = dstBits.begin();
+            // RGB -> Indexed
+            case IMAGE_INDEXED: {
+              LockImageBits<IndexedTraits> dstBits(new_image, Image::WriteLock, rows);
+              auto dst_it = dstBits.begin();
 #ifdef _DEBUG
-          auto dst_end = dstBits.end();
+              auto dst_end = dstBits.end();
 #endif
 
-          for (; src_it != src_end; ++src_it, ++dst_it) {
-            ASSERT(dst_it != dst_end);
-            c = *src_it;
-
-            r = rgba_getr(c);
-            g = rgba_getg(c);
-            b = rgba_getb(c);
-            a = rgba_geta(c);
-
-            if (a == 0)
-              *dst_it = (new_mask_color == -1? 0 : new_mask_color);
-            else if (rgbmap)
-              *dst_it = rgbmap->mapColor(c);
-            else
-              *dst_it = palette->findBestfit(r, g, b, a, new_mask_color);
+              for (; src_it != src_end; ++src_it, ++dst_it) {
+                ASSERT(dst_it != dst_end);
+                c = *src_it;
+
+                r = rgba_getr(c);
+                g = rgba_getg(c);
+                b = rgba_getb(c);
+                a = rgba_geta(c);
+
+                if (a == 0)
+                  *dst_it = (new_mask_color == -1? 0 : new_mask_color);
+                else if (rgbmap)
+                  *dst_it = rgbmap->mapColor(c);
+                else
+                  *dst_it = palette->findBestfit(r, g, b, a, new_mask_color);
+              }
+              ASSERT(dst_it == dst_end);
+              break;
+            }
           }
-          ASSERT(dst_it == dst_end);
           break;
         }
-      }
-      break;
-    }
 
-    case IMAGE_GRAYSCALE: {
-      const LockImageBits<GrayscaleTraits> srcBits(image);
-      auto src_it = srcBits.begin(), src_end = srcBits.end();
+        case IMAGE_GRAYSCALE: {
+          const LockImageBits<GrayscaleTraits> srcBits(image, rows);
+          auto src_it = srcBits.begin(), src_end = srcBits.end();
 
-      switch (new_image->pixelFormat()) {
+          switch (new_image->pixelFormat()) {
 
-        // Grayscale -> RGB
-        case IMAGE_RGB: {
-          LockImageBits<RgbTraits> dstBits(new_image, Image::WriteLock);
-          auto dst_it = dstBits.begin();
+            // Grayscale -> RGB
+            case IMAGE_RGB: {
+              LockImageBits<RgbTraits> dstBits(new_image, Image::WriteLock, rows);
+              auto dst_it = dstBits.begin();
 #ifdef _DEBUG
-          auto dst_end = dstBits.end();
+              auto dst_end = dstBits.end();
 #endif
-          for (; src_it != src_end; ++src_it, ++dst_it) {
-            ASSERT(dst_it != dst_end);
-            c = *src_it;
-
-            g = graya_getv(c);
+              for (; src_it != src_end; ++src_it, ++dst_it) {
+                ASSERT(dst_it != dst_end);
+                c = *src_it;
 
-            *dst_it = rgba(g, g, g, graya_geta(c));
-          }
-          ASSERT(dst_it == dst_end);
-          break;
-        }
+                g = graya_getv(c);
 
-        // Grayscale -> Grayscale
-        case IMAGE_GRAYSCALE:
-          new_image->copy(image, gfx::Clip(image->bounds()));
-          break;
+                *dst_it = rgba(g, g, g, graya_geta(c));
+              }
+              ASSERT(dst_it == dst_end);
+              break;
+            }
 
-        // Grayscale -> Indexed
-        case IMAGE_INDEXED: {
-          LockImageBits<IndexedTraits> dstBits(new_image, Image::WriteLock);
-          auto dst_it = dstBits.begin();
+            // Grayscale -> Indexed
+            case IMAGE_INDEXED: {
+              LockImageBits<IndexedTraits> dstBits(new_image, Image::WriteLock, rows);
+              auto dst_it = dstBits.begin();
 #ifdef _DEBUG
-          auto dst_end = dstBits.end();
+              auto dst_end = dstBits.end();
 #endif
-          for (; src_it != src_end; ++src_it, ++dst_it) {
-            ASSERT(dst_it != dst_end);
-            c = *src_it;
-            a = graya_geta(c);
-            c = graya_getv(c);
-
-            if (a == 0)
-              *dst_it = (new_mask_color == -1? 0 : new_mask_color);
-            else if (rgbmap)
-              *dst_it = rgbmap->mapColor(c, c, c, a);
-            else
-              *dst_it = palette->findBestfit(c, c, c, a, new_mask_color);
+              for (; src_it != src_end; ++src_it, ++dst_it) {
+                ASSERT(dst_it != dst_end);
+                c = *src_it;
+                a = graya_geta(c);
+                c = graya_getv(c);
+
+                if (a == 0)
+                  *dst_it = (new_mask_color == -1? 0 : new_mask_color);
+                else if (rgbmap)
+                  *dst_it = rgbmap->mapColor(c, c, c, a);
+                else
+                  *dst_it = palette->findBestfit(c, c, c, a, new_mask_color);
+              }
+              ASSERT(dst_it == dst_end);
+              break;
+            }
           }
-          ASSERT(dst_it == dst_end);
           break;
         }
-      }
-      break;
-    }
 
-    case IMAGE_INDEXED: {
-      const LockImageBits<IndexedTraits> srcBits(image);
-      auto src_it = srcBits.begin(), src_end = srcBits.end();
+        case IMAGE_INDEXED: {
+          const LockImageBits<IndexedTraits> srcBits(image, rows);
+          auto src_it = srcBits.begin(), src_end = srcBits.end();
 
-      switch (new_image->pixelFormat()) {
+          switch (new_image->pixelFormat()) {
 
-        // Indexed -> RGB
-        case IMAGE_RGB: {
-          LockImageBits<RgbTraits> dstBits(new_image, Image::WriteLock);
-          auto dst_it = dstBits.begin();
+            // Indexed -> RGB
+            case IMAGE_RGB: {
+              LockImageBits<RgbTraits> dstBits(new_image, Image::WriteLock, rows);
+              auto dst_it = dstBits.begin();
 #ifdef _DEBUG
-          auto dst_end = dstBits.end();
+              auto dst_end = dstBits.end();
 #endif
-          for (; src_it != src_end; ++src_it, ++dst_it) {
-            ASSERT(dst_it != dst_end);
-            c = *src_it;
-
-            if (!is_background && c == image->maskColor())
-              *dst_it = rgba(0, 0, 0, 0);
-            else {
-              const uint32_t p = palette->getEntry(c);
-              if (is_background)
-                *dst_it = rgba(rgba_getr(p), rgba_getg(p), rgba_getb(p), 255);
-              else
-                *dst_it = p;
+              for (; src_it != src_end; ++src_it, ++dst_it) {
+                ASSERT(dst_it != dst_end);
+                c = *src_it;
+
+                if (!is_background && c == image->maskColor())
+                  *dst_it = rgba(0, 0, 0, 0);
+                else {
+                  const uint32_t p = palette->getEntry(c);
+                  if (is_background)
+                    *dst_it = rgba(rgba_getr(p), rgba_getg(p), rgba_getb(p), 255);
+                  else
+                    *dst_it = p;
+                }
+              }
+              ASSERT(dst_it == dst_end);
+              break;
             }
-          }
-          ASSERT(dst_it == dst_end);
-          break;
-        }
 
-        // Indexed -> Grayscale
-        case IMAGE_GRAYSCALE: {
-          LockImageBits<GrayscaleTraits> dstBits(new_image, Image::WriteLock);
-          auto dst_it = dstBits.begin();
+            // Indexed -> Grayscale
+            case IMAGE_GRAYSCALE: {
+              LockImageBits<GrayscaleTraits> dstBits(new_image, Image::WriteLock, rows);
+              auto dst_it = dstBits.begin();
 #ifdef _DEBUG
-          auto dst_end = dstBits.end();
-          ASSERT(toGray);
+              auto dst_end = dstBits.end();
+              ASSERT(toGray);
 #endif
-          for (; src_it != src_end; ++src_it, ++dst_it) {
-            ASSERT(dst_it != dst_end);
-            c = *src_it;
-
-            if (!is_background && c == image->maskColor())
-              *dst_it = graya(0, 0);
-            else {
-              c = palette->getEntry(c);
-              *dst_it = (*toGray)(c);
+              for (; src_it != src_end; ++src_it, ++dst_it) {
+                ASSERT(dst_it != dst_end);
+                c = *src_it;
+
+                if (!is_background && c == image->maskColor())
+                  *dst_it = graya(0, 0);
+                else {
+                  c = palette->getEntry(c);
+                  *dst_it = (*toGray)(c);
+                }
+              }
+              ASSERT(dst_it == dst_end);
+              break;
             }
-          }
-          ASSERT(dst_it == dst_end);
-          break;
-        }
 
-        // Indexed -> Indexed
-        case IMAGE_INDEXED: {
-          LockImageBits<IndexedTraits> dstBits(new_image, Image::WriteLock);
-          auto dst_it = dstBits.begin();
+            // Indexed -> Indexed
+            case IMAGE_INDEXED: {
+              LockImageBits<IndexedTraits> dstBits(new_image, Image::WriteLock, rows);
+              auto dst_it = dstBits.begin();
 #ifdef _DEBUG
-          auto dst_end = dstBits.end();
+              auto dst_end = dstBits.end();
 #endif
-          for (; src_it != src_end; ++src_it, ++dst_it) {
-            ASSERT(dst_it != dst_end);
-            c = *src_it;
-
-            if (!is_background && c == image->maskColor())
-              *dst_it = new_mask_color;
-            else {
-              c = palette->getEntry(c);
-              r = rgba_getr(c);
-              g = rgba_getg(c);
-              b = rgba_getb(c);
-              a = rgba_geta(c);
-
-              if (rgbmap)
-                *dst_it = rgbmap->mapColor(r, g, b, a);
-              else
-                *dst_it = palette->findBestfit(r, g, b, a, new_mask_color);
+              for (; src_it != src_end; ++src_it, ++dst_it) {
+                ASSERT(dst_it != dst_end);
+                c = *src_it;
+
+                if (!is_background && c == image->maskColor())
+                  *dst_it = new_mask_color;
+                else {
+                  c = palette->getEntry(c);
+                  r = rgba_getr(c);
+                  g = rgba_getg(c);
+                  b = rgba_getb(c);
+                  a = rgba_geta(c);
+
+                  if (rgbmap)
+                    *dst_it = rgbmap->mapColor(r, g, b, a);
+                  else
+                    *dst_it = palette->findBestfit(r, g, b, a, new_mask_color);
+                }
+              }
+              ASSERT(dst_it == dst_end);
+              break;
             }
+
           }
-          ASSERT(dst_it == dst_end);
           break;
         }
-
       }
-      break;
-    }
-  }
+    });
 
   return new_image;
 }
@@ -13,6 +13,7 @@
 
 #include "doc/blend_internals.h"
 #include "doc/blend_mode.h"
+#include "doc/blend_row.h"
 #include "doc/doc.h"
 #include "doc/image_impl.h"
 #include "doc/layer_tilemap.h"
@@ -20,10 +21,15 @@
 #include "doc/render_plan.h"
 #include "doc/tileset.h"
 #include "doc/tilesets.h"
+#include "doc/worker_pool.h"
 #include "gfx/clip.h"
 #include "gfx/region.h"
+#include "render/composite_cache.h"
 
+#include <algorithm>
+#include <atomic>
 #include <cmath>
+#include <cstring>
 
 #define TRACE_RENDER_CEL(...) // TRACE
 
@@ -147,6 +153,35 @@ public:
   }
 };
 
+// Returns a function to blend a whole row of pixels at once (using
+// SIMD instructions when possible), or nullptr if there is no row
+// blender for the given combination of pixel formats.
+template<class DstTraits, class SrcTraits>
+struct RowBlender {
+  typedef void (*Func)(typename DstTraits::pixel_t* dst,
+                       const typename SrcTraits::pixel_t* src,
+                       int n, int opacity, color_t maskColor);
+  static Func get(BlendMode blendMode, const bool newBlend) {
+    return nullptr;
+  }
+};
+
+template<>
+struct RowBlender<RgbTraits, RgbTraits> {
+  typedef RgbaBlendRowFunc Func;
+  static Func get(BlendMode blendMode, const bool newBlend) {
+    return get_rgba_row_blender(blendMode, newBlend);
+  }
+};
+
+template<>
+struct RowBlender<GrayscaleTraits, GrayscaleTraits> {
+  typedef GrayaBlendRowFunc Func;
+  static Func get(BlendMode blendMode, const bool newBlend) {
+    return get_graya_row_blender(blendMode, newBlend);
+  }
+};
+
 template<class DstTraits, class SrcTraits>
 void composite_image_without_scale(
   Image* dst, const Image* src, const Palette* pal,
@@ -176,6 +211,20 @@ void composite_image_without_scale(
 
   ASSERT(!srcBounds.isEmpty());
 
+  // Blend whole rows when it's possible
+  auto rowBlender = RowBlender<DstTraits, SrcTraits>::get(blendMode, newBlend);
+  if (rowBlender) {
+    const color_t maskColor = src->maskColor();
+    const int h = std::min(srcBounds.h, dstBounds.h);
+    for (int y=0; y<h; ++y) {
+      rowBlender(
+        get_pixel_address_fast<DstTraits>(dst, dstBounds.x, dstBounds.y+y),
+        get_pixel_address_fast<SrcTraits>(src, srcBounds.x, srcBounds.y+y),
+        srcBounds.w, opacity, maskColor);
+    }
+    return;
+  }
+
   // Lock all necessary bits
   const LockImageBits<SrcTraits> srcBits(src, srcBounds);
   LockImageBits<DstTraits> dstBits(dst, dstBounds);
@@ -276,6 +325,9 @@ void composite_image_scale_up(
 #endif
   typename LockImageBits<DstTraits>::iterator dst_it, dst_end;
 
+  auto rowBlender = RowBlender<DstTraits, SrcTraits>::get(blendMode, newBlend);
+  const color_t maskColor = src->maskColor();
+
   // For each line to draw of the source image...
   dstBounds.h = 1;
   for (int y=0; y<srcBounds.h; ++y) {
@@ -289,8 +341,15 @@ void composite_image_scale_up(
       ASSERT(dst_it >= dstBits.begin() && dst_it < dst_end);
       ASSERT(scanline_it >= scanline.begin() && scanline_it < scanline_end);
 
-      *scanline_it = blender(*dst_it, *src_it, opacity);
-      ++src_it;
+      // With a row blender we just copy the 'dst' pixels to the
+      // scanline and then blend the whole scanline with 'src'
+      if (rowBlender) {
+        *scanline_it = *dst_it;
+      }
+      else {
+        *scanline_it = blender(*dst_it, *src_it, opacity);
+        ++src_it;
+      }
 
       int delta;
       if (x == 0)
@@ -304,6 +363,13 @@ void composite_image_scale_up(
       ++scanline_it;
     }
 
+    if (rowBlender) {
+      rowBlender(&scanline[0],
+                 get_pixel_address_fast<SrcTraits>(src, srcBounds.x, srcBounds.y+y),
+                 srcBounds.w, opacity, maskColor);
+      src_it += srcBounds.w;
+    }
+
     // Get the 'height' of the line to be painted in 'dst'
     if ((y == 0) && (first_px_h > 0))
       line_h = first_px_h;
@@ -408,6 +474,28 @@ void composite_image_scale_down(
   // Adjust to src_it for each line
   int adjust_per_line = (dstBounds.w*step_w)*(step_h-1);
 
+  // With a row blender we collect the 'src' pixels of each line in a
+  // scanline and blend all of them at once
+  auto rowBlender = RowBlender<DstTraits, SrcTraits>::get(blendMode, newBlend);
+  if (rowBlender) {
+    const color_t maskColor = src->maskColor();
+    std::vector<typename SrcTraits::pixel_t> scanline(dstBounds.w);
+
+    for (int y=0; y<dstBounds.h; ++y) {
+      for (int x=0; x<dstBounds.w; ++x) {
+        ASSERT(src_it >= srcBits.begin() && src_it < src_end);
+        scanline[x] = *src_it;
+        src_it += step_w;
+      }
+      rowBlender(
+        get_pixel_address_fast<DstTraits>(dst, dstBounds.x, dstBounds.y+y),
+        &scanline[0], dstBounds.w, opacity, maskColor);
+
+      src_it += adjust_per_line;
+    }
+    return;
+  }
+
   // For each line to draw of the source image...
   for (int y=0; y<dstBounds.h; ++y) {
     for (int x=0; x<dstBounds.w; ++x) {
@@ -621,6 +709,11 @@ CompositeImageFunc get_fastest_composition_path(const Projection& proj,
   }
 }
 
+// Number of pixels of each tile rendered by one thread in the
+// parallel rendering (64K RGBA pixels = 256KB, which fits in L2).
+const int kParallelTilePixels = 64*1024;
+const int kParallelMinTileHeight = 8;
+
 bool has_visible_reference_layers(const LayerGroup* group)
 {
   for (const Layer* child : group->layers()) {
@@ -637,6 +730,16 @@ bool has_visible_reference_layers(const LayerGroup* group)
   return false;
 }
 
+// Returns the first item of the plan that renders the given layer
+RenderPlan::Items::const_iterator find_layer_item(const RenderPlan::Items& items,
+                                                  const Layer* layer)
+{
+  return std::find_if(items.begin(), items.end(),
+                      [layer](const RenderPlan::Item& item){
+                        return (item.layer == layer);
+                      });
+}
+
 } // anonymous namespace
 
 Render::Render()
@@ -657,6 +760,8 @@ Render::Render()
   , m_previewTileset(nullptr)
   , m_previewBlendMode(BlendMode::NORMAL)
   , m_onionskin(OnionskinType::NONE)
+  , m_parallel(false)
+  , m_cache(nullptr)
 {
 }
 
@@ -678,6 +783,16 @@ void Render::setNewBlend(const bool newBlend)
   m_newBlendMethod = newBlend;
 }
 
+void Render::setParallelRendering(const bool state)
+{
+  m_parallel = state;
+}
+
+void Render::setCompositeCache(CompositeCache* cache)
+{
+  m_cache = cache;
+}
+
 void Render::setProjection(const Projection& projection)
 {
   m_proj = projection;
@@ -784,10 +899,24 @@ void Render::renderLayer(
 
   doc::RenderPlan plan;
   plan.addLayer(layer, frame);
-  renderPlan(
-    plan, dstImage, area,
-    frame, compositeImage,
-    true, true, blendMode);
+
+  // Tilemaps are rendered at once (their "pixels" are tile indexes)
+  if (dstImage->pixelFormat() == IMAGE_TILEMAP) {
+    renderPlan(
+      plan.items(), dstImage, area,
+      frame, compositeImage,
+      true, true, blendMode);
+    return;
+  }
+
+  renderTiles(
+    gfx::ClipF(area),
+    [&plan, dstImage, frame, compositeImage, blendMode](Render& render, const gfx::ClipF& tile){
+      render.renderPlan(
+        plan.items(), dstImage, tile,
+        frame, compositeImage,
+        true, true, blendMode);
+    });
 }
 
 void Render::renderSprite(
@@ -827,8 +956,21 @@ void Render::renderSprite(
     // is enough as a base color).
     fill_rect(dstImage, area.dstBounds(), bg_color);
 
+    // Get the cached layers below the active one before rendering
+    // the tiles, so the whole canvas is rendered in parallel (if it's
+    // not in the cache) instead of by the first tile while the other
+    // ones wait for it.
+    if (m_cache)
+      m_cachedLayersBelow = getCachedSpriteLayersBelow(
+        dstImage, area, frame, bg_color, compositeImage);
+
     // Draw the Background layer - Onion skin behind the sprite - Transparent Layers
-    renderSpriteLayers(dstImage, area, frame, compositeImage);
+    renderTiles(
+      area,
+      [dstImage, frame, bg_color, compositeImage](Render& render, const gfx::ClipF& tile){
+        render.renderSpriteLayers(dstImage, tile, frame, bg_color, compositeImage);
+      });
+    m_cachedLayersBelow.reset();
 
     // In case that we need a special background (e.g. like the
     // checkered pattern), we can draw the background in a temporal
@@ -848,12 +990,21 @@ void Render::renderSprite(
   // Old Blending Method:
   else {
     renderBackground(dstImage, bgLayer, bg_color, area);
-    renderSpriteLayers(dstImage, area, frame, compositeImage);
+    renderTiles(
+      area,
+      [dstImage, frame, bg_color, compositeImage](Render& render, const gfx::ClipF& tile){
+        render.renderSpriteLayers(dstImage, tile, frame, bg_color, compositeImage);
+      });
   }
 
   // Draw onion skin in front of the sprite.
-  if (m_onionskin.position() == OnionskinPosition::INFRONT)
-    renderOnionskin(dstImage, area, frame, compositeImage);
+  if (m_onionskin.position() == OnionskinPosition::INFRONT) {
+    renderTiles(
+      area,
+      [dstImage, frame, compositeImage](Render& render, const gfx::ClipF& tile){
+        render.renderOnionskin(dstImage, tile, frame, compositeImage);
+      });
+  }
 
   // Overlay preview image
   if (m_previewImage &&
@@ -876,17 +1027,79 @@ void Render::renderSprite(
   }
 }
 
+void Render::renderTiles(
+  const gfx::ClipF& area,
+  const std::function<void(Render& render,
+                           const gfx::ClipF& tile)>& func)
+{
+  // Tiles are horizontal bands of the whole area width, in this way
+  // the source coordinates of each pixel are calculated exactly in
+  // the same way as when the whole area is rendered at once (only
+  // the Y coordinate is displaced an integer number of pixels).
+  const int w = std::max(1, int(std::ceil(area.size.w)));
+  const int tileH = std::max(kParallelMinTileHeight, kParallelTilePixels / w);
+  const int ntiles = int(std::ceil(area.size.h / tileH));
+  const int nthreads =
+    std::min(ntiles, doc::worker_threads());
+
+  if (!m_parallel ||
+      nthreads < 2 ||
+      !hasExactSubareas()) {
+    func(*this, area);
+    return;
+  }
+
+  std::atomic<int> nextTile(0);
+
+  // Each thread takes the next tile to render until there are no
+  // more tiles, so a thread that finishes its tile earlier (e.g. an
+  // empty area of the sprite) helps with the remaining ones.
+  auto renderNextTiles = [this, &area, &func, &nextTile, tileH, ntiles]{
+    // Workers that start when all tiles are taken don't copy the
+    // Render.
+    if (nextTile >= ntiles)
+      return;
+
+    // Each thread needs its own copy of the Render (which contains
+    // some state that is modified in the rendering process) and its
+    // own temporary buffer.
+    Render render(*this);
+    render.m_tmpBuf.reset();
+    render.m_parallel = false;
+
+    int i;
+    while ((i = nextTile++) < ntiles) {
+      const double y = double(i * tileH);
+      const gfx::ClipF tile(area.dst.x, area.dst.y + y,
+                            area.src.x, area.src.y + y,
+                            area.size.w,
+                            std::min(double(tileH), area.size.h - y));
+      func(render, tile);
+    }
+  };
+
+  // The calling thread renders tiles too
+  doc::run_in_workers(nthreads, renderNextTiles);
+}
+
 void Render::renderSpriteLayers(Image* dstImage,
                                 const gfx::ClipF& area,
                                 frame_t frame,
+                                const color_t bg_color,
                                 CompositeImageFunc compositeImage)
 {
   doc::RenderPlan plan;
   plan.addLayer(m_sprite->root(), frame);
 
+  if (m_cache &&
+      renderCachedSpriteLayers(dstImage, area, frame, bg_color,
+                               compositeImage, plan.items())) {
+    return;
+  }
+
   // Draw the background layer.
   m_globalOpacity = 255;
-  renderPlan(plan, dstImage,
+  renderPlan(plan.items(), dstImage,
              area, frame, compositeImage,
              true,
              false,
@@ -898,13 +1111,213 @@ void Render::renderSpriteLayers(Image* dstImage,
 
   // Draw the transparent layers.
   m_globalOpacity = 255;
-  renderPlan(plan, dstImage,
+  renderPlan(plan.items(), dstImage,
              area, frame, compositeImage,
              false,
              true,
              BlendMode::UNSPECIFIED);
 }
 
+ImageRef Render::getCachedSpriteLayersBelow(const Image* dstImage,
+                                            const gfx::ClipF& area,
+                                            const frame_t frame,
+                                            const color_t bg_color,
+                                            const CompositeImageFunc compositeImage)
+{
+  doc::RenderPlan plan;
+  plan.addLayer(m_sprite->root(), frame);
+
+  if (!canUseCache(dstImage, area, plan.items()))
+    return nullptr;
+
+  return getCachedLayersBelow(dstImage, frame, bg_color, compositeImage,
+                              plan.items());
+}
+
+bool Render::renderCachedSpriteLayers(Image* dstImage,
+                                      const gfx::ClipF& area,
+                                      const frame_t frame,
+                                      const color_t bg_color,
+                                      const CompositeImageFunc compositeImage,
+                                      const RenderPlan::Items& items)
+{
+  if (!canUseCache(dstImage, area, items))
+    return false;
+
+  // The active layer (the one that is being edited) and the layers
+  // above it are rendered in each call, the layers below it are
+  // taken from the cache (or cached if they are not there yet).
+  ImageRef image = m_cachedLayersBelow;
+  if (!image)
+    image = getCachedLayersBelow(dstImage, frame, bg_color,
+                                 compositeImage, items);
+  if (image)
+    dstImage->copy(image.get(), gfx::Clip(area));
+
+  // The layers above the active one are blended one by one (they
+  // cannot be flattened in a transparent image and then composited
+  // as the "normal" blend mode of unpremultiplied colors isn't
+  // associative, e.g. with semi-transparent pixels).
+  const RenderPlan::Items activeAndAbove(
+    find_layer_item(items, m_selectedLayerForOpacity), items.end());
+  m_globalOpacity = 255;
+  renderPlan(activeAndAbove, dstImage, area, frame, compositeImage,
+             true, true, BlendMode::UNSPECIFIED);
+  return true;
+}
+
+bool Render::canUseCache(const Image* dstImage,
+                         const gfx::ClipF& area,
+                         const RenderPlan::Items& items) const
+{
+  const Layer* activeLayer = m_selectedLayerForOpacity;
+  if (!m_newBlendMethod ||
+      !activeLayer ||
+      activeLayer->isGroup() ||
+      (m_onionskin.type() != OnionskinType::NONE &&
+       m_onionskin.position() == OnionskinPosition::BEHIND) ||
+      // Preview images and extra cels can be used only in the active layer
+      (m_previewImage && m_selectedLayer != activeLayer) ||
+      (m_extraCel && m_extraImage && m_currentLayer != activeLayer) ||
+      !hasExactSubareas())
+    return false;
+
+  // Cached images contain the whole sprite canvas, so we cannot use
+  // them to render parts outside the canvas, or when we cannot keep
+  // at least two of these images in the cache.
+  const gfx::Rect canvasBounds = m_proj.apply(m_sprite->bounds());
+  const std::size_t canvasMemSize =
+    std::size_t(canvasBounds.w) * canvasBounds.h * dstImage->bytesPerPixel();
+  if (!canvasBounds.contains(gfx::Clip(area).srcBounds()) ||
+      2*canvasMemSize > m_cache->maxMemory())
+    return false;
+
+  // The background layer is rendered in a first pass in
+  // renderSpriteLayers(), so we can render the layers as in the plan
+  // order only if the background is the first item.
+  for (int i=1; i<int(items.size()); ++i) {
+    if (items[i].layer->isBackground())
+      return false;
+  }
+  return true;
+}
+
+ImageRef Render::getCachedLayersBelow(const Image* dstImage,
+                                      const frame_t frame,
+                                      const color_t bg_color,
+                                      const CompositeImageFunc compositeImage,
+                                      const RenderPlan::Items& items)
+{
+  const RenderPlan::Items below(
+    items.begin(), find_layer_item(items, m_selectedLayerForOpacity));
+  if (below.empty())
+    return nullptr;
+
+  // The layers below start from the same background color that
+  // renderSprite() uses to clear the destination image. The canvas
+  // is rendered in parallel when it's created from the calling
+  // thread of renderSprite() (and not from one of its tiles).
+  const gfx::Rect canvasBounds = m_proj.apply(m_sprite->bounds());
+  const PixelFormat format = dstImage->pixelFormat();
+  return m_cache->get(
+    makeCacheKey(below, frame, format, bg_color),
+    [this, &below, frame, bg_color, compositeImage, &canvasBounds, format]{
+      ImageRef image(Image::create(format, canvasBounds.w, canvasBounds.h));
+      image->clear(bg_color);
+      m_globalOpacity = 255;
+      renderTiles(
+        gfx::ClipF(canvasBounds),
+        [&below, &image, frame, compositeImage](Render& render, const gfx::ClipF& tile){
+          render.renderPlan(below, image.get(), tile,
+                            frame, compositeImage, true, true,
+                            BlendMode::UNSPECIFIED);
+        });
+      return image;
+    });
+}
+
+CompositeCache::Key Render::makeCacheKey(const RenderPlan::Items& items,
+                                         const frame_t frame,
+                                         const PixelFormat dstFormat,
+                                         const color_t bg_color) const
+{
+  CompositeCache::Key key;
+  auto add = [&key](const uint64_t value) {
+    key.push_back(value);
+  };
+  auto addDouble = [&key](const double value) {
+    uint64_t bits;
+    std::memcpy(&bits, &value, sizeof(bits));
+    key.push_back(bits);
+  };
+
+  const Palette* pal = m_sprite->palette(frame);
+  add(m_sprite->id());
+  add(m_sprite->version());
+  add(pal->id());
+  add(pal->version());
+  add(dstFormat);
+  add(bg_color);
+  add(m_flags);
+  add(m_newBlendMethod);
+  add(m_nonactiveLayersOpacity);
+  add(m_selectedLayerForOpacity ? m_selectedLayerForOpacity->id(): 0);
+  addDouble(m_proj.scaleX());
+  addDouble(m_proj.scaleY());
+
+  for (const auto& item : items) {
+    const auto* layer = static_cast<const LayerImage*>(item.layer);
+    add(layer->id());
+    add(layer->version());
+    add(int(layer->flags()));
+    add(layer->opacity());
+    add(int(layer->blendMode()));
+
+    const Cel* cel = (item.cel ? item.cel: layer->cel(frame));
+    if (!cel) {
+      add(0);
+      continue;
+    }
+    add(cel->id());
+    add(cel->version());
+    add(cel->opacity());
+    add(cel->zIndex());
+    add(cel->data()->id());
+    add(cel->data()->version());
+    const gfx::RectF& bounds = cel->boundsF();
+    addDouble(bounds.x);
+    addDouble(bounds.y);
+    addDouble(bounds.w);
+    addDouble(bounds.h);
+    if (const Image* image = cel->image()) {
+      add(image->id());
+      add(image->version());
+      add(image->width());
+      add(image->height());
+    }
+    if (layer->isTilemap()) {
+      const Tileset* tileset = static_cast<const LayerTilemap*>(layer)->tileset();
+      add(tileset ? tileset->id(): 0);
+      add(tileset ? tileset->version(): 0);
+    }
+  }
+  return key;
+}
+
+bool Render::hasExactSubareas() const
+{
+  // When the source coordinates of a part of the area could be
+  // fractional (zoom out, or reference layers that can be placed in
+  // sub-pixel positions) the result of rendering the area by parts
+  // can differ from rendering it at once due rounding differences.
+  return
+    (m_proj.zoom().isSimpleZoomLevel() &&
+     m_proj.scaleX() >= 1.0 &&
+     m_proj.scaleY() >= 1.0 &&
+     !((m_flags & Flags::ShowRefLayers) &&
+       has_visible_reference_layers(m_sprite->root())));
+}
+
 void Render::renderBackground(Image* image,
                               const Layer* bgLayer,
                               const color_t bg_color,
@@ -1000,7 +1413,7 @@ void Render::renderOnionskin(
         doc::RenderPlan plan;
         plan.addLayer(onionLayer, frameIn);
         renderPlan(
-          plan, dstImage,
+          plan.items(), dstImage,
           area, frameIn, compositeImage,
           // Render background only for "in-front" onion skinning and
           // when opacity is < 255
@@ -1099,7 +1512,7 @@ void Render::renderImage(
 }
 
 void Render::renderPlan(
-  RenderPlan& plan,
+  const RenderPlan::Items& items,
   Image* image,
   const gfx::Clip& area,
   const frame_t frame,
@@ -1108,7 +1521,7 @@ void Render::renderPlan(
   const bool render_transparent,
   const BlendMode blendMode)
 {
-  for (const auto& item : plan.items()) {
+  for (const auto& item : items) {
     const Cel* cel = item.cel;
     const Layer* layer = item.layer;
 
@@ -1259,9 +1672,11 @@ void Render::renderPlan(
 
     }
 
-    // Draw extras
+    // Draw extras (only inside the area, as other tiles of the same
+    // image can be rendered in parallel by other threads)
     if (drawExtra && m_extraType != ExtraType::NONE) {
-      if (m_extraCel->opacity() > 0) {
+      extraArea &= area.srcBounds();
+      if (m_extraCel->opacity() > 0 && !extraArea.isEmpty()) {
         renderCel(
           image,
           m_extraCel,
@@ -15,21 +15,24 @@
 #include "doc/doc.h"
 #include "doc/frame.h"
 #include "doc/pixel_format.h"
+#include "doc/render_plan.h"
 #include "doc/tile.h"
 #include "gfx/clip.h"
 #include "gfx/point.h"
 #include "gfx/size.h"
 #include "render/bg_options.h"
+#include "render/composite_cache.h"
 #include "render/extra_type.h"
 #include "render/onionskin_options.h"
 #include "render/projection.h"
 
+#include <functional>
+
 namespace doc {
   class Cel;
   class Image;
   class Layer;
   class Palette;
-  class RenderPlan;
   class Sprite;
   class Tileset;
 }
@@ -64,6 +67,20 @@ namespace render {
     void setBgOptions(const BgOptions& bg);
     void setSelectedLayer(const Layer* layer);
 
+    // Enables the parallel rendering of renderSprite(). The area is
+    // split in tiles that are rendered by several threads (each one
+    // with its own copy of this Render). The result is the same as
+    // rendering the whole area in the calling thread.
+    void setParallelRendering(const bool state);
+
+    // Sets a cache to store the layers below the selected layer
+    // (setSelectedLayer()) already composited, so only the selected
+    // layer and the layers above it are blended in each
+    // renderSprite() call while the other layers don't change. The
+    // cache isn't owned by the Render and can be shared between
+    // several Render instances.
+    void setCompositeCache(CompositeCache* cache);
+
     // Sets the preview image. This preview image is an alternative
     // image to be used for the given layer/frame.
     void setPreviewImage(const Layer* layer,
@@ -139,12 +156,66 @@ namespace render {
       const BlendMode blendMode);
 
   private:
+    // Calls "func" for each tile of the given area from several
+    // threads when the parallel rendering is enabled, or just one time
+    // with the whole area in other case.
+    void renderTiles(
+      const gfx::ClipF& area,
+      const std::function<void(Render& render,
+                               const gfx::ClipF& tile)>& func);
+
     void renderSpriteLayers(
       Image* dstImage,
       const gfx::ClipF& area,
       frame_t frame,
+      const color_t bg_color,
       CompositeImageFunc compositeImage);
 
+    // Returns the layers below the active layer from the cache (or
+    // renders them in parallel and caches them), nullptr if the
+    // cache cannot be used.
+    ImageRef getCachedSpriteLayersBelow(
+      const Image* dstImage,
+      const gfx::ClipF& area,
+      const frame_t frame,
+      const color_t bg_color,
+      const CompositeImageFunc compositeImage);
+
+    // Renders the given plan items using the composite cache. Returns
+    // false if the cache cannot be used with the current options.
+    bool renderCachedSpriteLayers(
+      Image* dstImage,
+      const gfx::ClipF& area,
+      const frame_t frame,
+      const color_t bg_color,
+      const CompositeImageFunc compositeImage,
+      const doc::RenderPlan::Items& items);
+
+    bool canUseCache(
+      const Image* dstImage,
+      const gfx::ClipF& area,
+      const doc::RenderPlan::Items& items) const;
+
+    // Returns the whole canvas with the layers below the active one
+    // from the cache (rendering and caching it if it's not there), or
+    // nullptr if there are no layers below the active one.
+    ImageRef getCachedLayersBelow(
+      const Image* dstImage,
+      const frame_t frame,
+      const color_t bg_color,
+      const CompositeImageFunc compositeImage,
+      const doc::RenderPlan::Items& items);
+
+    CompositeCache::Key makeCacheKey(
+      const doc::RenderPlan::Items& items,
+      const frame_t frame,
+      const PixelFormat dstFormat,
+      const color_t bg_color) const;
+
+    // Returns true if rendering the area by parts gives the same
+    // result as rendering it at once.
+    bool hasExactSubareas() const;
+
     void renderBackground(
       Image* image,
       const Layer* bgLayer,
@@ -162,7 +233,7 @@ namespace render {
       const CompositeImageFunc compositeImage);
 
     void renderPlan(
-      doc::RenderPlan& plan,
+      const doc::RenderPlan::Items& items,
       Image* image,
       const gfx::Clip& area,
       const frame_t frame,
@@ -224,6 +295,11 @@ namespace render {
     BlendMode m_previewBlendMode;
     OnionskinOptions m_onionskin;
     ImageBufferPtr m_tmpBuf;
+    bool m_parallel;
+    CompositeCache* m_cache;
+    // Layers below the active one taken from the cache while
+    // renderSprite() renders its tiles
+    ImageRef m_cachedLayersBelow;
   };
 
   void composite_image(Image* dst,
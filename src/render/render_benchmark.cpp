@@ -26,6 +26,8 @@ static void Bm_Render(benchmark::State& state)
 {
   const int w = state.range(0);
   const int h = state.range(1);
+  const BlendMode blendMode = BlendMode(state.range(2));
+  const bool parallel = (state.range(3) != 0);
 
   Sprite* spr = Sprite::MakeStdSprite(ImageSpec(ColorMode::RGB, w, h));
   LayerImage* lay1 = static_cast<LayerImage*>(spr->root()->firstLayer());
@@ -34,6 +36,8 @@ static void Bm_Render(benchmark::State& state)
 
   spr->root()->addLayer(lay2);
   spr->root()->addLayer(lay3);
+  lay2->setBlendMode(blendMode);
+  lay3->setBlendMode(blendMode);
 
   Image* img1 = lay1->cel(0)->image();
   ImageRef img2(Image::create(spr->pixelFormat(), w, h));
@@ -65,18 +69,32 @@ static void Bm_Render(benchmark::State& state)
     bg.color2 = rgba(200, 200, 200, 255);
     bg.stripeSize = gfx::Size(16, 16);
     render.setBgOptions(bg);
+    render.setParallelRendering(parallel);
     render.renderSprite(
       dst.get(), spr, frame_t(0),
       gfx::Clip(0, 0, 0, 0, w, h));
   }
 }
 
+static void RenderArguments(benchmark::internal::Benchmark* b)
+{
+  for (BlendMode blendMode : { BlendMode::NORMAL,
+                               BlendMode::MULTIPLY,
+                               BlendMode::SCREEN,
+                               BlendMode::ADDITION,
+                               BlendMode::HSL_HUE }) { // HSL_HUE doesn't have a SIMD row blender
+    for (int parallel : { 0, 1 }) {
+      b->Args({ 256, 256, int(blendMode), parallel })
+       ->Args({ 1024, 256, int(blendMode), parallel })
+       ->Args({ 256, 1024, int(blendMode), parallel })
+       ->Args({ 1024, 1024, int(blendMode), parallel })
+       ->Args({ 4096, 4096, int(blendMode), parallel });
+    }
+  }
+}
+
 BENCHMARK(Bm_Render)
-  ->Args({ 256, 256 })
-  ->Args({ 1024, 256 })
-  ->Args({ 256, 1024 })
-  ->Args({ 1024, 1024 })
-  ->Args({ 4096, 4096 })
+  ->Apply(RenderArguments)
   ->Unit(benchmark::kMicrosecond);
 
 BENCHMARK_MAIN();
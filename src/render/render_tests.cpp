@@ -277,6 +277,186 @@ TEST(Render, BugWithMultiplesOf3ZoomFactors)
   }
 }
 
+TEST(Render, ParallelRenderingIsEqualToSerial)
+{
+  const int w = 97, h = 731;
+  std::shared_ptr<Document> doc = std::make_shared<Document>();
+  doc->sprites().add(Sprite::MakeStdSprite(ImageSpec(ColorMode::RGB, w, h)));
+  Sprite* spr = doc->sprite();
+
+  LayerImage* lay1 = static_cast<LayerImage*>(spr->root()->firstLayer());
+  LayerImage* lay2 = new LayerImage(spr);
+  spr->root()->addLayer(lay2);
+  lay2->setBlendMode(BlendMode::MULTIPLY);
+
+  ImageRef img2(Image::create(IMAGE_RGB, w/2, h/2));
+  lay2->addCel(new Cel(frame_t(0), img2));
+  lay2->cel(0)->setPosition(w/4, h/3);
+
+  Image* img1 = lay1->cel(0)->image();
+  clear_image(img1, 0);
+  clear_image(img2.get(), rgba(255, 0, 0, 128));
+  for (int y=0; y<h; ++y)
+    for (int x=0; x<w; ++x)
+      put_pixel(img1, x, y, rgba(x*255/w, y*255/h, (x*y) & 255, (x+y) & 255));
+
+  BgOptions bg;
+  bg.type = BgType::CHECKERED;
+  bg.zoom = true;
+  bg.colorPixelFormat = IMAGE_RGB;
+  bg.color1 = rgba(128, 128, 128, 255);
+  bg.color2 = rgba(64, 64, 64, 255);
+  bg.stripeSize = gfx::Size(3, 5);
+
+  for (const Zoom& zoom : { Zoom(1, 1), Zoom(2, 1), Zoom(1, 2), Zoom(2, 3) }) {
+    gfx::Clip area(3, 5, 0, 0, zoom.apply(w), zoom.apply(h));
+    std::unique_ptr<Image> serial(Image::create(IMAGE_RGB, area.size.w+3, area.size.h+5));
+    std::unique_ptr<Image> parallel(Image::create(IMAGE_RGB, area.size.w+3, area.size.h+5));
+    clear_image(serial.get(), 0);
+    clear_image(parallel.get(), 0);
+
+    Render render;
+    render.setBgOptions(bg);
+    render.setProjection(Projection(PixelRatio(1, 1), zoom));
+    render.renderSprite(serial.get(), spr, frame_t(0), area);
+    render.setParallelRendering(true);
+    render.renderSprite(parallel.get(), spr, frame_t(0), area);
+
+    EXPECT_EQ(0, count_diff_between_images(serial.get(), parallel.get()))
+      << " zoom=" << zoom.scale();
+
+    // The layers below the active one are rendered in parallel in
+    // the composite cache (only once for all tiles, and only if the
+    // zoom level can be rendered by parts)
+    CompositeCache cache;
+    clear_image(parallel.get(), 0);
+    render.setSelectedLayer(lay2);
+    render.setCompositeCache(&cache);
+    render.renderSprite(parallel.get(), spr, frame_t(0), area);
+    render.setSelectedLayer(nullptr);
+    render.setCompositeCache(nullptr);
+
+    EXPECT_EQ(0, count_diff_between_images(serial.get(), parallel.get()))
+      << " zoom=" << zoom.scale();
+    EXPECT_EQ(0, cache.stats().hits);
+    EXPECT_EQ(zoom.isSimpleZoomLevel() && zoom.scale() >= 1.0 ? 1: 0,
+              cache.stats().misses);
+
+    // Only one layer
+    clear_image(serial.get(), 0);
+    clear_image(parallel.get(), 0);
+    render.setParallelRendering(false);
+    render.renderLayer(serial.get(), lay1, frame_t(0), area);
+    render.setParallelRendering(true);
+    render.renderLayer(parallel.get(), lay1, frame_t(0), area);
+
+    EXPECT_EQ(0, count_diff_between_images(serial.get(), parallel.get()))
+      << " zoom=" << zoom.scale();
+  }
+}
+
+TEST(Render, CompositeCache)
+{
+  const int w = 16, h = 16;
+  std::shared_ptr<Document> doc = std::make_shared<Document>();
+  doc->sprites().add(Sprite::MakeStdSprite(ImageSpec(ColorMode::RGB, w, h)));
+  Sprite* spr = doc->sprite();
+
+  // Layers: 1 (normal), 2 (multiply), 3 (active), 4 (normal),
+  // 5 (normal with opacity), 6 (normal with a cel opacity)
+  const int n = 6;
+  LayerImage* lay[n];
+  lay[0] = static_cast<LayerImage*>(spr->root()->firstLayer());
+  for (int i=1; i<n; ++i) {
+    lay[i] = new LayerImage(spr);
+    lay[i]->addCel(new Cel(frame_t(0), ImageRef(Image::create(IMAGE_RGB, w, h))));
+    spr->root()->addLayer(lay[i]);
+  }
+  lay[1]->setBlendMode(BlendMode::MULTIPLY);
+  lay[4]->setOpacity(128);
+  lay[5]->cel(0)->setOpacity(200);
+
+  // All layers (including the ones above the active layer) have
+  // semi-transparent pixels
+  for (int i=0; i<n; ++i) {
+    Image* img = lay[i]->cel(0)->image();
+    for (int y=0; y<h; ++y)
+      for (int x=0; x<w; ++x)
+        put_pixel(img, x, y, rgba(x*16, y*16, (i+1)*40, (x*y*(i+1)+i*50) & 255));
+  }
+
+  BgOptions bg;
+  bg.type = BgType::CHECKERED;
+  bg.zoom = true;
+  bg.colorPixelFormat = IMAGE_RGB;
+  bg.color1 = rgba(128, 128, 128, 255);
+  bg.color2 = rgba(64, 64, 64, 255);
+  bg.stripeSize = gfx::Size(4, 4);
+
+  int nonactiveLayersOpacity = 255;
+  auto renderSprite = [spr, &bg, &lay, &nonactiveLayersOpacity](CompositeCache* cache) {
+    std::unique_ptr<Image> dst(Image::create(IMAGE_RGB, w-3, h-5));
+    Render render;
+    render.setBgOptions(bg);
+    render.setSelectedLayer(lay[2]);
+    render.setNonactiveLayersOpacity(nonactiveLayersOpacity);
+    render.setCompositeCache(cache);
+    render.renderSprite(dst.get(), spr, frame_t(0),
+                        gfx::Clip(0, 0, 2, 3, w-3, h-5));
+    return dst;
+  };
+
+  CompositeCache cache;
+  std::unique_ptr<Image> expected = renderSprite(nullptr);
+  std::unique_ptr<Image> cached = renderSprite(&cache);
+  EXPECT_EQ(0, count_diff_between_images(expected.get(), cached.get()));
+  EXPECT_EQ(0, cache.stats().hits);
+  EXPECT_EQ(1, cache.stats().misses);
+
+  cached = renderSprite(&cache);
+  EXPECT_EQ(0, count_diff_between_images(expected.get(), cached.get()));
+  EXPECT_EQ(1, cache.stats().hits);
+  EXPECT_EQ(1, cache.stats().misses);
+
+  // Modifying the active layer doesn't invalidate the cache
+  Image* activeImg = lay[2]->cel(0)->image();
+  clear_image(activeImg, rgba(255, 0, 0, 128));
+  activeImg->incrementVersion();
+  expected = renderSprite(nullptr);
+  cached = renderSprite(&cache);
+  EXPECT_EQ(0, count_diff_between_images(expected.get(), cached.get()));
+  EXPECT_EQ(2, cache.stats().hits);
+  EXPECT_EQ(1, cache.stats().misses);
+
+  // Modifying a layer above doesn't invalidate the cache either
+  Image* aboveImg = lay[4]->cel(0)->image();
+  clear_image(aboveImg, rgba(0, 0, 255, 100));
+  aboveImg->incrementVersion();
+  expected = renderSprite(nullptr);
+  cached = renderSprite(&cache);
+  EXPECT_EQ(0, count_diff_between_images(expected.get(), cached.get()));
+  EXPECT_EQ(3, cache.stats().hits);
+  EXPECT_EQ(1, cache.stats().misses);
+
+  // Modifying a layer below does
+  Image* belowImg = lay[1]->cel(0)->image();
+  clear_image(belowImg, rgba(0, 255, 0, 200));
+  belowImg->incrementVersion();
+  expected = renderSprite(nullptr);
+  cached = renderSprite(&cache);
+  EXPECT_EQ(0, count_diff_between_images(expected.get(), cached.get()));
+  EXPECT_EQ(3, cache.stats().hits);
+  EXPECT_EQ(2, cache.stats().misses);
+
+  // Non-active layers opacity
+  nonactiveLayersOpacity = 100;
+  expected = renderSprite(nullptr);
+  cached = renderSprite(&cache);
+  EXPECT_EQ(0, count_diff_between_images(expected.get(), cached.get()));
+  EXPECT_EQ(3, cache.stats().hits);
+  EXPECT_EQ(3, cache.stats().misses);
+}
+
 int main(int argc, char** argv)
 {
   ::testing::InitGoogleTest(&argc, argv);
@@ -0,0 +1,47 @@
+// Aseprite Render Library
+// Copyright (c) 2023  Igara Studio S.A.
+//
+// This file is released under the terms of the MIT license.
+// Read LICENSE.txt for more information.
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "render/row_bands.h"
+
+#include "doc/worker_pool.h"
+#include "render/task_delegate.h"
+
+namespace render {
+
+namespace {
+
+// Approximate number of pixels of each band
+const int kPixelsPerBand = 64*1024;
+
+} // anonymous namespace
+
+bool for_each_row_band(const int width, const int height,
+                       const bool parallel,
+                       TaskDelegate* delegate,
+                       const std::function<void(int y1, int y2)>& processRows)
+{
+  if (width < 1 || height < 1)
+    return true;
+
+  const bool result = doc::for_each_row_band(
+    width, height, kPixelsPerBand / width, parallel, processRows,
+    [height, delegate](const int doneRows){
+      if (!delegate)
+        return true;
+      delegate->notifyTaskProgress(double(doneRows) / double(height));
+      return delegate->continueTask();
+    });
+
+  if (delegate && result)
+    delegate->notifyTaskProgress(1.0);
+  return result;
+}
+
+} // namespace render
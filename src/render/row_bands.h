@@ -0,0 +1,32 @@
+// Aseprite Render Library
+// Copyright (c) 2023  Igara Studio S.A.
+//
+// This file is released under the terms of the MIT license.
+// Read LICENSE.txt for more information.
+
+#ifndef RENDER_ROW_BANDS_H_INCLUDED
+#define RENDER_ROW_BANDS_H_INCLUDED
+#pragma once
+
+#include <functional>
+
+namespace render {
+
+  class TaskDelegate;
+
+  // Calls processRows(y1, y2) for each band of rows [y1, y2) of an
+  // image with the given size. If "parallel" is true, the bands of
+  // big images are processed in several threads, so processRows()
+  // must be thread-safe.
+  //
+  // The delegate is used only from the calling thread (between
+  // bands), and when the task is canceled the remaining bands are
+  // skipped. Returns false if the task was canceled.
+  bool for_each_row_band(const int width, const int height,
+                         const bool parallel,
+                         TaskDelegate* delegate,
+                         const std::function<void(int y1, int y2)>& processRows);
+
+} // namespace render
+
+#endif
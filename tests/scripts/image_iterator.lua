@@ -1,3 +1,4 @@
+-- Copyright (C) 2023  Igara Studio S.A.
 -- Copyright (C) 2018  David Capello
 --
 -- This file is released under the terms of the MIT license.
@@ -70,3 +71,30 @@ do
       c = c+1
    end
 end
+
+-- Pixels modified with the iterator are saved (the compressed
+-- pixels cached when the file was saved/loaded are not re-used)
+do
+   local spr = Sprite(8, 4)
+   local image = app.site.image
+   for it in image:pixels() do
+      it(pc.rgba(it.x*16, it.y*32, 0, 255))
+   end
+   spr:saveAs("_test_image_iterator.aseprite")
+   spr:close()
+
+   spr = Sprite{ fromFile="_test_image_iterator.aseprite" }
+   image = spr.cels[1].image
+   for it in image:pixels() do
+      it(pc.rgba(255, it.x*16, it.y*32, 255))
+   end
+   spr:saveAs("_test_image_iterator.aseprite")
+   spr:close()
+
+   spr = Sprite{ fromFile="_test_image_iterator.aseprite" }
+   image = spr.cels[1].image
+   for it in image:pixels() do
+      assert(it() == pc.rgba(255, it.x*16, it.y*32, 255))
+   end
+   spr:close()
+end